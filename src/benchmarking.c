@@ -12,50 +12,101 @@
  *  See the LICENSE file for details.
  */
 
+#define _GNU_SOURCE // CPU affinity
 #include "snappy-c.h"
 #include "vite.h"
 #include "zstd.h"
 #include <dirent.h>
 #include <immintrin.h>
 #include <math.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
+#ifdef BENCHMARK_LZ4
+#include "lz4.h"
+#endif
+#ifdef BENCHMARK_ROARING
+#include "roaring/roaring.h"
+#endif
 
-#define NUM_ITERATIONS 100
-#define CONFIDENCE_LEVEL 0.95
-
-double total_initial_size = 0;
-double total_snappy_size = 0;
-double total_zstd_size = 0;
-double total_vitemap_size = 0;
-double total_snappy_comp_time = 0;
-double total_zstd_comp_time = 0;
-double total_vitemap_comp_time = 0;
-double total_snappy_decomp_time = 0;
-double total_zstd_decomp_time = 0;
-double total_vitemap_decomp_time = 0;
-int total_files = 0;
-
-// Statistics of benchmarking.
+#define DEFAULT_ITERATIONS 100
+#define DEFAULT_WARMUP 10
+#define DEFAULT_SYNTHETIC_SIZE (1 << 20)
+#define DEFAULT_SEED 42
+#define MIN_SWEEP_ITERATIONS 3
+#define CACHE_LINE_SIZE 64
+#define SCALING_SIZE (16 << 20) // Bytes compressed by every scaling thread
+#define MAX_NUMA_NODES 64
+
+// Options of a benchmark run, parsed from the command line.
+typedef enum { FORMAT_TEXT, FORMAT_CSV, FORMAT_JSON } OutputFormat;
+
+typedef struct {
+  const char *traces_dir; // Directory of the input bitmaps
+  int iterations;         // Timed runs per input and codec
+  int warmup;             // Untimed runs before them
+  bool cold;              // Evict all buffers from the caches before each run
+  bool sweep;             // Also run inputs of growing sizes
+  bool streaming;         // Also compare regular and non-temporal stores
+  bool scaling;           // Also run growing numbers of threads
+  int max_threads;        // Largest number of threads (or all CPUs if 0)
+  bool synthetic;         // Run generated inputs instead of the traces
+  size_t synthetic_size;  // Size of every generated input in bytes
+  uint64_t seed;          // Seed of the generated inputs
+  const char *codec;      // Only run the codec of this name (or all if NULL)
+  OutputFormat format;
+} BenchmarkOptions;
+
+// A compression algorithm under test. No function allocates its buffers, so
+// that timings only include encoding and decoding.
 typedef struct {
-  long length;
-  long comp_time;
-  long decomp_time;
-  int verified;
-} BenchmarkResult;
+  const char *name;
+
+  // Returns the maximum compressed size of `size` bytes.
+  size_t (*bound)(size_t size);
+
+  // Compresses `size` bytes of input, and returns the compressed size (0 on
+  // failure).
+  size_t (*compress)(const uint8_t *input, size_t size, uint8_t *output,
+                     size_t capacity);
+
+  // Decompresses exactly `size` bytes, possibly writing up to OUTPUT_PADDING
+  // bytes past them. Returns false on failure.
+  bool (*decompress)(const uint8_t *compressed, size_t compressed_size,
+                     uint8_t *output, size_t size);
+} Codec;
+
+// Slack after the decompressed data, for codecs writing whole buckets.
+#define OUTPUT_PADDING 128
 
+// Latency distribution of one operation, in nanoseconds.
 typedef struct {
-  long length;
-  double avg_comp_time;
-  double ci_comp_margin;
-  double avg_decomp_time;
-  double ci_decomp_margin;
-  int verified;
-} AggregatedResult;
+  double mean;
+  double ci_margin; // 95% confidence interval of the mean
+  double p50;
+  double p99;
+} LatencyStats;
+
+// Statistics of one codec on one input.
+typedef struct {
+  const char *input;
+  const char *codec;
+  size_t size;
+  double density; // Fraction of set bits
+  size_t compressed_size;
+  LatencyStats comp;
+  LatencyStats decomp;
+  bool verified;
+#ifdef VITEMAP_INSTRUMENTATION
+  VitemapStats stats; // Vitemap calls of all runs, warm-up included
+#endif
+} BenchmarkRecord;
 
 // Helper function to calculate time difference in nanoseconds
 long calculate_time_diff(struct timespec start, struct timespec end) {
@@ -70,283 +121,1174 @@ long calculate_time_diff(struct timespec start, struct timespec end) {
   return seconds * 1000000000 + nanoseconds;
 }
 
-// Returns the statistics of compressing and decompressing with Snappy.
-BenchmarkResult benchmark_snappy(uint8_t *bitmap, size_t size) {
-  struct timespec start, end;
-  BenchmarkResult results = {0};
+// Snappy (general purpose compression algorithm developed by Google).
+static size_t snappy_bound(size_t size) {
+  return snappy_max_compressed_length(size);
+}
 
-  size_t output_length = snappy_max_compressed_length(size);
-  char *output = malloc(output_length);
+static size_t snappy_codec_compress(const uint8_t *input, size_t size,
+                                    uint8_t *output, size_t capacity) {
+  size_t output_length = capacity;
+  return snappy_compress((const char *)input, size, (char *)output,
+                         &output_length) == SNAPPY_OK
+             ? output_length
+             : 0;
+}
 
-  clock_gettime(CLOCK_MONOTONIC_RAW, &start);
-  snappy_compress((const char *)bitmap, size, output, &output_length);
-  clock_gettime(CLOCK_MONOTONIC_RAW, &end);
-  results.comp_time = calculate_time_diff(start, end);
+static bool snappy_codec_decompress(const uint8_t *compressed,
+                                    size_t compressed_size, uint8_t *output,
+                                    size_t size) {
+  size_t output_length = size;
+  return snappy_uncompress((const char *)compressed, compressed_size,
+                           (char *)output, &output_length) == SNAPPY_OK &&
+         output_length == size;
+}
 
-  uint8_t *decompressed = malloc(size);
-  size_t decompressed_length = size;
+// Zstd (general purpose compression algorithm developed by Facebook), at its
+// fastest standard level.
+static size_t zstd_bound(size_t size) { return ZSTD_compressBound(size); }
 
-  clock_gettime(CLOCK_MONOTONIC_RAW, &start);
-  snappy_uncompress(output, output_length, (char *)decompressed,
-                    &decompressed_length);
-  clock_gettime(CLOCK_MONOTONIC_RAW, &end);
-  results.decomp_time = calculate_time_diff(start, end);
+static size_t zstd_codec_compress(const uint8_t *input, size_t size,
+                                  uint8_t *output, size_t capacity) {
+  size_t output_length = ZSTD_compress(output, capacity, input, size, 1);
+  return ZSTD_isError(output_length) ? 0 : output_length;
+}
 
-  results.verified = (memcmp(bitmap, decompressed, size) == 0);
-  results.length = output_length;
+static bool zstd_codec_decompress(const uint8_t *compressed,
+                                  size_t compressed_size, uint8_t *output,
+                                  size_t size) {
+  return ZSTD_decompress(output, size, compressed, compressed_size) == size;
+}
 
-  free(output);
-  free(decompressed);
+#ifdef BENCHMARK_LZ4
+// LZ4 (general purpose compression algorithm focused on speed).
+static size_t lz4_bound(size_t size) { return LZ4_compressBound((int)size); }
 
-  return results;
+static size_t lz4_codec_compress(const uint8_t *input, size_t size,
+                                 uint8_t *output, size_t capacity) {
+  int output_length = LZ4_compress_default(
+      (const char *)input, (char *)output, (int)size, (int)capacity);
+  return output_length > 0 ? (size_t)output_length : 0;
 }
 
-// Returns the statistics of compressing and decompressing with Zstd.
-BenchmarkResult benchmark_zstd(uint8_t *bitmap, size_t size) {
-  struct timespec start, end;
-  BenchmarkResult results = {0};
+static bool lz4_codec_decompress(const uint8_t *compressed,
+                                 size_t compressed_size, uint8_t *output,
+                                 size_t size) {
+  return LZ4_decompress_safe((const char *)compressed, (char *)output,
+                             (int)compressed_size, (int)size) == (int)size;
+}
+#endif
 
-  size_t output_length = ZSTD_compressBound(size);
-  void *output = malloc(output_length);
+#ifdef BENCHMARK_ROARING
+// CRoaring (Lemire's Roaring bitmaps), run-optimized and serialized in the
+// portable format. Set bits are added one by one, which is the cost of
+// building a Roaring bitmap from an uncompressed one.
+static size_t roaring_bound(size_t size) {
+  // Every 64Ki bits become at most an 8KB bitmap container and its header.
+  return size + 16 * (size / 8192 + 1) + 64;
+}
 
-  clock_gettime(CLOCK_MONOTONIC_RAW, &start);
-  output_length = ZSTD_compress(output, output_length, bitmap, size, 1);
-  clock_gettime(CLOCK_MONOTONIC_RAW, &end);
-  results.comp_time = calculate_time_diff(start, end);
+static size_t roaring_codec_compress(const uint8_t *input, size_t size,
+                                     uint8_t *output, size_t capacity) {
+  roaring_bitmap_t *bitmap = roaring_bitmap_create();
+  roaring_bulk_context_t context = {0};
+  for (size_t i = 0; i < size; i += 8) {
+    uint64_t word = 0;
+    memcpy(&word, input + i, size - i < 8 ? size - i : 8);
+    while (word) {
+      roaring_bitmap_add_bulk(bitmap, &context,
+                              (uint32_t)(i * 8 + __builtin_ctzll(word)));
+      word &= word - 1;
+    }
+  }
+  roaring_bitmap_run_optimize(bitmap);
 
-  uint8_t *decompressed = malloc(size);
+  size_t output_length = roaring_bitmap_portable_size_in_bytes(bitmap);
+  if (output_length > capacity) {
+    output_length = 0;
+  } else {
+    roaring_bitmap_portable_serialize(bitmap, (char *)output);
+  }
+  roaring_bitmap_free(bitmap);
+  return output_length;
+}
 
-  clock_gettime(CLOCK_MONOTONIC_RAW, &start);
-  ZSTD_decompress(decompressed, size, output, output_length);
-  clock_gettime(CLOCK_MONOTONIC_RAW, &end);
-  results.decomp_time = calculate_time_diff(start, end);
+static bool set_roaring_bit(uint32_t value, void *output) {
+  ((uint8_t *)output)[value / 8] |= 1 << value % 8;
+  return true;
+}
 
-  results.verified = (memcmp(bitmap, decompressed, size) == 0);
-  results.length = output_length;
+static bool roaring_codec_decompress(const uint8_t *compressed,
+                                     size_t compressed_size, uint8_t *output,
+                                     size_t size) {
+  roaring_bitmap_t *bitmap = roaring_bitmap_portable_deserialize_safe(
+      (const char *)compressed, compressed_size);
+  if (bitmap == NULL) {
+    return false;
+  }
+  memset(output, 0, size);
+  roaring_iterate(bitmap, set_roaring_bit, output);
+  roaring_bitmap_free(bitmap);
+  return true;
+}
+#endif
 
-  free(output);
-  free(decompressed);
+// Vitemap (our custom *bitmap* encoding scheme, based on Lemire's Roaring
+// bitmaps), into caller memory, without and with runs.
+static size_t vitemap_bound(size_t size) {
+  return vitemap_max_compressed_size(size);
+}
 
-  return results;
+static size_t vitemap_codec_compress(const uint8_t *input, size_t size,
+                                     uint8_t *output, size_t capacity) {
+  (void)capacity;
+  return vitemap_compress_buffer(input, size, output, 0);
 }
 
-// Returns the statistics of compressing and decompressing with our Vitemap
-// encoding scheme.
-BenchmarkResult benchmark_vitemap(uint8_t *bitmap, size_t size) {
-  struct timespec start, end;
-  BenchmarkResult results = {0};
+static size_t vitemap_runs_compress(const uint8_t *input, size_t size,
+                                    uint8_t *output, size_t capacity) {
+  (void)capacity;
+  return vitemap_compress_buffer(input, size, output, VITEMAP_FLAG_RUNS);
+}
 
-  Vitemap *vm = vitemap_create(size);
-  memcpy(vm->input, bitmap, size);
+static bool vitemap_codec_decompress(const uint8_t *compressed,
+                                     size_t compressed_size, uint8_t *output,
+                                     size_t size) {
+  (void)size;
+  vitemap_decompress(compressed, compressed_size, output);
+  return true;
+}
 
-  clock_gettime(CLOCK_MONOTONIC_RAW, &start);
-  size_t output_length = vitemap_compress(vm, size);
-  clock_gettime(CLOCK_MONOTONIC_RAW, &end);
-  results.comp_time = calculate_time_diff(start, end);
+static const Codec codecs[] = {
+    {"snappy", snappy_bound, snappy_codec_compress, snappy_codec_decompress},
+    {"zstd", zstd_bound, zstd_codec_compress, zstd_codec_decompress},
+#ifdef BENCHMARK_LZ4
+    {"lz4", lz4_bound, lz4_codec_compress, lz4_codec_decompress},
+#endif
+#ifdef BENCHMARK_ROARING
+    {"roaring", roaring_bound, roaring_codec_compress,
+     roaring_codec_decompress},
+#endif
+    {"vitemap", vitemap_bound, vitemap_codec_compress,
+     vitemap_codec_decompress},
+    {"vitemap-runs", vitemap_bound, vitemap_runs_compress,
+     vitemap_codec_decompress},
+};
+#define NUM_CODECS (sizeof(codecs) / sizeof(codecs[0]))
 
-  uint32_t data_size;
-  uint32_t buffer_size;
-  vitemap_extract_decompressed_sizes(vm->output, &data_size, &buffer_size);
-  uint8_t *decompressed = malloc(buffer_size);
+// Upper bounds of the density groups of the summary, in fraction of set bits.
+static const double density_bounds[] = {0.01, 0.05, 0.10, 0.25, 0.50, 1.00};
+#define NUM_DENSITIES (sizeof(density_bounds) / sizeof(density_bounds[0]))
 
-  clock_gettime(CLOCK_MONOTONIC_RAW, &start);
-  vitemap_decompress(vm->output, output_length, decompressed);
-  clock_gettime(CLOCK_MONOTONIC_RAW, &end);
-  results.decomp_time = calculate_time_diff(start, end);
+// Totals of one codec on the inputs of one density group.
+typedef struct {
+  size_t inputs;
+  double size;
+  double compressed_size;
+  double comp_time; // Sum of the median latencies
+  double decomp_time;
+} SummaryCell;
 
-  results.verified =
-      (memcmp(bitmap, decompressed, size) == 0) && data_size == size;
-  results.length = output_length;
+static SummaryCell summary[NUM_CODECS][NUM_DENSITIES];
 
-  vitemap_delete(vm);
-  free(decompressed);
+static size_t density_group(double density) {
+  size_t group = 0;
+  while (group < NUM_DENSITIES - 1 && density >= density_bounds[group]) {
+    group++;
+  }
+  return group;
+}
 
-  return results;
+// Evicts a buffer from all cache levels.
+static void flush_buffer(const uint8_t *data, size_t size) {
+  for (size_t i = 0; i < size; i += CACHE_LINE_SIZE) {
+    _mm_clflush(data + i);
+  }
+  _mm_mfence();
 }
 
-void calculate_stats(long times[], int n, double *mean, double *std_dev) {
-  *mean = 0;
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+// Summarizes `n` latencies, which are sorted in place.
+static LatencyStats latency_stats(double *times, int n) {
+  LatencyStats stats = {0};
   for (int i = 0; i < n; i++) {
-    *mean += times[i];
+    stats.mean += times[i];
   }
-  *mean /= n;
+  stats.mean /= n;
 
-  *std_dev = 0;
+  double variance = 0;
   for (int i = 0; i < n; i++) {
-    *std_dev += pow(times[i] - *mean, 2);
+    variance += pow(times[i] - stats.mean, 2);
   }
-  *std_dev = sqrt(*std_dev / (n - 1)); // Use n-1 for sample standard deviation
+  // Use n-1 for sample standard deviation
+  double std_dev = n > 1 ? sqrt(variance / (n - 1)) : 0;
+  stats.ci_margin = 1.96 * std_dev / sqrt(n);
+
+  qsort(times, n, sizeof(double), compare_doubles);
+  stats.p50 = times[(n - 1) / 2];
+  stats.p99 = times[(int)ceil(0.99 * n) - 1];
+  return stats;
 }
 
-AggregatedResult aggregate_results(long *comp_times, long *decomp_times, int n,
-                                   int verified) {
-  double comp_mean, comp_std_dev, decomp_mean, decomp_std_dev;
-  calculate_stats(comp_times, n, &comp_mean, &comp_std_dev);
-  calculate_stats(decomp_times, n, &decomp_mean, &decomp_std_dev);
+// Returns the fraction of set bits of a bitmap.
+static double bitmap_density(const uint8_t *bitmap, size_t size) {
+  size_t count = 0;
+  for (size_t i = 0; i < size; i++) {
+    count += __builtin_popcount(bitmap[i]);
+  }
+  return size > 0 ? (double)count / (8.0 * size) : 0;
+}
 
-  double comp_margin = 1.96 * (comp_std_dev / sqrt(n));
-  double decomp_margin = 1.96 * (decomp_std_dev / sqrt(n));
+// Runs a codec on a bitmap: each run compresses the bitmap and decompresses
+// it, with separate timings, and the first `warmup` runs are discarded. With
+// `cold`, the buffers read and written are evicted from the caches before
+// every operation.
+static BenchmarkRecord benchmark_codec(const Codec *codec, const char *input,
+                                       const uint8_t *bitmap, size_t size,
+                                       int iterations,
+                                       const BenchmarkOptions *options) {
+  BenchmarkRecord record = {.input = input, .codec = codec->name, .size = size};
+  size_t capacity = codec->bound(size);
+  uint8_t *compressed = malloc(capacity);
+  uint8_t *output = malloc(size + OUTPUT_PADDING);
+  double *comp_times = malloc(iterations * sizeof(double));
+  double *decomp_times = malloc(iterations * sizeof(double));
+  struct timespec start, end;
+  bool success = true;
+#ifdef VITEMAP_INSTRUMENTATION
+  vitemap_reset_stats();
+#endif
 
-  AggregatedResult result = {.avg_comp_time = comp_mean,
-                             .ci_comp_margin = comp_margin,
-                             .avg_decomp_time = decomp_mean,
-                             .ci_decomp_margin = decomp_margin,
-                             .verified = verified};
+  for (int i = -options->warmup; i < iterations && success; i++) {
+    if (options->cold) {
+      flush_buffer(bitmap, size);
+      flush_buffer(compressed, capacity);
+    }
+    clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+    record.compressed_size =
+        codec->compress(bitmap, size, compressed, capacity);
+    clock_gettime(CLOCK_MONOTONIC_RAW, &end);
+    long comp_time = calculate_time_diff(start, end);
 
-  return result;
+    if (options->cold) {
+      flush_buffer(compressed, record.compressed_size);
+      flush_buffer(output, size + OUTPUT_PADDING);
+    }
+    clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+    success = record.compressed_size > 0 &&
+              codec->decompress(compressed, record.compressed_size, output,
+                                size);
+    clock_gettime(CLOCK_MONOTONIC_RAW, &end);
+    if (i >= 0) {
+      comp_times[i] = comp_time;
+      decomp_times[i] = calculate_time_diff(start, end);
+    }
+  }
+
+  record.verified = success && memcmp(bitmap, output, size) == 0;
+#ifdef VITEMAP_INSTRUMENTATION
+  vitemap_get_stats(&record.stats);
+#endif
+  if (success) {
+    record.comp = latency_stats(comp_times, iterations);
+    record.decomp = latency_stats(decomp_times, iterations);
+  }
+
+  free(compressed);
+  free(output);
+  free(comp_times);
+  free(decomp_times);
+  return record;
 }
 
-AggregatedResult
-aggregate_benchmark(uint8_t *bitmap, size_t size,
-                    BenchmarkResult (*benchmark_func)(uint8_t *, size_t)) {
-  long lengths[NUM_ITERATIONS];
-  long comp_times[NUM_ITERATIONS];
-  long decomp_times[NUM_ITERATIONS];
-  int verified = 1;
+// Returns the throughput of `size` uncompressed bytes in `time` ns, in GB/s.
+static double throughput(double size, double time) {
+  return time > 0 ? size / time : 0;
+}
 
-  for (int i = 0; i < NUM_ITERATIONS; i++) {
-    BenchmarkResult result = benchmark_func(bitmap, size);
-    lengths[i] = result.length;
-    comp_times[i] = result.comp_time;
-    decomp_times[i] = result.decomp_time;
-    verified &= result.verified;
+static void print_json_string(const char *string) {
+  putchar('"');
+  for (; *string; string++) {
+    if (*string == '"' || *string == '\\') {
+      putchar('\\');
+    }
+    putchar(*string);
   }
+  putchar('"');
+}
 
-  AggregatedResult agg_result =
-      aggregate_results(comp_times, decomp_times, NUM_ITERATIONS, verified);
-  agg_result.length = lengths[0];
+static void print_json_latency(const char *name, const LatencyStats *stats,
+                               size_t size) {
+  printf("\"%s\": {\"mean_ns\": %.1f, \"ci_ns\": %.1f, \"p50_ns\": %.1f, "
+         "\"p99_ns\": %.1f, \"gbps\": %f}, ",
+         name, stats->mean, stats->ci_margin, stats->p50, stats->p99,
+         throughput(size, stats->p50));
+}
 
-  return agg_result;
+static void print_text_latency(const char *name, const LatencyStats *stats,
+                               size_t size) {
+  printf("  %-6s %10.0f ± %-8.0f p50 %10.0f  p99 %10.0f ns  %8.2f GB/s\n",
+         name, stats->mean, stats->ci_margin, stats->p50, stats->p99,
+         throughput(size, stats->p50));
+}
+
+#ifdef VITEMAP_INSTRUMENTATION
+// Prints the hardware counters of an operation per call, and its buckets by
+// category (array, inverted array, bitmap, run).
+static void print_text_counters(const char *name,
+                                const VitemapCounters *counters,
+                                bool counters_available) {
+  double calls = counters->calls;
+  double kilobytes = counters->bytes / 1024.0;
+  if (counters_available) {
+    printf("  %-6s %.3f cycles/B, IPC %.2f, %.2f branch misses/KB, %.2f L1D "
+           "and %.2f LLC misses/KB\n",
+           name, counters->cycles / (double)counters->bytes,
+           counters->instructions / (double)counters->cycles,
+           counters->branch_misses / kilobytes,
+           counters->l1d_misses / kilobytes, counters->llc_misses / kilobytes);
+  }
+  printf("  %-6s %.0f/%.0f/%.0f/%.0f buckets per call\n", name,
+         counters->buckets[0] / calls, counters->buckets[1] / calls,
+         counters->buckets[2] / calls, counters->buckets[3] / calls);
 }
+#endif
 
-void process_file(const char *filename) {
+static void print_header(const BenchmarkOptions *options) {
+  if (options->format == FORMAT_CSV) {
+    printf("input,codec,size,density,compressed_size,ratio,"
+           "comp_mean_ns,comp_ci_ns,comp_p50_ns,comp_p99_ns,comp_gbps,"
+           "decomp_mean_ns,decomp_ci_ns,decomp_p50_ns,decomp_p99_ns,"
+           "decomp_gbps,verified,cold\n");
+  } else if (options->format == FORMAT_JSON) {
+    printf("[");
+  }
+}
+
+static void print_record(const BenchmarkRecord *record,
+                         const BenchmarkOptions *options) {
+  static bool first = true;
+  double ratio = (double)record->compressed_size / (double)record->size;
+
+  switch (options->format) {
+  case FORMAT_TEXT:
+    printf("%s, %s, %zu bytes (density %.4f): %zu bytes (%f) %s\n",
+           record->input, record->codec, record->size, record->density,
+           record->compressed_size, ratio, record->verified ? "✓" : "✗");
+    print_text_latency("comp", &record->comp, record->size);
+    print_text_latency("decomp", &record->decomp, record->size);
+#ifdef VITEMAP_INSTRUMENTATION
+    if (record->stats.compress.calls > 0) {
+      print_text_counters("comp", &record->stats.compress,
+                          record->stats.counters_available);
+      print_text_counters("decomp", &record->stats.decompress,
+                          record->stats.counters_available);
+    }
+#endif
+    break;
+  case FORMAT_CSV:
+    printf("%s,%s,%zu,%f,%zu,%f,%.1f,%.1f,%.1f,%.1f,%f,%.1f,%.1f,%.1f,%.1f,"
+           "%f,%d,%d\n",
+           record->input, record->codec, record->size, record->density,
+           record->compressed_size, ratio, record->comp.mean,
+           record->comp.ci_margin, record->comp.p50, record->comp.p99,
+           throughput(record->size, record->comp.p50), record->decomp.mean,
+           record->decomp.ci_margin, record->decomp.p50, record->decomp.p99,
+           throughput(record->size, record->decomp.p50), record->verified,
+           options->cold);
+    break;
+  case FORMAT_JSON:
+    printf("%s\n  {\"input\": ", first ? "" : ",");
+    print_json_string(record->input);
+    printf(", \"codec\": ");
+    print_json_string(record->codec);
+    printf(", \"size\": %zu, \"density\": %f, \"compressed_size\": %zu, "
+           "\"ratio\": %f, ",
+           record->size, record->density, record->compressed_size, ratio);
+    print_json_latency("comp", &record->comp, record->size);
+    print_json_latency("decomp", &record->decomp, record->size);
+    printf("\"verified\": %s, \"cold\": %s}",
+           record->verified ? "true" : "false",
+           options->cold ? "true" : "false");
+    break;
+  }
+  first = false;
+}
+
+// Ends the output. Text output also gets the ratio and throughput (at p50) of
+// every codec on every density group of the inputs.
+static void print_footer(const BenchmarkOptions *options) {
+  if (options->format == FORMAT_JSON) {
+    printf("\n]\n");
+  }
+  if (options->format != FORMAT_TEXT) {
+    return;
+  }
+
+  printf("\n%-16s %-8s %6s %8s %10s %12s\n", "codec", "density", "inputs",
+         "ratio", "comp GB/s", "decomp GB/s");
+  for (size_t codec = 0; codec < NUM_CODECS; codec++) {
+    for (size_t group = 0; group < NUM_DENSITIES; group++) {
+      const SummaryCell *cell = &summary[codec][group];
+      if (cell->inputs == 0) {
+        continue;
+      }
+      printf("%-16s < %-6.2f %6zu %8.4f %10.2f %12.2f\n", codecs[codec].name,
+             density_bounds[group], cell->inputs,
+             cell->compressed_size / cell->size,
+             throughput(cell->size, cell->comp_time),
+             throughput(cell->size, cell->decomp_time));
+    }
+  }
+}
+
+// Runs all codecs (or the one of `--codec`) on a bitmap, and returns whether
+// all of them decompressed it correctly. With `summarize`, the results are
+// added to the summary.
+static bool benchmark_bitmap(const char *input, const uint8_t *bitmap,
+                             size_t size, int iterations, bool summarize,
+                             const BenchmarkOptions *options) {
+  double density = bitmap_density(bitmap, size);
+  bool verified = true;
+  for (size_t codec = 0; codec < NUM_CODECS; codec++) {
+    if (options->codec != NULL &&
+        strcmp(options->codec, codecs[codec].name) != 0) {
+      continue;
+    }
+    BenchmarkRecord record = benchmark_codec(&codecs[codec], input, bitmap,
+                                             size, iterations, options);
+    record.density = density;
+    print_record(&record, options);
+    verified &= record.verified;
+
+    if (summarize) {
+      SummaryCell *cell = &summary[codec][density_group(density)];
+      cell->inputs++;
+      cell->size += size;
+      cell->compressed_size += record.compressed_size;
+      cell->comp_time += record.comp.p50;
+      cell->decomp_time += record.decomp.p50;
+    }
+  }
+  return verified;
+}
+
+// Reads a whole file into a newly allocated buffer, or returns NULL.
+static uint8_t *read_file(const char *filename, size_t *size) {
   FILE *file = fopen(filename, "rb");
   if (file == NULL) {
     perror("Error opening file");
-    return;
+    return NULL;
   }
 
   fseek(file, 0, SEEK_END);
   long file_size = ftell(file);
-  if (file_size < 0) {
+  fseek(file, 0, SEEK_SET);
+  uint8_t *data = file_size > 0 ? malloc(file_size) : NULL;
+  if (data == NULL || fread(data, 1, file_size, file) != (size_t)file_size) {
+    perror("Error reading file");
+    free(data);
     fclose(file);
-    perror("Error getting file size");
-    return;
+    return NULL;
   }
-  fseek(file, 0, SEEK_SET);
+  fclose(file);
+  *size = file_size;
+  return data;
+}
 
-  uint8_t *bitmap = (uint8_t *)malloc(file_size);
-  if (bitmap == NULL) {
-    fclose(file);
-    perror("Error allocating memory");
+// Finds the raw array of a Python pickle of an `array.array` (protocol 2 and
+// above), which is a single bytes object passed to `_array_reconstructor`. The
+// opcodes preceding it are walked, and any other opcode than those written by
+// `pickle.dump` for arrays makes the file be rejected (returns false).
+static bool find_pickled_array(const uint8_t *data, size_t size,
+                               const uint8_t **payload, size_t *payload_size) {
+  static const char reconstructor[] = "_array_reconstructor";
+  bool found_reconstructor = false;
+  size_t pos = 0;
+  while (pos < size) {
+    uint8_t opcode = data[pos++];
+    size_t fixed = 0;  // Size of the fixed arguments
+    size_t prefix = 0; // Size of the length prefix of variable arguments
+    bool bytes = false;
+    switch (opcode) {
+    case 0x28: // MARK
+    case 0x93: // STACK_GLOBAL
+    case 0x94: // MEMOIZE
+      break;
+    case 0x80: // PROTO
+    case 0x4B: // BININT1
+      fixed = 1;
+      break;
+    case 0x4D: // BININT2
+      fixed = 2;
+      break;
+    case 0x4A: // BININT
+      fixed = 4;
+      break;
+    case 0x95: // FRAME
+      fixed = 8;
+      break;
+    case 0x8C: // SHORT_BINUNICODE
+      prefix = 1;
+      break;
+    case 0x58: // BINUNICODE
+      prefix = 4;
+      break;
+    case 0x43: // SHORT_BINBYTES
+      prefix = 1;
+      bytes = true;
+      break;
+    case 0x42: // BINBYTES
+      prefix = 4;
+      bytes = true;
+      break;
+    case 0x8E: // BINBYTES8
+      prefix = 8;
+      bytes = true;
+      break;
+    default:
+      return false;
+    }
+    if ((pos == 1 && opcode != 0x80) || size - pos < fixed + prefix) {
+      return false;
+    }
+
+    uint64_t length = 0; // Little-endian, as the host
+    memcpy(&length, data + pos + fixed, prefix);
+    pos += fixed + prefix;
+    if (length > size - pos) {
+      return false;
+    }
+    if (bytes) {
+      *payload = data + pos;
+      *payload_size = length;
+      return found_reconstructor;
+    }
+    found_reconstructor |=
+        length == sizeof(reconstructor) - 1 &&
+        memcmp(data + pos, reconstructor, sizeof(reconstructor) - 1) == 0;
+    pos += length;
+  }
+  return false;
+}
+
+// Concatenation of all traces, repeated to the sizes of the sweep.
+typedef struct {
+  uint8_t *data;
+  size_t size;
+} TracePool;
+
+static void append_to_pool(TracePool *pool, const uint8_t *data, size_t size) {
+  uint8_t *grown = realloc(pool->data, pool->size + size);
+  if (grown == NULL) {
     return;
   }
+  memcpy(grown + pool->size, data, size);
+  pool->data = grown;
+  pool->size += size;
+}
 
-  size_t bytes_read = fread(bitmap, 1, file_size, file);
-  if (bytes_read != (size_t)file_size) {
+// Fills `bitmap` with the repeated traces.
+static void fill_from_pool(const TracePool *pool, uint8_t *bitmap,
+                           size_t size) {
+  for (size_t offset = 0; offset < size; offset += pool->size) {
+    size_t length = size - offset < pool->size ? size - offset : pool->size;
+    memcpy(bitmap + offset, pool->data, length);
+  }
+}
+
+// Returns the number of runs of an input of `size` bytes, so that every size
+// takes about as long as a 1MB input (down to MIN_SWEEP_ITERATIONS runs).
+static int scaled_iterations(const BenchmarkOptions *options, size_t size) {
+  double scaled = (double)options->iterations * (1 << 20) / (double)size;
+  int iterations =
+      scaled < options->iterations ? (int)scaled : options->iterations;
+  return iterations < MIN_SWEEP_ITERATIONS ? MIN_SWEEP_ITERATIONS : iterations;
+}
+
+// Runs all codecs on inputs of 64KB to 64MB cut out of the repeated traces.
+static bool run_sweep(const TracePool *pool, const BenchmarkOptions *options) {
+  bool verified = true;
+  for (size_t size = 64 << 10; size <= 64 << 20 && pool->size > 0; size *= 4) {
+    uint8_t *bitmap = malloc(size);
+    fill_from_pool(pool, bitmap, size);
+
+    char input[64];
+    snprintf(input, sizeof(input), "sweep-%zu", size);
+    verified &= benchmark_bitmap(input, bitmap, size,
+                                 scaled_iterations(options, size), false,
+                                 options);
     free(bitmap);
-    fclose(file);
-    perror("Error reading file");
-    return;
   }
-  fclose(file);
+  return verified;
+}
 
-  // Run aggregated benchmarks
-  AggregatedResult snappy =
-      aggregate_benchmark(bitmap, file_size, benchmark_snappy);
-  AggregatedResult zstd =
-      aggregate_benchmark(bitmap, file_size, benchmark_zstd);
-  AggregatedResult vitemap =
-      aggregate_benchmark(bitmap, file_size, benchmark_vitemap);
-
-  // Print results for this file
-  printf("File: %s\n", filename);
-  printf("initial, %ld\n", file_size);
-  printf("snappy, %ld (%f), %.2f ± %.2f, %.2f ± %.2f, %s\n", snappy.length,
-         (double)snappy.length / (double)file_size, snappy.avg_comp_time,
-         snappy.ci_comp_margin, snappy.avg_decomp_time, snappy.ci_decomp_margin,
-         snappy.verified ? "✓" : "✗");
-  printf("zstd, %ld (%f), %.2f ± %.2f, %.2f ± %.2f, %s\n", zstd.length,
-         (double)zstd.length / (double)file_size, zstd.avg_comp_time,
-         zstd.ci_comp_margin, zstd.avg_decomp_time, zstd.ci_decomp_margin,
-         zstd.verified ? "✓" : "✗");
-  printf("vitemap, %ld (%f), %.2f ± %.2f, %.2f ± %.2f, %s\n", vitemap.length,
-         (double)vitemap.length / (double)file_size, vitemap.avg_comp_time,
-         vitemap.ci_comp_margin, vitemap.avg_decomp_time,
-         vitemap.ci_decomp_margin, vitemap.verified ? "✓" : "✗");
-  printf("\n");
+// Runs Vitemap on inputs of 1MB to 1GB cut out of the repeated traces, with
+// regular and with non-temporal stores (see
+// `vitemap_set_streaming_threshold`), as "regular-<size>" and
+// "streaming-<size>" inputs. Warm-up runs are limited to the timed ones.
+static bool run_streaming(const TracePool *pool,
+                          const BenchmarkOptions *options) {
+  const Codec *vitemap = NULL;
+  for (size_t codec = 0; codec < NUM_CODECS; codec++) {
+    if (strcmp(codecs[codec].name, "vitemap") == 0) {
+      vitemap = &codecs[codec];
+    }
+  }
+  size_t default_threshold = vitemap_get_streaming_threshold();
+  bool verified = true;
+
+  for (size_t size = 1 << 20; size <= 1 << 30 && pool->size > 0; size *= 4) {
+    uint8_t *bitmap = malloc(size);
+    if (bitmap == NULL) {
+      fprintf(stderr, "Not enough memory for %zu byte inputs\n", size);
+      break;
+    }
+    fill_from_pool(pool, bitmap, size);
+    double density = bitmap_density(bitmap, size);
+
+    BenchmarkOptions limited = *options;
+    int iterations = scaled_iterations(options, size);
+    if (limited.warmup > iterations) {
+      limited.warmup = iterations;
+    }
+    for (int streaming = 0; streaming < 2; streaming++) {
+      vitemap_set_streaming_threshold(streaming ? 0 : SIZE_MAX);
+      char input[64];
+      snprintf(input, sizeof(input), "%s-%zu",
+               streaming ? "streaming" : "regular", size);
+      BenchmarkRecord record = benchmark_codec(vitemap, input, bitmap, size,
+                                               iterations, &limited);
+      record.density = density;
+      print_record(&record, options);
+      verified &= record.verified;
+    }
+    free(bitmap);
+  }
+
+  vitemap_set_streaming_threshold(default_threshold);
+  return verified;
+}
+
+// One thread of the scaling benchmark, pinned to `cpu` with its own Vitemap
+// and output buffer. With `remote`, both are allocated (and first touched)
+// from `memory_cpu`, on another NUMA node than `cpu`.
+typedef struct {
+  int cpu;
+  int memory_cpu;
+  const TracePool *pool;
+  int iterations;
+  pthread_barrier_t *barrier;
+  struct timespec comp_start, comp_end;
+  struct timespec decomp_start, decomp_end;
+  size_t compressed_size;
+  bool verified;
+} ScalingThread;
+
+static bool pin_to_cpu(int cpu) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+// Returns the NUMA node of a CPU, or 0 if unknown.
+static int numa_node(int cpu) {
+  char path[128];
+  for (int node = 0; node < MAX_NUMA_NODES; node++) {
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpu%d", node,
+             cpu);
+    if (access(path, F_OK) == 0) {
+      return node;
+    }
+  }
+  return 0;
+}
+
+// Compresses and decompresses SCALING_SIZE bytes of the pool, all threads
+// starting each operation together, and verifies the result.
+static void *run_scaling_thread(void *arg) {
+  ScalingThread *thread = arg;
+  pin_to_cpu(thread->memory_cpu);
+  Vitemap *vm = vitemap_create(SCALING_SIZE);
+  uint8_t *output = malloc(SCALING_SIZE + OUTPUT_PADDING);
+  fill_from_pool(thread->pool, vm->input, SCALING_SIZE);
+  memset(vm->output, 0, vm->max_compressed_size);
+  memset(output, 0, SCALING_SIZE + OUTPUT_PADDING);
+  pin_to_cpu(thread->cpu);
+
+  // Untimed first run, which also faults in the buffers.
+  thread->compressed_size = vitemap_compress(vm, SCALING_SIZE);
+  vitemap_decompress(vm->output, vm->output_size, output);
+
+  pthread_barrier_wait(thread->barrier);
+  clock_gettime(CLOCK_MONOTONIC_RAW, &thread->comp_start);
+  for (int i = 0; i < thread->iterations; i++) {
+    vitemap_compress(vm, SCALING_SIZE);
+  }
+  clock_gettime(CLOCK_MONOTONIC_RAW, &thread->comp_end);
+
+  pthread_barrier_wait(thread->barrier);
+  clock_gettime(CLOCK_MONOTONIC_RAW, &thread->decomp_start);
+  for (int i = 0; i < thread->iterations; i++) {
+    vitemap_decompress(vm->output, vm->output_size, output);
+  }
+  clock_gettime(CLOCK_MONOTONIC_RAW, &thread->decomp_end);
+
+  thread->verified = memcmp(vm->input, output, SCALING_SIZE) == 0;
+  free(output);
+  vitemap_delete(vm);
+  return NULL;
+}
+
+// Aggregate and mean per-thread throughput of one operation, in GB/s, and
+// the memory traffic (bytes read and written) of the aggregate.
+static void scaling_throughput(const ScalingThread *threads, int num_threads,
+                               bool compress, double *aggregate,
+                               double *per_thread, double *traffic) {
+  struct timespec first = {0}, last = {0};
+  double bytes = 0, compressed_bytes = 0, thread_sum = 0;
+  for (int i = 0; i < num_threads; i++) {
+    struct timespec start =
+        compress ? threads[i].comp_start : threads[i].decomp_start;
+    struct timespec end =
+        compress ? threads[i].comp_end : threads[i].decomp_end;
+    if (i == 0 || calculate_time_diff(start, first) > 0) {
+      first = start;
+    }
+    if (i == 0 || calculate_time_diff(last, end) > 0) {
+      last = end;
+    }
+    double thread_bytes = (double)SCALING_SIZE * threads[i].iterations;
+    bytes += thread_bytes;
+    compressed_bytes +=
+        (double)threads[i].compressed_size * threads[i].iterations;
+    thread_sum += throughput(thread_bytes, calculate_time_diff(start, end));
+  }
+  double time = calculate_time_diff(first, last);
+  *aggregate = throughput(bytes, time);
+  *per_thread = thread_sum / num_threads;
+  *traffic = throughput(bytes + compressed_bytes, time);
+}
+
+// Runs Vitemap (without runs) on 1, 2, 4... threads up to `--threads` (all
+// allowed CPUs by default), each pinned to its own CPU and compressing its own
+// copy of the repeated traces. Threads are given CPUs in increasing order,
+// which fills the physical cores before their hyper-threads on Linux. Every
+// step runs with local memory, then on machines with several NUMA nodes with
+// the memory of every thread on another node.
+static bool run_scaling(const TracePool *pool,
+                        const BenchmarkOptions *options) {
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+    perror("Error getting CPU affinity");
+    return false;
+  }
+  int num_cpus = 0;
+  int cpus[CPU_SETSIZE];
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &allowed)) {
+      cpus[num_cpus++] = cpu;
+    }
+  }
+  int max_threads = options->max_threads > 0 && options->max_threads < num_cpus
+                        ? options->max_threads
+                        : num_cpus;
+
+  int iterations = scaled_iterations(options, SCALING_SIZE);
+  ScalingThread *threads = malloc(max_threads * sizeof(ScalingThread));
+  pthread_t *handles = malloc(max_threads * sizeof(pthread_t));
+  bool verified = true;
+
+  printf("\n%-8s %-7s %10s %10s %8s %12s %10s %8s\n", "threads", "memory",
+         "comp GB/s", "per thread", "traffic", "decomp GB/s", "per thread",
+         "traffic");
+  for (int num_threads = 1;; num_threads *= 2) {
+    if (num_threads > max_threads) {
+      num_threads = max_threads;
+    }
+    for (int remote = 0; remote < 2; remote++) {
+      bool placed = true;
+      for (int i = 0; i < num_threads; i++) {
+        int cpu = cpus[i];
+        int memory_cpu = cpu;
+        for (int j = 0; remote && memory_cpu == cpu && j < num_cpus; j++) {
+          if (numa_node(cpus[j]) != numa_node(cpu)) {
+            memory_cpu = cpus[j];
+          }
+        }
+        placed &= memory_cpu != cpu || !remote;
+        threads[i] = (ScalingThread){.cpu = cpu,
+                                     .memory_cpu = memory_cpu,
+                                     .pool = pool,
+                                     .iterations = iterations};
+      }
+      if (!placed) {
+        continue; // Single NUMA node
+      }
+
+      pthread_barrier_t barrier;
+      pthread_barrier_init(&barrier, NULL, num_threads);
+      for (int i = 0; i < num_threads; i++) {
+        threads[i].barrier = &barrier;
+        if (pthread_create(&handles[i], NULL, run_scaling_thread,
+                           &threads[i]) != 0) {
+          // The threads already created would wait forever at the barrier.
+          fprintf(stderr, "Error creating thread %d\n", i);
+          exit(1);
+        }
+      }
+      for (int i = 0; i < num_threads; i++) {
+        pthread_join(handles[i], NULL);
+        verified &= threads[i].verified;
+      }
+      pthread_barrier_destroy(&barrier);
+
+      double comp[3], decomp[3];
+      scaling_throughput(threads, num_threads, true, &comp[0], &comp[1],
+                         &comp[2]);
+      scaling_throughput(threads, num_threads, false, &decomp[0], &decomp[1],
+                         &decomp[2]);
+      printf("%-8d %-7s %10.2f %10.2f %8.2f %12.2f %10.2f %8.2f\n",
+             num_threads, remote ? "remote" : "local", comp[0], comp[1],
+             comp[2], decomp[0], decomp[1], decomp[2]);
+    }
+    if (num_threads == max_threads) {
+      break;
+    }
+  }
+
+  free(threads);
+  free(handles);
+  return verified;
+}
+
+// Generator of synthetic inputs (splitmix64), seeded by `--seed`.
+static uint64_t random_state;
+
+static uint64_t next_random(void) {
+  uint64_t z = random_state += 0x9E3779B97F4A7C15ULL;
+  z = (z ^ z >> 30) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ z >> 27) * 0x94D049BB133111EBULL;
+  return z ^ z >> 31;
+}
+
+// Returns a uniform random number in [0, 1).
+static double next_unit(void) { return (next_random() >> 11) * 0x1.0p-53; }
+
+// Sets `count` distinct random bits of a zeroed bucket.
+static void set_random_bits(uint8_t *bucket, size_t count) {
+  uint8_t positions[BUCKET_SIZE];
+  for (size_t i = 0; i < BUCKET_SIZE; i++) {
+    positions[i] = i;
+  }
+  for (size_t i = 0; i < count; i++) {
+    size_t j = i + next_random() % (BUCKET_SIZE - i);
+    uint8_t position = positions[j];
+    positions[j] = positions[i];
+    bucket[position / 8] |= 1 << position % 8;
+  }
+}
+
+// Every bit is set with probability `density`.
+static void generate_uniform(uint8_t *bitmap, size_t size, double density) {
+  for (size_t i = 0; i < 8 * size; i++) {
+    if (next_unit() < density) {
+      bitmap[i / 8] |= 1 << i % 8;
+    }
+  }
+}
+
+// Every bucket has exactly `count` bits set, to place all buckets on one side
+// of a category boundary (arrays below 32 bits, inverted arrays above 224).
+static void generate_bucket_counts(uint8_t *bitmap, size_t size,
+                                   size_t count) {
+  for (size_t i = 0; i + BUCKET_SIZE_U8 <= size; i += BUCKET_SIZE_U8) {
+    set_random_bits(bitmap + i, count);
+  }
+}
+
+// Alternating stretches of unset and set bits, of exponentially distributed
+// lengths averaging `length` bits together, `density` of which are set.
+static void generate_runs(uint8_t *bitmap, size_t size, double length,
+                          double density) {
+  bool set = false;
+  for (size_t i = 0; i < 8 * size;) {
+    double mean = length * (set ? density : 1 - density);
+    size_t run = 1 + (size_t)(-mean * log(1 - next_unit()));
+    for (size_t end = i + run; i < end && i < 8 * size; i++) {
+      bitmap[i / 8] |= set << i % 8;
+    }
+    set = !set;
+  }
+}
+
+// Buckets in random order, the bucket of rank r having 256 / r^exponent set
+// bits: a few dense buckets and a long tail of sparse and empty ones.
+static void generate_zipf(uint8_t *bitmap, size_t size, double exponent) {
+  size_t num_buckets = size / BUCKET_SIZE_U8;
+  size_t *ranks = malloc(num_buckets * sizeof(size_t));
+  for (size_t i = 0; i < num_buckets; i++) {
+    ranks[i] = i + 1;
+  }
+  for (size_t i = num_buckets; i > 1; i--) {
+    size_t j = next_random() % i;
+    size_t rank = ranks[j];
+    ranks[j] = ranks[i - 1];
+    ranks[i - 1] = rank;
+  }
+  for (size_t i = 0; i < num_buckets; i++) {
+    size_t count = (size_t)round(BUCKET_SIZE / pow(ranks[i], exponent));
+    set_random_bits(bitmap + i * BUCKET_SIZE_U8, count);
+  }
+  free(ranks);
+}
+
+// Every bucket falls in a different category than the previous one, among
+// arrays, bitmaps and inverted arrays, with a random number of set bits. With
+// `periodic`, categories follow a fixed cycle; otherwise they are random, so
+// that the category of the next bucket cannot be predicted.
+static void generate_mixed(uint8_t *bitmap, size_t size, bool periodic) {
+  static const size_t bounds[3][2] = {
+      {0, BUCKET_SIZE_U8 - 1},
+      {BUCKET_SIZE_U8, BUCKET_SIZE - BUCKET_SIZE_U8},
+      {BUCKET_SIZE - BUCKET_SIZE_U8 + 1, BUCKET_SIZE}};
+  size_t category = 0;
+  for (size_t i = 0; i + BUCKET_SIZE_U8 <= size; i += BUCKET_SIZE_U8) {
+    category = (category + (periodic ? 1 : 1 + next_random() % 2)) % 3;
+    size_t low = bounds[category][0];
+    size_t count = low + next_random() % (bounds[category][1] - low + 1);
+    set_random_bits(bitmap + i, count);
+  }
+}
+
+// Runs all codecs on generated inputs of `--synthetic-size` bytes: uniform
+// densities, exact bucket counts around the category boundaries, runs, Zipf
+// distributions and mixed categories.
+static bool run_synthetic(const BenchmarkOptions *options) {
+  static const double densities[] = {0.001, 0.01, 0.05, 0.10, 0.25,
+                                     0.50,  0.75, 0.90, 0.99, 0.999};
+  static const size_t counts[] = {0,   1,   16,  30,  31,  32,  33,
+                                  34,  64,  128, 192, 222, 223, 224,
+                                  225, 226, 240, 255, 256};
+  static const double run_lengths[] = {64, 1024, 16384};
+  static const double exponents[] = {0.5, 1.0, 1.5};
+  size_t size = options->synthetic_size;
+  uint8_t *bitmap = malloc(size);
+  char input[64];
+  bool verified = true;
+  random_state = options->seed;
+
+  for (size_t i = 0; i < sizeof(densities) / sizeof(densities[0]); i++) {
+    memset(bitmap, 0, size);
+    generate_uniform(bitmap, size, densities[i]);
+    snprintf(input, sizeof(input), "uniform-%g", densities[i]);
+    verified &= benchmark_bitmap(input, bitmap, size, options->iterations,
+                                 true, options);
+  }
+  for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+    memset(bitmap, 0, size);
+    generate_bucket_counts(bitmap, size, counts[i]);
+    snprintf(input, sizeof(input), "bucket-count-%zu", counts[i]);
+    verified &= benchmark_bitmap(input, bitmap, size, options->iterations,
+                                 true, options);
+  }
+  for (size_t i = 0; i < sizeof(run_lengths) / sizeof(run_lengths[0]); i++) {
+    for (size_t j = 0; j < 2; j++) {
+      double density = j == 0 ? 0.1 : 0.5;
+      memset(bitmap, 0, size);
+      generate_runs(bitmap, size, run_lengths[i], density);
+      snprintf(input, sizeof(input), "runs-%g-%g", run_lengths[i], density);
+      verified &= benchmark_bitmap(input, bitmap, size, options->iterations,
+                                   true, options);
+    }
+  }
+  for (size_t i = 0; i < sizeof(exponents) / sizeof(exponents[0]); i++) {
+    memset(bitmap, 0, size);
+    generate_zipf(bitmap, size, exponents[i]);
+    snprintf(input, sizeof(input), "zipf-%g", exponents[i]);
+    verified &= benchmark_bitmap(input, bitmap, size, options->iterations,
+                                 true, options);
+  }
+  for (size_t periodic = 0; periodic < 2; periodic++) {
+    memset(bitmap, 0, size);
+    generate_mixed(bitmap, size, periodic);
+    snprintf(input, sizeof(input), "mixed-%s",
+             periodic ? "periodic" : "random");
+    verified &= benchmark_bitmap(input, bitmap, size, options->iterations,
+                                 true, options);
+  }
 
   free(bitmap);
+  return verified;
+}
 
-  total_files++;
-  total_initial_size += file_size;
-  total_snappy_size += snappy.length;
-  total_zstd_size += zstd.length;
-  total_vitemap_size += vitemap.length;
-  total_snappy_comp_time += snappy.avg_comp_time;
-  total_zstd_comp_time += zstd.avg_comp_time;
-  total_vitemap_comp_time += vitemap.avg_comp_time;
-  total_snappy_decomp_time += snappy.avg_decomp_time;
-  total_zstd_decomp_time += zstd.avg_decomp_time;
-  total_vitemap_decomp_time += vitemap.avg_decomp_time;
-}
-
-// Runs benchmarks for all files within the ./traces directory.
-// We evaluate the compression ratio and time for three different compression
-// algorithms:
-// - Snappy (general purpose compression algorithm developed by Google)
-// - Zstd (general purpose compression algorithm developed by Facebook)
-// - Vitemap (our custom *bitmap* encoding scheme, based on Lemir's Roaring
-// bitmaps) We run all benchmarks multiple times and aggregate the results: we
-// compute a 95% confidence interval for the time.
-int main() {
-  const char *traces_dir = "traces";
-  DIR *dir;
-  struct dirent *ent;
-  struct stat st;
-  char filepath[1024];
+void print_usage(const char *program) {
+  fprintf(stderr,
+          "Usage: %s [--cold] [--sweep] [--streaming] [--scaling]\n"
+          "       [--threads N]\n"
+          "       [--format text|csv|json]\n"
+          "       [--iterations N] [--warmup N] [--codec NAME]\n"
+          "       [--synthetic] [--synthetic-size BYTES] [--seed N]\n"
+          "       [traces_dir]\n",
+          program);
+}
 
-  dir = opendir(traces_dir);
-  if (dir == NULL) {
-    perror("Error opening traces directory");
-    return 1;
+// Parses the command line into `options`, and returns whether it is valid.
+static bool parse_options(int argc, char *argv[], BenchmarkOptions *options) {
+  for (int i = 1; i < argc; i++) {
+    const char *arg = argv[i];
+    bool has_value = i + 1 < argc;
+    if (strcmp(arg, "--cold") == 0) {
+      options->cold = true;
+    } else if (strcmp(arg, "--sweep") == 0) {
+      options->sweep = true;
+    } else if (strcmp(arg, "--streaming") == 0) {
+      options->streaming = true;
+    } else if (strcmp(arg, "--scaling") == 0) {
+      options->scaling = true;
+    } else if (strcmp(arg, "--threads") == 0 && has_value) {
+      options->max_threads = atoi(argv[++i]);
+    } else if (strcmp(arg, "--synthetic") == 0) {
+      options->synthetic = true;
+    } else if (strcmp(arg, "--synthetic-size") == 0 && has_value) {
+      options->synthetic_size = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(arg, "--seed") == 0 && has_value) {
+      options->seed = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(arg, "--codec") == 0 && has_value) {
+      options->codec = argv[++i];
+    } else if (strcmp(arg, "--format") == 0 && has_value) {
+      const char *format = argv[++i];
+      if (strcmp(format, "text") == 0) {
+        options->format = FORMAT_TEXT;
+      } else if (strcmp(format, "csv") == 0) {
+        options->format = FORMAT_CSV;
+      } else if (strcmp(format, "json") == 0) {
+        options->format = FORMAT_JSON;
+      } else {
+        return false;
+      }
+    } else if (strcmp(arg, "--iterations") == 0 && has_value) {
+      options->iterations = atoi(argv[++i]);
+    } else if (strcmp(arg, "--warmup") == 0 && has_value) {
+      options->warmup = atoi(argv[++i]);
+    } else if (arg[0] != '-') {
+      options->traces_dir = arg;
+    } else {
+      return false;
+    }
   }
+  return options->iterations > 0 && options->warmup >= 0 &&
+         options->synthetic_size >= BUCKET_SIZE_U8 &&
+         options->max_threads >= 0 &&
+         (!options->scaling || options->format == FORMAT_TEXT);
+}
 
+// Runs all codecs on every trace of `dir`, the opened `traces_dir`, and
+// appends the traces to `pool` for the sweeps and the scaling benchmark. Traces
+// pickled by Python (see `find_pickled_array`) are reduced to their bitmap,
+// other files are taken as is.
+static bool run_traces(DIR *dir, const BenchmarkOptions *options,
+                       TracePool *pool) {
+  bool verified = true;
+  struct dirent *ent;
+  struct stat st;
+  char filepath[1024];
   while ((ent = readdir(dir)) != NULL) {
-    snprintf(filepath, sizeof(filepath), "%s/%s", traces_dir, ent->d_name);
+    snprintf(filepath, sizeof(filepath), "%s/%s", options->traces_dir,
+             ent->d_name);
     if (stat(filepath, &st) == -1) {
       perror("Error getting file status");
       continue;
     }
+    if (!S_ISREG(st.st_mode)) {
+      continue;
+    }
 
-    if (S_ISREG(st.st_mode)) {
-      process_file(filepath);
-    }
-  }
-  closedir(dir);
-
-  printf("Aggregate Statistics:\n");
-  printf("Average Initial Size: %.2f bytes\n",
-         total_initial_size / total_files);
-  printf("Snappy - Average Size: %.2f bytes (%.4f), Average Comp Time: %.2f "
-         "ns, Average Decomp Time: %.2f ns\n",
-         total_snappy_size / total_files,
-         (total_snappy_size / total_files) / (total_initial_size / total_files),
-         total_snappy_comp_time / total_files,
-         total_snappy_decomp_time / total_files);
-  printf("Zstd - Average Size: %.2f bytes (%.4f), Average Comp Time: %.2f ns, "
-         "Average Decomp Time: %.2f ns\n",
-         total_zstd_size / total_files,
-         (total_zstd_size / total_files) / (total_initial_size / total_files),
-         total_zstd_comp_time / total_files,
-         total_zstd_decomp_time / total_files);
-  printf("Vitemap - Average Size: %.2f bytes (%.4f), Average Comp Time: %.2f "
-         "ns, Average Decomp Time: %.2f ns\n",
-         total_vitemap_size / total_files,
-         (total_vitemap_size / total_files) /
-             (total_initial_size / total_files),
-         total_vitemap_comp_time / total_files,
-         total_vitemap_decomp_time / total_files);
+    size_t size;
+    uint8_t *data = read_file(filepath, &size);
+    if (data == NULL) {
+      continue;
+    }
+    const uint8_t *bitmap = data;
+    const uint8_t *payload;
+    size_t payload_size;
+    if (find_pickled_array(data, size, &payload, &payload_size)) {
+      bitmap = payload;
+      size = payload_size;
+    }
+    verified &= benchmark_bitmap(ent->d_name, bitmap, size,
+                                 options->iterations, true, options);
+    if (options->sweep || options->streaming || options->scaling) {
+      append_to_pool(pool, bitmap, size);
+    }
+    free(data);
+  }
+  return verified;
+}
 
+// Runs benchmarks for all files within the traces directory (./traces by
+// default), with every codec of `codecs`:
+// - Snappy, Zstd and optionally LZ4 (general purpose compression algorithms)
+// - Optionally CRoaring (Lemire's Roaring bitmaps)
+// - Vitemap (our custom *bitmap* encoding scheme), without and with runs
+// Each codec compresses and decompresses each file `--iterations` times, after
+// `--warmup` untimed runs, on a hot cache unless `--cold` is given. We report
+// the mean latency with its 95% confidence interval, the p50 and p99
+// latencies and the throughput at p50, as text, CSV or JSON. `--sweep` also
+// runs inputs of growing sizes, `--streaming` compares regular and
+// non-temporal stores up to 1GB, and `--scaling` runs growing numbers of
+// threads (text output only). `--synthetic` replaces the traces with
+// generated inputs (see `run_synthetic`), and `--codec` restricts the run to
+// one codec.
+int main(int argc, char *argv[]) {
+  BenchmarkOptions options = {.traces_dir = "traces",
+                              .iterations = DEFAULT_ITERATIONS,
+                              .warmup = DEFAULT_WARMUP,
+                              .format = FORMAT_TEXT,
+                              .synthetic_size = DEFAULT_SYNTHETIC_SIZE,
+                              .seed = DEFAULT_SEED};
+  if (!parse_options(argc, argv, &options)) {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  DIR *dir = NULL;
+  if (!options.synthetic && (dir = opendir(options.traces_dir)) == NULL) {
+    perror("Error opening traces directory");
+    return 1;
+  }
+
+  print_header(&options);
+  TracePool pool = {0};
+  bool verified;
+  if (options.synthetic) {
+    verified = run_synthetic(&options);
+  } else {
+    verified = run_traces(dir, &options, &pool);
+    closedir(dir);
+  }
+
+  if (options.sweep && pool.size > 0) {
+    verified &= run_sweep(&pool, &options);
+  }
+  if (options.streaming && pool.size > 0) {
+    verified &= run_streaming(&pool, &options);
+  }
+  if (options.scaling && pool.size > 0) {
+    verified &= run_scaling(&pool, &options);
+  }
+  free(pool.data);
+  print_footer(&options);
+
+  if (!verified) {
+    fprintf(stderr, "Some codecs did not decompress their input correctly.\n");
+    return 1;
+  }
   return 0;
-}
\ No newline at end of file
+}
@@ -13,12 +13,19 @@
  */
 
 #include "vite.h"
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
 
-#define MAX_FILENAME 256
+#define MAX_FILENAME 4096
+#define MAX_WORKERS 256
 
 // ANSI color codes
 #define ANSI_COLOR_RED "\x1b[31m"
@@ -31,8 +38,12 @@
 
 void print_usage() {
   printf(ANSI_COLOR_CYAN);
-  printf("Usage: ./vitemap [input_file] [output_file] [mode]\n");
+  printf("Usage: ./vitemap [--threads N] [input_file] [output_file] [mode]\n");
+  printf("       ./vitemap --batch [mode] [--threads N] [--output-dir DIR] "
+         "[files...]\n");
   printf("Mode: c for compress, d for decompress\n");
+  printf("Batch outputs: file.vm when compressing, and file without .vm (or "
+         "file.out) when decompressing\n");
   printf(ANSI_COLOR_RESET);
 }
 
@@ -49,125 +60,228 @@ double get_time_ms(struct timespec start, struct timespec end) {
          (end.tv_nsec - start.tv_nsec) / 1e6;
 }
 
-void print_stats(const char *operation, long input_size, uint32_t output_size,
-                 double time_ms) {
+void print_stats(const char *operation, uint64_t input_size,
+                 uint64_t output_size, double time_ms) {
   printf(ANSI_COLOR_YELLOW);
   printf("┌─────────────────────────────────────────┐\n");
   printf("│ %-37s   │\n", operation);
   printf("├─────────────────────────────────────────┤\n");
-  printf("│ Input size:\t\t%10ld bytes  │\n", input_size);
-  printf("│ Output size:\t\t%10u bytes  │\n", output_size);
+  printf("│ Input size:\t\t%10" PRIu64 " bytes  │\n", input_size);
+  printf("│ Output size:\t\t%10" PRIu64 " bytes  │\n", output_size);
   printf("│ Ratio:\t\t     %10.2f%%  │\n",
-         (operation[0] == 'C') ? (1 - (double)output_size / input_size) * 100
-                               : ((double)output_size / input_size - 1) * 100);
+         (operation[0] == 'C')
+             ? (1 - (double)output_size / input_size) * 100
+             : ((double)output_size / input_size - 1) * 100);
   printf("│ Time elapsed:\t\t   %10.2f ms  │\n", time_ms);
   printf("└─────────────────────────────────────────┘\n");
   printf(ANSI_COLOR_RESET);
 }
 
-int main(int argc, char *argv[]) {
-  if (argc != 4) {
-    print_usage();
-    return 1;
+// Compresses or decompresses one file into another through the file API, so
+// that regular files are memory-mapped instead of read and written.
+bool process_file(const char *input_file, const char *output_file, char mode,
+                  unsigned num_threads, uint64_t *input_size,
+                  uint64_t *output_size) {
+  int in_fd = open(input_file, O_RDONLY);
+  if (in_fd < 0) {
+    return false;
   }
-
-  print_header();
-
-  char *input_file = argv[1];
-  char *output_file = argv[2];
-  char mode = argv[3][0];
-
-  FILE *in_fp = fopen(input_file, "rb");
-  if (!in_fp) {
-    perror(ANSI_COLOR_RED "Error opening input file" ANSI_COLOR_RESET);
-    return 1;
+  struct stat st;
+  if (fstat(in_fd, &st) != 0) {
+    close(in_fd);
+    return false;
   }
+  *input_size = st.st_size;
 
-  fseek(in_fp, 0, SEEK_END);
-  long input_size = ftell(in_fp);
-  fseek(in_fp, 0, SEEK_SET);
-
-  uint8_t *input_buffer = malloc(input_size);
-  if (!input_buffer) {
-    perror(ANSI_COLOR_RED "Error allocating memory" ANSI_COLOR_RESET);
-    fclose(in_fp);
-    return 1;
+  // Read access lets the output be mapped. The output is only truncated once
+  // it is known not to be the input.
+  int out_fd = open(output_file, O_RDWR | O_CREAT, 0644);
+  if (out_fd < 0) {
+    close(in_fd);
+    return false;
+  }
+  struct stat out_st;
+  if (fstat(out_fd, &out_st) != 0 ||
+      (out_st.st_dev == st.st_dev && out_st.st_ino == st.st_ino)) {
+    close(in_fd);
+    close(out_fd);
+    return false;
   }
 
-  fread(input_buffer, 1, input_size, in_fp);
-  fclose(in_fp);
+  bool done = ftruncate(out_fd, 0) == 0 &&
+              (mode == 'c' ? vitemap_compress_file(in_fd, out_fd, 0,
+                                                   num_threads, output_size)
+                           : vitemap_decompress_file(in_fd, out_fd,
+                                                     num_threads, output_size));
+  close(in_fd);
+  done &= close(out_fd) == 0;
+  // No partial output is left behind.
+  if (!done) {
+    unlink(output_file);
+  }
+  return done;
+}
 
-  struct timespec start, end;
-  clock_gettime(CLOCK_MONOTONIC, &start);
+// Writes the output path of `input_file` in batch mode to `output_file`,
+// in `output_dir` if given and next to the input otherwise.
+bool batch_output_file(const char *input_file, char mode,
+                       const char *output_dir, char *output_file) {
+  const char *name = input_file;
+  if (output_dir != NULL) {
+    const char *slash = strrchr(input_file, '/');
+    name = slash != NULL ? slash + 1 : input_file;
+  }
+  const char *separator = output_dir != NULL ? "/" : "";
+  const char *dir = output_dir != NULL ? output_dir : "";
 
+  int length;
+  size_t name_length = strlen(name);
   if (mode == 'c') {
-    Vitemap *vm = vitemap_create(input_size);
-    if (!vm) {
-      perror(ANSI_COLOR_RED "Error creating Vitemap" ANSI_COLOR_RESET);
-      free(input_buffer);
-      return 1;
-    }
-
-    memcpy(vm->input, input_buffer, input_size);
-    uint32_t compressed_size = vitemap_compress(vm, input_size);
+    length = snprintf(output_file, MAX_FILENAME, "%s%s%s.vm", dir, separator,
+                      name);
+  } else if (name_length > 3 && strcmp(name + name_length - 3, ".vm") == 0) {
+    length = snprintf(output_file, MAX_FILENAME, "%s%s%.*s", dir, separator,
+                      (int)(name_length - 3), name);
+  } else {
+    length = snprintf(output_file, MAX_FILENAME, "%s%s%s.out", dir, separator,
+                      name);
+  }
+  return length > 0 && length < MAX_FILENAME;
+}
 
-    clock_gettime(CLOCK_MONOTONIC, &end);
-    double time_ms = get_time_ms(start, end);
+// Files of a batch, shared by all workers, which take the next unprocessed
+// file until none is left.
+typedef struct {
+  char **files;
+  size_t num_files;
+  char mode;
+  const char *output_dir;
+  unsigned num_threads; // Threads per file
+  atomic_size_t next;   // Next file to process
+  atomic_size_t failed; // Number of files that could not be processed
+  atomic_uint_fast64_t input_size;
+  atomic_uint_fast64_t output_size;
+} Batch;
 
-    FILE *out_fp = fopen(output_file, "wb");
-    if (!out_fp) {
-      perror(ANSI_COLOR_RED "Error opening output file" ANSI_COLOR_RESET);
-      vitemap_delete(vm);
-      free(input_buffer);
-      return 1;
+void *run_batch_worker(void *arg) {
+  Batch *batch = arg;
+  size_t file;
+  while ((file = atomic_fetch_add(&batch->next, 1)) < batch->num_files) {
+    const char *input_file = batch->files[file];
+    char output_file[MAX_FILENAME];
+    uint64_t input_size = 0;
+    uint64_t output_size = 0;
+    if (!batch_output_file(input_file, batch->mode, batch->output_dir,
+                           output_file) ||
+        !process_file(input_file, output_file, batch->mode,
+                      batch->num_threads, &input_size, &output_size)) {
+      printf(ANSI_COLOR_RED "✗ %s\n" ANSI_COLOR_RESET, input_file);
+      atomic_fetch_add(&batch->failed, 1);
+      continue;
     }
+    printf("✓ %s -> %s (%" PRIu64 " -> %" PRIu64 " bytes)\n", input_file,
+           output_file, input_size, output_size);
+    atomic_fetch_add(&batch->input_size, input_size);
+    atomic_fetch_add(&batch->output_size, output_size);
+  }
+  return NULL;
+}
 
-    fwrite(vm->output, 1, compressed_size, out_fp);
-    fclose(out_fp);
-
-    print_stats("Compression Statistics", input_size, compressed_size, time_ms);
-
-    vitemap_delete(vm);
-  } else if (mode == 'd') {
-    uint32_t decompressed_size = 0;
-    uint32_t buffer_size = 0;
-    vitemap_extract_decompressed_sizes(input_buffer, &decompressed_size,
-                                       &buffer_size);
-    uint8_t *output_buffer = malloc(buffer_size);
-    if (!output_buffer) {
-      perror(ANSI_COLOR_RED
-             "Error allocating memory for decompression" ANSI_COLOR_RESET);
-      free(input_buffer);
-      return 1;
-    }
+// Processes all files of a batch with `num_threads` workers, or with
+// `num_threads` threads on a single file.
+int run_batch(char **files, size_t num_files, char mode,
+              const char *output_dir, unsigned num_threads) {
+  unsigned num_workers = num_threads < num_files ? num_threads : num_files;
+  num_workers = num_workers < MAX_WORKERS ? num_workers : MAX_WORKERS;
+  Batch batch = {.files = files,
+                 .num_files = num_files,
+                 .mode = mode,
+                 .output_dir = output_dir,
+                 .num_threads = num_files == 1 ? num_threads : 1};
 
-    vitemap_decompress(input_buffer, input_size, output_buffer);
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  pthread_t workers[MAX_WORKERS];
+  unsigned started = 0;
+  for (unsigned i = 1; i < num_workers; i++) {
+    started += pthread_create(&workers[started], NULL, run_batch_worker,
+                              &batch) == 0;
+  }
+  run_batch_worker(&batch);
+  for (unsigned i = 0; i < started; i++) {
+    pthread_join(workers[i], NULL);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
 
-    clock_gettime(CLOCK_MONOTONIC, &end);
-    double time_ms = get_time_ms(start, end);
+  size_t failed = atomic_load(&batch.failed);
+  if (failed < num_files) {
+    print_stats(mode == 'c' ? "Compression Statistics"
+                            : "Decompression Statistics",
+                atomic_load(&batch.input_size),
+                atomic_load(&batch.output_size), get_time_ms(start, end));
+  }
+  printf("%zu files processed, %zu failed\n", num_files - failed, failed);
+  return failed > 0;
+}
 
-    FILE *out_fp = fopen(output_file, "wb");
-    if (!out_fp) {
-      perror(ANSI_COLOR_RED "Error opening output file" ANSI_COLOR_RESET);
-      free(input_buffer);
-      free(output_buffer);
-      return 1;
+int main(int argc, char *argv[]) {
+  unsigned num_threads = 1;
+  const char *output_dir = NULL;
+  char batch_mode = 0;
+  char *positional[3];
+  int num_positional = 0;
+  int first_file = argc;
+  for (int i = 1; i < argc && first_file == argc; i++) {
+    if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      num_threads = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--output-dir") == 0 && i + 1 < argc) {
+      output_dir = argv[++i];
+    } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+      batch_mode = argv[++i][0];
+    } else if (batch_mode != 0) {
+      first_file = i;
+    } else if (num_positional < 3) {
+      positional[num_positional++] = argv[i];
+    } else {
+      num_positional++;
     }
+  }
 
-    fwrite(output_buffer, 1, decompressed_size, out_fp);
-    fclose(out_fp);
+  bool batch = batch_mode != 0;
+  char mode = batch ? batch_mode : num_positional == 3 ? positional[2][0] : 0;
+  if ((batch ? first_file == argc : num_positional != 3) ||
+      num_threads == 0 || (output_dir != NULL && !batch)) {
+    print_usage();
+    return 1;
+  }
 
-    print_stats("Decompression Statistics", input_size, decompressed_size,
-                time_ms);
+  print_header();
 
-    free(output_buffer);
-  } else {
+  if (mode != 'c' && mode != 'd') {
     printf(ANSI_COLOR_RED "Invalid mode. Use 'c' for compress or 'd' for "
                           "decompress.\n" ANSI_COLOR_RESET);
-    free(input_buffer);
     return 1;
   }
+  if (batch) {
+    return run_batch(argv + first_file, argc - first_file, mode, output_dir,
+                     num_threads);
+  }
 
-  free(input_buffer);
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  uint64_t input_size = 0;
+  uint64_t output_size = 0;
+  if (!process_file(positional[0], positional[1], mode, num_threads,
+                    &input_size, &output_size)) {
+    printf(ANSI_COLOR_RED "Error: could not %s %s into %s\n" ANSI_COLOR_RESET,
+           mode == 'c' ? "compress" : "decompress", positional[0],
+           positional[1]);
+    return 1;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  print_stats(mode == 'c' ? "Compression Statistics"
+                          : "Decompression Statistics",
+              input_size, output_size, get_time_ms(start, end));
   return 0;
-}
\ No newline at end of file
+}
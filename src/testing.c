@@ -13,12 +13,17 @@
  */
 
 #include "vite.h"
+#include "vite_fixed.h"
 
 #include <assert.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 
 #define MAX_NUM_TESTS 100
 
@@ -40,6 +45,61 @@ static void print_binaries(uint8_t *arr, size_t len) {
   printf("\n");
 }
 
+// Deterministic xorshift generator, so that failures are reproducible.
+static uint64_t next_random(uint64_t *state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+// Fills buckets with a mix of empty, sparse, random, dense and full buckets,
+// exercising all bucket categories.
+static void fill_mixed_buckets(uint8_t *dst, size_t num_buckets,
+                               uint64_t seed) {
+  uint64_t state = seed;
+  for (size_t bucket = 0; bucket < num_buckets; bucket++) {
+    uint8_t *src = dst + bucket * BUCKET_SIZE_U8;
+    uint64_t kind = next_random(&state) % 5;
+    memset(src, kind == 4 ? 0xFF : 0, BUCKET_SIZE_U8);
+
+    if (kind == 1 || kind == 3) {
+      size_t bits = next_random(&state) % BUCKET_SIZE_U8;
+      for (size_t i = 0; i < bits; i++) {
+        size_t pos = next_random(&state) % BUCKET_SIZE;
+        src[pos / 8] |= 1 << (pos % 8);
+      }
+      if (kind == 3) {
+        for (size_t i = 0; i < BUCKET_SIZE_U8; i++) {
+          src[i] = ~src[i];
+        }
+      }
+    } else if (kind == 2) {
+      for (size_t i = 0; i < BUCKET_SIZE_U8; i++) {
+        src[i] = next_random(&state);
+      }
+    }
+  }
+}
+
+// Fills buckets with stretches of empty, full and mixed buckets of random
+// lengths, as found in very sparse (or very dense) bitmaps.
+static void fill_run_buckets(uint8_t *dst, size_t num_buckets, uint64_t seed) {
+  uint64_t state = seed;
+  for (size_t bucket = 0; bucket < num_buckets;) {
+    size_t length = 1 + next_random(&state) % 150;
+    length = length < num_buckets - bucket ? length : num_buckets - bucket;
+    uint64_t kind = next_random(&state) % 3;
+    if (kind == 2) {
+      fill_mixed_buckets(dst + bucket * BUCKET_SIZE_U8, length, state);
+    } else {
+      memset(dst + bucket * BUCKET_SIZE_U8, kind ? 0xFF : 0,
+             length * BUCKET_SIZE_U8);
+    }
+    bucket += length;
+  }
+}
+
 static void add_test(const char *name, test_function func) {
   assert(test_count < MAX_NUM_TESTS);
   test_cases[test_count].name = name;
@@ -284,12 +344,12 @@ static test_function array_bucket_tests[] = {
 static bool test_round_up_input_size() {
   Vitemap *vm = vitemap_create(1);
   if (vm->max_size != BUCKET_SIZE_U8) {
-    printf("Max size was %d, expected %d.\n", vm->max_size, 32);
+    printf("Max size was %zu, expected %d.\n", vm->max_size, 32);
     vitemap_delete(vm);
     return false;
   }
   if (vm->num_buckets != 1) {
-    printf("Num buckets was %d, expected %d.\n", vm->num_buckets, 1);
+    printf("Num buckets was %zu, expected %d.\n", vm->num_buckets, 1);
     vitemap_delete(vm);
     return false;
   }
@@ -298,21 +358,2297 @@ static bool test_round_up_input_size() {
 
   vm = vitemap_create(100);
   if (vm->max_size != BUCKET_SIZE_U8 * 4) {
-    printf("Max size was %d, expected %d.\n", vm->max_size, 32);
+    printf("Max size was %zu, expected %d.\n", vm->max_size, 32);
     vitemap_delete(vm);
     return false;
   }
   if (vm->num_buckets != 4) {
-    printf("Num buckets was %d, expected %d.\n", vm->num_buckets, 1);
+    printf("Num buckets was %zu, expected %d.\n", vm->num_buckets, 1);
+    vitemap_delete(vm);
+    return false;
+  }
+
+  vitemap_delete(vm);
+
+  return true;
+}
+
+static bool test_seekable_round_trip() {
+  uint32_t num_buckets = 1000;
+  uint32_t size = num_buckets * BUCKET_SIZE_U8 - 5;
+
+  Vitemap *vm = vitemap_create(size);
+  vm->flags = VITEMAP_FLAG_SEEKABLE;
+  fill_mixed_buckets(vm->input, num_buckets, 42);
+  memset(vm->input + size, 0, vm->max_size - size);
+
+  uint32_t compressed_size = vitemap_compress(vm, size);
+
+  if (*(uint32_t *)vm->output != VITEMAP_EXTENDED_HEADER ||
+      vm->output[5] != VITEMAP_FLAG_SEEKABLE) {
+    printf("Stream does not start with a seekable extended header.\n");
     vitemap_delete(vm);
     return false;
   }
 
+  uint32_t data_size, buffer_size;
+  vitemap_extract_decompressed_sizes(vm->output, &data_size, &buffer_size);
+  if (data_size != size || buffer_size != vm->max_size) {
+    printf("Sizes were %u/%u, expected %u/%zu.\n", data_size, buffer_size,
+           size, vm->max_size);
+    vitemap_delete(vm);
+    return false;
+  }
+
+  uint8_t *decompressed = malloc(buffer_size);
+  vitemap_decompress(vm->output, compressed_size, decompressed);
+  bool success = memcmp(decompressed, vm->input, size) == 0;
+  if (!success) {
+    printf("Decompressed seekable stream is not identical.\n");
+  }
+
+  free(decompressed);
+  vitemap_delete(vm);
+  return success;
+}
+
+static bool check_decompress_range(uint32_t flags, const char *name) {
+  printf("\033[1m %s: \033[0m", name);
+  size_t size = 1000 * BUCKET_SIZE_U8 - 11;
+  Vitemap *vm = vitemap_create(size);
+  fill_run_buckets(vm->input, vm->num_buckets, flags + 3);
+  vm->flags = flags;
+  size_t compressed_size = vitemap_compress(vm, size);
+
+  uint8_t *range = malloc(size + 1);
+  uint64_t state = flags + 5;
+  bool success = true;
+  for (size_t trial = 0; trial < 400 && success; trial++) {
+    // Every fourth range starts on a bucket, and some of them are empty.
+    uint64_t lo = next_random(&state) % (size * 8);
+    uint64_t hi = lo + next_random(&state) % (size * 8 - lo + 1);
+    if (trial % 4 == 0) {
+      lo -= lo % BUCKET_SIZE;
+    }
+    if (trial == 0) {
+      lo = 0;
+      hi = size * 8;
+    }
+
+    size_t range_size = (hi - lo + 7) / 8;
+    range[range_size] = 0xA5;
+    memset(range, 0xA5, range_size);
+    vitemap_decompress_range(vm->output, compressed_size, lo, hi, range);
+    for (uint64_t i = 0; i < range_size * 8 && success; i++) {
+      uint64_t bit = lo + i;
+      bool expected = bit < hi && (vm->input[bit / 8] >> (bit % 8) & 1);
+      if ((range[i / 8] >> (i % 8) & 1) != expected) {
+        printf("Bit %lu of range [%lu, %lu) is wrong.\n", (unsigned long)i,
+               (unsigned long)lo, (unsigned long)hi);
+        success = false;
+      }
+    }
+    if (range[range_size] != 0xA5) {
+      printf("Range [%lu, %lu) is written past its end.\n",
+             (unsigned long)lo, (unsigned long)hi);
+      success = false;
+    }
+  }
+
+  free(range);
   vitemap_delete(vm);
+  printf(success ? "Success\n" : "");
+  return success;
+}
+
+static bool test_decompress_range() {
+  return check_decompress_range(0, "Legacy  ") &&
+         check_decompress_range(VITEMAP_FLAG_SEEKABLE, "Seekable") &&
+         check_decompress_range(VITEMAP_FLAG_RUNS, "Runs    ") &&
+         check_decompress_range(VITEMAP_FLAG_SEEKABLE | VITEMAP_FLAG_RUNS |
+                                    VITEMAP_FLAG_WIDE,
+                                "Wide    ");
+}
+
+static bool check_random_access(bool seekable) {
+  printf("\033[1m %s: \033[0m", seekable ? "Seekable" : "Legacy  ");
+
+  uint32_t num_buckets = 300;
+  uint32_t size = num_buckets * BUCKET_SIZE_U8;
 
+  Vitemap *vm = vitemap_create(size);
+  vm->flags = seekable ? VITEMAP_FLAG_SEEKABLE : 0;
+  fill_mixed_buckets(vm->input, num_buckets, 7);
+  uint32_t compressed_size = vitemap_compress(vm, size);
+
+  uint8_t bucket[BUCKET_SIZE_U8];
+  for (uint32_t i = num_buckets; i-- > 0;) {
+    vitemap_get_bucket(vm->output, compressed_size, i, bucket);
+    if (memcmp(bucket, vm->input + i * BUCKET_SIZE_U8, BUCKET_SIZE_U8) != 0) {
+      printf("Bucket %u is not identical.\n", i);
+      vitemap_delete(vm);
+      return false;
+    }
+  }
+
+  for (uint64_t bit = 0; bit < (uint64_t)size * 8 + 10; bit++) {
+    bool expected =
+        bit < (uint64_t)size * 8 && (vm->input[bit / 8] >> (bit % 8)) & 1;
+    if (vitemap_test_bit(vm->output, compressed_size, bit) != expected) {
+      printf("Bit %lu was %d, expected %d.\n", (unsigned long)bit, !expected,
+             expected);
+      vitemap_delete(vm);
+      return false;
+    }
+  }
+
+  vitemap_delete(vm);
+  printf("\033[1;32m✓\033[0m\n");
   return true;
 }
 
+static bool test_random_access() {
+  return check_random_access(true) && check_random_access(false);
+}
+
+static bool check_operation(VitemapOperation op, const char *name,
+                            uint32_t a_buckets, uint32_t b_buckets) {
+  printf("\033[1m %-6s (%u, %u buckets): \033[0m", name, a_buckets,
+         b_buckets);
+
+  uint32_t num_buckets = a_buckets > b_buckets ? a_buckets : b_buckets;
+  uint32_t size = num_buckets * BUCKET_SIZE_U8;
+
+  Vitemap *a = vitemap_create(a_buckets * BUCKET_SIZE_U8);
+  Vitemap *b = vitemap_create(b_buckets * BUCKET_SIZE_U8);
+  Vitemap *expected = vitemap_create(size);
+  Vitemap *result = vitemap_create(size);
+  fill_mixed_buckets(a->input, a_buckets, 1234);
+  fill_mixed_buckets(b->input, b_buckets, 5678);
+
+  for (uint32_t i = 0; i < size; i++) {
+    uint8_t byte_a = i < a->max_size ? a->input[i] : 0;
+    uint8_t byte_b = i < b->max_size ? b->input[i] : 0;
+    switch (op) {
+    case VITEMAP_AND:
+      expected->input[i] = byte_a & byte_b;
+      break;
+    case VITEMAP_OR:
+      expected->input[i] = byte_a | byte_b;
+      break;
+    case VITEMAP_XOR:
+      expected->input[i] = byte_a ^ byte_b;
+      break;
+    case VITEMAP_ANDNOT:
+      expected->input[i] = byte_a & ~byte_b;
+      break;
+    }
+  }
+
+  uint32_t a_size = vitemap_compress(a, a->max_size);
+  uint32_t b_size = vitemap_compress(b, b->max_size);
+  uint32_t expected_size = vitemap_compress(expected, size);
+  uint32_t result_size =
+      vitemap_operate(result, op, a->output, a_size, b->output, b_size);
+
+  bool success = result_size == expected_size &&
+                 memcmp(result->output, expected->output, result_size) == 0;
+  if (!success) {
+    printf("Result is not identical to the compressed raw result (size %u, "
+           "expected %u).\n",
+           result_size, expected_size);
+  } else {
+    printf("\033[1;32m✓\033[0m\n");
+  }
+
+  vitemap_delete(a);
+  vitemap_delete(b);
+  vitemap_delete(expected);
+  vitemap_delete(result);
+  return success;
+}
+
+static bool test_operations() {
+  return check_operation(VITEMAP_AND, "AND", 500, 500) &&
+         check_operation(VITEMAP_OR, "OR", 500, 500) &&
+         check_operation(VITEMAP_XOR, "XOR", 500, 500) &&
+         check_operation(VITEMAP_ANDNOT, "ANDNOT", 500, 500) &&
+         check_operation(VITEMAP_AND, "AND", 300, 500) &&
+         check_operation(VITEMAP_OR, "OR", 500, 300) &&
+         check_operation(VITEMAP_ANDNOT, "ANDNOT", 300, 500);
+}
+
+static bool test_seekable_operation() {
+  uint32_t num_buckets = 200;
+  uint32_t size = num_buckets * BUCKET_SIZE_U8;
+
+  Vitemap *a = vitemap_create(size);
+  Vitemap *b = vitemap_create(size);
+  Vitemap *result = vitemap_create(size);
+  fill_mixed_buckets(a->input, num_buckets, 11);
+  fill_mixed_buckets(b->input, num_buckets, 13);
+  a->flags = VITEMAP_FLAG_SEEKABLE;
+  result->flags = VITEMAP_FLAG_SEEKABLE;
+
+  uint32_t a_size = vitemap_compress(a, size);
+  uint32_t b_size = vitemap_compress(b, size);
+  uint32_t result_size =
+      vitemap_operate(result, VITEMAP_OR, a->output, a_size, b->output, b_size);
+
+  bool success = true;
+  uint8_t bucket[BUCKET_SIZE_U8];
+  for (uint32_t i = 0; i < num_buckets && success; i++) {
+    vitemap_get_bucket(result->output, result_size, i, bucket);
+    for (size_t j = 0; j < BUCKET_SIZE_U8; j++) {
+      uint8_t expected = a->input[i * BUCKET_SIZE_U8 + j] |
+                         b->input[i * BUCKET_SIZE_U8 + j];
+      if (bucket[j] != expected) {
+        printf("Byte %zu of bucket %u was %d, expected %d.\n", j, i,
+               bucket[j], expected);
+        success = false;
+        break;
+      }
+    }
+  }
+
+  vitemap_delete(a);
+  vitemap_delete(b);
+  vitemap_delete(result);
+  return success;
+}
+
+static bool check_rank_select(uint32_t flags, const char *name) {
+  printf("\033[1m %s: \033[0m", name);
+
+  uint32_t num_buckets = 3000;
+  uint32_t size = num_buckets * BUCKET_SIZE_U8 - 9;
+  uint64_t num_bits = (uint64_t)size * 8;
+
+  Vitemap *vm = vitemap_create(size);
+  Vitemap *result = vitemap_create(size);
+  vm->flags = result->flags = flags;
+  fill_mixed_buckets(vm->input, num_buckets, 17);
+  uint32_t compressed_size = vitemap_compress_parallel(vm, size, 4);
+
+  // Positions of all set bits, as expected from select.
+  uint64_t *positions = malloc(num_bits * sizeof(uint64_t));
+  uint64_t cardinality = 0;
+  for (uint64_t bit = 0; bit < num_bits; bit++) {
+    if ((vm->input[bit / 8] >> (bit % 8)) & 1) {
+      positions[cardinality++] = bit;
+    }
+  }
+
+  bool success =
+      vitemap_cardinality(vm->output, compressed_size) == cardinality;
+  if (!success) {
+    printf("Cardinality is %lu instead of %lu.\n",
+           (unsigned long)vitemap_cardinality(vm->output, compressed_size),
+           (unsigned long)cardinality);
+  }
+
+  uint64_t rank = 0;
+  for (uint64_t bit = 0; bit < num_bits + 300 && success; bit++) {
+    if (bit % 97 == 0 || bit >= num_bits - 300) {
+      uint64_t actual = vitemap_rank(vm->output, compressed_size, bit);
+      if (actual != rank) {
+        printf("Rank of bit %lu is %lu instead of %lu.\n", (unsigned long)bit,
+               (unsigned long)actual, (unsigned long)rank);
+        success = false;
+      }
+    }
+    rank += bit < num_bits && (vm->input[bit / 8] >> (bit % 8)) & 1;
+  }
+
+  for (uint64_t i = 0; i < cardinality + 10 && success; i += i < 50 ? 1 : 89) {
+    uint64_t bit = 0;
+    bool found = vitemap_select(vm->output, compressed_size, i, &bit);
+    if (found != (i < cardinality) || (found && bit != positions[i])) {
+      printf("Select of rank %lu is wrong.\n", (unsigned long)i);
+      success = false;
+    }
+  }
+
+  // Set operations write counts as well.
+  uint32_t result_size = vitemap_operate(result, VITEMAP_OR, vm->output,
+                                         compressed_size, vm->output,
+                                         compressed_size);
+  if (success && vitemap_cardinality(result->output, result_size) !=
+                     cardinality) {
+    printf("Cardinality of a set operation result is wrong.\n");
+    success = false;
+  }
+
+  free(positions);
+  vitemap_delete(vm);
+  vitemap_delete(result);
+  if (success) {
+    printf("\033[1;32m✓\033[0m\n");
+  }
+  return success;
+}
+
+static bool test_rank_select() {
+  return check_rank_select(0, "Legacy  ") &&
+         check_rank_select(VITEMAP_FLAG_SEEKABLE, "Seekable") &&
+         check_rank_select(VITEMAP_FLAG_COUNTS, "Counts  ");
+}
+
+static bool test_to_positions() {
+  uint32_t num_buckets = 2000;
+  uint32_t size = num_buckets * BUCKET_SIZE_U8;
+
+  Vitemap *vm = vitemap_create(size);
+  fill_mixed_buckets(vm->input, num_buckets, 23);
+  uint32_t compressed_size = vitemap_compress(vm, size);
+
+  // Exactly sized buffers, so that any overrun is reported.
+  uint64_t cardinality = vitemap_cardinality(vm->output, compressed_size);
+  uint8_t *compressed = malloc(compressed_size);
+  uint32_t *positions = malloc(cardinality * sizeof(uint32_t));
+  memcpy(compressed, vm->output, compressed_size);
+
+  bool success = true;
+  VitemapIsa default_isa = vitemap_get_isa();
+  for (VitemapIsa isa = VITEMAP_ISA_SCALAR; isa <= VITEMAP_ISA_AVX512; isa++) {
+    if (!vitemap_set_isa(isa)) {
+      continue;
+    }
+
+    uint64_t count = vitemap_to_positions(compressed, compressed_size,
+                                          positions);
+    bool identical = count == cardinality;
+    for (uint32_t bit = 0, i = 0; bit < size * 8 && identical; bit++) {
+      if ((vm->input[bit / 8] >> (bit % 8)) & 1) {
+        identical = positions[i++] == bit;
+      }
+    }
+    if (!identical) {
+      printf("Positions of ISA %d differ from the bitmap.\n", isa);
+      success = false;
+    }
+  }
+  vitemap_set_isa(default_isa);
+
+  free(positions);
+  free(compressed);
+  vitemap_delete(vm);
+  return success;
+}
+
+// Aggregates the first `num_values` values of a column at the set bits of a
+// raw bitmap, one at a time.
+static VitemapAggregate reference_aggregate(const uint8_t *bitmap,
+                                            const void *column,
+                                            VitemapColumnType type,
+                                            uint64_t num_values) {
+  VitemapAggregate result = {.int_min = INT64_MAX,
+                             .int_max = INT64_MIN,
+                             .min = INFINITY,
+                             .max = -INFINITY};
+  for (uint64_t bit = 0; bit < num_values; bit++) {
+    if (!((bitmap[bit / 8] >> (bit % 8)) & 1)) {
+      continue;
+    }
+    result.count++;
+    int64_t int_value = 0;
+    double value = 0;
+    switch (type) {
+    case VITEMAP_COLUMN_INT32:
+      int_value = ((const int32_t *)column)[bit];
+      break;
+    case VITEMAP_COLUMN_INT64:
+      int_value = ((const int64_t *)column)[bit];
+      break;
+    case VITEMAP_COLUMN_FLOAT:
+      value = ((const float *)column)[bit];
+      break;
+    default:
+      value = ((const double *)column)[bit];
+      break;
+    }
+    result.int_sum = (int64_t)((uint64_t)result.int_sum + (uint64_t)int_value);
+    result.int_min = int_value < result.int_min ? int_value : result.int_min;
+    result.int_max = int_value > result.int_max ? int_value : result.int_max;
+    result.sum += value;
+    result.min = value < result.min ? value : result.min;
+    result.max = value > result.max ? value : result.max;
+  }
+  if (type == VITEMAP_COLUMN_FLOAT || type == VITEMAP_COLUMN_DOUBLE) {
+    result.int_sum = 0;
+    result.int_min = INT64_MAX;
+    result.int_max = INT64_MIN;
+  } else {
+    result.sum = 0;
+    result.min = INFINITY;
+    result.max = -INFINITY;
+  }
+  return result;
+}
+
+static bool test_aggregate() {
+  static const char *type_names[] = {"int32", "int64", "float", "double"};
+  uint32_t num_buckets = 1000;
+  uint32_t size = num_buckets * BUCKET_SIZE_U8;
+  uint64_t num_bits = (uint64_t)size * 8;
+
+  // Columns of exactly `num_bits` values, so that any overrun is reported.
+  // Floating-point values are small integers, which every summation order
+  // adds exactly.
+  uint64_t state = 99;
+  int32_t *int32_column = malloc(num_bits * sizeof(int32_t));
+  int64_t *int64_column = malloc(num_bits * sizeof(int64_t));
+  float *float_column = malloc(num_bits * sizeof(float));
+  double *double_column = malloc(num_bits * sizeof(double));
+  for (uint64_t i = 0; i < num_bits; i++) {
+    uint64_t random = next_random(&state);
+    int32_column[i] = (int32_t)random;
+    int64_column[i] = (int64_t)random;
+    float_column[i] = (float)((int64_t)(random % 2001) - 1000);
+    double_column[i] = (double)((int64_t)(random % 200001) - 100000);
+  }
+  const void *columns[] = {int32_column, int64_column, float_column,
+                           double_column};
+
+  // Mixed buckets, and runs ending within the limits below.
+  Vitemap *vm = vitemap_create(size);
+  fill_mixed_buckets(vm->input, num_buckets / 2, 7);
+  fill_run_buckets(vm->input + size / 2, num_buckets / 2, 8);
+  memset(vm->input + size - 10 * BUCKET_SIZE_U8, 0xFF, 10 * BUCKET_SIZE_U8);
+  const uint64_t limits[] = {num_bits, num_bits - 77, num_bits / 2 + 3, 300,
+                             0};
+
+  bool success = true;
+  VitemapIsa default_isa = vitemap_get_isa();
+  for (uint32_t flags = 0; flags <= VITEMAP_FLAG_RUNS && success;
+       flags += VITEMAP_FLAG_RUNS) {
+    vm->flags = flags;
+    uint32_t compressed_size = vitemap_compress(vm, size);
+    uint8_t *compressed = malloc(compressed_size);
+    memcpy(compressed, vm->output, compressed_size);
+
+    for (VitemapIsa isa = VITEMAP_ISA_SCALAR; isa <= VITEMAP_ISA_AVX512;
+         isa++) {
+      if (!vitemap_set_isa(isa)) {
+        continue;
+      }
+      for (VitemapColumnType type = VITEMAP_COLUMN_INT32;
+           type <= VITEMAP_COLUMN_DOUBLE; type++) {
+        for (size_t i = 0; i < sizeof(limits) / sizeof(limits[0]); i++) {
+          VitemapAggregate expected =
+              reference_aggregate(vm->input, columns[type], type, limits[i]);
+          VitemapAggregate result;
+          if (!vitemap_aggregate(compressed, compressed_size, columns[type],
+                                 type, limits[i], &result) ||
+              memcmp(&result, &expected, sizeof(result)) != 0) {
+            printf("Aggregate of ISA %d, flags %u, %s column, %llu values "
+                   "differs: count %llu instead of %llu.\n",
+                   isa, flags, type_names[type],
+                   (unsigned long long)limits[i],
+                   (unsigned long long)result.count,
+                   (unsigned long long)expected.count);
+            success = false;
+          }
+        }
+      }
+    }
+    free(compressed);
+  }
+  vitemap_set_isa(default_isa);
+
+  VitemapAggregate result;
+  if (vitemap_aggregate(vm->output, vm->output_size, int32_column,
+                        (VitemapColumnType)4, num_bits, &result)) {
+    printf("An invalid column type was accepted.\n");
+    success = false;
+  }
+
+  vitemap_delete(vm);
+  free(int32_column);
+  free(int64_column);
+  free(float_column);
+  free(double_column);
+  return success;
+}
+
+static bool test_streaming() {
+  static const uint32_t sizes[] = {32, 100, 64 * 32 * 5 + 7, 300000};
+  static const uint32_t flags[] = {0, VITEMAP_FLAG_RUNS,
+                                   VITEMAP_FLAG_COUNTS | VITEMAP_FLAG_RUNS};
+  static const size_t offsets[] = {0, 32, 16, 1, 63};
+  size_t default_threshold = vitemap_get_streaming_threshold();
+  VitemapIsa default_isa = vitemap_get_isa();
+  bool success = true;
+
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]) && success; i++) {
+    uint32_t size = sizes[i];
+    Vitemap *vm = vitemap_create(size);
+    fill_run_buckets(vm->input, vm->num_buckets, size);
+    size_t capacity = vitemap_max_compressed_size(size);
+    uint8_t *compressed = malloc(capacity + 64);
+    // Outputs at the given offsets from a cache line.
+    uint8_t *buffer = malloc(vm->max_size + 128);
+    uint8_t *decompressed = buffer + (-(uintptr_t)buffer % 64);
+
+    for (size_t j = 0; j < sizeof(flags) / sizeof(flags[0]) && success; j++) {
+      vitemap_set_streaming_threshold(SIZE_MAX);
+      vm->flags = flags[j];
+      uint32_t reference_size = vitemap_compress(vm, size);
+
+      vitemap_set_streaming_threshold(0);
+      for (VitemapIsa isa = VITEMAP_ISA_SCALAR; isa <= VITEMAP_ISA_AVX512;
+           isa++) {
+        if (!vitemap_set_isa(isa)) {
+          continue;
+        }
+        for (size_t k = 0; k < sizeof(offsets) / sizeof(offsets[0]); k++) {
+          size_t offset = offsets[k];
+          size_t compressed_size = vitemap_compress_buffer(
+              vm->input, size, compressed + offset, flags[j]);
+          if (compressed_size != reference_size ||
+              memcmp(compressed + offset, vm->output, reference_size) != 0) {
+            printf("Streaming compression of %u bytes (ISA %d, flags %u, "
+                   "offset %zu) differs.\n",
+                   size, isa, flags[j], offset);
+            success = false;
+          }
+
+          memset(decompressed, 0xAA, vm->max_size + 64);
+          vitemap_decompress(vm->output, reference_size, decompressed + offset);
+          if (memcmp(decompressed + offset, vm->input, size) != 0) {
+            printf("Streaming decompression of %u bytes (ISA %d, flags %u, "
+                   "offset %zu) differs.\n",
+                   size, isa, flags[j], offset);
+            success = false;
+          }
+        }
+      }
+      vitemap_set_isa(default_isa);
+    }
+
+    free(compressed);
+    free(buffer);
+    vitemap_delete(vm);
+  }
+
+  vitemap_set_streaming_threshold(default_threshold);
+  return success;
+}
+
+// Compresses `size` bytes with the kernels of their size on every instruction
+// set, and checks them against the generic functions.
+static bool check_fixed(size_t size) {
+  printf("\033[1m %6zu bits: \033[0m", size * 8);
+  size_t capacity = vitemap_max_compressed_size(size);
+  uint8_t *bitmap = malloc(size);
+  uint8_t *expected = malloc(capacity);
+  uint8_t *compressed = malloc(capacity);
+  uint8_t *decompressed = malloc(size);
+  VitemapIsa default_isa = vitemap_get_isa();
+  bool success = true;
+
+  for (unsigned seed = 0; seed < 4 && success; seed++) {
+    if (seed % 2 == 0) {
+      fill_mixed_buckets(bitmap, size / BUCKET_SIZE_U8, seed);
+    } else {
+      fill_run_buckets(bitmap, size / BUCKET_SIZE_U8, seed);
+    }
+    for (VitemapIsa isa = VITEMAP_ISA_SCALAR; isa <= VITEMAP_ISA_AVX512;
+         isa++) {
+      if (!vitemap_set_isa(isa)) {
+        continue;
+      }
+      size_t expected_size = vitemap_compress_buffer(bitmap, size, expected, 0);
+      size_t compressed_size = vitemap_compress_fixed(bitmap, size, compressed);
+      if (compressed_size != expected_size ||
+          memcmp(compressed, expected, expected_size) != 0) {
+        printf("Compression (ISA %d, seed %u) differs.\n", isa, seed);
+        success = false;
+      }
+      memset(decompressed, 0xAA, size);
+      vitemap_decompress_fixed(compressed, compressed_size, size, decompressed);
+      if (memcmp(decompressed, bitmap, size) != 0) {
+        printf("Decompression (ISA %d, seed %u) differs.\n", isa,
+               seed);
+        success = false;
+      }
+
+      // Other formats go through the generic decoder.
+      compressed_size = vitemap_compress_buffer(
+          bitmap, size, compressed, VITEMAP_FLAG_SEEKABLE | VITEMAP_FLAG_RUNS);
+      memset(decompressed, 0xAA, size);
+      vitemap_decompress_fixed(compressed, compressed_size, size, decompressed);
+      if (memcmp(decompressed, bitmap, size) != 0) {
+        printf("Decompressing runs (ISA %d, seed %u) differs.\n",
+               isa, seed);
+        success = false;
+      }
+    }
+    vitemap_set_isa(default_isa);
+  }
+
+  free(bitmap);
+  free(expected);
+  free(compressed);
+  free(decompressed);
+  if (success) {
+    printf("\033[1;32m✓\033[0m\n");
+  }
+  return success;
+}
+
+static bool test_fixed() {
+  bool success = true;
+#define CHECK_FIXED(bits) success &= check_fixed((bits) / 8);
+  VITEMAP_FIXED_SIZES(CHECK_FIXED)
+#undef CHECK_FIXED
+  // Sizes without kernels of their own.
+  success &= check_fixed(96) && check_fixed(8192 + 32);
+  return success;
+}
+
+// Returns the whole contents of a file, from its start.
+static uint8_t *read_file(int fd, size_t *size) {
+  *size = lseek(fd, 0, SEEK_END);
+  uint8_t *data = malloc(*size + 1);
+  lseek(fd, 0, SEEK_SET);
+  ssize_t bytes = read(fd, data, *size);
+  *size = bytes > 0 ? (size_t)bytes : 0;
+  return data;
+}
+
+// Compresses and decompresses `size` bytes between files, or from a pipe
+// (`size` must then fit in the pipe buffer), with a prefix already written to
+// the output, which must then be written through, or without, which maps it.
+static bool check_file(uint32_t size, uint32_t flags, unsigned num_threads,
+                       bool from_pipe, bool prefixed) {
+  printf("\033[1m %6u bytes, flags %2u, %u threads, %s, %s: \033[0m", size,
+         flags, num_threads, from_pipe ? "pipe" : "file",
+         prefixed ? "written" : "mapped ");
+
+  uint32_t num_buckets = (size + BUCKET_SIZE_U8 - 1) / BUCKET_SIZE_U8;
+  uint8_t *bitmap = calloc(num_buckets + 1, BUCKET_SIZE_U8);
+  fill_run_buckets(bitmap, num_buckets, size);
+  memset(bitmap + size, 0, BUCKET_SIZE_U8);
+  uint8_t *expected = malloc(vitemap_max_compressed_size(size));
+  size_t expected_size = vitemap_compress_buffer(bitmap, size, expected, flags);
+
+  FILE *input = tmpfile();
+  FILE *compressed = tmpfile();
+  FILE *decompressed = tmpfile();
+  int fds[2] = {-1, -1};
+  bool success = input != NULL && compressed != NULL && decompressed != NULL;
+  if (success && from_pipe) {
+    success = pipe(fds) == 0 && write(fds[1], bitmap, size) == (ssize_t)size;
+    close(fds[1]);
+  } else if (success) {
+    success = write(fileno(input), bitmap, size) == (ssize_t)size &&
+              lseek(fileno(input), 0, SEEK_SET) == 0;
+  }
+  const char prefix[] = "prefix";
+  if (success && prefixed) {
+    success = write(fileno(compressed), prefix, sizeof(prefix)) > 0 &&
+              write(fileno(decompressed), prefix, sizeof(prefix)) > 0;
+  }
+  if (!success) {
+    printf("Temporary files could not be written.\n");
+  }
+
+  uint64_t compressed_size = 0;
+  int input_fd = from_pipe ? fds[0] : fileno(input);
+  if (success && (!vitemap_compress_file(input_fd, fileno(compressed), flags,
+                                         num_threads, &compressed_size) ||
+                  compressed_size != expected_size)) {
+    printf("Compression failed or returned a wrong size.\n");
+    success = false;
+  }
+  size_t skipped = prefixed ? sizeof(prefix) : 0;
+  size_t file_size = 0;
+  uint8_t *data = success ? read_file(fileno(compressed), &file_size) : NULL;
+  if (success && (file_size != skipped + expected_size ||
+                  memcmp(data, prefix, skipped) != 0 ||
+                  memcmp(data + skipped, expected, expected_size) != 0)) {
+    printf("The compressed file does not match vitemap_compress_buffer.\n");
+    success = false;
+  }
+  free(data);
+
+  uint64_t decompressed_size = 0;
+  lseek(fileno(compressed), skipped, SEEK_SET);
+  if (success &&
+      (!vitemap_decompress_file(fileno(compressed), fileno(decompressed),
+                                num_threads, &decompressed_size) ||
+       decompressed_size != size)) {
+    printf("Decompression failed or returned a wrong size.\n");
+    success = false;
+  }
+  data = success ? read_file(fileno(decompressed), &file_size) : NULL;
+  if (success && (file_size != skipped + size ||
+                  memcmp(data + skipped, bitmap, size) != 0)) {
+    printf("The decompressed file does not match the bitmap.\n");
+    success = false;
+  }
+  free(data);
+
+  // Corrupted streams are rejected before anything is decompressed.
+  if (success && expected_size > 8) {
+    ftruncate(fileno(compressed), skipped + expected_size - 1);
+    lseek(fileno(compressed), skipped, SEEK_SET);
+    if (vitemap_decompress_file(fileno(compressed), fileno(decompressed),
+                                num_threads, NULL)) {
+      printf("A truncated stream was decompressed.\n");
+      success = false;
+    }
+  }
+
+  if (fds[0] >= 0) {
+    close(fds[0]);
+  }
+  FILE *files[] = {input, compressed, decompressed};
+  for (size_t i = 0; i < 3; i++) {
+    if (files[i] != NULL) {
+      fclose(files[i]);
+    }
+  }
+  free(expected);
+  free(bitmap);
+  if (success) {
+    printf("\033[1;32m✓\033[0m\n");
+  }
+  return success;
+}
+
+static bool test_files() {
+  static const uint32_t sizes[] = {0, 100, 32 * 64 * 3 + 5, 40000, 1000000};
+  static const uint32_t flags[] = {0,
+                                   VITEMAP_FLAG_SEEKABLE | VITEMAP_FLAG_RUNS};
+  bool success = true;
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    for (size_t j = 0; j < sizeof(flags) / sizeof(flags[0]); j++) {
+      for (unsigned num_threads = 1; num_threads <= 4; num_threads += 3) {
+        success &= check_file(sizes[i], flags[j], num_threads, false, false);
+        success &= check_file(sizes[i], flags[j], num_threads, false, true);
+        if (sizes[i] <= 40000) {
+          success &= check_file(sizes[i], flags[j], num_threads, true, false);
+        }
+      }
+    }
+  }
+
+  // Outputs opened write-only cannot be mapped, and are written to their exact
+  // size instead.
+  uint8_t bitmap[1000] = {1, 2, 3};
+  uint8_t *expected = malloc(vitemap_max_compressed_size(sizeof(bitmap)));
+  size_t expected_size = vitemap_compress_buffer(bitmap, sizeof(bitmap),
+                                                 expected, 0);
+  FILE *input = tmpfile();
+  FILE *output = tmpfile();
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", fileno(output));
+  int write_only = open(path, O_WRONLY);
+  uint64_t compressed_size = 0;
+  size_t file_size = 0;
+  bool written =
+      write(fileno(input), bitmap, sizeof(bitmap)) == (ssize_t)sizeof(bitmap) &&
+      lseek(fileno(input), 0, SEEK_SET) == 0 && write_only >= 0 &&
+      vitemap_compress_file(fileno(input), write_only, 0, 1,
+                            &compressed_size);
+  uint8_t *data = read_file(fileno(output), &file_size);
+  if (!written || compressed_size != expected_size ||
+      file_size != expected_size || memcmp(data, expected, file_size) != 0) {
+    printf("A write-only output does not match vitemap_compress_buffer.\n");
+    success = false;
+  }
+  free(data);
+  free(expected);
+  close(write_only);
+  fclose(input);
+  fclose(output);
+  return success;
+}
+
+// One of the threads of `test_concurrent_readers`, all reading the same view.
+typedef struct {
+  const VitemapView *view;
+  const uint8_t *bitmap;     // Raw bitmap of the view
+  uint64_t cardinality;      // Number of set bits of the bitmap
+  const uint8_t *xored;      // Expected result of XOR-ing the view with itself
+  size_t xored_size;         // Size of `xored`
+  uint64_t seed;             // Seed of the bits tested
+  bool success;
+} ReaderThread;
+
+static void *run_reader_thread(void *arg) {
+  ReaderThread *thread = arg;
+  const VitemapView *view = thread->view;
+  uint8_t *decompressed = malloc(view->buffer_size);
+  uint8_t *output = malloc(vitemap_max_compressed_size(view->bitmap_size));
+  uint64_t state = thread->seed;
+  thread->success = true;
+
+  for (int iteration = 0; iteration < 20 && thread->success; iteration++) {
+    vitemap_decompress(view->data, view->size, decompressed);
+    thread->success &=
+        memcmp(decompressed, thread->bitmap, view->bitmap_size) == 0;
+    thread->success &=
+        vitemap_cardinality(view->data, view->size) == thread->cardinality;
+    for (int i = 0; i < 100; i++) {
+      uint64_t bit = next_random(&state) % (view->bitmap_size * 8);
+      bool set = thread->bitmap[bit / 8] >> (bit % 8) & 1;
+      thread->success &= vitemap_test_bit(view->data, view->size, bit) == set;
+    }
+
+    // Writers only share their input.
+    size_t size = vitemap_compress_buffer(thread->bitmap, view->bitmap_size,
+                                          output, view->flags);
+    thread->success &=
+        size == view->size && memcmp(output, view->data, size) == 0;
+    size = vitemap_operate_buffer(VITEMAP_XOR, view->data, view->size,
+                                  view->data, view->size, output, 0);
+    thread->success &= size == thread->xored_size &&
+                       memcmp(output, thread->xored, size) == 0;
+  }
+
+  free(output);
+  free(decompressed);
+  return NULL;
+}
+
+static bool test_concurrent_readers() {
+  enum { NUM_READERS = 4 };
+  const size_t size = 300 * BUCKET_SIZE_U8 + 5;
+  uint32_t flags =
+      VITEMAP_FLAG_SEEKABLE | VITEMAP_FLAG_COUNTS | VITEMAP_FLAG_RUNS;
+  Vitemap *vm = vitemap_create(size);
+  fill_run_buckets(vm->input, vm->num_buckets, 42);
+  memset(vm->input + size, 0, vm->max_size - size);
+  vm->flags = flags;
+  size_t compressed_size = vitemap_compress(vm, size);
+
+  VitemapView view;
+  if (vitemap_view_init(&view, vm->output, compressed_size - 1) == VITEMAP_OK ||
+      vitemap_view_init(&view, vm->output, compressed_size) != VITEMAP_OK ||
+      view.bitmap_size != size || view.buffer_size != vm->max_size ||
+      view.flags != flags) {
+    printf("The view does not describe the compressed bitmap.\n");
+    vitemap_delete(vm);
+    return false;
+  }
+
+  // Set operations and evaluations into caller memory match their Vitemap
+  // variants.
+  Vitemap *xored = vitemap_create(size);
+  size_t xored_size = vitemap_operate(xored, VITEMAP_XOR, view.data, view.size,
+                                      view.data, view.size);
+  const VitemapStep steps[] = {
+      {.type = VITEMAP_STEP_INPUT, .input = 0},
+      {.type = VITEMAP_STEP_NOT},
+  };
+  VitemapExpression expr = {.steps = steps,
+                            .num_steps = 2,
+                            .inputs = &view.data,
+                            .sizes = &view.size,
+                            .num_inputs = 1};
+  Vitemap *complemented = vitemap_create(size);
+  complemented->flags = flags;
+  size_t complemented_size = vitemap_evaluate(complemented, &expr);
+  uint8_t *output = malloc(vitemap_max_compressed_size(size));
+  bool success = true;
+  if (vitemap_evaluate_buffer(&expr, output, flags) != complemented_size ||
+      memcmp(output, complemented->output, complemented_size) != 0) {
+    printf("vitemap_evaluate_buffer differs from vitemap_evaluate.\n");
+    success = false;
+  }
+
+  uint64_t cardinality = 0;
+  for (size_t i = 0; i < size; i++) {
+    cardinality += __builtin_popcount(vm->input[i]);
+  }
+  ReaderThread threads[NUM_READERS];
+  pthread_t ids[NUM_READERS];
+  for (int i = 0; i < NUM_READERS; i++) {
+    threads[i] = (ReaderThread){.view = &view,
+                                .bitmap = vm->input,
+                                .cardinality = cardinality,
+                                .xored = xored->output,
+                                .xored_size = xored_size,
+                                .seed = i};
+    pthread_create(&ids[i], NULL, run_reader_thread, &threads[i]);
+  }
+  for (int i = 0; i < NUM_READERS; i++) {
+    pthread_join(ids[i], NULL);
+    if (!threads[i].success) {
+      printf("Reader thread %d got a wrong result.\n", i);
+      success = false;
+    }
+  }
+
+  free(output);
+  vitemap_delete(complemented);
+  vitemap_delete(xored);
+  vitemap_delete(vm);
+  return success;
+}
+
+// Splits `size` bytes compressed with `flags` on every instruction set, and
+// checks the offsets, the conversions back to streams and the decoding.
+static bool check_split(size_t size, uint32_t flags) {
+  printf("\033[1m %6zu bytes, flags %2u: \033[0m", size, flags);
+  size_t num_buckets = (size + BUCKET_SIZE_U8 - 1) / BUCKET_SIZE_U8;
+  size_t capacity = vitemap_max_compressed_size(size);
+  uint8_t *bitmap = calloc(num_buckets, BUCKET_SIZE_U8);
+  uint8_t *compressed = malloc(capacity);
+  uint8_t *expected = malloc(capacity);
+  uint8_t *output = malloc(capacity);
+  uint8_t *decompressed = malloc(num_buckets * BUCKET_SIZE_U8);
+  fill_run_buckets(bitmap, num_buckets, size);
+  memset(bitmap + size, 0, num_buckets * BUCKET_SIZE_U8 - size);
+  VitemapIsa default_isa = vitemap_get_isa();
+  bool success = true;
+
+  for (VitemapIsa isa = VITEMAP_ISA_SCALAR; isa <= VITEMAP_ISA_AVX512;
+       isa++) {
+    if (!vitemap_set_isa(isa)) {
+      continue;
+    }
+    size_t compressed_size =
+        vitemap_compress_buffer(bitmap, size, compressed, flags);
+    VitemapSplit *split = vitemap_split_create(compressed, compressed_size);
+    if (split->size != size || split->num_buckets != num_buckets) {
+      printf("Split sizes (ISA %d) are wrong.\n", isa);
+      success = false;
+      vitemap_split_delete(split);
+      break;
+    }
+
+    uint64_t offset = 0;
+    for (size_t i = 0; i < num_buckets; i++) {
+      success &= split->offsets[i] == offset && split->headers[i] >> 6 != 3;
+      offset += split->headers[i] & 0x3F;
+    }
+    if (!success || split->offsets[num_buckets] != offset) {
+      printf("Split offsets (ISA %d) are not the prefix sum.\n", isa);
+      success = false;
+    }
+
+    // Back to the source format, and to every other one.
+    const uint32_t targets[] = {
+        split->flags, 0, VITEMAP_FLAG_RUNS,
+        VITEMAP_FLAG_SEEKABLE | VITEMAP_FLAG_COUNTS | VITEMAP_FLAG_RUNS};
+    for (size_t i = 0; i < sizeof(targets) / sizeof(*targets); i++) {
+      size_t expected_size =
+          vitemap_compress_buffer(bitmap, size, expected, targets[i]);
+      size_t output_size = vitemap_split_to_stream(split, output, targets[i]);
+      if (output_size != expected_size ||
+          memcmp(output, expected, expected_size) != 0) {
+        printf("Stream with flags %u (ISA %d) differs.\n", targets[i], isa);
+        success = false;
+      }
+    }
+
+    for (unsigned num_threads = 1; num_threads <= 4; num_threads *= 4) {
+      memset(decompressed, 0xAA, num_buckets * BUCKET_SIZE_U8);
+      vitemap_split_decompress(split, decompressed, num_threads);
+      if (memcmp(decompressed, bitmap, num_buckets * BUCKET_SIZE_U8) != 0) {
+        printf("Decompression (ISA %d, %u threads) differs.\n", isa,
+               num_threads);
+        success = false;
+      }
+    }
+    vitemap_split_delete(split);
+  }
+  vitemap_set_isa(default_isa);
+
+  free(bitmap);
+  free(compressed);
+  free(expected);
+  free(output);
+  free(decompressed);
+  if (success) {
+    printf("\033[1;32m✓\033[0m\n");
+  }
+  return success;
+}
+
+static bool test_split() {
+  const size_t sizes[] = {0, 5, BUCKET_SIZE_U8, 300 * BUCKET_SIZE_U8 + 5,
+                          1000 * BUCKET_SIZE_U8};
+  const uint32_t flags[] = {
+      0, VITEMAP_FLAG_RUNS,
+      VITEMAP_FLAG_SEEKABLE | VITEMAP_FLAG_COUNTS | VITEMAP_FLAG_RUNS};
+  bool success = true;
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(*sizes); i++) {
+    for (size_t j = 0; j < sizeof(flags) / sizeof(*flags); j++) {
+      success &= check_split(sizes[i], flags[j]);
+    }
+  }
+  return success;
+}
+
+static bool check_runs(uint32_t flags, uint32_t size, const char *name) {
+  printf("\033[1m %s, %6u bytes: \033[0m", name, size);
+
+  Vitemap *vm = vitemap_create(size);
+  Vitemap *other = vitemap_create(size);
+  fill_run_buckets(vm->input, vm->num_buckets, size);
+  memset(vm->input + size, 0, vm->max_size - size);
+  memcpy(other->input, vm->input, vm->max_size);
+
+  other->flags = flags;
+  uint32_t plain_size = vitemap_compress(other, size);
+  vm->flags = flags | VITEMAP_FLAG_RUNS;
+  uint32_t compressed_size = vitemap_compress(vm, size);
+  bool success = compressed_size < plain_size;
+  if (!success) {
+    printf("Runs do not shrink the output (%u, %u without).\n",
+           compressed_size, plain_size);
+  }
+
+  // Every ISA and every compression path writes the same stream.
+  VitemapBuilder *builder = vitemap_builder_create(size);
+  uint8_t *buffer = malloc(vitemap_max_compressed_size(size));
+  uint8_t *decompressed = malloc(vm->max_size);
+  memcpy(builder->vm->input, vm->input, size);
+  vitemap_builder_recount(builder);
+  builder->vm->flags = other->flags = vm->flags;
+  VitemapIsa default_isa = vitemap_get_isa();
+  for (VitemapIsa isa = VITEMAP_ISA_SCALAR; isa <= VITEMAP_ISA_AVX512; isa++) {
+    if (!success || !vitemap_set_isa(isa)) {
+      continue;
+    }
+
+    uint32_t parallel_size = vitemap_compress_parallel(other, size, 4);
+    uint32_t buffer_size =
+        vitemap_compress_buffer(vm->input, size, buffer, vm->flags);
+    uint32_t builder_size = vitemap_builder_compress(builder);
+    if (parallel_size != compressed_size || buffer_size != compressed_size ||
+        builder_size != compressed_size ||
+        memcmp(other->output, vm->output, compressed_size) != 0 ||
+        memcmp(buffer, vm->output, compressed_size) != 0 ||
+        memcmp(builder->vm->output, vm->output, compressed_size) != 0) {
+      printf("Compression paths of ISA %d differ.\n", isa);
+      success = false;
+    }
+
+    vitemap_decompress(vm->output, compressed_size, decompressed);
+    success &= memcmp(decompressed, vm->input, vm->max_size) == 0;
+    memset(decompressed, 0x55, vm->max_size);
+    vitemap_decompress_parallel(vm->output, compressed_size, decompressed, 3);
+    success &= memcmp(decompressed, vm->input, vm->max_size) == 0;
+    if (!success) {
+      printf("Decompression with ISA %d is not identical.\n", isa);
+    }
+  }
+  vitemap_set_isa(default_isa);
+
+  // Random access and counting, within and around runs.
+  uint8_t bucket[BUCKET_SIZE_U8];
+  for (uint32_t i = 0; i < vm->num_buckets && success; i++) {
+    vitemap_get_bucket(vm->output, compressed_size, i, bucket);
+    if (memcmp(bucket, vm->input + i * BUCKET_SIZE_U8, BUCKET_SIZE_U8) != 0) {
+      printf("Bucket %u is not identical.\n", i);
+      success = false;
+    }
+  }
+  uint64_t rank = 0;
+  for (uint64_t bit = 0; bit < (uint64_t)size * 8 && success; bit++) {
+    bool set = (vm->input[bit / 8] >> (bit % 8)) & 1;
+    uint64_t position = 0;
+    if (vitemap_test_bit(vm->output, compressed_size, bit) != set ||
+        (bit % 61 == 0 &&
+         vitemap_rank(vm->output, compressed_size, bit) != rank) ||
+        (set && rank % 53 == 0 &&
+         (!vitemap_select(vm->output, compressed_size, rank, &position) ||
+          position != bit))) {
+      printf("Bit %lu is not accessed correctly.\n", (unsigned long)bit);
+      success = false;
+    }
+    rank += set;
+  }
+  uint32_t *positions = malloc((rank + 1) * sizeof(uint32_t));
+  if (success &&
+      (vitemap_cardinality(vm->output, compressed_size) != rank ||
+       vitemap_to_positions(vm->output, compressed_size, positions) != rank)) {
+    printf("Cardinality or positions are wrong.\n");
+    success = false;
+  }
+
+  free(positions);
+  free(decompressed);
+  free(buffer);
+  vitemap_builder_delete(builder);
+  vitemap_delete(vm);
+  vitemap_delete(other);
+  if (success) {
+    printf("\033[1;32m✓\033[0m\n");
+  }
+  return success;
+}
+
+static bool test_runs() {
+  uint32_t size = 3000 * BUCKET_SIZE_U8;
+  return check_runs(0, size, "Regular ") &&
+         check_runs(VITEMAP_FLAG_SEEKABLE, size, "Seekable") &&
+         check_runs(VITEMAP_FLAG_COUNTS, size - 3, "Counts  ") &&
+         check_runs(VITEMAP_FLAG_COUNTS | VITEMAP_FLAG_WIDE, size - 3,
+                    "Wide    ") &&
+         check_runs(0, size - 17, "Regular ");
+}
+
+static bool check_run_operation(VitemapOperation op, uint32_t flags) {
+  uint32_t num_buckets = 1500;
+  uint32_t size = num_buckets * BUCKET_SIZE_U8 - 1;
+
+  Vitemap *a = vitemap_create(size);
+  Vitemap *b = vitemap_create(size);
+  Vitemap *expected = vitemap_create(size);
+  Vitemap *result = vitemap_create(size);
+  fill_run_buckets(a->input, num_buckets, 31);
+  fill_run_buckets(b->input, num_buckets, 37);
+  memset(a->input + size, 0, a->max_size - size);
+  memset(b->input + size, 0, b->max_size - size);
+  for (uint32_t i = 0; i < a->max_size; i++) {
+    uint8_t byte_a = a->input[i], byte_b = b->input[i];
+    expected->input[i] = op == VITEMAP_AND   ? byte_a & byte_b
+                         : op == VITEMAP_OR  ? byte_a | byte_b
+                         : op == VITEMAP_XOR ? byte_a ^ byte_b
+                                             : byte_a & ~byte_b;
+  }
+
+  a->flags = b->flags = VITEMAP_FLAG_RUNS;
+  expected->flags = result->flags = flags;
+  uint32_t a_size = vitemap_compress(a, size);
+  uint32_t b_size = vitemap_compress(b, size);
+  uint32_t expected_size = vitemap_compress(expected, size);
+  uint32_t result_size =
+      vitemap_operate(result, op, a->output, a_size, b->output, b_size);
+
+  bool success = result_size == expected_size &&
+                 memcmp(result->output, expected->output, result_size) == 0;
+  if (!success) {
+    printf("Operation %d with flags %u differs from the raw result.\n", op,
+           flags);
+  }
+
+  vitemap_delete(a);
+  vitemap_delete(b);
+  vitemap_delete(expected);
+  vitemap_delete(result);
+  return success;
+}
+
+static bool test_run_operations() {
+  bool success = true;
+  for (VitemapOperation op = VITEMAP_AND; op <= VITEMAP_ANDNOT; op++) {
+    success &= check_run_operation(op, 0);
+    success &= check_run_operation(op, VITEMAP_FLAG_RUNS);
+    success &= check_run_operation(op, VITEMAP_FLAG_RUNS | VITEMAP_FLAG_COUNTS);
+    success &=
+        check_run_operation(op, VITEMAP_FLAG_SEEKABLE | VITEMAP_FLAG_WIDE);
+  }
+  return success;
+}
+
+// Evaluates an expression on byte `i` of raw bitmaps of the given sizes.
+static uint8_t evaluate_byte(const VitemapStep *steps, size_t num_steps,
+                             uint8_t *const *inputs, const size_t *sizes,
+                             size_t i) {
+  uint8_t stack[VITEMAP_MAX_EXPRESSION_DEPTH];
+  size_t depth = 0;
+  for (size_t j = 0; j < num_steps; j++) {
+    if (steps[j].type == VITEMAP_STEP_INPUT) {
+      uint32_t input = steps[j].input;
+      stack[depth++] = i < sizes[input] ? inputs[input][i] : 0;
+    } else if (steps[j].type == VITEMAP_STEP_NOT) {
+      stack[depth - 1] = ~stack[depth - 1];
+    } else {
+      uint8_t a = stack[depth - 2], b = stack[--depth];
+      stack[depth - 1] = steps[j].op == VITEMAP_AND   ? a & b
+                         : steps[j].op == VITEMAP_OR  ? a | b
+                         : steps[j].op == VITEMAP_XOR ? a ^ b
+                                                      : a & ~b;
+    }
+  }
+  return stack[0];
+}
+
+// Writes a random well-formed expression of inputs below `num_inputs`, and
+// returns its number of steps.
+static size_t random_expression(uint64_t *state, size_t num_inputs,
+                                VitemapStep *steps) {
+  size_t num_operands = 2 + next_random(state) % 9;
+  size_t num_steps = 0, depth = 0, pushed = 0;
+  while (pushed < num_operands || depth > 1) {
+    uint64_t choice = next_random(state) % 4;
+    if (pushed < num_operands && (depth < 2 || choice < 2)) {
+      steps[num_steps++] = (VitemapStep){
+          .type = VITEMAP_STEP_INPUT,
+          .input = next_random(state) % num_inputs,
+      };
+      depth++;
+      pushed++;
+    } else {
+      steps[num_steps++] = (VitemapStep){
+          .type = VITEMAP_STEP_APPLY,
+          .op = next_random(state) % 4,
+      };
+      depth--;
+    }
+    if (next_random(state) % 4 == 0) {
+      steps[num_steps++] = (VitemapStep){.type = VITEMAP_STEP_NOT};
+    }
+  }
+  return num_steps;
+}
+
+static bool check_expression(uint64_t seed, uint32_t flags) {
+  enum { NUM_INPUTS = 6 };
+  // The result has the size of the first input, ending with a partial bucket.
+  const size_t sizes[NUM_INPUTS] = {
+      800 * BUCKET_SIZE_U8 - 3, 799 * BUCKET_SIZE_U8, 600 * BUCKET_SIZE_U8 + 7,
+      800 * BUCKET_SIZE_U8 - 3, 700 * BUCKET_SIZE_U8, 64 * BUCKET_SIZE_U8};
+  size_t size = sizes[0];
+
+  Vitemap *inputs[NUM_INPUTS];
+  uint8_t *raw_inputs[NUM_INPUTS];
+  const uint8_t *compressed[NUM_INPUTS];
+  size_t compressed_sizes[NUM_INPUTS];
+  for (size_t i = 0; i < NUM_INPUTS; i++) {
+    inputs[i] = vitemap_create(sizes[i]);
+    fill_run_buckets(inputs[i]->input, inputs[i]->num_buckets, seed + i);
+    inputs[i]->flags = i % 2 ? VITEMAP_FLAG_RUNS : VITEMAP_FLAG_SEEKABLE;
+    raw_inputs[i] = inputs[i]->input;
+    compressed[i] = inputs[i]->output;
+    compressed_sizes[i] = vitemap_compress(inputs[i], sizes[i]);
+  }
+
+  uint64_t state = seed;
+  VitemapStep steps[64];
+  size_t num_steps = random_expression(&state, NUM_INPUTS, steps);
+  VitemapExpression expr = {
+      .steps = steps,
+      .num_steps = num_steps,
+      .inputs = compressed,
+      .sizes = compressed_sizes,
+      .num_inputs = NUM_INPUTS,
+  };
+
+  Vitemap *expected = vitemap_create(size);
+  Vitemap *result = vitemap_create(size);
+  for (size_t i = 0; i < size; i++) {
+    expected->input[i] =
+        evaluate_byte(steps, num_steps, raw_inputs, sizes, i);
+  }
+  expected->flags = result->flags = flags;
+  size_t expected_size = vitemap_compress(expected, size);
+  size_t result_size = vitemap_evaluate(result, &expr);
+
+  uint32_t *expected_positions = malloc(size * 8 * sizeof(uint32_t));
+  uint32_t *positions = malloc(size * 8 * sizeof(uint32_t));
+  uint64_t expected_count =
+      vitemap_to_positions(expected->output, expected_size, expected_positions);
+  uint64_t count = vitemap_evaluate_positions(&expr, positions);
+
+  bool success =
+      vitemap_check_expression(&expr) && result_size == expected_size &&
+      memcmp(result->output, expected->output, result_size) == 0 &&
+      count == expected_count &&
+      memcmp(positions, expected_positions, count * sizeof(uint32_t)) == 0;
+  if (!success) {
+    printf("Expression %lu with flags %u differs from the raw result.\n",
+           (unsigned long)seed, flags);
+  }
+
+  free(positions);
+  free(expected_positions);
+  vitemap_delete(result);
+  vitemap_delete(expected);
+  for (size_t i = 0; i < NUM_INPUTS; i++) {
+    vitemap_delete(inputs[i]);
+  }
+  return success;
+}
+
+static bool test_expressions() {
+  // Every instruction set evaluates its own random expressions.
+  VitemapIsa default_isa = vitemap_get_isa();
+  bool success = true;
+  for (uint64_t seed = 1; seed <= 60 && success; seed++) {
+    uint32_t flags = seed % 4 == 0   ? 0
+                     : seed % 4 == 1 ? VITEMAP_FLAG_RUNS
+                     : seed % 4 == 2 ? VITEMAP_FLAG_RUNS | VITEMAP_FLAG_COUNTS
+                                     : VITEMAP_FLAG_SEEKABLE;
+    if (vitemap_set_isa(seed % 3)) {
+      success = check_expression(seed, flags);
+    }
+  }
+  vitemap_set_isa(default_isa);
+
+  // Malformed expressions: unknown input, missing operand, two results.
+  const uint8_t *inputs[1] = {NULL};
+  size_t sizes[1] = {0};
+  VitemapStep steps[] = {
+      {.type = VITEMAP_STEP_INPUT, .input = 0},
+      {.type = VITEMAP_STEP_INPUT, .input = 1},
+      {.type = VITEMAP_STEP_APPLY, .op = VITEMAP_AND},
+  };
+  VitemapExpression unknown = {steps, 3, inputs, sizes, 1};
+  VitemapExpression missing = {steps + 2, 1, inputs, sizes, 2};
+  VitemapExpression unfinished = {steps, 2, inputs, sizes, 2};
+  VitemapExpression widest = {steps, 1, inputs, sizes,
+                              VITEMAP_MAX_EXPRESSION_INPUTS};
+  VitemapExpression too_wide = {steps, 1, inputs, sizes,
+                                VITEMAP_MAX_EXPRESSION_INPUTS + 1};
+  if (vitemap_check_expression(&unknown) ||
+      vitemap_check_expression(&missing) ||
+      vitemap_check_expression(&unfinished) ||
+      vitemap_check_expression(&too_wide)) {
+    printf("A malformed expression is accepted.\n");
+    success = false;
+  }
+  if (!vitemap_check_expression(&widest)) {
+    printf("An expression with the most inputs is rejected.\n");
+    success = false;
+  }
+  return success;
+}
+
+static bool test_wide() {
+  size_t size = 2000 * BUCKET_SIZE_U8 + 9;
+  uint32_t flags = VITEMAP_FLAG_COUNTS | VITEMAP_FLAG_RUNS;
+  uint8_t *input = malloc(size);
+  uint8_t *narrow = malloc(vitemap_max_compressed_size(size));
+  uint8_t *wide = malloc(vitemap_max_compressed_size(size));
+  fill_run_buckets(input, size / BUCKET_SIZE_U8, 3);
+  memset(input + size - 9, 0x3C, 9);
+  size_t narrow_size = vitemap_compress_buffer(input, size, narrow, flags);
+  size_t wide_size =
+      vitemap_compress_buffer(input, size, wide, flags | VITEMAP_FLAG_WIDE);
+
+  // Same payload, after a 64-bit size and 64-bit index entries.
+  size_t num_entries = (size / BUCKET_SIZE_U8 + 1 + VITEMAP_INDEX_STRIDE - 1) /
+                       VITEMAP_INDEX_STRIDE;
+  size_t narrow_payload = VITEMAP_EXTENDED_HEADER_SIZE + 12 * num_entries;
+  size_t wide_payload = VITEMAP_WIDE_HEADER_SIZE + 16 * num_entries;
+  uint64_t header_size;
+  memcpy(&header_size, wide + 8, sizeof(header_size));
+  size_t data_size, buffer_size;
+  vitemap_extract_decompressed_sizes64(wide, &data_size, &buffer_size);
+  bool success =
+      wide[5] == (flags | VITEMAP_FLAG_SEEKABLE | VITEMAP_FLAG_WIDE) &&
+      header_size == size && data_size == size &&
+      buffer_size == (size / BUCKET_SIZE_U8 + 1) * BUCKET_SIZE_U8 &&
+      wide_size - wide_payload == narrow_size - narrow_payload &&
+      memcmp(wide + wide_payload, narrow + narrow_payload,
+             wide_size - wide_payload) == 0;
+  if (!success) {
+    printf("Wide header or payload is wrong.\n");
+  }
+
+  // Queries agree with the regular stream.
+  for (uint64_t bit = 0; bit < size * 8 && success; bit += 7) {
+    uint64_t rank = vitemap_rank(narrow, narrow_size, bit);
+    uint64_t narrow_bit = 0, wide_bit = 0;
+    bool found = vitemap_select(narrow, narrow_size, rank, &narrow_bit);
+    if (vitemap_test_bit(wide, wide_size, bit) !=
+            vitemap_test_bit(narrow, narrow_size, bit) ||
+        vitemap_rank(wide, wide_size, bit) != rank ||
+        vitemap_select(wide, wide_size, rank, &wide_bit) != found ||
+        wide_bit != narrow_bit) {
+      printf("Bit %lu is not accessed correctly.\n", (unsigned long)bit);
+      success = false;
+    }
+  }
+
+  // Bitmaps of 4 GiB may not fit 32-bit offsets, and are always written wide.
+  if (vitemap_max_compressed_size((size_t)1 << 32) <= UINT32_MAX) {
+    printf("The maximum compressed size of 4 GiB does not exceed 4 GiB.\n");
+    success = false;
+  }
+
+  free(wide);
+  free(narrow);
+  free(input);
+  return success;
+}
+
+// Checks that untrusted copies of a stream decode safely: valid streams decode
+// identically, and truncated or corrupted ones never fault (under ASAN).
+static bool check_checked_decoder(uint32_t flags, const char *name) {
+  printf("\033[1m %s: \033[0m", name);
+  size_t size = 700 * BUCKET_SIZE_U8 + 5;
+  uint8_t *input = malloc(size);
+  uint8_t *compressed = malloc(vitemap_max_compressed_size(size));
+  fill_run_buckets(input, size / BUCKET_SIZE_U8, flags + 1);
+  memset(input + size - 5, 0xA5, 5);
+  size_t compressed_size =
+      vitemap_compress_buffer(input, size, compressed, flags);
+
+  size_t data_size, capacity;
+  vitemap_extract_decompressed_sizes64(compressed, &data_size, &capacity);
+  uint8_t *output = malloc(capacity);
+  bool success =
+      vitemap_validate(compressed, compressed_size) == VITEMAP_OK &&
+      vitemap_decompress_checked(compressed, compressed_size, output,
+                                 capacity) == VITEMAP_OK &&
+      memcmp(output, input, size) == 0 &&
+      vitemap_decompress_checked(compressed, compressed_size, output,
+                                 capacity - 1) == VITEMAP_ERROR_CAPACITY;
+  if (!success) {
+    printf("The valid stream is rejected or decoded incorrectly.\n");
+  }
+
+  // Truncated streams are always rejected, from a copy of the exact size.
+  for (size_t length = 0; length < compressed_size && success; length++) {
+    uint8_t *copy = malloc(length + 1);
+    memcpy(copy, compressed, length);
+    if (vitemap_validate(copy, length) == VITEMAP_OK ||
+        vitemap_decompress_checked(copy, length, output, capacity) ==
+            VITEMAP_OK) {
+      printf("A stream truncated to %zu bytes is accepted.\n", length);
+      success = false;
+    }
+    free(copy);
+  }
+
+  // Corrupted streams may be accepted, but are decoded within bounds.
+  uint8_t *copy = malloc(compressed_size);
+  uint64_t state = flags + 7;
+  for (size_t trial = 0; trial < 2000; trial++) {
+    memcpy(copy, compressed, compressed_size);
+    for (size_t i = 0; i < 1 + trial % 3; i++) {
+      copy[next_random(&state) % compressed_size] ^= 1 << (trial % 8);
+    }
+    VitemapStatus status = vitemap_validate(copy, compressed_size);
+    if (vitemap_decompress_checked(copy, compressed_size, output, capacity) !=
+            VITEMAP_OK &&
+        status == VITEMAP_OK) {
+      printf("A validated stream fails to decode.\n");
+      success = false;
+    }
+  }
+
+  free(copy);
+  free(output);
+  free(compressed);
+  free(input);
+  printf(success ? "Success\n" : "");
+  return success;
+}
+
+static bool test_checked_decoder() {
+  bool success = check_checked_decoder(0, "Legacy   ") &&
+                 check_checked_decoder(VITEMAP_FLAG_SEEKABLE, "Seekable ") &&
+                 check_checked_decoder(VITEMAP_FLAG_COUNTS, "Counts   ") &&
+                 check_checked_decoder(VITEMAP_FLAG_RUNS, "Runs     ") &&
+                 check_checked_decoder(VITEMAP_FLAG_WIDE, "Wide     ") &&
+                 check_checked_decoder(VITEMAP_FLAG_WIDE | VITEMAP_FLAG_RUNS,
+                                       "Wide runs") &&
+                 check_checked_decoder(VITEMAP_FLAG_COUNTS | VITEMAP_FLAG_RUNS |
+                                           VITEMAP_FLAG_WIDE,
+                                       "Wide all ");
+
+  // Wide streams without an index have no index entries to account for, even
+  // when their buckets are smaller than the 64-bit entries would be.
+  const uint32_t sparse_flags[] = {VITEMAP_FLAG_WIDE,
+                                   VITEMAP_FLAG_WIDE | VITEMAP_FLAG_RUNS};
+  uint8_t empty[80 * BUCKET_SIZE_U8] = {0};
+  uint8_t *sparse = malloc(vitemap_max_compressed_size(sizeof(empty)));
+  for (size_t i = 0; i < sizeof(sparse_flags) / sizeof(*sparse_flags); i++) {
+    for (size_t size = 80; size <= sizeof(empty); size = size * 4 + 5) {
+      size_t sparse_size =
+          vitemap_compress_buffer(empty, size, sparse, sparse_flags[i]);
+      if (vitemap_validate(sparse, sparse_size) != VITEMAP_OK) {
+        printf("A sparse wide stream (%zu bytes, flags %u) is rejected.\n",
+               size, sparse_flags[i]);
+        success = false;
+      }
+    }
+  }
+  free(sparse);
+
+  // A bitmap, followed by an array of the positions 3 and 7, and a run.
+  uint8_t input[3 * BUCKET_SIZE_U8] = {0};
+  memset(input, 0x5A, BUCKET_SIZE_U8);
+  input[BUCKET_SIZE_U8] = 0x88;
+  uint8_t output[3 * BUCKET_SIZE_U8];
+  uint8_t *stream = malloc(vitemap_max_compressed_size(sizeof(input)));
+  uint8_t *copy = malloc(vitemap_max_compressed_size(sizeof(input)));
+  size_t size =
+      vitemap_compress_buffer(input, sizeof(input), stream,
+                              VITEMAP_FLAG_COUNTS | VITEMAP_FLAG_RUNS);
+  uint8_t *array = stream + VITEMAP_EXTENDED_HEADER_SIZE + 12 + 33;
+  struct {
+    size_t offset;
+    uint8_t value;
+    size_t size;
+    VitemapStatus decoded;
+    VitemapStatus validated;
+  } corruptions[] = {
+      {4, VITEMAP_VERSION + 1, size, VITEMAP_ERROR_HEADER,
+       VITEMAP_ERROR_HEADER},
+      {5, VITEMAP_FLAG_COUNTS, size, VITEMAP_ERROR_HEADER,
+       VITEMAP_ERROR_HEADER},
+      {7, 1, size, VITEMAP_ERROR_HEADER,
+       VITEMAP_ERROR_HEADER},
+      {VITEMAP_EXTENDED_HEADER_SIZE + 12, 0x80 | 31, size,
+       VITEMAP_ERROR_BUCKETS, VITEMAP_ERROR_BUCKETS},
+      {VITEMAP_EXTENDED_HEADER_SIZE, 1, size, VITEMAP_OK, VITEMAP_ERROR_INDEX},
+      {VITEMAP_EXTENDED_HEADER_SIZE + 4, 1, size, VITEMAP_OK,
+       VITEMAP_ERROR_INDEX},
+      {array - stream + 1, 7, size, VITEMAP_OK, VITEMAP_ERROR_BUCKETS},
+      {array - stream, 40, size, VITEMAP_ERROR_BUCKETS, VITEMAP_ERROR_BUCKETS},
+      {size, 0, size + 1, VITEMAP_ERROR_BUCKETS, VITEMAP_ERROR_BUCKETS},
+  };
+  for (size_t i = 0; i < sizeof(corruptions) / sizeof(corruptions[0]); i++) {
+    memcpy(copy, stream, size);
+    copy[corruptions[i].offset] = corruptions[i].value;
+    if (vitemap_decompress_checked(copy, corruptions[i].size, output,
+                                   sizeof(output)) != corruptions[i].decoded ||
+        vitemap_validate(copy, corruptions[i].size) !=
+            corruptions[i].validated) {
+      printf("Corruption %zu is not reported correctly.\n", i);
+      success = false;
+    }
+  }
+
+  free(copy);
+  free(stream);
+  return success;
+}
+
+static bool check_parallel(bool seekable, unsigned num_threads) {
+  printf("\033[1m %s, %u threads: \033[0m", seekable ? "Seekable" : "Legacy  ",
+         num_threads);
+
+  uint32_t num_buckets = 5000;
+  uint32_t size = num_buckets * BUCKET_SIZE_U8 - 17;
+
+  Vitemap *serial = vitemap_create(size);
+  Vitemap *parallel = vitemap_create(size);
+  serial->flags = parallel->flags = seekable ? VITEMAP_FLAG_SEEKABLE : 0;
+  fill_mixed_buckets(serial->input, num_buckets, 99);
+  memset(serial->input + size, 0, serial->max_size - size);
+  memcpy(parallel->input, serial->input, serial->max_size);
+
+  uint32_t serial_size = vitemap_compress(serial, size);
+  uint32_t parallel_size =
+      vitemap_compress_parallel(parallel, size, num_threads);
+  if (serial_size != parallel_size ||
+      memcmp(serial->output, parallel->output, serial_size) != 0) {
+    printf("Parallel output is not identical to the serial output.\n");
+    vitemap_delete(serial);
+    vitemap_delete(parallel);
+    return false;
+  }
+
+  uint8_t *decompressed = malloc(serial->max_size);
+  vitemap_decompress_parallel(parallel->output, parallel_size, decompressed,
+                              num_threads);
+  bool success = memcmp(decompressed, serial->input, size) == 0;
+  if (!success) {
+    printf("Parallel decompression is not identical.\n");
+  } else {
+    printf("\033[1;32m✓\033[0m\n");
+  }
+
+  free(decompressed);
+  vitemap_delete(serial);
+  vitemap_delete(parallel);
+  return success;
+}
+
+static bool test_parallel() {
+  return check_parallel(false, 3) && check_parallel(true, 3) &&
+         check_parallel(false, 8) && check_parallel(true, 64);
+}
+
+static bool test_isa_equivalence() {
+  static const char *names[] = {"Scalar", "AVX2", "AVX-512"};
+  VitemapIsa default_isa = vitemap_get_isa();
+  uint32_t num_buckets = 2000;
+  uint32_t size = num_buckets * BUCKET_SIZE_U8;
+
+  Vitemap *a = vitemap_create(size);
+  Vitemap *b = vitemap_create(size);
+  Vitemap *reference = vitemap_create(size);
+  fill_mixed_buckets(a->input, num_buckets, 2024);
+  fill_mixed_buckets(b->input, num_buckets, 4202);
+  uint32_t b_size = vitemap_compress(b, size);
+
+  // The scalar kernels are the reference, as they are always supported.
+  vitemap_set_isa(VITEMAP_ISA_SCALAR);
+  uint32_t a_size = vitemap_compress(a, size);
+  uint32_t reference_size = vitemap_operate(reference, VITEMAP_XOR, a->output,
+                                            a_size, b->output, b_size);
+
+  bool success = true;
+  uint8_t *decompressed = malloc(size);
+  for (VitemapIsa isa = VITEMAP_ISA_SCALAR; isa <= VITEMAP_ISA_AVX512; isa++) {
+    printf("\033[1m %-7s: \033[0m", names[isa]);
+    if (!vitemap_set_isa(isa)) {
+      printf("unsupported by this CPU\n");
+      continue;
+    }
+
+    Vitemap *result = vitemap_create(size);
+    memcpy(result->input, a->input, size);
+    uint32_t compressed_size = vitemap_compress(result, size);
+    if (compressed_size != a_size ||
+        memcmp(result->output, a->output, a_size) != 0) {
+      printf("Compressed output differs from the scalar kernels.\n");
+      success = false;
+    }
+
+    vitemap_decompress(a->output, a_size, decompressed);
+    if (success && memcmp(decompressed, a->input, size) != 0) {
+      printf("Decompressed output is not identical.\n");
+      success = false;
+    }
+
+    uint32_t result_size = vitemap_operate(result, VITEMAP_XOR, a->output,
+                                           a_size, b->output, b_size);
+    if (success && (result_size != reference_size ||
+                    memcmp(result->output, reference->output,
+                           reference_size) != 0)) {
+      printf("Set operation differs from the scalar kernels.\n");
+      success = false;
+    }
+
+    vitemap_delete(result);
+    if (!success) {
+      break;
+    }
+    printf("\033[1;32m✓\033[0m\n");
+  }
+
+  vitemap_set_isa(default_isa);
+  free(decompressed);
+  vitemap_delete(a);
+  vitemap_delete(b);
+  vitemap_delete(reference);
+  return success;
+}
+
+// Growable in-memory sink for the streaming compressor.
+typedef struct {
+  uint8_t *data;
+  size_t size;
+  size_t capacity;
+} MemorySink;
+
+static bool memory_sink_write(void *ctx, const uint8_t *data, size_t size) {
+  MemorySink *sink = ctx;
+  if (sink->size + size > sink->capacity) {
+    sink->capacity = 2 * (sink->size + size);
+    sink->data = realloc(sink->data, sink->capacity);
+  }
+  memcpy(sink->data + sink->size, data, size);
+  sink->size += size;
+  return true;
+}
+
+static bool memory_sink_patch(void *ctx, size_t offset, const uint8_t *data,
+                              size_t size) {
+  MemorySink *sink = ctx;
+  memcpy(sink->data + offset, data, size);
+  return true;
+}
+
+static bool check_stream(size_t chunk_size, bool patch) {
+  printf("\033[1m %4zuB pushes, %s: \033[0m", chunk_size,
+         patch ? "patched" : "manual ");
+
+  uint32_t num_buckets = 700;
+  uint32_t size = num_buckets * BUCKET_SIZE_U8 - 9;
+
+  Vitemap *vm = vitemap_create(size);
+  fill_mixed_buckets(vm->input, num_buckets, 31);
+  memset(vm->input + size, 0, vm->max_size - size);
+  uint32_t expected_size = vitemap_compress(vm, size);
+
+  MemorySink memory = {0};
+  VitemapSink sink = {.write = memory_sink_write,
+                      .patch = patch ? memory_sink_patch : NULL,
+                      .ctx = &memory};
+  VitemapStream *stream = vitemap_stream_begin(sink);
+  bool success = stream != NULL;
+  for (size_t pushed = 0; success && pushed < size; pushed += chunk_size) {
+    size_t remaining = size - pushed;
+    success = vitemap_stream_push(stream, vm->input + pushed,
+                                  remaining < chunk_size ? remaining
+                                                         : chunk_size);
+  }
+  if (!patch) {
+    memcpy(memory.data, &stream->size, sizeof(stream->size));
+  }
+
+  uint32_t compressed_size = 0;
+  success = vitemap_stream_finish(stream, &compressed_size) && success;
+  if (!success || compressed_size != expected_size ||
+      memory.size != expected_size ||
+      memcmp(memory.data, vm->output, expected_size) != 0) {
+    printf("Stream output is not identical to vitemap_compress.\n");
+    success = false;
+  } else {
+    printf("\033[1;32m✓\033[0m\n");
+  }
+
+  free(memory.data);
+  vitemap_delete(vm);
+  return success;
+}
+
+// Discards the compressed data.
+static bool null_sink_write(void *ctx, const uint8_t *data, size_t size) {
+  return true;
+}
+
+// Checks that pushes are rejected once the compressed size may overflow.
+static bool check_stream_limit() {
+  printf("\033[1m Size limit: \033[0m");
+  VitemapSink sink = {.write = null_sink_write};
+  VitemapStream *stream = vitemap_stream_begin(sink);
+  uint8_t data[BUCKET_SIZE_U8 + 1] = {0};
+
+  // Incompressible data up to the limit would take all 32 bits: only the
+  // accounting of the pushed size is needed to reach it.
+  stream->size = VITEMAP_STREAM_MAX_SIZE - BUCKET_SIZE_U8;
+  bool success = (uint64_t)VITEMAP_LEGACY_HEADER_SIZE +
+                         (uint64_t)VITEMAP_STREAM_MAX_SIZE / BUCKET_SIZE_U8 *
+                             (1 + BUCKET_SIZE_U8) <=
+                     UINT32_MAX &&
+                 vitemap_stream_push(stream, data, BUCKET_SIZE_U8) &&
+                 !vitemap_stream_push(stream, data, 1);
+  success = !vitemap_stream_finish(stream, NULL) && success;
+  if (!success) {
+    printf("Pushes past VITEMAP_STREAM_MAX_SIZE are not rejected.\n");
+  } else {
+    printf("\033[1;32m✓\033[0m\n");
+  }
+  return success;
+}
+
+static bool test_stream() {
+  return check_stream(1, true) && check_stream(29, true) &&
+         check_stream(BUCKET_SIZE_U8, true) && check_stream(4096, false) &&
+         check_stream_limit();
+}
+
+static bool check_container(uint32_t flags) {
+  printf("\033[1m Flags %u: \033[0m", flags);
+
+  // Bitmaps of various sizes, added in an arbitrary key order.
+  enum { NUM_BITMAPS = 200, MAX_SIZE = 3000 };
+  size_t stride = vitemap_max_compressed_size(MAX_SIZE);
+  uint8_t *compressed = malloc(NUM_BITMAPS * stride);
+  uint8_t *bitmap = malloc(MAX_SIZE);
+  uint32_t sizes[NUM_BITMAPS];
+  uint64_t state = 17;
+  MemorySink memory = {0};
+  VitemapSink sink = {.write = memory_sink_write, .ctx = &memory};
+  VitemapContainerWriter *writer = vitemap_container_begin(sink, flags);
+  bool success = writer != NULL;
+  for (size_t i = 0; i < NUM_BITMAPS && success; i++) {
+    uint32_t size = next_random(&state) % MAX_SIZE;
+    fill_run_buckets(bitmap, MAX_SIZE / BUCKET_SIZE_U8, state);
+    uint8_t *output = compressed + i * stride;
+    sizes[i] = vitemap_compress_buffer(bitmap, size, output, VITEMAP_FLAG_RUNS);
+    success = vitemap_container_add(writer, i * 0x9E3779B97F4A7C15ULL, output,
+                                    sizes[i]);
+  }
+  success = vitemap_container_finish(writer) && success;
+
+  VitemapContainer *container =
+      success ? vitemap_container_wrap(memory.data, memory.size, flags) : NULL;
+  success = container != NULL && container->count == NUM_BITMAPS;
+  for (size_t i = 0; i < NUM_BITMAPS && success; i++) {
+    const uint8_t *view;
+    uint32_t size;
+    const uint8_t *output = compressed + i * stride;
+    if (!vitemap_container_get(container, i * 0x9E3779B97F4A7C15ULL, &view,
+                               &size) ||
+        size != sizes[i] || memcmp(view, output, size) != 0 ||
+        (view - memory.data) % VITEMAP_CONTAINER_ALIGNMENT != 0 ||
+        vitemap_cardinality(view, size) != vitemap_cardinality(output, size)) {
+      printf("Bitmap %zu is not returned as added.\n", i);
+      success = false;
+    }
+  }
+  const uint8_t *view;
+  uint32_t size;
+  if (success && vitemap_container_get(container, 1, &view, &size)) {
+    printf("A missing key was found.\n");
+    success = false;
+  }
+  if (container != NULL) {
+    vitemap_container_close(container);
+  }
+
+  // Corruption is only detected with checksums, and only when verifying.
+  if (success) {
+    memory.data[VITEMAP_CONTAINER_ALIGNMENT + 7] ^= 1;
+    container = vitemap_container_wrap(memory.data, memory.size, 0);
+    bool verified = vitemap_container_verify(container);
+    vitemap_container_close(container);
+    container = vitemap_container_wrap(memory.data, memory.size, flags);
+    if (verified != !(flags & VITEMAP_CONTAINER_CHECKSUMS) ||
+        (container != NULL) != !(flags & VITEMAP_CONTAINER_CHECKSUMS)) {
+      printf("Corruption detection does not follow the checksum flag.\n");
+      success = false;
+    }
+    if (container != NULL) {
+      vitemap_container_close(container);
+    }
+    memory.data[VITEMAP_CONTAINER_ALIGNMENT + 7] ^= 1;
+  }
+
+  // Round trip through a mapped file.
+  const char *path = "testing_container.tmp";
+  FILE *file = fopen(path, "wb");
+  success = success && file != NULL &&
+            fwrite(memory.data, 1, memory.size, file) == memory.size;
+  if (file != NULL) {
+    fclose(file);
+  }
+  container = success ? vitemap_container_open(path, flags) : NULL;
+  if (success &&
+      (container == NULL ||
+       !vitemap_container_get(container, 0, &view, &size) ||
+       size != sizes[0] || memcmp(view, compressed, size) != 0)) {
+    printf("The mapped file does not match the written container.\n");
+    success = false;
+  }
+  if (container != NULL) {
+    vitemap_container_close(container);
+  }
+  remove(path);
+
+  free(memory.data);
+  free(bitmap);
+  free(compressed);
+  if (success) {
+    printf("\033[1;32m✓\033[0m\n");
+  }
+  return success;
+}
+
+static bool test_container() {
+  // Duplicate keys are rejected.
+  MemorySink memory = {0};
+  VitemapSink sink = {.write = memory_sink_write, .ctx = &memory};
+  VitemapContainerWriter *writer = vitemap_container_begin(sink, 0);
+  uint8_t compressed[] = {0, 0, 0, 0};
+  vitemap_container_add(writer, 3, compressed, sizeof(compressed));
+  vitemap_container_add(writer, 3, compressed, sizeof(compressed));
+  bool duplicate = vitemap_container_finish(writer);
+  free(memory.data);
+  if (duplicate) {
+    printf("A container with duplicate keys was accepted.\n");
+    return false;
+  }
+
+  // Bitmaps too large for the directory are rejected, without failing the
+  // container (their data is never read).
+  memory = (MemorySink){0};
+  writer = vitemap_container_begin(sink, 0);
+  bool too_large = vitemap_container_add(writer, 1, compressed,
+                                         (size_t)UINT32_MAX + 1);
+  bool added = vitemap_container_add(writer, 2, compressed, sizeof(compressed));
+  bool finished = vitemap_container_finish(writer);
+  VitemapContainer *container =
+      vitemap_container_wrap(memory.data, memory.size, 0);
+  const uint8_t *data;
+  uint32_t size;
+  bool found = container != NULL && !vitemap_container_get(container, 1, &data,
+                                                           &size) &&
+               vitemap_container_get(container, 2, &data, &size) &&
+               size == sizeof(compressed);
+  if (container != NULL) {
+    vitemap_container_close(container);
+  }
+  free(memory.data);
+  if (too_large || !added || !finished || !found) {
+    printf("A bitmap too large for the directory was not rejected.\n");
+    return false;
+  }
+  return check_container(0) && check_container(VITEMAP_CONTAINER_CHECKSUMS);
+}
+
+// Compresses from an exactly sized input into an exactly sized output, so that
+// the address sanitizer catches any access past either of them.
+static bool check_compress_buffer(uint32_t size, bool seekable) {
+  printf("\033[1m %s, %6u bytes: \033[0m", seekable ? "Seekable" : "Legacy  ",
+         size);
+
+  uint32_t flags = seekable ? VITEMAP_FLAG_SEEKABLE : 0;
+  Vitemap *vm = vitemap_create(size);
+  vm->flags = flags;
+  fill_mixed_buckets(vm->input, vm->num_buckets, size); // Non-zero padding
+  uint32_t expected_size = vitemap_compress(vm, size);
+
+  uint8_t *input = malloc(size);
+  memcpy(input, vm->input, size);
+  memset(vm->input + size, 0, vm->max_size - size);
+
+  uint8_t *decompressed = malloc(vm->max_size);
+  vitemap_decompress(vm->output, expected_size, decompressed);
+  if (memcmp(decompressed, vm->input, vm->max_size) != 0) {
+    printf("Bytes past the input size were not ignored.\n");
+    free(decompressed);
+    free(input);
+    vitemap_delete(vm);
+    return false;
+  }
+
+  bool success = true;
+  VitemapIsa default_isa = vitemap_get_isa();
+  for (VitemapIsa isa = VITEMAP_ISA_SCALAR; isa <= VITEMAP_ISA_AVX512; isa++) {
+    if (!vitemap_set_isa(isa)) {
+      continue;
+    }
+
+    uint8_t *output = malloc(vitemap_max_compressed_size(size));
+    uint32_t compressed_size =
+        vitemap_compress_buffer(input, size, output, flags);
+    if (compressed_size != expected_size ||
+        memcmp(output, vm->output, expected_size) != 0) {
+      printf("Output differs from vitemap_compress (ISA %d).\n", isa);
+      success = false;
+    }
+    free(output);
+  }
+  vitemap_set_isa(default_isa);
+
+  if (success) {
+    printf("\033[1;32m✓\033[0m\n");
+  }
+
+  free(decompressed);
+  free(input);
+  vitemap_delete(vm);
+  return success;
+}
+
+static bool test_compress_buffer() {
+  // The last size has a partial bucket starting a new index entry.
+  static const uint32_t sizes[] = {1, 31, 33, 1000 * BUCKET_SIZE_U8 + 7,
+                                   2 * VITEMAP_INDEX_STRIDE * BUCKET_SIZE_U8 +
+                                       5};
+  bool success = true;
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    success &= check_compress_buffer(sizes[i], false);
+    success &= check_compress_buffer(sizes[i], true);
+  }
+  return success;
+}
+
+static bool check_append(uint32_t flags, const char *name) {
+  printf("\033[1m %s: \033[0m", name);
+  size_t size = 700 * BUCKET_SIZE_U8 + 13;
+  size_t capacity = vitemap_max_compressed_size(size);
+  uint8_t *input = malloc(size);
+  uint8_t *compressed = malloc(capacity);
+  uint8_t *expected = malloc(capacity);
+  fill_run_buckets(input, size / BUCKET_SIZE_U8, flags + 17);
+  memset(input + size - 13, 0x81, 13);
+
+  // Appends of random lengths, from an empty bitmap.
+  size_t compressed_size = vitemap_compress_buffer(input, 0, compressed, flags);
+  uint64_t state = flags + 19;
+  bool success = true;
+  for (size_t appended = 0; appended < size && success;) {
+    size_t length = next_random(&state) % 5 == 0
+                        ? next_random(&state) % (3 * VITEMAP_INDEX_STRIDE *
+                                                 BUCKET_SIZE_U8)
+                        : next_random(&state) % 100;
+    length = length < size - appended ? length : size - appended;
+    compressed_size = vitemap_append(compressed, compressed_size, capacity,
+                                     input + appended, length);
+    appended += length;
+
+    size_t expected_size =
+        vitemap_compress_buffer(input, appended, expected, flags);
+    if (compressed_size != expected_size ||
+        memcmp(compressed, expected, expected_size) != 0) {
+      printf("Appending up to %zu bytes differs from compressing them.\n",
+             appended);
+      success = false;
+    }
+  }
+
+  // Buffers too small are left unchanged.
+  memcpy(expected, compressed, compressed_size);
+  if (success &&
+      (vitemap_append(compressed, compressed_size, compressed_size + 8, input,
+                      BUCKET_SIZE_U8) != 0 ||
+       memcmp(compressed, expected, compressed_size) != 0)) {
+    printf("Appending to a full buffer does not fail cleanly.\n");
+    success = false;
+  }
+
+  free(expected);
+  free(compressed);
+  free(input);
+  printf(success ? "Success\n" : "");
+  return success;
+}
+
+static bool test_append() {
+  return check_append(0, "Legacy  ") &&
+         check_append(VITEMAP_FLAG_SEEKABLE, "Seekable") &&
+         check_append(VITEMAP_FLAG_COUNTS, "Counts  ") &&
+         check_append(VITEMAP_FLAG_RUNS, "Runs    ") &&
+         check_append(VITEMAP_FLAG_COUNTS | VITEMAP_FLAG_RUNS |
+                          VITEMAP_FLAG_WIDE,
+                      "Wide    ");
+}
+
+static bool check_compress_batch(uint32_t flags) {
+  printf("\033[1m Flags %u: \033[0m", flags);
+
+  // Many small bitmaps, with a few empty and larger ones.
+  enum { NUM_INPUTS = 300 };
+  VitemapBatchInput inputs[NUM_INPUTS];
+  uint8_t *data = malloc(NUM_INPUTS * 4096);
+  uint64_t state = 41;
+  for (size_t i = 0; i < NUM_INPUTS; i++) {
+    uint32_t size = next_random(&state) % (i % 10 ? 400 : 4096);
+    inputs[i] = (VitemapBatchInput){.data = data + i * 4096, .size = size};
+  }
+  fill_run_buckets(data, NUM_INPUTS * 4096 / BUCKET_SIZE_U8, 43);
+
+  size_t arena_size = vitemap_max_batch_compressed_size(inputs, NUM_INPUTS);
+  uint8_t *arena = malloc(arena_size);
+  size_t offsets[NUM_INPUTS + 1];
+  size_t total =
+      vitemap_compress_batch(inputs, NUM_INPUTS, arena, offsets, flags);
+
+  bool success = offsets[0] == 0 && offsets[NUM_INPUTS] == total;
+  uint8_t *expected = malloc(vitemap_max_compressed_size(4096));
+  for (size_t i = 0; i < NUM_INPUTS && success; i++) {
+    uint32_t expected_size = vitemap_compress_buffer(
+        inputs[i].data, inputs[i].size, expected, flags);
+    if (offsets[i + 1] - offsets[i] != expected_size ||
+        memcmp(arena + offsets[i], expected, expected_size) != 0) {
+      printf("Bitmap %zu differs from vitemap_compress_buffer.\n", i);
+      success = false;
+    }
+  }
+
+  free(expected);
+  free(arena);
+  free(data);
+  if (success) {
+    printf("\033[1;32m✓\033[0m\n");
+  }
+  return success;
+}
+
+static bool test_compress_batch() {
+  return check_compress_batch(0) &&
+         check_compress_batch(VITEMAP_FLAG_SEEKABLE | VITEMAP_FLAG_RUNS);
+}
+
+typedef struct {
+  size_t allocations;
+  size_t releases;
+  bool misaligned;
+} CountingAllocator;
+
+static void *counting_allocate(void *ctx, size_t size, size_t alignment) {
+  CountingAllocator *counter = ctx;
+  counter->allocations++;
+  counter->misaligned |= alignment != VITEMAP_ALIGNMENT;
+  void *ptr = aligned_alloc(alignment, (size + alignment - 1) / alignment *
+                                           alignment);
+  // Garbage contents, which must not leak into compressed data
+  memset(ptr, 0xA5, size);
+  return ptr;
+}
+
+static void counting_release(void *ctx, void *ptr) {
+  CountingAllocator *counter = ctx;
+  counter->releases++;
+  free(ptr);
+}
+
+static bool test_reset() {
+  CountingAllocator counter = {0};
+  VitemapAllocator allocator = {counting_allocate, counting_release, &counter};
+  uint32_t sizes[] = {5000 * BUCKET_SIZE_U8 + 7, 100, 0, 4999 * BUCKET_SIZE_U8,
+                      20000 * BUCKET_SIZE_U8 + 31};
+
+  Vitemap *vm = vitemap_create_with_allocator(sizes[0], &allocator);
+  if (vm == NULL) {
+    printf("Creation with a custom allocator failed.\n");
+    return false;
+  }
+  vm->flags = VITEMAP_FLAG_SEEKABLE | VITEMAP_FLAG_RUNS;
+  bool success = true;
+  uint64_t state = 5;
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]) && success; i++) {
+    uint32_t size = sizes[i];
+    size_t allocations = counter.allocations;
+    if (i > 0 && !vitemap_reset(vm, size)) {
+      printf("Reset to %u bytes failed.\n", size);
+      success = false;
+      break;
+    }
+    bool grown = counter.allocations != allocations;
+    if (i > 0 && grown != (i == 4)) {
+      printf("Reset to %u bytes %s.\n", size,
+             grown ? "allocated" : "did not allocate");
+      success = false;
+    }
+    if ((uintptr_t)vm->input % VITEMAP_ALIGNMENT != 0 ||
+        (uintptr_t)vm->output % VITEMAP_ALIGNMENT != 0) {
+      counter.misaligned = true;
+    }
+
+    Vitemap *reference = vitemap_create(size);
+    reference->flags = vm->flags;
+    fill_run_buckets(reference->input, reference->num_buckets, state++);
+    memset(reference->input + size, 0, reference->max_size - size);
+    memcpy(vm->input, reference->input, size);
+
+    uint32_t compressed_size = vitemap_compress(vm, size);
+    uint32_t reference_size = vitemap_compress(reference, size);
+    if (vm->num_buckets != reference->num_buckets ||
+        compressed_size != reference_size ||
+        memcmp(vm->output, reference->output, reference_size) != 0) {
+      printf("Compression after a reset to %u bytes differs.\n", size);
+      success = false;
+    }
+    vitemap_delete(reference);
+  }
+
+  vitemap_delete(vm);
+  if (counter.allocations != counter.releases || counter.misaligned) {
+    printf("%zu allocations, %zu releases, %s.\n", counter.allocations,
+           counter.releases, counter.misaligned ? "misaligned" : "aligned");
+    success = false;
+  }
+  if (success) {
+    printf("\033[1;32m✓\033[0m\n");
+  }
+  return success;
+}
+
+static bool test_builder() {
+  uint32_t size = 3000 * BUCKET_SIZE_U8 + 13;
+  VitemapBuilder *builder = vitemap_builder_create(size);
+  Vitemap *reference = vitemap_create(size);
+  builder->vm->flags = reference->flags = VITEMAP_FLAG_SEEKABLE;
+
+  // Dense and sparse regions, with some bits set and cleared repeatedly.
+  uint64_t state = 7;
+  uint64_t num_bits = (uint64_t)size * 8;
+  for (size_t i = 0; i < 200000; i++) {
+    uint64_t bit = next_random(&state) % (i % 2 ? num_bits : num_bits / 16);
+    if (next_random(&state) % 3 == 0) {
+      vitemap_clear_bit(builder, bit);
+    } else {
+      vitemap_set_bit(builder, bit);
+    }
+  }
+  if (vitemap_set_bit(builder, num_bits) || vitemap_clear_bit(builder, 0) ||
+      !vitemap_set_bit(builder, 0) || vitemap_set_bit(builder, 0)) {
+    printf("Set and clear report the wrong previous values.\n");
+    vitemap_builder_delete(builder);
+    vitemap_delete(reference);
+    return false;
+  }
+
+  uint64_t cardinality = 0;
+  for (uint32_t i = 0; i < size; i++) {
+    cardinality += __builtin_popcount(builder->vm->input[i]);
+  }
+  memcpy(reference->input, builder->vm->input, size);
+
+  bool success = vitemap_builder_cardinality(builder) == cardinality;
+  if (!success) {
+    printf("Cardinality is %lu instead of %lu.\n",
+           vitemap_builder_cardinality(builder), cardinality);
+  }
+
+  uint32_t compressed_size = vitemap_builder_compress(builder);
+  uint32_t reference_size = vitemap_compress(reference, size);
+  if (compressed_size != reference_size ||
+      memcmp(builder->vm->output, reference->output, reference_size) != 0) {
+    printf("Builder output differs from vitemap_compress.\n");
+    success = false;
+  }
+
+  // Counts are rebuilt after writing the bitmap directly.
+  fill_mixed_buckets(builder->vm->input, builder->vm->num_buckets, 8);
+  vitemap_builder_recount(builder);
+  memcpy(reference->input, builder->vm->input, builder->vm->max_size);
+  compressed_size = vitemap_builder_compress(builder);
+  reference_size = vitemap_compress(reference, size);
+  if (compressed_size != reference_size ||
+      memcmp(builder->vm->output, reference->output, reference_size) != 0) {
+    printf("Builder output differs after recounting.\n");
+    success = false;
+  }
+
+  vitemap_builder_delete(builder);
+  vitemap_delete(reference);
+  return success;
+}
+
+#ifdef VITEMAP_INSTRUMENTATION
+static bool test_instrumentation(void) {
+  // A bitmap, an array, an inverted array, an empty bucket and a partial one.
+  uint8_t input[4 * BUCKET_SIZE_U8 + 5] = {0};
+  memset(input, 0x5A, BUCKET_SIZE_U8);
+  input[BUCKET_SIZE_U8] = 0x01;
+  memset(input + 2 * BUCKET_SIZE_U8, 0xFF, BUCKET_SIZE_U8);
+  input[2 * BUCKET_SIZE_U8] = 0xFE;
+  uint8_t *compressed = malloc(vitemap_max_compressed_size(sizeof(input)));
+  uint8_t output[5 * BUCKET_SIZE_U8];
+
+  vitemap_reset_stats();
+  size_t size = vitemap_compress_buffer(input, sizeof(input), compressed, 0);
+  vitemap_decompress(compressed, size, output);
+  VitemapStats stats;
+  vitemap_get_stats(&stats);
+
+  bool success = true;
+  const VitemapCounters *operations[] = {&stats.compress, &stats.decompress};
+  for (size_t i = 0; i < 2; i++) {
+    const VitemapCounters *counters = operations[i];
+    if (counters->calls != 1 || counters->bytes != sizeof(input) ||
+        counters->buckets[0] != 3 || counters->buckets[1] != 1 ||
+        counters->buckets[2] != 1 || counters->buckets[3] != 0) {
+      printf("Operation %zu counts %lu calls, %lu bytes and %lu/%lu/%lu/%lu "
+             "buckets.\n",
+             i, counters->calls, counters->bytes, counters->buckets[0],
+             counters->buckets[1], counters->buckets[2], counters->buckets[3]);
+      success = false;
+    }
+    if (stats.counters_available &&
+        (counters->cycles == 0 || counters->instructions == 0)) {
+      printf("Operation %zu has no cycles or instructions.\n", i);
+      success = false;
+    }
+  }
+  if (!stats.counters_available) {
+    printf("Hardware counters are not available, only checking buckets.\n");
+  }
+
+  vitemap_reset_stats();
+  vitemap_get_stats(&stats);
+  if (stats.compress.calls != 0 || stats.decompress.buckets[0] != 0) {
+    printf("Statistics are not reset.\n");
+    success = false;
+  }
+
+  free(compressed);
+  return success;
+}
+#endif
+
 // Add tests here and execute them.
 int main() {
   add_test("A `random` bucket should use bitmap encoding.",
@@ -327,6 +2663,63 @@ int main() {
   }
 
   add_test("Input size should round to upper 32B.", test_round_up_input_size);
+  add_test("A seekable stream should decompress to the original bitmap.",
+           test_seekable_round_trip);
+  add_test("Bit ranges should decompress to the matching raw bits.",
+           test_decompress_range);
+  add_test("Single buckets and bits should be accessible randomly.",
+           test_random_access);
+  add_test("Set operations should match compressing the raw result.",
+           test_operations);
+  add_test("Set operations should support a seekable result.",
+           test_seekable_operation);
+  add_test("Parallel compression should match the serial one.",
+           test_parallel);
+  add_test("All instruction sets should produce identical streams.",
+           test_isa_equivalence);
+  add_test("Streaming compression should match vitemap_compress.",
+           test_stream);
+  add_test("Compressing from caller memory should match vitemap_compress.",
+           test_compress_buffer);
+  add_test("Appending to a compressed bitmap should match compressing it.",
+           test_append);
+  add_test("Batch compression should match compressing every bitmap.",
+           test_compress_batch);
+  add_test("Containers should return every bitmap without copying.",
+           test_container);
+  add_test("A reset Vitemap should reuse its buffers and compress identically.",
+           test_reset);
+  add_test("A builder should track cardinalities and compress identically.",
+           test_builder);
+  add_test("Cardinality, rank and select should match the raw bitmap.",
+           test_rank_select);
+  add_test("Set bit positions should be extracted in order.",
+           test_to_positions);
+  add_test("Aggregates should match scanning the raw bitmap.",
+           test_aggregate);
+  add_test("Non-temporal stores should not change any output.",
+           test_streaming);
+  add_test("Fixed-size kernels should match the generic functions.",
+           test_fixed);
+  add_test("Files should be compressed and decompressed through mappings.",
+           test_files);
+  add_test("Threads should share compressed bitmaps without synchronization.",
+           test_concurrent_readers);
+  add_test("Split streams should decode every bucket on its own.",
+           test_split);
+  add_test("Runs should round-trip and match on every compression path.",
+           test_runs);
+  add_test("Set operations should read and write runs.", test_run_operations);
+  add_test("Expressions should match evaluating them on the raw bitmaps.",
+           test_expressions);
+  add_test("Wide streams should only differ from regular ones by their header.",
+           test_wide);
+  add_test("Untrusted streams should be decoded within bounds or rejected.",
+           test_checked_decoder);
+#ifdef VITEMAP_INSTRUMENTATION
+  add_test("Instrumentation should count calls, bytes and buckets.",
+           test_instrumentation);
+#endif
 
   run_tests();
 
@@ -13,124 +13,159 @@
  */
 
 #include "vite.h"
-#include <immintrin.h>
+#include "vite_internal.h"
+#include <math.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 
 // Align to 32-byte boundary for efficient AVX2 loads.
-__attribute__((aligned(32))) static uint64_t bit_lookup[BUCKET_SIZE][4] = {{0}};
+__attribute__((aligned(32))) uint64_t vitemap_bit_lookup[BUCKET_SIZE][4] = {
+    {0}};
 __attribute__((constructor)) static void init_bit_lookup(void) {
   for (size_t i = 0; i < BUCKET_SIZE; i++) {
     size_t chunk = i / 64;
     size_t bit = i % 64;
-    bit_lookup[i][chunk] = 1ULL << bit;
+    vitemap_bit_lookup[i][chunk] = 1ULL << bit;
   }
 }
-__attribute__((aligned(32))) static uint8_t indices[BUCKET_SIZE] = {0};
+__attribute__((aligned(32))) uint8_t vitemap_indices[BUCKET_SIZE] = {0};
 __attribute__((constructor)) static void init_indices(void) {
   for (size_t i = 0; i < BUCKET_SIZE; i++) {
-    indices[i] = i;
-  }
-}
-
-// Fast popcount for 256 bits.
-// Calling this function in the critical section increases incoding time by
-// ~25%. When maintaining the bitmap, it makes sense to dynamically keep track
-// of the bucket sizes, so this could be a potential optimization.
-static size_t popcount_256(uint8_t *restrict ptr) {
-  __m256i vec = _mm256_loadu_si256((__m256i *)ptr);
-  __m256i popcnt = _mm256_popcnt_epi64(vec);
-  __m128i sum = _mm_add_epi64(_mm256_castsi256_si128(popcnt),
-                              _mm256_extracti128_si256(popcnt, 1));
-  sum = _mm_add_epi64(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
-  return _mm_cvtsi128_si64(sum);
-}
-
-// Performs highly optimized selective bit extraction and compaction.
-// Uses precomputed indices to selectively extract and compact bits from a
-// 256-bit (4x64-bit) bucket using AVX-512 SIMD instructions.
-static void extract_and_compact_256(uint64_t *restrict src,
-                                    uint8_t *restrict dst) {
-  uint8_t *restrict moving_indices = indices;
-  for (size_t i = 0; i < BUCKET_SIZE_U64; i++) {
-    __m512i indices_vector = _mm512_loadu_si512(moving_indices);
-    __m512i compact = _mm512_maskz_compress_epi8(*src, indices_vector);
-    _mm512_storeu_epi8(
-        dst,
-        compact); // This instruction will systematically
-                  // overflow to the next bucket. However, since each bucket is
-                  // processed sequentially, this is not a problem. Furthermore,
-                  // we allocate one extra bucket at the end of the output
-                  // buffer to avoid any tail buffer overflows.
-
-    dst += _mm_popcnt_u64(*src);
-    src += 1;
-    moving_indices += 64;
-  }
-}
-
-// Performs highly optimized selective bit expansion and scattering.
-// Uses provided indices to selectively expand and scatter bits into a
-// 256-bit (4x64-bit) bucket using AVX2 SIMD instructions.
-// Uses a 65KB lookup table for fast bit expansion.
-static void expand_and_scatter_256(uint8_t *restrict src, size_t bucket_size,
-                                   uint8_t *restrict dst) {
-  __m256i result = _mm256_setzero_si256();
-  size_t i;
-
-  // Manually unrolling gives a substantial improvement benefit.
-  for (i = 0; i + 4 <= bucket_size; i += 4) {
-    __m256i lookup1 = _mm256_loadu_si256((__m256i *)bit_lookup[src[i]]);
-    __m256i lookup2 = _mm256_loadu_si256((__m256i *)bit_lookup[src[i + 1]]);
-    __m256i lookup3 = _mm256_loadu_si256((__m256i *)bit_lookup[src[i + 2]]);
-    __m256i lookup4 = _mm256_loadu_si256((__m256i *)bit_lookup[src[i + 3]]);
-
-    result = _mm256_or_si256(result, lookup1);
-    result = _mm256_or_si256(result, lookup2);
-    result = _mm256_or_si256(result, lookup3);
-    result = _mm256_or_si256(result, lookup4);
-  }
-
-  for (; i < bucket_size; i++) {
-    __m256i lookup = _mm256_loadu_si256((__m256i *)bit_lookup[src[i]]);
-    result = _mm256_or_si256(result, lookup);
-  }
-
-  _mm256_storeu_si256((__m256i *)dst, result);
-}
-
-// Inverts all 256 bits in src and stores inverse into dst.
-static void invert_256(uint8_t *restrict src, uint8_t *restrict dst) {
-  __m256i src_vec = _mm256_loadu_si256((__m256i *)src);
-  __m256i all_ones = _mm256_set1_epi8((char)0xFFU);
-  __m256i inverted = _mm256_xor_si256(src_vec, all_ones);
-  _mm256_storeu_si256((__m256i *)dst, inverted);
-}
-
-Vitemap *vitemap_create(uint32_t size) {
-  uint32_t full_buckets = size / BUCKET_SIZE_U8;
-  uint32_t remaining_bytes = size % BUCKET_SIZE_U8;
-  uint32_t num_buckets = full_buckets + (remaining_bytes > 0 ? 1 : 0);
-
-  Vitemap *vm = calloc(1, sizeof(Vitemap));
+    vitemap_indices[i] = i;
+  }
+}
+uint64_t vitemap_byte_positions[256] = {0};
+__attribute__((constructor)) static void init_byte_positions(void) {
+  for (size_t i = 0; i < 256; i++) {
+    size_t count = 0;
+    for (size_t bit = 0; bit < 8; bit++) {
+      if (i & (1 << bit)) {
+        vitemap_byte_positions[i] |= (uint64_t)bit << (8 * count++);
+      }
+    }
+  }
+}
+
+// Kernels of the best instruction set supported by the CPU, selected once at
+// load time.
+static const VitemapKernels *kernels = &vitemap_kernels_scalar;
+
+static bool isa_supported(VitemapIsa isa) {
+  __builtin_cpu_init();
+  switch (isa) {
+  case VITEMAP_ISA_AVX512:
+    return __builtin_cpu_supports("avx512f") &&
+           __builtin_cpu_supports("avx512bw") &&
+           __builtin_cpu_supports("avx512vl") &&
+           __builtin_cpu_supports("avx512vpopcntdq") &&
+           __builtin_cpu_supports("avx512vbmi") &&
+           __builtin_cpu_supports("avx512vbmi2") &&
+           __builtin_cpu_supports("avx512bitalg");
+  case VITEMAP_ISA_AVX2:
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt") &&
+           __builtin_cpu_supports("bmi");
+  case VITEMAP_ISA_SCALAR:
+    return true;
+  }
+  return false;
+}
+
+__attribute__((constructor)) static void init_kernels(void) {
+  if (!vitemap_set_isa(VITEMAP_ISA_AVX512)) {
+    vitemap_set_isa(VITEMAP_ISA_AVX2);
+  }
+}
+
+// Bitmap size from which non-temporal stores are used, the size of the last
+// level cache.
+#define DEFAULT_STREAMING_THRESHOLD (32 << 20)
+static size_t streaming_threshold = DEFAULT_STREAMING_THRESHOLD;
+
+__attribute__((constructor)) static void init_streaming_threshold(void) {
+  long llc_size = sysconf(_SC_LEVEL3_CACHE_SIZE);
+  if (llc_size > 0) {
+    streaming_threshold = llc_size;
+  }
+}
+
+size_t vitemap_get_streaming_threshold(void) { return streaming_threshold; }
+
+void vitemap_set_streaming_threshold(size_t size) {
+  streaming_threshold = size;
+}
+
+VitemapIsa vitemap_get_isa(void) { return kernels->isa; }
+
+bool vitemap_set_isa(VitemapIsa isa) {
+  if (!isa_supported(isa)) {
+    return false;
+  }
+
+  switch (isa) {
+  case VITEMAP_ISA_AVX512:
+    kernels = &vitemap_kernels_avx512;
+    break;
+  case VITEMAP_ISA_AVX2:
+    kernels = &vitemap_kernels_avx2;
+    break;
+  case VITEMAP_ISA_SCALAR:
+    kernels = &vitemap_kernels_scalar;
+    break;
+  }
+  return true;
+}
+
+static void *default_allocate(void *ctx, size_t size, size_t alignment) {
+  (void)ctx;
+  // aligned_alloc requires a multiple of the alignment
+  return aligned_alloc(alignment, (size + alignment - 1) & ~(alignment - 1));
+}
+
+static void default_release(void *ctx, void *ptr) {
+  (void)ctx;
+  free(ptr);
+}
+
+static const VitemapAllocator default_allocator = {default_allocate,
+                                                   default_release, NULL};
+
+static void *allocate(const VitemapAllocator *allocator, size_t size) {
+  // Never request 0 bytes, for which allocators may return NULL
+  return allocator->allocate(allocator->ctx, size > 0 ? size : 1,
+                             VITEMAP_ALIGNMENT);
+}
+
+static void release(const VitemapAllocator *allocator, void *ptr) {
+  if (ptr != NULL) {
+    allocator->release(allocator->ctx, ptr);
+  }
+}
+
+Vitemap *vitemap_create(size_t size) {
+  Vitemap *vm = vitemap_create_with_allocator(size, NULL);
+  if (vm != NULL) {
+    memset(vm->input, 0, vm->max_size);
+  }
+  return vm;
+}
+
+Vitemap *vitemap_create_with_allocator(size_t size,
+                                       const VitemapAllocator *allocator) {
+  if (allocator == NULL) {
+    allocator = &default_allocator;
+  }
+
+  Vitemap *vm = allocate(allocator, sizeof(Vitemap));
   if (vm == NULL) {
     return NULL;
   }
+  memset(vm, 0, sizeof(Vitemap));
+  vm->allocator = *allocator;
 
-  vm->max_size = num_buckets * BUCKET_SIZE_U8;
-  vm->num_buckets = num_buckets;
-
-  vm->max_compressed_size =
-      4 + vm->max_size +
-      num_buckets *
-          BUCKET_SIZE_U8; // Orig size + offsets + worst-case encoded size.
-
-  vm->input = calloc(vm->max_size, sizeof(uint8_t));
-  vm->output = calloc(vm->max_compressed_size + BUCKET_SIZE_U8,
-                      sizeof(uint8_t)); // See `extract_and_compact_256` for
-                                        // extra bucket explanation.
-  vm->helper_bucket = calloc(BUCKET_SIZE_U8, sizeof(uint8_t));
-  if (vm->input == NULL || vm->output == NULL || vm->helper_bucket == NULL) {
+  vm->helper_bucket = allocate(allocator, BUCKET_SIZE_U8);
+  if (vm->helper_bucket == NULL || !vitemap_reset(vm, size)) {
     vitemap_delete(vm);
     return NULL;
   }
@@ -138,98 +173,1846 @@ Vitemap *vitemap_create(uint32_t size) {
   return vm;
 }
 
+bool vitemap_reset(Vitemap *vm, size_t size) {
+  size_t full_buckets = size / BUCKET_SIZE_U8;
+  size_t remaining_bytes = size % BUCKET_SIZE_U8;
+  size_t num_buckets = full_buckets + (remaining_bytes > 0 ? 1 : 0);
+
+  size_t max_size = num_buckets * BUCKET_SIZE_U8;
+  size_t max_compressed_size = vitemap_max_compressed_size(max_size);
+
+  // Allocate both buffers before releasing anything, so that vm is left
+  // untouched on failure. Contents are not preserved.
+  uint8_t *input = vm->input;
+  uint8_t *output = vm->output;
+  if (input == NULL || vm->input_capacity < max_size) {
+    input = allocate(&vm->allocator, max_size);
+  }
+  if (output == NULL || vm->output_capacity < max_compressed_size) {
+    output = allocate(&vm->allocator, max_compressed_size);
+  }
+  if (input == NULL || output == NULL) {
+    if (input != vm->input) {
+      release(&vm->allocator, input);
+    }
+    if (output != vm->output) {
+      release(&vm->allocator, output);
+    }
+    return false;
+  }
+
+  if (input != vm->input) {
+    release(&vm->allocator, vm->input);
+    vm->input = input;
+    vm->input_capacity = max_size;
+  }
+  if (output != vm->output) {
+    release(&vm->allocator, vm->output);
+    vm->output = output;
+    vm->output_capacity = max_compressed_size;
+  }
+
+  vm->max_size = max_size;
+  vm->num_buckets = num_buckets;
+  vm->max_compressed_size = max_compressed_size;
+  vm->output_size = 0;
+
+  // The last bucket is compressed whole, past the end of the bitmap
+  memset(vm->input + size, 0, max_size - size);
+  return true;
+}
+
 void vitemap_delete(Vitemap *vm) {
-  free(vm->input);
+  VitemapAllocator allocator = vm->allocator;
+  release(&allocator, vm->input);
   vm->input = NULL;
-  free(vm->output);
+  release(&allocator, vm->output);
   vm->output = NULL;
-  free(vm->helper_bucket);
+  release(&allocator, vm->helper_bucket);
   vm->helper_bucket = NULL;
-  free(vm);
+  release(&allocator, vm);
 }
 
-uint32_t vitemap_compress(Vitemap *vm, uint32_t size) {
-  uint32_t result_size = 0;
-  uint8_t *input = vm->input;
-  uint8_t *output = vm->output;
+size_t vitemap_max_compressed_size(size_t size) {
+  size_t num_buckets = size / BUCKET_SIZE_U8 + (size % BUCKET_SIZE_U8 > 0);
+  size_t num_entries =
+      (num_buckets + VITEMAP_INDEX_STRIDE - 1) / VITEMAP_INDEX_STRIDE;
+
+  // Wide header, index and counts, worst-case encoded size, and the slack for
+  // the SIMD stores past the last bucket (see `extract_and_compact_256`).
+  return VITEMAP_WIDE_HEADER_SIZE + (8 + 8) * num_entries +
+         num_buckets * (1 + BUCKET_SIZE_U8) + COMPRESS_BUCKET_OVERRUN;
+}
+
+// Returns the format flags of the stream written for `size` bytes of input
+// with the requested `flags`. Bitmaps whose size or offsets may not fit in 32
+// bits are always written as wide streams.
+static uint32_t stream_flags(size_t size, uint32_t flags) {
+  flags &= VITEMAP_FLAG_SEEKABLE | VITEMAP_FLAG_COUNTS | VITEMAP_FLAG_RUNS |
+           VITEMAP_FLAG_WIDE;
+  if (flags & VITEMAP_FLAG_COUNTS) {
+    flags |= VITEMAP_FLAG_SEEKABLE;
+  }
+  if (vitemap_max_compressed_size(size) > UINT32_MAX) {
+    flags |= VITEMAP_FLAG_WIDE;
+  }
+  return flags;
+}
+
+// Writes the payload offset of an index entry, 64-bit in wide streams.
+static void set_index(uint8_t *index, bool wide, size_t entry, size_t offset) {
+  if (wide) {
+    uint64_t value = offset;
+    memcpy(index + 8 * entry, &value, sizeof(value));
+  } else {
+    uint32_t value = offset;
+    memcpy(index + 4 * entry, &value, sizeof(value));
+  }
+}
+
+// Returns the payload offset of an index entry.
+static size_t index_offset(const StreamInfo *info, size_t entry) {
+  if (info->flags & VITEMAP_FLAG_WIDE) {
+    uint64_t value;
+    memcpy(&value, info->index + 8 * entry, sizeof(value));
+    return value;
+  }
+  uint32_t value;
+  memcpy(&value, info->index + 4 * entry, sizeof(value));
+  return value;
+}
+
+// Returns the number of set bits before the given indexed bucket.
+static uint64_t indexed_count(const StreamInfo *info, size_t entry) {
+  uint64_t count;
+  memcpy(&count, info->counts + 8 * entry, sizeof(count));
+  return count;
+}
+
+// Returns the offset of the first encoded bucket in the stream written for
+// `size` bytes of input with the given format flags (from `stream_flags`).
+static size_t payload_offset(size_t size, uint32_t flags) {
+  if (flags == 0) {
+    return VITEMAP_LEGACY_HEADER_SIZE;
+  }
+
+  size_t num_buckets = size / BUCKET_SIZE_U8 + (size % BUCKET_SIZE_U8 > 0);
+  size_t num_entries =
+      (num_buckets + VITEMAP_INDEX_STRIDE - 1) / VITEMAP_INDEX_STRIDE;
+  bool wide = flags & VITEMAP_FLAG_WIDE;
+  size_t offset =
+      wide ? VITEMAP_WIDE_HEADER_SIZE : VITEMAP_EXTENDED_HEADER_SIZE;
+  if (flags & VITEMAP_FLAG_SEEKABLE) {
+    offset += (wide ? 8 : 4) * num_entries;
+  }
+  if (flags & VITEMAP_FLAG_COUNTS) {
+    offset += 8 * num_entries;
+  }
+  return offset;
+}
+
+// Writes the stream header for `size` bytes of input with the given format
+// flags (from `stream_flags`), and returns a pointer to the first encoded
+// bucket. For seekable streams, `index` receives the reserved bucket offset
+// index (see `set_index`), and NULL otherwise. Set bit counts are reserved as
+// well, and filled by `write_counts`.
+static uint8_t *write_header(uint8_t *output, size_t size, uint32_t flags,
+                             uint8_t **index) {
+  *index = NULL;
+  if (flags == 0) {
+    *(uint32_t *)output = size;
+    return output + VITEMAP_LEGACY_HEADER_SIZE;
+  }
+
+  bool wide = flags & VITEMAP_FLAG_WIDE;
+  *(uint32_t *)output = VITEMAP_EXTENDED_HEADER;
+  output[4] = VITEMAP_VERSION;
+  output[5] = flags;
+  output[6] = VITEMAP_INDEX_STRIDE_LOG2;
+  output[7] = 0;
+
+  if (wide) {
+    uint64_t wide_size = size;
+    memcpy(output + 8, &wide_size, sizeof(wide_size));
+  } else {
+    *(uint32_t *)(output + 8) = size;
+  }
+  if (flags & VITEMAP_FLAG_SEEKABLE) {
+    *index = output + (wide ? VITEMAP_WIDE_HEADER_SIZE
+                            : VITEMAP_EXTENDED_HEADER_SIZE);
+  }
+  return output + payload_offset(size, flags);
+}
+
+static void parse_stream(const uint8_t *compressed_data, size_t size,
+                         StreamInfo *info);
+
+// Fills the set bit counts of a stream written with VITEMAP_FLAG_COUNTS, from
+// the given index entry on, once all of its buckets are encoded. The counts of
+// the previous entries must be filled already. Other streams are left
+// untouched.
+static void write_counts_from(uint8_t *output, size_t compressed_size,
+                              size_t first_entry) {
+  StreamInfo info;
+  parse_stream(output, compressed_size, &info);
+  if (info.counts == NULL) {
+    return;
+  }
+
+  // Counting resumes from the last filled entry.
+  uint8_t *counts = output + (info.counts - output);
+  size_t stride = (size_t)1 << info.stride_log2;
+  size_t entry = first_entry > 0 ? first_entry - 1 : 0;
+  uint64_t count = first_entry > 0 ? indexed_count(&info, entry) : 0;
+  for (size_t first = entry * stride; first < info.num_buckets;
+       first += stride) {
+    entry = first >> info.stride_log2;
+    size_t remaining = info.num_buckets - first;
+    if (entry >= first_entry) {
+      memcpy(counts + 8 * entry, &count, sizeof(count));
+    }
+    kernels->count_buckets(info.payload + index_offset(&info, entry),
+                           remaining < stride ? remaining : stride, &count);
+  }
+}
+
+// Fills the set bit counts of a stream written with VITEMAP_FLAG_COUNTS, once
+// all of its buckets are encoded. Other streams are left untouched.
+static void write_counts(uint8_t *output, size_t compressed_size) {
+  write_counts_from(output, compressed_size, 0);
+}
+
+#ifdef VITEMAP_INSTRUMENTATION
+// Stops the hardware counters of a compression or decompression, and adds its
+// decompressed size and buckets by category to the statistics of the thread.
+static void end_instrumentation(bool compress, const uint8_t *compressed_data,
+                                size_t size) {
+  VitemapCounters *totals = instrument_end(compress);
+  StreamInfo info;
+  parse_stream(compressed_data, size, &info);
+  totals->bytes += info.size;
+
+  const uint8_t *ptr = info.payload;
+  for (size_t bucket = 0; bucket < info.num_buckets;) {
+    totals->buckets[*ptr >> 6]++;
+    bucket += bucket_span(ptr);
+    ptr += 1 + (*ptr & 0x3F);
+  }
+}
+
+#define INSTRUMENT_BEGIN() instrument_begin()
+#define INSTRUMENT_END(compress, compressed_data, size)                       \
+  end_instrumentation(compress, compressed_data, size)
+#else
+#define INSTRUMENT_BEGIN() ((void)0)
+#define INSTRUMENT_END(compress, compressed_data, size) ((void)0)
+#endif
+
+// Output staged in a cache-resident buffer, and written to the destination one
+// whole cache line at a time with non-temporal stores, for outputs much larger
+// than the caches (see `vitemap_get_streaming_threshold`). Kernels may write
+// up to COMPRESS_BUCKET_OVERRUN bytes past their output, which then stay in
+// the buffer.
+#define STAGING_SIZE                                                           \
+  (2 * 64 + VITEMAP_INDEX_STRIDE * (1 + BUCKET_SIZE_U8) +                      \
+   COMPRESS_BUCKET_OVERRUN)
+
+typedef struct {
+  uint8_t *dst;   // Destination of the first staged byte
+  size_t pending; // Number of staged bytes
+  __attribute__((aligned(64))) uint8_t data[STAGING_SIZE];
+} StagedOutput;
+
+// Accounts for `written` more staged bytes, and writes all whole destination
+// cache lines out of the buffer.
+static void flush_staged(StagedOutput *staging, size_t written) {
+  staging->pending += written;
+  size_t head = -(uintptr_t)staging->dst % 64;
+  if (staging->pending < head + 64) {
+    return;
+  }
+
+  size_t lines = (staging->pending - head) / 64 * 64;
+  memcpy(staging->dst, staging->data, head);
+  kernels->stream_copy(staging->dst + head, staging->data + head, lines);
+  size_t flushed = head + lines;
+  memmove(staging->data, staging->data + flushed, staging->pending - flushed);
+  staging->dst += flushed;
+  staging->pending -= flushed;
+}
+
+// Compresses `size` bytes of input into output. Full buckets are encoded in
+// batches, one index entry at a time for seekable streams, and the trailing
+// partial bucket is zero-padded without reading past the input. If given,
+// `cardinalities` holds the set bits of every bucket, and input must then be
+// padded with zeros up to the next bucket.
+static size_t compress_into(const uint8_t *input,
+                            const uint16_t *cardinalities, size_t size,
+                            uint8_t *output, uint32_t flags,
+                            uint8_t *helper_bucket) {
+  flags = stream_flags(size, flags);
+  uint8_t *index;
+  uint8_t *payload = write_header(output, size, flags, &index);
+  uint8_t *ptr = payload;
+  size_t num_full = size / BUCKET_SIZE_U8;
+  size_t tail_size = size % BUCKET_SIZE_U8;
+  bool runs = flags & VITEMAP_FLAG_RUNS;
+  bool wide = flags & VITEMAP_FLAG_WIDE;
+
+  // Large outputs are staged one stride at a time, which encodes the same
+  // stream, as runs never cross strides. `ptr` only tracks the end of the
+  // staged data.
+  bool staged = size >= streaming_threshold;
+  StagedOutput staging;
+  staging.dst = ptr;
+  staging.pending = 0;
+  size_t stride = index != NULL || staged ? VITEMAP_INDEX_STRIDE : num_full;
+
+  for (size_t first = 0; first < num_full; first += stride) {
+    if (index != NULL) {
+      set_index(index, wide, first / VITEMAP_INDEX_STRIDE, ptr - payload);
+    }
+
+    size_t count = num_full - first < stride ? num_full - first : stride;
+    uint8_t *target = staged ? staging.data + staging.pending : ptr;
+    size_t written;
+    if (cardinalities != NULL) {
+      written = kernels->compress_counted_buckets(
+          input, cardinalities + first, count, runs, target, helper_bucket);
+    } else {
+      written =
+          kernels->compress_buckets(input, count, runs, target, helper_bucket);
+    }
+    ptr += written;
+    if (staged) {
+      flush_staged(&staging, written);
+    }
+    input += count * BUCKET_SIZE_U8;
+  }
 
-  *(uint32_t *)output = size;
-  output += 4;
-  result_size += 4;
+  // The partial bucket is never part of a run.
+  if (tail_size > 0) {
+    if (index != NULL && num_full % VITEMAP_INDEX_STRIDE == 0) {
+      set_index(index, wide, num_full / VITEMAP_INDEX_STRIDE, ptr - payload);
+    }
+    uint8_t *target = staged ? staging.data + staging.pending : ptr;
+    size_t written;
+    if (cardinalities != NULL) {
+      written = kernels->compress_counted_buckets(
+          input, cardinalities + num_full, 1, false, target, helper_bucket);
+    } else {
+      written = kernels->compress_partial_bucket(input, tail_size, target,
+                                                 helper_bucket);
+    }
+    ptr += written;
+    staging.pending += written;
+  }
+  if (staged) {
+    memcpy(staging.dst, staging.data, staging.pending);
+  }
+
+  write_counts(output, ptr - output);
+  return ptr - output;
+}
+
+size_t vitemap_compress(Vitemap *vm, size_t size) {
+  INSTRUMENT_BEGIN();
+  vm->output_size = compress_into(vm->input, NULL, size, vm->output,
+                                  vm->flags, vm->helper_bucket);
+  INSTRUMENT_END(true, vm->output, vm->output_size);
+  return vm->output_size;
+}
+
+size_t vitemap_compress_buffer(const uint8_t *input, size_t size,
+                               uint8_t *output, uint32_t flags) {
+  uint8_t helper_bucket[BUCKET_SIZE_U8];
+  INSTRUMENT_BEGIN();
+  size_t compressed_size =
+      compress_into(input, NULL, size, output, flags, helper_bucket);
+  INSTRUMENT_END(true, output, compressed_size);
+  return compressed_size;
+}
+
+#define DEFINE_FIXED_FUNCTIONS(bits)                                           \
+  size_t vitemap_compress_fixed_##bits(const uint8_t *input,                   \
+                                       uint8_t *output) {                      \
+    return kernels->compress_fixed_##bits(input, output);                      \
+  }                                                                            \
+  void vitemap_decompress_fixed_##bits(const uint8_t *compressed_data,         \
+                                       size_t size,                            \
+                                       uint8_t *decompressed_data) {           \
+    uint32_t header;                                                           \
+    memcpy(&header, compressed_data, sizeof(header));                          \
+    if (header == (bits) / 8) {                                                \
+      kernels->decompress_fixed_##bits(                                        \
+          compressed_data + VITEMAP_LEGACY_HEADER_SIZE, decompressed_data);    \
+    } else {                                                                   \
+      vitemap_decompress(compressed_data, size, decompressed_data);            \
+    }                                                                          \
+  }
+VITEMAP_FIXED_SIZES(DEFINE_FIXED_FUNCTIONS)
+#undef DEFINE_FIXED_FUNCTIONS
+
+size_t vitemap_max_batch_compressed_size(const VitemapBatchInput *inputs,
+                                         size_t count) {
+  // Streams are written back-to-back, so only the last overrun remains.
+  size_t size = COMPRESS_BUCKET_OVERRUN;
+  for (size_t i = 0; i < count; i++) {
+    size += vitemap_max_compressed_size(inputs[i].size) -
+            COMPRESS_BUCKET_OVERRUN;
+  }
+  return size;
+}
+
+size_t vitemap_compress_batch(const VitemapBatchInput *inputs, size_t count,
+                              uint8_t *output, size_t *offsets,
+                              uint32_t flags) {
+  uint8_t helper_bucket[BUCKET_SIZE_U8];
+  size_t offset = 0;
+  for (size_t i = 0; i < count; i++) {
+    offsets[i] = offset;
+    offset += compress_into(inputs[i].data, NULL, inputs[i].size,
+                            output + offset, flags, helper_bucket);
+  }
+  offsets[count] = offset;
+  return offset;
+}
+
+VitemapBuilder *vitemap_builder_create(size_t size) {
+  VitemapBuilder *builder = calloc(1, sizeof(VitemapBuilder));
+  if (builder == NULL) {
+    return NULL;
+  }
+
+  builder->size = size;
+  builder->vm = vitemap_create(size);
+  if (builder->vm == NULL) {
+    vitemap_builder_delete(builder);
+    return NULL;
+  }
+  builder->cardinalities = calloc(builder->vm->num_buckets, sizeof(uint16_t));
+  if (builder->cardinalities == NULL) {
+    vitemap_builder_delete(builder);
+    return NULL;
+  }
+
+  return builder;
+}
+
+void vitemap_builder_delete(VitemapBuilder *builder) {
+  if (builder->vm != NULL) {
+    vitemap_delete(builder->vm);
+  }
+  builder->vm = NULL;
+  free(builder->cardinalities);
+  builder->cardinalities = NULL;
+  free(builder);
+}
+
+bool vitemap_set_bit(VitemapBuilder *builder, uint64_t bit) {
+  if (bit >= (uint64_t)builder->size * 8) {
+    return false;
+  }
+
+  uint8_t *byte = builder->vm->input + bit / 8;
+  uint8_t mask = 1 << (bit % 8);
+  if (*byte & mask) {
+    return false;
+  }
+  *byte |= mask;
+  builder->cardinalities[bit / BUCKET_SIZE]++;
+  builder->cardinality++;
+
+  return true;
+}
+
+bool vitemap_clear_bit(VitemapBuilder *builder, uint64_t bit) {
+  if (bit >= (uint64_t)builder->size * 8) {
+    return false;
+  }
+
+  uint8_t *byte = builder->vm->input + bit / 8;
+  uint8_t mask = 1 << (bit % 8);
+  if (!(*byte & mask)) {
+    return false;
+  }
+  *byte &= ~mask;
+  builder->cardinalities[bit / BUCKET_SIZE]--;
+  builder->cardinality--;
+
+  return true;
+}
+
+void vitemap_builder_recount(VitemapBuilder *builder) {
+  Vitemap *vm = builder->vm;
 
+  // Bits past the bitmap size are never set through the builder.
+  memset(vm->input + builder->size, 0, vm->max_size - builder->size);
+
+  builder->cardinality = 0;
   for (size_t bucket = 0; bucket < vm->num_buckets; bucket++) {
-    size_t count = popcount_256(input);
-    if (count < BUCKET_SIZE_U8) {
-      *output = count;
-      output += 1;
+    uint64_t words[BUCKET_SIZE_U64];
+    memcpy(words, vm->input + bucket * BUCKET_SIZE_U8,
+           BUCKET_SIZE_U8);
+
+    uint16_t count = 0;
+    for (size_t i = 0; i < BUCKET_SIZE_U64; i++) {
+      count += __builtin_popcountll(words[i]);
+    }
+    builder->cardinalities[bucket] = count;
+    builder->cardinality += count;
+  }
+}
 
-      extract_and_compact_256((uint64_t *)(input), output);
-      output += count;
+uint64_t vitemap_builder_cardinality(const VitemapBuilder *builder) {
+  return builder->cardinality;
+}
 
-      result_size += (1 + count);
-    } else if (BUCKET_SIZE - count < BUCKET_SIZE_U8) {
-      *output = (BUCKET_SIZE - count) | 0b01000000;
-      output += 1;
+size_t vitemap_builder_compress(VitemapBuilder *builder) {
+  Vitemap *vm = builder->vm;
+  vm->output_size =
+      compress_into(vm->input, builder->cardinalities, builder->size,
+                    vm->output, vm->flags, vm->helper_bucket);
+  return vm->output_size;
+}
 
-      invert_256(input, vm->helper_bucket);
-      extract_and_compact_256((uint64_t *)(vm->helper_bucket), output);
-      output += (BUCKET_SIZE - count);
+static void parse_stream(const uint8_t *compressed_data, size_t size,
+                         StreamInfo *info) {
+  uint32_t first = *(const uint32_t *)compressed_data;
+  info->end = compressed_data + size;
+  info->index = NULL;
+  info->counts = NULL;
+  info->flags = 0;
+  info->stride_log2 = 0;
 
-      result_size += (1 + BUCKET_SIZE - count);
+  if (first != VITEMAP_EXTENDED_HEADER) {
+    info->size = first;
+    info->payload = compressed_data + VITEMAP_LEGACY_HEADER_SIZE;
+  } else {
+    info->flags = compressed_data[5];
+    info->stride_log2 = compressed_data[6];
+    if (info->flags & VITEMAP_FLAG_WIDE) {
+      uint64_t wide_size;
+      memcpy(&wide_size, compressed_data + 8, sizeof(wide_size));
+      info->size = wide_size;
+      info->payload = compressed_data + VITEMAP_WIDE_HEADER_SIZE;
     } else {
-      *output = BUCKET_SIZE_U8 | 0b10000000;
-      output += 1;
+      info->size = *(const uint32_t *)(compressed_data + 8);
+      info->payload = compressed_data + VITEMAP_EXTENDED_HEADER_SIZE;
+    }
+  }
+  info->num_buckets =
+      info->size / BUCKET_SIZE_U8 + (info->size % BUCKET_SIZE_U8 > 0);
 
-      memcpy(output, input, BUCKET_SIZE_U8);
-      output += BUCKET_SIZE_U8;
+  if (info->flags & VITEMAP_FLAG_SEEKABLE) {
+    size_t stride = (size_t)1 << info->stride_log2;
+    size_t num_entries = (info->num_buckets + stride - 1) / stride;
+    info->index = info->payload;
+    info->payload += (info->flags & VITEMAP_FLAG_WIDE ? 8 : 4) * num_entries;
+    if (info->flags & VITEMAP_FLAG_COUNTS) {
+      info->counts = info->payload;
+      info->payload += 8 * num_entries;
+    }
+  }
+}
 
-      result_size += (1 + BUCKET_SIZE_U8);
+// Skips the encoded buckets standing for the next `count` buckets, and returns
+// a pointer to the header of the following one. If it belongs to a run, the
+// header of the run is returned, and its position within the run is stored to
+// `run_offset` (which is 0 otherwise).
+static const uint8_t *skip_into_run(const uint8_t *ptr, size_t count,
+                                    size_t *run_offset) {
+  while (count > 0) {
+    uint32_t span = bucket_span(ptr);
+    if (span > count) {
+      break;
     }
+    ptr += 1 + (*ptr & 0x3F);
+    count -= span;
+  }
 
-    input += BUCKET_SIZE_U8;
+  *run_offset = count;
+  return ptr;
+}
+
+static const uint8_t *skip_buckets(const uint8_t *ptr, size_t count) {
+  size_t run_offset;
+  return skip_into_run(ptr, count, &run_offset);
+}
+
+// Returns a pointer to the header of the given bucket (or of its run, see
+// `skip_into_run`), using the index if available and skipping the remaining
+// bucket headers otherwise.
+static const uint8_t *seek_into_run(const StreamInfo *info, size_t bucket,
+                                    size_t *run_offset) {
+  if (info->index == NULL) {
+    return skip_into_run(info->payload, bucket, run_offset);
   }
 
-  return result_size;
+  return skip_into_run(
+      info->payload + index_offset(info, bucket >> info->stride_log2),
+      bucket & ((1U << info->stride_log2) - 1), run_offset);
+}
+
+static const uint8_t *seek_bucket(const StreamInfo *info, size_t bucket) {
+  size_t run_offset;
+  return seek_into_run(info, bucket, &run_offset);
 }
 
-void vitemap_extract_decompressed_sizes(uint8_t *compressed_data,
+void vitemap_extract_decompressed_sizes(const uint8_t *compressed_data,
                                         uint32_t *data_size,
                                         uint32_t *buffer_size) {
-  *data_size = *(uint32_t *)compressed_data;
+  *data_size = *(const uint32_t *)compressed_data;
+  if (*data_size == VITEMAP_EXTENDED_HEADER) {
+    *data_size = *(const uint32_t *)(compressed_data + 8);
+  }
   uint32_t full_buckets = *data_size / BUCKET_SIZE_U8;
   uint32_t remaining_bytes = *data_size % BUCKET_SIZE_U8;
   *buffer_size =
       (full_buckets + (remaining_bytes > 0 ? 1 : 0)) * BUCKET_SIZE_U8;
 }
 
-void vitemap_decompress(uint8_t *compressed_data, uint32_t size,
+void vitemap_extract_decompressed_sizes64(const uint8_t *compressed_data,
+                                          size_t *data_size,
+                                          size_t *buffer_size) {
+  StreamInfo info;
+  parse_stream(compressed_data, 0, &info);
+  *data_size = info.size;
+  *buffer_size = info.num_buckets * BUCKET_SIZE_U8;
+}
+
+void vitemap_decompress(const uint8_t *compressed_data, size_t size,
                         uint8_t *decompressed_data) {
-  const uint8_t *end = compressed_data + size;
-  compressed_data += 4;
+  INSTRUMENT_BEGIN();
+  StreamInfo info;
+  parse_stream(compressed_data, size, &info);
+  if (info.size >= streaming_threshold) {
+    kernels->decompress_streaming_buckets(info.payload, info.num_buckets,
+                                          decompressed_data);
+  } else {
+    kernels->decompress_buckets(info.payload, info.num_buckets,
+                                decompressed_data);
+  }
+  INSTRUMENT_END(false, compressed_data, size);
+}
+
+void vitemap_decompress_range(const uint8_t *compressed_data, size_t size,
+                              uint64_t lo, uint64_t hi,
+                              uint8_t *decompressed_data) {
+  StreamInfo info;
+  parse_stream(compressed_data, size, &info);
+  if (lo >= hi) {
+    return;
+  }
+
+  size_t first = lo / BUCKET_SIZE;
+  size_t end = (hi - 1) / BUCKET_SIZE + 1;
+  size_t run_offset;
+  const uint8_t *ptr = seek_into_run(&info, first, &run_offset);
+
+  // The covering buckets are decoded one index stride at a time, as runs never
+  // cross strides, and their words are shifted into place.
+  uint64_t words[VITEMAP_INDEX_STRIDE * BUCKET_SIZE_U64];
+  uint32_t shift = lo % 64;
+  size_t output_size = (hi - lo + 7) / 8;
+  size_t written = 0;
+  uint64_t previous = 0;
+  bool started = false;
+  for (size_t bucket = first; bucket < end;) {
+    size_t stride_end = (bucket / VITEMAP_INDEX_STRIDE + 1) *
+                        VITEMAP_INDEX_STRIDE;
+    size_t count = (stride_end < end ? stride_end : end) - bucket;
+    if (run_offset > 0) {
+      // Only the rest of the run is left in the first run.
+      size_t remaining = bucket_span(ptr) - run_offset;
+      count = remaining < count ? remaining : count;
+      run_offset = 0;
+    }
+    ptr = kernels->decompress_buckets(ptr, count, (uint8_t *)words);
 
-  while (compressed_data < end) {
-    uint8_t bucket_size = *compressed_data & 0x3F;
-    uint8_t category = *compressed_data >> 6;
-    compressed_data += 1;
+    size_t first_word = bucket == first ? lo % BUCKET_SIZE / 64 : 0;
+    for (size_t i = first_word; i < count * BUCKET_SIZE_U64; i++) {
+      if (started) {
+        uint64_t word = previous >> shift | (shift ? words[i] << (64 - shift)
+                                                   : 0);
+        size_t length = output_size - written < 8 ? output_size - written : 8;
+        memcpy(decompressed_data + written, &word, length);
+        written += length;
+      }
+      previous = words[i];
+      started = true;
+    }
+    bucket += count;
+  }
+
+  // The last output word only comes from the last covering word.
+  if (written < output_size) {
+    uint64_t word = previous >> shift;
+    memcpy(decompressed_data + written, &word, output_size - written);
+  }
+  if ((hi - lo) % 8 != 0) {
+    decompressed_data[output_size - 1] &= (1U << (hi - lo) % 8) - 1;
+  }
+}
 
-    switch (category) {
-    case 0:
-      expand_and_scatter_256(compressed_data, bucket_size, decompressed_data);
+// Encodes `size` bytes of input to `ptr`, as the buckets of a stream starting
+// at the `bucket`-th, and returns a pointer past them. Index entries are
+// written for the strides starting there, and a trailing partial bucket is
+// zero-padded. With runs, `bucket` must be a multiple of VITEMAP_INDEX_STRIDE.
+static uint8_t *encode_at(const uint8_t *input, size_t size, size_t bucket,
+                          uint8_t *ptr, uint8_t *payload, uint8_t *index,
+                          uint32_t flags, uint8_t *helper_bucket) {
+  bool runs = flags & VITEMAP_FLAG_RUNS;
+  bool wide = flags & VITEMAP_FLAG_WIDE;
+  size_t num_full = size / BUCKET_SIZE_U8;
+  size_t tail_size = size % BUCKET_SIZE_U8;
+
+  for (size_t end = bucket + num_full; bucket < end + (tail_size > 0);) {
+    if (index != NULL && bucket % VITEMAP_INDEX_STRIDE == 0) {
+      set_index(index, wide, bucket / VITEMAP_INDEX_STRIDE, ptr - payload);
+    }
+    if (bucket == end) {
+      ptr += kernels->compress_partial_bucket(input, tail_size, ptr,
+                                              helper_bucket);
       break;
-    case 1:
-      expand_and_scatter_256(compressed_data, bucket_size, decompressed_data);
-      // Unrestricted version of invert_256.
-      __m256i src_vec = _mm256_loadu_si256((__m256i *)decompressed_data);
-      __m256i all_ones = _mm256_set1_epi8((char)0xFFU);
-      __m256i inverted = _mm256_xor_si256(src_vec, all_ones);
-      _mm256_storeu_si256((__m256i *)decompressed_data, inverted);
+    }
+
+    size_t count = VITEMAP_INDEX_STRIDE - bucket % VITEMAP_INDEX_STRIDE;
+    count = end - bucket < count ? end - bucket : count;
+    ptr += kernels->compress_buckets(input, count, runs, ptr, helper_bucket);
+    input += count * BUCKET_SIZE_U8;
+    bucket += count;
+  }
+  return ptr;
+}
+
+size_t vitemap_append(uint8_t *compressed_data, size_t size, size_t capacity,
+                      const uint8_t *data, size_t data_size) {
+  StreamInfo info;
+  parse_stream(compressed_data, size, &info);
+  size_t new_size = info.size + data_size;
+  uint32_t flags = info.flags;
+  if (stream_flags(new_size, flags) != flags) {
+    return 0;
+  }
+
+  // Encoding resumes at the partial bucket, or at the start of its stride
+  // with runs, which may then grow. Runs never cross strides, so that the
+  // preceding buckets are final.
+  size_t restart = info.size / BUCKET_SIZE_U8;
+  if (flags & VITEMAP_FLAG_RUNS) {
+    restart -= restart % VITEMAP_INDEX_STRIDE;
+  }
+  const uint8_t *restart_ptr =
+      restart < info.num_buckets ? seek_bucket(&info, restart) : info.end;
+  size_t prefix_size = restart_ptr - info.payload;
+  size_t new_offset = payload_offset(new_size, flags);
+  size_t new_buckets =
+      new_size / BUCKET_SIZE_U8 + (new_size % BUCKET_SIZE_U8 > 0);
+  if (capacity < new_offset + prefix_size +
+                     (new_buckets - restart) * (1 + BUCKET_SIZE_U8) +
+                     COMPRESS_BUCKET_OVERRUN) {
+    return 0;
+  }
+
+  // The restarted buckets are decoded, and completed with new data up to the
+  // end of their stride.
+  uint8_t head[VITEMAP_INDEX_STRIDE * BUCKET_SIZE_U8];
+  uint8_t helper_bucket[BUCKET_SIZE_U8];
+  size_t old_size = info.size - restart * BUCKET_SIZE_U8;
+  size_t stride_end =
+      (restart / VITEMAP_INDEX_STRIDE + 1) * VITEMAP_INDEX_STRIDE;
+  size_t head_size =
+      (new_size < stride_end * BUCKET_SIZE_U8 ? new_size
+                                              : stride_end * BUCKET_SIZE_U8) -
+      restart * BUCKET_SIZE_U8;
+  kernels->decompress_buckets(info.payload + prefix_size,
+                              info.num_buckets - restart, head);
+  size_t copied = head_size - old_size;
+  memcpy(head + old_size, data, copied);
+
+  // New index entries and counts push the encoded buckets forward.
+  size_t new_entries =
+      (new_buckets + VITEMAP_INDEX_STRIDE - 1) / VITEMAP_INDEX_STRIDE;
+  if (new_offset != (size_t)(info.payload - compressed_data)) {
+    memmove(compressed_data + new_offset, info.payload, prefix_size);
+    if (info.counts != NULL) {
+      size_t old_entries = (info.payload - info.counts) / 8;
+      memmove(compressed_data + new_offset - 8 * new_entries, info.counts,
+              8 * old_entries);
+    }
+  }
+
+  uint8_t *index;
+  uint8_t *payload = write_header(compressed_data, new_size, flags, &index);
+  uint8_t *ptr = encode_at(head, head_size, restart, payload + prefix_size,
+                           payload, index, flags, helper_bucket);
+  ptr = encode_at(data + copied, data_size - copied, stride_end, ptr, payload,
+                  index, flags, helper_bucket);
+
+  write_counts_from(compressed_data, ptr - compressed_data,
+                    restart / VITEMAP_INDEX_STRIDE);
+  return ptr - compressed_data;
+}
+
+// Checks that the header, index and counts of a stream fit in `size` bytes
+// and are supported, and then resolves its layout.
+static VitemapStatus check_header(const uint8_t *compressed_data, size_t size,
+                                  StreamInfo *info) {
+  if (size < VITEMAP_LEGACY_HEADER_SIZE) {
+    return VITEMAP_ERROR_HEADER;
+  }
+
+  size_t header_size = VITEMAP_LEGACY_HEADER_SIZE;
+  if (*(const uint32_t *)compressed_data == VITEMAP_EXTENDED_HEADER) {
+    uint32_t known = VITEMAP_FLAG_SEEKABLE | VITEMAP_FLAG_COUNTS |
+                     VITEMAP_FLAG_RUNS | VITEMAP_FLAG_WIDE;
+    if (size < VITEMAP_EXTENDED_HEADER_SIZE) {
+      return VITEMAP_ERROR_HEADER;
+    }
+    uint8_t flags = compressed_data[5];
+    header_size = flags & VITEMAP_FLAG_WIDE ? VITEMAP_WIDE_HEADER_SIZE
+                                            : VITEMAP_EXTENDED_HEADER_SIZE;
+    if (compressed_data[4] != VITEMAP_VERSION || (flags & ~known) != 0 ||
+        ((flags & VITEMAP_FLAG_COUNTS) && !(flags & VITEMAP_FLAG_SEEKABLE)) ||
+        compressed_data[6] != VITEMAP_INDEX_STRIDE_LOG2 ||
+        compressed_data[7] != 0 || size < header_size) {
+      return VITEMAP_ERROR_HEADER;
+    }
+  }
+
+  parse_stream(compressed_data, size, info);
+  size_t num_entries =
+      (info->num_buckets + VITEMAP_INDEX_STRIDE - 1) / VITEMAP_INDEX_STRIDE;
+  size_t index_entry_size = info->flags & VITEMAP_FLAG_WIDE ? 8 : 4;
+  size_t entry_size =
+      (info->flags & VITEMAP_FLAG_SEEKABLE ? index_entry_size : 0) +
+      (info->flags & VITEMAP_FLAG_COUNTS ? 8 : 0);
+  // Also rules out sizes whose buffer size would overflow.
+  if (info->size > SIZE_MAX - BUCKET_SIZE_U8 ||
+      (entry_size > 0 && num_entries > (size - header_size) / entry_size)) {
+    return VITEMAP_ERROR_HEADER;
+  }
+  return VITEMAP_OK;
+}
+
+VitemapStatus vitemap_decompress_checked(const uint8_t *compressed_data,
+                                         size_t size,
+                                         uint8_t *decompressed_data,
+                                         size_t capacity) {
+  StreamInfo info;
+  VitemapStatus status = check_header(compressed_data, size, &info);
+  if (status != VITEMAP_OK) {
+    return status;
+  }
+  if (capacity / BUCKET_SIZE_U8 < info.num_buckets) {
+    return VITEMAP_ERROR_CAPACITY;
+  }
+
+  const uint8_t *end = kernels->decompress_checked_buckets(
+      info.payload, info.end, info.num_buckets, decompressed_data);
+  return end == info.end ? VITEMAP_OK : VITEMAP_ERROR_BUCKETS;
+}
+
+VitemapStatus vitemap_validate(const uint8_t *compressed_data, size_t size) {
+  StreamInfo info;
+  VitemapStatus status = check_header(compressed_data, size, &info);
+  if (status != VITEMAP_OK) {
+    return status;
+  }
+
+  // Every index entry starts a bucket, runs never crossing index strides.
+  const uint8_t *ptr = info.payload;
+  const uint8_t *stride_start = ptr;
+  uint64_t count = 0;
+  for (size_t bucket = 0; bucket < info.num_buckets;) {
+    if (info.index != NULL && bucket % VITEMAP_INDEX_STRIDE == 0) {
+      size_t entry = bucket / VITEMAP_INDEX_STRIDE;
+      if (info.counts != NULL && entry > 0) {
+        kernels->count_buckets(stride_start, VITEMAP_INDEX_STRIDE, &count);
+      }
+      if (index_offset(&info, entry) != (size_t)(ptr - info.payload) ||
+          (info.counts != NULL && indexed_count(&info, entry) != count)) {
+        return VITEMAP_ERROR_INDEX;
+      }
+      stride_start = ptr;
+    }
+
+    size_t span = checked_span(ptr, info.end, bucket, info.num_buckets);
+    if (span == 0) {
+      return VITEMAP_ERROR_BUCKETS;
+    }
+
+    // Queries rely on sorted arrays, without duplicates.
+    for (size_t i = 1; *ptr >> 6 < 2 && i < (*ptr & 0x3Fu); i++) {
+      if (ptr[i] >= ptr[i + 1]) {
+        return VITEMAP_ERROR_BUCKETS;
+      }
+    }
+    ptr += 1 + (*ptr & 0x3F);
+    bucket += span;
+  }
+
+  return ptr == info.end ? VITEMAP_OK : VITEMAP_ERROR_BUCKETS;
+}
+
+VitemapStatus vitemap_view_init(VitemapView *view,
+                                const uint8_t *compressed_data, size_t size) {
+  VitemapStatus status = vitemap_validate(compressed_data, size);
+  if (status != VITEMAP_OK) {
+    return status;
+  }
+
+  StreamInfo info;
+  parse_stream(compressed_data, size, &info);
+  *view = (VitemapView){.data = compressed_data,
+                        .size = size,
+                        .bitmap_size = info.size,
+                        .buffer_size = info.num_buckets * BUCKET_SIZE_U8,
+                        .flags = info.flags};
+  return VITEMAP_OK;
+}
+
+void vitemap_get_bucket(const uint8_t *compressed_data, size_t size,
+                        size_t bucket, uint8_t *decompressed_bucket) {
+  StreamInfo info;
+  parse_stream(compressed_data, size, &info);
+  kernels->decompress_buckets(seek_bucket(&info, bucket), 1,
+                              decompressed_bucket);
+}
+
+bool vitemap_test_bit(const uint8_t *compressed_data, size_t size,
+                      uint64_t bit) {
+  StreamInfo info;
+  parse_stream(compressed_data, size, &info);
+  if (bit >= (uint64_t)info.size * 8) {
+    return false;
+  }
+
+  const uint8_t *ptr = seek_bucket(&info, bit / BUCKET_SIZE);
+  uint8_t bucket_size = *ptr & 0x3F;
+  uint8_t category = *ptr >> 6;
+  uint8_t target = bit % BUCKET_SIZE;
+  ptr += 1;
+
+  if (category == 2) {
+    return (ptr[target / 8] >> (target % 8)) & 1;
+  } else if (category == 3) {
+    return *ptr & RUN_FULL;
+  }
+
+  // Array payloads are sorted, so the scan can stop at the first index that
+  // is not smaller than the target.
+  bool found = false;
+  for (uint8_t i = 0; i < bucket_size && ptr[i] <= target; i++) {
+    found = ptr[i] == target;
+  }
+
+  return found != (category == 1);
+}
+
+// Decodes a single bucket into 64-bit words.
+static void decode_words(const uint8_t *ptr, uint64_t *words) {
+  uint8_t bucket[BUCKET_SIZE_U8];
+  kernels->decompress_buckets(ptr, 1, bucket);
+  memcpy(words, bucket, BUCKET_SIZE_U8);
+}
+
+uint64_t vitemap_cardinality(const uint8_t *compressed_data, size_t size) {
+  return vitemap_rank(compressed_data, size, UINT64_MAX);
+}
+
+uint64_t vitemap_rank(const uint8_t *compressed_data, size_t size,
+                      uint64_t bit) {
+  StreamInfo info;
+  parse_stream(compressed_data, size, &info);
+  if (bit > (uint64_t)info.num_buckets * BUCKET_SIZE) {
+    bit = (uint64_t)info.num_buckets * BUCKET_SIZE;
+  }
+
+  size_t bucket = bit / BUCKET_SIZE;
+  size_t first = 0;
+  uint64_t rank = 0;
+  const uint8_t *ptr = info.payload;
+  if (info.counts != NULL && bucket > 0) {
+    // Past the last bucket, start from the last indexed one.
+    size_t last = bucket < info.num_buckets ? bucket : bucket - 1;
+    size_t entry = last >> info.stride_log2;
+    first = entry << info.stride_log2;
+    rank = indexed_count(&info, entry);
+    ptr += index_offset(&info, entry);
+  }
+  kernels->count_buckets(ptr, bucket - first, &rank);
+
+  // Partial count within the bucket of the bit.
+  uint32_t offset = bit % BUCKET_SIZE;
+  if (offset > 0) {
+    uint64_t words[BUCKET_SIZE_U64];
+    decode_words(seek_bucket(&info, bucket), words);
+    for (uint32_t i = 0; i < offset / 64; i++) {
+      rank += __builtin_popcountll(words[i]);
+    }
+    if (offset % 64 > 0) {
+      rank += __builtin_popcountll(words[offset / 64] &
+                                   ((1ULL << (offset % 64)) - 1));
+    }
+  }
+
+  return rank;
+}
+
+bool vitemap_select(const uint8_t *compressed_data, size_t size,
+                    uint64_t rank, uint64_t *bit) {
+  StreamInfo info;
+  parse_stream(compressed_data, size, &info);
+
+  size_t bucket = 0;
+  uint64_t before = 0;
+  const uint8_t *ptr = info.payload;
+  if (info.counts != NULL && info.num_buckets > 0) {
+    // Last indexed bucket with at most `rank` set bits before it.
+    size_t low = 0;
+    size_t high = (info.num_buckets - 1) >> info.stride_log2;
+    while (low < high) {
+      size_t middle = low + (high - low + 1) / 2;
+      if (indexed_count(&info, middle) <= rank) {
+        low = middle;
+      } else {
+        high = middle - 1;
+      }
+    }
+    bucket = low << info.stride_log2;
+    before = indexed_count(&info, low);
+    ptr += index_offset(&info, low);
+  }
+
+  while (bucket < info.num_buckets) {
+    uint32_t span = bucket_span(ptr);
+    uint64_t count = before;
+    const uint8_t *next = kernels->count_buckets(ptr, span, &count);
+    if (count > rank) {
       break;
-    case 2:
-      memcpy(decompressed_data, compressed_data, BUCKET_SIZE_U8);
+    }
+    before = count;
+    ptr = next;
+    bucket += span;
+  }
+  if (bucket >= info.num_buckets) {
+    return false;
+  }
+
+  // Within a run of full buckets, every bucket holds exactly 256 set bits.
+  uint64_t skipped = (rank - before) / BUCKET_SIZE;
+  bucket += skipped;
+  before += skipped * BUCKET_SIZE;
+
+  uint64_t words[BUCKET_SIZE_U64];
+  decode_words(ptr, words);
+  uint64_t remaining = rank - before;
+  for (uint32_t i = 0; i < BUCKET_SIZE_U64; i++) {
+    uint64_t count = __builtin_popcountll(words[i]);
+    if (remaining < count) {
+      uint64_t word = words[i];
+      for (; remaining > 0; remaining--) {
+        word &= word - 1;
+      }
+      *bit = (uint64_t)bucket * BUCKET_SIZE + i * 64 + __builtin_ctzll(word);
+      return true;
+    }
+    remaining -= count;
+  }
+
+  return false; // Unreachable with a consistent stream.
+}
+
+uint64_t vitemap_to_positions(const uint8_t *compressed_data, size_t size,
+                              uint32_t *positions) {
+  StreamInfo info;
+  parse_stream(compressed_data, size, &info);
+  return kernels->extract_positions(info.payload, info.num_buckets, 0,
+                                    positions);
+}
+
+bool vitemap_aggregate(const uint8_t *compressed_data, size_t size,
+                       const void *column, VitemapColumnType type,
+                       uint64_t num_values, VitemapAggregate *result) {
+  *result = (VitemapAggregate){.int_min = INT64_MAX,
+                               .int_max = INT64_MIN,
+                               .min = INFINITY,
+                               .max = -INFINITY};
+  if ((unsigned)type > VITEMAP_COLUMN_DOUBLE) {
+    return false;
+  }
+
+  StreamInfo info;
+  parse_stream(compressed_data, size, &info);
+  kernels->aggregate_buckets(info.payload, info.num_buckets, column, type,
+                             num_values, result);
+  return true;
+}
+
+// Returns the current bucket of a stream and moves to the next one. Buckets of
+// runs are returned one at a time, as equivalent empty or full arrays, with
+// `run_offset` tracking the position within the run.
+static const uint8_t *next_bucket(const uint8_t **ptr, uint32_t *run_offset) {
+  static const uint8_t empty_bucket = 0;
+  static const uint8_t full_bucket = 0b01000000;
+
+  const uint8_t *bucket = *ptr;
+  if (*bucket >> 6 != 3) {
+    *ptr += 1 + (*bucket & 0x3F);
+    return bucket;
+  }
+
+  if (++*run_offset == bucket_span(bucket)) {
+    *run_offset = 0;
+    *ptr += 2;
+  }
+  return bucket[1] & RUN_FULL ? &full_bucket : &empty_bucket;
+}
+
+// Merges the bucket just encoded at `output` into the empty or full buckets
+// right before it, tracked by `run`, and returns the number of bytes the
+// output grows by. Runs are started from two identical buckets, so that the
+// result matches the encoding of `compress_buckets`.
+static size_t append_run(uint8_t *output, size_t written, uint8_t **run,
+                         size_t bucket) {
+  bool uniform = written == 1 && (*output == 0 || *output == 0b01000000);
+  if (!uniform) {
+    *run = NULL;
+    return written;
+  }
+
+  uint8_t fill = *output ? RUN_FULL : 0;
+  if (*run == NULL || bucket % VITEMAP_INDEX_STRIDE == 0) {
+    *run = output;
+  } else if (**run != RUN_HEADER && **run == *output) {
+    (*run)[0] = RUN_HEADER;
+    (*run)[1] = fill | 1;
+  } else if (**run == RUN_HEADER && ((*run)[1] & RUN_FULL) == fill) {
+    (*run)[1]++;
+    return 0;
+  } else {
+    *run = output;
+  }
+  return 1;
+}
+
+// Writes the result of `op` on a and b to output, in the format of `flags`,
+// and returns its compressed size.
+static size_t operate_into(VitemapOperation op, const uint8_t *a,
+                           size_t a_size, const uint8_t *b, size_t b_size,
+                           uint8_t *output_data, uint32_t flags,
+                           uint8_t *helper_bucket) {
+  // Missing trailing buckets of the shorter operand are read as empty.
+  static const uint8_t empty_bucket = 0;
+
+  StreamInfo info_a, info_b;
+  parse_stream(a, a_size, &info_a);
+  parse_stream(b, b_size, &info_b);
+
+  size_t size = info_a.size > info_b.size ? info_a.size : info_b.size;
+  size_t num_buckets = info_a.num_buckets > info_b.num_buckets
+                           ? info_a.num_buckets
+                           : info_b.num_buckets;
+
+  flags = stream_flags(size, flags);
+  bool wide = flags & VITEMAP_FLAG_WIDE;
+  uint8_t *index;
+  uint8_t *payload = write_header(output_data, size, flags, &index);
+  uint8_t *output = payload;
+  const uint8_t *ptr_a = info_a.payload;
+  const uint8_t *ptr_b = info_b.payload;
+  uint32_t run_a = 0, run_b = 0;
+  uint8_t *run = NULL;
+
+  for (size_t bucket = 0; bucket < num_buckets; bucket++) {
+    if (index != NULL && bucket % VITEMAP_INDEX_STRIDE == 0) {
+      set_index(index, wide, bucket / VITEMAP_INDEX_STRIDE, output - payload);
+    }
+
+    const uint8_t *bucket_a = bucket < info_a.num_buckets
+                                  ? next_bucket(&ptr_a, &run_a)
+                                  : &empty_bucket;
+    const uint8_t *bucket_b = bucket < info_b.num_buckets
+                                  ? next_bucket(&ptr_b, &run_b)
+                                  : &empty_bucket;
+    size_t written = kernels->operate_bucket(op, bucket_a, bucket_b, output,
+                                             helper_bucket);
+
+    // The partial bucket is never part of a run.
+    bool full = (bucket + 1) * BUCKET_SIZE_U8 <= size;
+    if ((flags & VITEMAP_FLAG_RUNS) && full) {
+      written = append_run(output, written, &run, bucket);
+    }
+    output += written;
+  }
+
+  write_counts(output_data, output - output_data);
+  return output - output_data;
+}
+
+size_t vitemap_operate(Vitemap *vm, VitemapOperation op, const uint8_t *a,
+                       size_t a_size, const uint8_t *b, size_t b_size) {
+  vm->output_size = operate_into(op, a, a_size, b, b_size, vm->output,
+                                 vm->flags, vm->helper_bucket);
+  return vm->output_size;
+}
+
+size_t vitemap_operate_buffer(VitemapOperation op, const uint8_t *a,
+                              size_t a_size, const uint8_t *b, size_t b_size,
+                              uint8_t *output, uint32_t flags) {
+  uint8_t helper_bucket[BUCKET_SIZE_U8];
+  return operate_into(op, a, a_size, b, b_size, output, flags, helper_bucket);
+}
+
+bool vitemap_check_expression(const VitemapExpression *expr) {
+  if (expr->num_inputs > VITEMAP_MAX_EXPRESSION_INPUTS) {
+    return false;
+  }
+  size_t depth = 0;
+  for (size_t i = 0; i < expr->num_steps; i++) {
+    const VitemapStep *step = &expr->steps[i];
+    switch (step->type) {
+    case VITEMAP_STEP_INPUT:
+      if (step->input >= expr->num_inputs ||
+          depth == VITEMAP_MAX_EXPRESSION_DEPTH) {
+        return false;
+      }
+      depth++;
       break;
+    case VITEMAP_STEP_NOT:
+      if (depth == 0) {
+        return false;
+      }
+      break;
+    case VITEMAP_STEP_APPLY:
+      if (depth < 2 || step->op > VITEMAP_ANDNOT) {
+        return false;
+      }
+      depth--;
+      break;
+    default:
+      return false;
     }
+  }
+  return depth == 1;
+}
 
-    compressed_data += bucket_size;
-    decompressed_data += BUCKET_SIZE_U8;
+// Position of the walk through one input of an expression.
+typedef struct {
+  const uint8_t *ptr;  // Next encoded bucket
+  size_t num_buckets;  // Number of buckets of the input
+  uint32_t run_offset; // Position within the current run
+} InputCursor;
+
+// Starts walking the inputs of an expression, and returns the number of
+// buckets of the result, whose size is stored to `size`.
+static size_t open_inputs(const VitemapExpression *expr, InputCursor *cursors,
+                          size_t *size) {
+  size_t num_buckets = 0;
+  *size = 0;
+  for (size_t i = 0; i < expr->num_inputs; i++) {
+    StreamInfo info;
+    parse_stream(expr->inputs[i], expr->sizes[i], &info);
+    cursors[i] = (InputCursor){.ptr = info.payload,
+                               .num_buckets = info.num_buckets};
+    *size = info.size > *size ? info.size : *size;
+    num_buckets = info.num_buckets > num_buckets ? info.num_buckets
+                                                 : num_buckets;
   }
-}
\ No newline at end of file
+  return num_buckets;
+}
+
+// Returns the number of buckets, from `bucket` on, over which every input
+// repeats an empty or full bucket, either within a run or past its end. This
+// is 1 unless all inputs are within runs, and never includes the partial
+// bucket, the `num_full`-th.
+static size_t repeated_span(const InputCursor *cursors, size_t num_inputs,
+                            size_t bucket, size_t num_full) {
+  size_t span = bucket < num_full ? num_full - bucket : 1;
+  for (size_t i = 0; i < num_inputs && span > 1; i++) {
+    if (bucket >= cursors[i].num_buckets) {
+      continue;
+    }
+    if (*cursors[i].ptr >> 6 != 3) {
+      return 1;
+    }
+    size_t remaining = bucket_span(cursors[i].ptr) - cursors[i].run_offset;
+    span = remaining < span ? remaining : span;
+  }
+  return span;
+}
+
+// Moves every input `count` buckets forward from `bucket`, within the runs
+// found by `repeated_span`.
+static void skip_repeated(InputCursor *cursors, size_t num_inputs,
+                          size_t bucket, size_t count) {
+  for (size_t i = 0; i < num_inputs && count > 0; i++) {
+    if (bucket >= cursors[i].num_buckets) {
+      continue;
+    }
+    cursors[i].run_offset += count;
+    if (cursors[i].run_offset == bucket_span(cursors[i].ptr)) {
+      cursors[i].run_offset = 0;
+      cursors[i].ptr += 2;
+    }
+  }
+}
+
+// Encodes the result of an expression on the next bucket of its inputs, the
+// `bucket`-th of a result of `size` bytes, and returns the number of bytes
+// written to output (see `compress_buckets` for overruns).
+static size_t evaluate_next(const VitemapExpression *expr,
+                            InputCursor *cursors, size_t bucket, size_t size,
+                            uint8_t *output, uint8_t *helper_bucket) {
+  // Missing trailing buckets of shorter inputs are read as empty.
+  static const uint8_t empty_bucket = 0;
+
+  const uint8_t *buckets[VITEMAP_MAX_EXPRESSION_INPUTS];
+  for (size_t i = 0; i < expr->num_inputs; i++) {
+    buckets[i] = bucket < cursors[i].num_buckets
+                     ? next_bucket(&cursors[i].ptr, &cursors[i].run_offset)
+                     : &empty_bucket;
+  }
+  size_t written = kernels->evaluate_bucket(expr->steps, expr->num_steps,
+                                            buckets, output, helper_bucket);
+
+  // Complements set the padding bits of the partial bucket, which are cleared.
+  size_t tail_size = size - bucket * BUCKET_SIZE_U8;
+  if (tail_size < BUCKET_SIZE_U8) {
+    uint8_t decoded[BUCKET_SIZE_U8];
+    kernels->decompress_buckets(output, 1, decoded);
+    written = kernels->compress_partial_bucket(decoded, tail_size, output,
+                                               helper_bucket);
+  }
+  return written;
+}
+
+// Writes the result of `expr` to output, in the format of `flags`, and
+// returns its compressed size.
+static size_t evaluate_into(const VitemapExpression *expr,
+                            uint8_t *output_data, uint32_t flags,
+                            uint8_t *helper_bucket) {
+  InputCursor cursors[VITEMAP_MAX_EXPRESSION_INPUTS];
+  size_t size;
+  size_t num_buckets = open_inputs(expr, cursors, &size);
+
+  flags = stream_flags(size, flags);
+  bool wide = flags & VITEMAP_FLAG_WIDE;
+  uint8_t *index;
+  uint8_t *payload = write_header(output_data, size, flags, &index);
+  uint8_t *output = payload;
+  uint8_t *run = NULL;
+
+  // Stretches where all inputs are runs are only evaluated once.
+  for (size_t bucket = 0; bucket < num_buckets;) {
+    size_t first = bucket;
+    size_t span = repeated_span(cursors, expr->num_inputs, bucket,
+                                size / BUCKET_SIZE_U8);
+    uint8_t repeated = 0;
+    for (; bucket < first + span; bucket++) {
+      if (index != NULL && bucket % VITEMAP_INDEX_STRIDE == 0) {
+        set_index(index, wide, bucket / VITEMAP_INDEX_STRIDE,
+                  output - payload);
+      }
+
+      size_t written = 1;
+      if (bucket == first) {
+        written = evaluate_next(expr, cursors, bucket, size, output,
+                                helper_bucket);
+        repeated = *output;
+      } else {
+        *output = repeated;
+      }
+
+      // The partial bucket is never part of a run.
+      bool full = (bucket + 1) * BUCKET_SIZE_U8 <= size;
+      if ((flags & VITEMAP_FLAG_RUNS) && full) {
+        written = append_run(output, written, &run, bucket);
+      }
+      output += written;
+    }
+    skip_repeated(cursors, expr->num_inputs, first + 1, span - 1);
+  }
+
+  write_counts(output_data, output - output_data);
+  return output - output_data;
+}
+
+size_t vitemap_evaluate(Vitemap *vm, const VitemapExpression *expr) {
+  vm->output_size =
+      evaluate_into(expr, vm->output, vm->flags, vm->helper_bucket);
+  return vm->output_size;
+}
+
+size_t vitemap_evaluate_buffer(const VitemapExpression *expr, uint8_t *output,
+                               uint32_t flags) {
+  uint8_t helper_bucket[BUCKET_SIZE_U8];
+  return evaluate_into(expr, output, flags, helper_bucket);
+}
+
+uint64_t vitemap_evaluate_positions(const VitemapExpression *expr,
+                                    uint32_t *positions) {
+  InputCursor cursors[VITEMAP_MAX_EXPRESSION_INPUTS];
+  size_t size;
+  size_t num_buckets = open_inputs(expr, cursors, &size);
+
+  uint8_t encoded[1 + BUCKET_SIZE_U8 + COMPRESS_BUCKET_OVERRUN];
+  uint8_t helper_bucket[BUCKET_SIZE_U8];
+  uint64_t count = 0;
+  for (size_t bucket = 0; bucket < num_buckets;) {
+    size_t span = repeated_span(cursors, expr->num_inputs, bucket,
+                                size / BUCKET_SIZE_U8);
+    evaluate_next(expr, cursors, bucket, size, encoded, helper_bucket);
+    skip_repeated(cursors, expr->num_inputs, bucket + 1, span - 1);
+    for (size_t i = 0; i < span && *encoded != 0; i++) {
+      count += kernels->extract_positions(
+          encoded, 1, (bucket + i) * BUCKET_SIZE, positions + count);
+    }
+    bucket += span;
+  }
+  return count;
+}
+
+// Upper bound on the number of threads of the parallel functions, as the
+// per-thread state lives on the stack.
+#define MAX_THREADS 256
+
+// Work assigned to a single thread: a contiguous range of buckets, aligned on
+// the index stride so that every thread owns its index entries.
+typedef struct {
+  const uint8_t *input;      // First bucket of the raw bitmap (compression)
+  uint8_t *decompressed;     // First bucket of the raw bitmap (decompression)
+  uint8_t *output;           // First encoded bucket (compression)
+  const uint8_t *compressed; // First encoded bucket (decompression)
+  const uint8_t *end;        // End of the chunk's encoded range
+  uint8_t *payload;          // First encoded bucket of the whole stream
+  uint8_t *index;            // Bucket offset index (NULL if not seekable)
+  size_t first_bucket;       // First bucket of the chunk
+  size_t num_buckets;        // Number of buckets in the chunk
+  bool runs;                 // Whether to encode runs (compression)
+  bool wide;                 // Whether index entries are 64-bit
+  size_t output_size;        // Encoded size of the chunk
+  const VitemapSplit *split; // Split stream (split decompression)
+} ParallelTask;
+
+// Runs `func` on all tasks, with the calling thread handling the first one.
+// Falls back to running the remaining tasks inline if threads are unavailable.
+static void run_parallel(void *(*func)(void *), ParallelTask *tasks,
+                         unsigned num_tasks) {
+  pthread_t threads[num_tasks];
+  bool spawned[num_tasks];
+
+  for (unsigned i = 1; i < num_tasks; i++) {
+    spawned[i] = pthread_create(&threads[i], NULL, func, &tasks[i]) == 0;
+  }
+  func(&tasks[0]);
+  for (unsigned i = 1; i < num_tasks; i++) {
+    if (spawned[i]) {
+      pthread_join(threads[i], NULL);
+    } else {
+      func(&tasks[i]);
+    }
+  }
+}
+
+// Splits the buckets into at most `num_threads` stride-aligned chunks and
+// returns the number of chunks.
+static unsigned split_buckets(size_t num_buckets, unsigned num_threads,
+                              ParallelTask *tasks) {
+  size_t per_task = (num_buckets + num_threads - 1) / num_threads;
+  per_task = (per_task + VITEMAP_INDEX_STRIDE - 1) &
+             ~(size_t)(VITEMAP_INDEX_STRIDE - 1);
+
+  unsigned num_tasks = 0;
+  for (size_t first = 0; first < num_buckets; first += per_task) {
+    size_t remaining = num_buckets - first;
+    tasks[num_tasks] = (ParallelTask){
+        .first_bucket = first,
+        .num_buckets = remaining < per_task ? remaining : per_task,
+    };
+    num_tasks++;
+  }
+
+  return num_tasks;
+}
+
+static void *measure_task(void *arg) {
+  ParallelTask *task = arg;
+  task->output_size =
+      kernels->measure_buckets(task->input, task->num_buckets, task->runs);
+  return NULL;
+}
+
+static void *compress_task(void *arg) {
+  ParallelTask *task = arg;
+  const uint8_t *input = task->input;
+  uint8_t *output = task->output;
+  uint8_t helper_bucket[BUCKET_SIZE_U8];
+
+  // Chunks start on a stride boundary, so every stride starts an index entry.
+  for (size_t i = 0; i < task->num_buckets; i += VITEMAP_INDEX_STRIDE) {
+    size_t bucket = task->first_bucket + i;
+    size_t remaining = task->num_buckets - i;
+    size_t count =
+        remaining < VITEMAP_INDEX_STRIDE ? remaining : VITEMAP_INDEX_STRIDE;
+    if (task->index != NULL) {
+      set_index(task->index, task->wide, bucket / VITEMAP_INDEX_STRIDE,
+                output - task->payload);
+    }
+
+    // The SIMD stores overrun the encoded buckets, which must not spill into
+    // the (concurrently written) next chunk: the last strides are encoded
+    // aside first.
+    if ((size_t)(task->end - output) >=
+        count * (1 + BUCKET_SIZE_U8) + COMPRESS_BUCKET_OVERRUN) {
+      output += kernels->compress_buckets(input, count, task->runs, output,
+                                          helper_bucket);
+    } else {
+      uint8_t encoded[VITEMAP_INDEX_STRIDE * (1 + BUCKET_SIZE_U8) +
+                      COMPRESS_BUCKET_OVERRUN];
+      size_t written = kernels->compress_buckets(input, count, task->runs,
+                                                 encoded, helper_bucket);
+      memcpy(output, encoded, written);
+      output += written;
+    }
+    input += count * BUCKET_SIZE_U8;
+  }
+
+  return NULL;
+}
+
+static void *decompress_task(void *arg) {
+  ParallelTask *task = arg;
+  kernels->decompress_buckets(task->compressed, task->num_buckets,
+                              task->decompressed);
+  return NULL;
+}
+
+// Compresses `size` bytes of input into output with up to `num_threads`
+// threads, and returns the compressed size.
+static size_t compress_parallel_into(const uint8_t *input, size_t size,
+                                     uint8_t *output_data, uint32_t flags,
+                                     uint8_t *helper_bucket,
+                                     unsigned num_threads) {
+  size_t num_full = size / BUCKET_SIZE_U8;
+  size_t tail_size = size % BUCKET_SIZE_U8;
+  num_threads = num_threads < MAX_THREADS ? num_threads : MAX_THREADS;
+  if (num_threads <= 1 || num_full < 2 * VITEMAP_INDEX_STRIDE) {
+    return compress_into(input, NULL, size, output_data, flags,
+                         helper_bucket);
+  }
+
+  // Threads only handle full buckets, the partial one is appended at the end.
+  ParallelTask tasks[num_threads];
+  unsigned num_tasks = split_buckets(num_full, num_threads, tasks);
+  flags = stream_flags(size, flags);
+  for (unsigned i = 0; i < num_tasks; i++) {
+    tasks[i].input = input + tasks[i].first_bucket * BUCKET_SIZE_U8;
+    tasks[i].runs = flags & VITEMAP_FLAG_RUNS;
+    tasks[i].wide = flags & VITEMAP_FLAG_WIDE;
+  }
+
+  // First pass: the encoded size of every chunk gives its output offset.
+  run_parallel(measure_task, tasks, num_tasks);
+
+  // Second pass: chunks are encoded in place, right after each other.
+  uint8_t *index;
+  uint8_t *payload = write_header(output_data, size, flags, &index);
+  uint8_t *output = payload;
+  for (unsigned i = 0; i < num_tasks; i++) {
+    tasks[i].output = output;
+    tasks[i].end = output + tasks[i].output_size;
+    tasks[i].payload = payload;
+    tasks[i].index = index;
+    output += tasks[i].output_size;
+  }
+  run_parallel(compress_task, tasks, num_tasks);
+
+  if (tail_size > 0) {
+    if (index != NULL && num_full % VITEMAP_INDEX_STRIDE == 0) {
+      set_index(index, flags & VITEMAP_FLAG_WIDE,
+                num_full / VITEMAP_INDEX_STRIDE, output - payload);
+    }
+    output += kernels->compress_partial_bucket(
+        input + num_full * BUCKET_SIZE_U8, tail_size, output, helper_bucket);
+  }
+
+  write_counts(output_data, output - output_data);
+  return output - output_data;
+}
+
+size_t vitemap_compress_parallel(Vitemap *vm, size_t size,
+                                 unsigned num_threads) {
+  vm->output_size =
+      num_threads <= 1
+          ? vitemap_compress(vm, size)
+          : compress_parallel_into(vm->input, size, vm->output, vm->flags,
+                                   vm->helper_bucket, num_threads);
+  return vm->output_size;
+}
+
+size_t vitemap_compress_buffer_parallel(const uint8_t *input, size_t size,
+                                        uint8_t *output, uint32_t flags,
+                                        unsigned num_threads) {
+  uint8_t helper_bucket[BUCKET_SIZE_U8];
+  return compress_parallel_into(input, size, output, flags, helper_bucket,
+                                num_threads);
+}
+
+void vitemap_decompress_parallel(const uint8_t *compressed_data, size_t size,
+                                 uint8_t *decompressed_data,
+                                 unsigned num_threads) {
+  StreamInfo info;
+  parse_stream(compressed_data, size, &info);
+  num_threads = num_threads < MAX_THREADS ? num_threads : MAX_THREADS;
+  if (num_threads <= 1 || info.num_buckets < 2 * VITEMAP_INDEX_STRIDE) {
+    kernels->decompress_buckets(info.payload, info.num_buckets,
+                                decompressed_data);
+    return;
+  }
+
+  ParallelTask tasks[num_threads];
+  unsigned num_tasks = split_buckets(info.num_buckets, num_threads, tasks);
+
+  // Chunk entry points come from the index if available, and from a cheap
+  // header-only scan otherwise.
+  const uint8_t *ptr = info.payload;
+  size_t bucket = 0;
+  for (unsigned i = 0; i < num_tasks; i++) {
+    if (info.index != NULL) {
+      ptr = seek_bucket(&info, tasks[i].first_bucket);
+    } else {
+      ptr = skip_buckets(ptr, tasks[i].first_bucket - bucket);
+      bucket = tasks[i].first_bucket;
+    }
+    tasks[i].compressed = ptr;
+    tasks[i].decompressed =
+        decompressed_data + tasks[i].first_bucket * BUCKET_SIZE_U8;
+  }
+
+  run_parallel(decompress_task, tasks, num_tasks);
+}
+
+VitemapSplit *vitemap_split_create(const uint8_t *compressed_data,
+                                   size_t size) {
+  StreamInfo info;
+  parse_stream(compressed_data, size, &info);
+
+  // Runs have no payload, and are only expanded by the second pass.
+  size_t payload_size = 0;
+  const uint8_t *ptr = info.payload;
+  for (size_t bucket = 0; bucket < info.num_buckets;) {
+    if (*ptr >> 6 != 3) {
+      payload_size += *ptr & 0x3F;
+    }
+    bucket += bucket_span(ptr);
+    ptr += 1 + (*ptr & 0x3F);
+  }
+
+  // The offsets come first, right after the (8-byte aligned) structure.
+  size_t offsets_size = (info.num_buckets + 1) * sizeof(uint64_t);
+  VitemapSplit *split = malloc(sizeof(VitemapSplit) + offsets_size +
+                               info.num_buckets + payload_size +
+                               VITEMAP_SPLIT_PADDING);
+  if (split == NULL) {
+    return NULL;
+  }
+  split->size = info.size;
+  split->num_buckets = info.num_buckets;
+  split->flags = info.flags;
+  split->offsets = (uint64_t *)(split + 1);
+  split->headers = (uint8_t *)split->offsets + offsets_size;
+  split->payload = split->headers + info.num_buckets;
+
+  ptr = info.payload;
+  uint32_t run_offset = 0;
+  uint64_t offset = 0;
+  for (size_t bucket = 0; bucket < info.num_buckets; bucket++) {
+    const uint8_t *encoded = next_bucket(&ptr, &run_offset);
+    uint8_t bucket_size = *encoded & 0x3F;
+    split->headers[bucket] = *encoded;
+    split->offsets[bucket] = offset;
+    memcpy(split->payload + offset, encoded + 1, bucket_size);
+    offset += bucket_size;
+  }
+  split->offsets[info.num_buckets] = offset;
+  memset(split->payload + offset, 0, VITEMAP_SPLIT_PADDING);
+  return split;
+}
+
+void vitemap_split_delete(VitemapSplit *split) { free(split); }
+
+size_t vitemap_split_to_stream(const VitemapSplit *split, uint8_t *output,
+                               uint32_t flags) {
+  flags = stream_flags(split->size, flags);
+  bool wide = flags & VITEMAP_FLAG_WIDE;
+  uint8_t *index;
+  uint8_t *payload = write_header(output, split->size, flags, &index);
+  uint8_t *ptr = payload;
+  uint8_t *run = NULL;
+
+  for (size_t bucket = 0; bucket < split->num_buckets; bucket++) {
+    if (index != NULL && bucket % VITEMAP_INDEX_STRIDE == 0) {
+      set_index(index, wide, bucket / VITEMAP_INDEX_STRIDE, ptr - payload);
+    }
+
+    uint8_t bucket_size = split->headers[bucket] & 0x3F;
+    *ptr = split->headers[bucket];
+    memcpy(ptr + 1, split->payload + split->offsets[bucket], bucket_size);
+    size_t written = 1 + bucket_size;
+
+    // The partial bucket is never part of a run.
+    bool full = (bucket + 1) * BUCKET_SIZE_U8 <= split->size;
+    if ((flags & VITEMAP_FLAG_RUNS) && full) {
+      written = append_run(ptr, written, &run, bucket);
+    }
+    ptr += written;
+  }
+
+  write_counts(output, ptr - output);
+  return ptr - output;
+}
+
+static void *split_decompress_task(void *arg) {
+  ParallelTask *task = arg;
+  const VitemapSplit *split = task->split;
+  kernels->decompress_split_buckets(split->headers + task->first_bucket,
+                                    split->offsets + task->first_bucket,
+                                    split->payload, task->num_buckets,
+                                    task->decompressed);
+  return NULL;
+}
+
+void vitemap_split_decompress(const VitemapSplit *split,
+                              uint8_t *decompressed_data,
+                              unsigned num_threads) {
+  num_threads = num_threads < MAX_THREADS ? num_threads : MAX_THREADS;
+  if (num_threads <= 1 || split->num_buckets < 2 * VITEMAP_INDEX_STRIDE) {
+    kernels->decompress_split_buckets(split->headers, split->offsets,
+                                      split->payload, split->num_buckets,
+                                      decompressed_data);
+    return;
+  }
+
+  // No entry point to look up: every chunk starts at its own offsets.
+  ParallelTask tasks[num_threads];
+  unsigned num_tasks = split_buckets(split->num_buckets, num_threads, tasks);
+  for (unsigned i = 0; i < num_tasks; i++) {
+    tasks[i].split = split;
+    tasks[i].decompressed =
+        decompressed_data + tasks[i].first_bucket * BUCKET_SIZE_U8;
+  }
+
+  run_parallel(split_decompress_task, tasks, num_tasks);
+}
+
+// Writes all buffered encoded buckets to the sink.
+static void flush_stream(VitemapStream *stream) {
+  if (stream->buffer_size > 0 && !stream->failed) {
+    stream->failed = !stream->sink.write(stream->sink.ctx, stream->buffer,
+                                         stream->buffer_size);
+  }
+  stream->compressed_size += stream->buffer_size;
+  stream->buffer_size = 0;
+}
+
+// Encodes complete buckets into the buffer, flushing it whenever the next
+// batch may not fit.
+static void compress_stream(VitemapStream *stream, const uint8_t *input,
+                            size_t num_buckets) {
+  while (num_buckets > 0) {
+    size_t count = num_buckets < VITEMAP_STREAM_BATCH ? num_buckets
+                                                      : VITEMAP_STREAM_BATCH;
+    if (stream->buffer_size + count * (1 + BUCKET_SIZE_U8) +
+            COMPRESS_BUCKET_OVERRUN >
+        sizeof(stream->buffer)) {
+      flush_stream(stream);
+    }
+
+    stream->buffer_size +=
+        kernels->compress_buckets(input, count, false,
+                                  stream->buffer + stream->buffer_size,
+                                  stream->helper_bucket);
+    input += count * BUCKET_SIZE_U8;
+    num_buckets -= count;
+  }
+}
+
+VitemapStream *vitemap_stream_begin(VitemapSink sink) {
+  VitemapStream *stream = malloc(sizeof(VitemapStream));
+  if (stream == NULL) {
+    return NULL;
+  }
+
+  stream->sink = sink;
+  stream->size = 0;
+  stream->compressed_size = VITEMAP_LEGACY_HEADER_SIZE;
+  stream->failed = false;
+  stream->tail_size = 0;
+  stream->buffer_size = 0;
+
+  // Placeholder for the size header, patched once the stream is finished.
+  static const uint8_t header[VITEMAP_LEGACY_HEADER_SIZE] = {0};
+  if (!sink.write(sink.ctx, header, sizeof(header))) {
+    free(stream);
+    return NULL;
+  }
+
+  return stream;
+}
+
+bool vitemap_stream_push(VitemapStream *stream, const uint8_t *data,
+                         size_t size) {
+  if (stream->failed || size > VITEMAP_STREAM_MAX_SIZE - stream->size) {
+    stream->failed = true;
+    return false;
+  }
+  stream->size += size;
+
+  if (stream->tail_size > 0) {
+    size_t missing = BUCKET_SIZE_U8 - stream->tail_size;
+    size_t copied = size < missing ? size : missing;
+    memcpy(stream->tail + stream->tail_size, data, copied);
+    stream->tail_size += copied;
+    data += copied;
+    size -= copied;
+
+    if (stream->tail_size < BUCKET_SIZE_U8) {
+      return true;
+    }
+    compress_stream(stream, stream->tail, 1);
+    stream->tail_size = 0;
+  }
+
+  compress_stream(stream, data, size / BUCKET_SIZE_U8);
+  stream->tail_size = size % BUCKET_SIZE_U8;
+  memcpy(stream->tail, data + size - stream->tail_size, stream->tail_size);
+
+  return !stream->failed;
+}
+
+bool vitemap_stream_finish(VitemapStream *stream, uint32_t *compressed_size) {
+  if (stream->tail_size > 0) {
+    memset(stream->tail + stream->tail_size, 0,
+           BUCKET_SIZE_U8 - stream->tail_size);
+    compress_stream(stream, stream->tail, 1);
+  }
+  flush_stream(stream);
+
+  uint8_t header[VITEMAP_LEGACY_HEADER_SIZE];
+  memcpy(header, &stream->size, sizeof(header));
+  if (stream->sink.patch != NULL && !stream->failed) {
+    stream->failed = !stream->sink.patch(stream->sink.ctx, 0, header,
+                                         sizeof(header));
+  }
+
+  bool success = !stream->failed;
+  if (compressed_size != NULL) {
+    *compressed_size = stream->compressed_size;
+  }
+  free(stream);
+
+  return success;
+}
@@ -15,6 +15,7 @@
 #ifndef VITE_H
 #define VITE_H
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 
@@ -25,6 +26,151 @@
 #define BUCKET_SIZE_U32 8  // Number of uint32_t in a bucket (256 / 32)
 #define BUCKET_SIZE_U64 4  // Number of uint64_t in a bucket (256 / 64)
 
+// Stream format definitions
+//
+// A legacy stream starts with the 4-byte decompressed size, directly followed
+// by the encoded buckets. An extended stream starts with the reserved size
+// value `VITEMAP_EXTENDED_HEADER` (which can never be a valid legacy size, as
+// it does not fit a 32B-rounded buffer), followed by:
+//
+//   uint8_t  version      Format version (VITEMAP_VERSION)
+//   uint8_t  flags        Combination of VITEMAP_FLAG_* values
+//   uint8_t  stride_log2  log2 of the number of buckets per index entry
+//   uint8_t  reserved     Must be 0
+//   uint32_t size         Decompressed size in bytes (uint64_t if
+//                         VITEMAP_FLAG_WIDE)
+//   uint32_t index[]      Only if VITEMAP_FLAG_SEEKABLE: payload offset of
+//                         every `1 << stride_log2`-th bucket (uint64_t if
+//                         VITEMAP_FLAG_WIDE)
+//   uint64_t counts[]     Only if VITEMAP_FLAG_COUNTS: number of set bits
+//                         before every indexed bucket
+//
+// and then the encoded buckets, exactly as in the legacy format. Streams
+// written with VITEMAP_FLAG_RUNS may also contain run buckets (category 3),
+// each standing for up to `VITEMAP_INDEX_STRIDE` consecutive empty or full
+// buckets. Runs never cross a multiple of `VITEMAP_INDEX_STRIDE` buckets, and
+// never include the trailing partial bucket.
+//
+// Wide streams (VITEMAP_FLAG_WIDE) lift the 4 GiB limits of the 32-bit size
+// and offsets. They are written whenever a bitmap is too large for the other
+// formats, whatever the requested flags.
+#define VITEMAP_EXTENDED_HEADER 0xFFFFFFFFU // Size value marking an extension
+#define VITEMAP_VERSION 1                   // Current extended format version
+#define VITEMAP_LEGACY_HEADER_SIZE 4        // Size of the legacy header
+#define VITEMAP_EXTENDED_HEADER_SIZE 12     // Size of the extended header
+#define VITEMAP_WIDE_HEADER_SIZE 16         // Size of the wide header
+#define VITEMAP_INDEX_STRIDE_LOG2 6 // Buckets per index entry (64), as log2
+#define VITEMAP_INDEX_STRIDE (1U << VITEMAP_INDEX_STRIDE_LOG2)
+
+// Stream format flags
+#define VITEMAP_FLAG_SEEKABLE 0x01 // Write a sparse bucket offset index
+#define VITEMAP_FLAG_COUNTS 0x02   // Also write cumulative set bit counts
+#define VITEMAP_FLAG_RUNS 0x04     // Encode empty and full stretches as runs
+#define VITEMAP_FLAG_WIDE 0x08     // Use a 64-bit size and 64-bit offsets
+
+// Set operations between two compressed bitmaps
+typedef enum {
+  VITEMAP_AND,    // a & b
+  VITEMAP_OR,     // a | b
+  VITEMAP_XOR,    // a ^ b
+  VITEMAP_ANDNOT, // a & ~b
+} VitemapOperation;
+
+// Types of the columns aggregated by `vitemap_aggregate`
+typedef enum {
+  VITEMAP_COLUMN_INT32,  // int32_t values
+  VITEMAP_COLUMN_INT64,  // int64_t values
+  VITEMAP_COLUMN_FLOAT,  // float values
+  VITEMAP_COLUMN_DOUBLE, // double values
+} VitemapColumnType;
+
+// Aggregates of the values of a column selected by a bitmap. Integer columns
+// fill the int_* fields, and floating-point columns the other ones. Without
+// any selected value, minimums and maximums are left at INT64_MAX and
+// INT64_MIN, or +INFINITY and -INFINITY.
+typedef struct {
+  uint64_t count;  // Number of selected values
+  int64_t int_sum; // Sum of integer values, wrapping around on overflow
+  int64_t int_min;
+  int64_t int_max;
+  double sum; // Sum of floating-point values, in double precision
+  double min;
+  double max;
+} VitemapAggregate;
+
+// Maximum number of values pending on the stack of an expression
+#define VITEMAP_MAX_EXPRESSION_DEPTH 32
+
+// Maximum number of inputs of an expression, whose walks live on the stack
+#define VITEMAP_MAX_EXPRESSION_INPUTS 256
+
+// Steps of a boolean expression, evaluated on a stack in postfix order
+typedef enum {
+  VITEMAP_STEP_INPUT, // Pushes the input bitmap `input`
+  VITEMAP_STEP_NOT,   // Complements the value on top of the stack
+  VITEMAP_STEP_APPLY, // Pops b, then a, and pushes `a op b`
+} VitemapStepType;
+
+typedef struct {
+  VitemapStepType type;
+  VitemapOperation op; // Operation applied (VITEMAP_STEP_APPLY)
+  uint32_t input;      // Index of the input pushed (VITEMAP_STEP_INPUT)
+} VitemapStep;
+
+// Boolean expression over compressed bitmaps. For instance, (A & B) | (C & ~D)
+// is written as the steps A, B, AND, C, D, NOT, AND, OR.
+typedef struct {
+  const VitemapStep *steps;
+  size_t num_steps;
+  const uint8_t *const *inputs; // Compressed input bitmaps
+  const size_t *sizes;          // Compressed sizes of the inputs
+  size_t num_inputs;
+} VitemapExpression;
+
+// Results of the validating decoder
+typedef enum {
+  VITEMAP_OK,             // Valid stream
+  VITEMAP_ERROR_HEADER,   // Truncated or unsupported stream header or index
+  VITEMAP_ERROR_BUCKETS,  // Invalid or truncated bucket, or trailing data
+  VITEMAP_ERROR_INDEX,    // Index or set bit counts not matching the buckets
+  VITEMAP_ERROR_CAPACITY, // Destination buffer too small
+} VitemapStatus;
+
+// Instruction sets with dedicated kernels
+typedef enum {
+  VITEMAP_ISA_SCALAR, // Portable fallback
+  VITEMAP_ISA_AVX2,   // AVX2, POPCNT and BMI1
+  VITEMAP_ISA_AVX512, // AVX-512 F, BW, VL, VPOPCNTDQ, VBMI, VBMI2, BITALG
+} VitemapIsa;
+
+// Alignment of all buffers allocated by the library
+#define VITEMAP_ALIGNMENT 64
+
+/**
+ * VitemapAllocator: Memory provider of a Vitemap, such as a pool or an arena.
+ *
+ * `allocate` returns `size` bytes aligned on `alignment` (a power of two), or
+ * NULL on failure, and `release` frees a block returned by `allocate`. Blocks
+ * need not be zero-filled.
+ */
+typedef struct {
+  void *(*allocate)(void *ctx, size_t size, size_t alignment);
+  void (*release)(void *ctx, void *ptr);
+  void *ctx; // Passed as is to both callbacks
+} VitemapAllocator;
+
+// Thread safety
+//
+// Functions taking compressed data as `const uint8_t *` only read it, and keep
+// no state between calls: any number of threads may decompress and query the
+// same data at once (e.g. a mapped file, see `VitemapView`) without
+// synchronization. So may the `_buffer` variants of the compression, set
+// operation and evaluation functions, which keep their scratch memory on the
+// stack. A Vitemap, VitemapBuilder or VitemapStream holds the scratch memory
+// and output of its own calls, and must only be used by one thread at a time:
+// reuse one per thread rather than sharing it. Only `vitemap_set_isa` and
+// `vitemap_set_streaming_threshold` change global state.
+
 /**
  * Vitemap: The main structure for compression.
  *
@@ -32,18 +178,272 @@
  * data, as well as auxiliary buffers for optimization purposes.
  */
 typedef struct {
-  uint8_t *input; // Input bitmap data
-  uint32_t
-      max_size; // Maximum size of input (rounded up to nearest 32B multiple)
-  uint32_t num_buckets; // Number of buckets in the input bitmap
+  uint8_t *input;  // Input bitmap data
+  size_t max_size; // Maximum size of input (rounded up to nearest 32B multiple)
+  size_t num_buckets; // Number of buckets in the input bitmap
+
+  uint8_t *output;            // Compressed bitmap output
+  size_t max_compressed_size; // Maximum size of output (worst-case scenario)
+  size_t output_size; // Actual size of compressed data after compression
 
-  uint8_t *output;              // Compressed bitmap output
-  uint32_t max_compressed_size; // Maximum size of output (worst-case scenario)
-  uint32_t output_size; // Actual size of compressed data after compression
+  uint32_t flags; // Stream format flags (VITEMAP_FLAG_*), legacy format if 0
 
   uint8_t *helper_bucket; // Auxiliary buffer for compression optimization
+
+  VitemapAllocator allocator; // Provider of all buffers
+  size_t input_capacity;      // Allocated size of input
+  size_t output_capacity;     // Allocated size of output
 } Vitemap;
 
+/**
+ * VitemapBuilder: Mutable bitmap keeping track of its set bits.
+ *
+ * Bits are set and cleared through `vitemap_set_bit` and `vitemap_clear_bit`,
+ * which maintain the number of set bits of every bucket, so that compressing
+ * skips the popcount of every bucket. The bitmap lives in vm->input: after
+ * modifying it directly, call `vitemap_builder_recount`.
+ */
+typedef struct {
+  Vitemap *vm;             // Bitmap and compression buffers
+  size_t size;             // Size of the bitmap in bytes
+  uint16_t *cardinalities; // Number of set bits of every bucket
+  uint64_t cardinality;    // Total number of set bits
+} VitemapBuilder;
+
+/**
+ * VitemapView: Read-only view of a validated compressed bitmap.
+ *
+ * A view is filled once by `vitemap_view_init`, and is never written to
+ * afterwards, nor is its data. It can then be shared by any number of reader
+ * threads, which pass `view->data` and `view->size` to the decompression and
+ * query functions: as the data was validated, these never read out of its
+ * bounds, even if it came from an untrusted file.
+ */
+typedef struct {
+  const uint8_t *data; // Compressed data, which must outlive the view
+  size_t size;         // Size of the compressed data
+  size_t bitmap_size;  // Size of the decompressed bitmap in bytes
+  size_t buffer_size;  // Size of its decompression buffer (32B multiple)
+  uint32_t flags;      // Stream format flags of the data (0 if legacy)
+} VitemapView;
+
+// Number of zero bytes after the payload of a split stream, so that the SIMD
+// loads of its last bucket stay within the allocation
+#define VITEMAP_SPLIT_PADDING 64
+
+/**
+ * VitemapSplit: Compressed bitmap in the split-stream layout.
+ *
+ * The encoded buckets of a stream are split into three arrays: the header of
+ * every bucket, the offset of every bucket in the payload (the prefix sum of
+ * the payload sizes of the headers), and the payloads of all buckets, back to
+ * back. Every bucket can then be decoded on its own, without walking the ones
+ * before it, e.g. by one GPU thread each (see vite_cuda.h). Runs are expanded
+ * into one empty (0x00) or full (0x40) header per bucket, without payload.
+ * All arrays live in the single allocation of `vitemap_split_create`.
+ */
+typedef struct {
+  size_t size;        // Size of the decompressed bitmap in bytes
+  size_t num_buckets; // Number of buckets, including the partial one
+  uint32_t flags;     // Stream format flags of the source (0 if legacy)
+  uint8_t *headers;   // Header of every bucket
+  uint64_t *offsets;  // Payload offset of every bucket, then the payload size
+  uint8_t *payload;   // Payloads, followed by VITEMAP_SPLIT_PADDING zeros
+} VitemapSplit;
+
+/**
+ * VitemapBatchInput: One bitmap of a batch compression.
+ */
+typedef struct {
+  const uint8_t *data; // Bitmap, of any length
+  uint32_t size;       // Size of the bitmap in bytes
+} VitemapBatchInput;
+
+// Number of buckets encoded at once by the streaming compressor
+#define VITEMAP_STREAM_BATCH 64
+
+// Largest input of the streaming compressor, whose compressed size (at most
+// 33 bytes per bucket after the size header) then always fits in 32 bits
+#define VITEMAP_STREAM_MAX_SIZE                                                \
+  ((UINT32_MAX - VITEMAP_LEGACY_HEADER_SIZE) / (1 + BUCKET_SIZE_U8) *          \
+   BUCKET_SIZE_U8)
+
+/**
+ * VitemapSink: Destination of the streaming compressor.
+ *
+ * Both callbacks return true on success. The compressed data is written in
+ * order through `write`. Once the stream is finished, `patch` rewrites the
+ * size header at the beginning of the output.
+ */
+typedef struct {
+  bool (*write)(void *ctx, const uint8_t *data, size_t size);
+  bool (*patch)(void *ctx, size_t offset, const uint8_t *data,
+                size_t size); // Optional, see `vitemap_stream_finish`
+  void *ctx;                  // Passed as is to both callbacks
+} VitemapSink;
+
+/**
+ * VitemapStream: Incremental compression context.
+ *
+ * Memory is bounded by one partial bucket and one batch of encoded buckets,
+ * however large the bitmap.
+ */
+typedef struct {
+  VitemapSink sink;
+  uint32_t size;                 // Number of bytes pushed so far
+  uint32_t compressed_size;      // Number of bytes written to the sink so far
+  bool failed;                   // Whether the sink failed or input overflowed
+  uint8_t tail[BUCKET_SIZE_U8];  // Partial trailing bucket
+  uint32_t tail_size;            // Number of bytes in the partial bucket
+  uint32_t buffer_size;          // Number of encoded bytes not yet flushed
+  uint8_t helper_bucket[BUCKET_SIZE_U8]; // Auxiliary buffer for compression
+  uint8_t buffer[VITEMAP_STREAM_BATCH * (1 + BUCKET_SIZE_U8) +
+                 2 * BUCKET_SIZE_U8 + 64]; // One batch, plus SIMD overruns
+} VitemapStream;
+
+// Container format definitions
+//
+// A container file holds many compressed bitmaps, each identified by a 64-bit
+// key. It starts with a header:
+//
+//   uint8_t  magic[8]           VITEMAP_CONTAINER_MAGIC
+//   uint32_t version            Format version (VITEMAP_CONTAINER_VERSION)
+//   uint32_t flags              Combination of VITEMAP_CONTAINER_* flags
+//
+// followed by the compressed bitmaps, each starting on a multiple of
+// VITEMAP_CONTAINER_ALIGNMENT bytes (zero padding in between). Then comes the
+// directory, a VitemapContainerEntry per bitmap sorted by increasing key and
+// also aligned, and finally a footer:
+//
+//   uint64_t directory_offset   Offset of the directory in the file
+//   uint64_t count              Number of directory entries
+//   uint32_t directory_checksum CRC-32C of the directory (or 0)
+//   uint32_t reserved           Must be 0
+//   uint8_t  magic[8]           VITEMAP_CONTAINER_MAGIC
+//
+// All fields are in native byte order, as in compressed streams.
+#define VITEMAP_CONTAINER_MAGIC "VITEMAPC"
+#define VITEMAP_CONTAINER_VERSION 1
+#define VITEMAP_CONTAINER_HEADER_SIZE 16
+#define VITEMAP_CONTAINER_FOOTER_SIZE 32
+#define VITEMAP_CONTAINER_ALIGNMENT 64
+
+// Container format flags
+#define VITEMAP_CONTAINER_CHECKSUMS 0x01 // Store the CRC-32C of every bitmap
+
+/**
+ * VitemapContainerEntry: Directory entry of one bitmap of a container.
+ */
+typedef struct {
+  uint64_t key;      // Key of the bitmap, unique in the container
+  uint64_t offset;   // Offset of the compressed bitmap in the file
+  uint32_t size;     // Size of the compressed bitmap in bytes
+  uint32_t checksum; // CRC-32C of the compressed bitmap (or 0)
+} VitemapContainerEntry;
+
+/**
+ * VitemapContainerWriter: Incremental writer of a container.
+ *
+ * Bitmaps are written through the sink as they are added, so that only the
+ * directory is kept in memory. The sink does not need a `patch` callback.
+ */
+typedef struct {
+  VitemapSink sink;
+  uint32_t flags;                 // Container format flags
+  uint64_t offset;                // Number of bytes written so far
+  VitemapContainerEntry *entries; // Directory, in insertion order
+  size_t count;                   // Number of bitmaps added
+  size_t capacity;                // Allocated directory entries
+  bool failed;                    // Whether the sink or an allocation failed
+} VitemapContainerWriter;
+
+/**
+ * VitemapContainer: Read-only view of a container.
+ *
+ * Bitmaps are returned as pointers into the mapped file, without any copy.
+ */
+typedef struct {
+  const uint8_t *data;                  // Whole container
+  size_t size;                          // Size of the container in bytes
+  uint32_t flags;                       // Container format flags
+  const VitemapContainerEntry *entries; // Directory, sorted by key
+  uint64_t count;                       // Number of bitmaps
+  bool mapped;                          // Whether data is owned and mapped
+} VitemapContainer;
+
+#ifdef VITEMAP_INSTRUMENTATION
+// Instrumentation
+//
+// Builds defining VITEMAP_INSTRUMENTATION (see `make instrumented`) measure
+// every call of `vitemap_compress`, `vitemap_compress_buffer` and
+// `vitemap_decompress` with hardware performance counters, and count the
+// buckets they encode or decode by category. Other builds contain none of it.
+
+/**
+ * VitemapCounters: Totals of the measured calls of one operation.
+ */
+typedef struct {
+  uint64_t calls;         // Number of measured calls
+  uint64_t bytes;         // Decompressed bytes processed
+  uint64_t buckets[4];    // Buckets by category (array, inverted, bitmap, run)
+  uint64_t cycles;        // CPU cycles
+  uint64_t instructions;  // Retired instructions
+  uint64_t branch_misses; // Mispredicted branches
+  uint64_t l1d_misses;    // L1 data cache read misses
+  uint64_t llc_misses;    // Last level cache misses
+} VitemapCounters;
+
+/**
+ * VitemapStats: Instrumentation statistics of the calling thread.
+ */
+typedef struct {
+  bool counters_available; // Whether the hardware counters could be opened
+  VitemapCounters compress;
+  VitemapCounters decompress;
+} VitemapStats;
+#endif
+
+/**
+ * Returns the instruction set of the kernels in use
+ *
+ * The best instruction set supported by the CPU is selected once at load
+ * time. All instruction sets produce byte-identical compressed data.
+ */
+VitemapIsa vitemap_get_isa(void);
+
+/**
+ * Forces the instruction set of the kernels in use
+ *
+ * @param isa Instruction set to use
+ * @return Whether the CPU supports the instruction set (unchanged otherwise)
+ *
+ * This function is meant for testing and benchmarking, and must not be called
+ * concurrently with any other function.
+ */
+bool vitemap_set_isa(VitemapIsa isa);
+
+/**
+ * Returns the bitmap size from which non-temporal stores are used
+ *
+ * Bitmaps of at least this many bytes are decompressed, and compressed, with
+ * non-temporal stores, which do not read the destination into the caches
+ * first, and the compressed data is prefetched ahead of decoding. This only
+ * pays off once the data no longer fits in the caches: the threshold is the
+ * size of the last level cache, read once at load time (32MB if unknown).
+ * Outputs are identical in both modes.
+ */
+size_t vitemap_get_streaming_threshold(void);
+
+/**
+ * Sets the bitmap size from which non-temporal stores are used
+ *
+ * @param size Threshold in bytes (0 to always use them, SIZE_MAX for never)
+ *
+ * This function is meant for testing and benchmarking, and must not be called
+ * concurrently with any other function.
+ */
+void vitemap_set_streaming_threshold(size_t size);
+
 /**
  * Creates a new Vitemap structure for usage and compression.
  *
@@ -51,9 +451,39 @@ typedef struct {
  * @return Initialized Vitemap structure
  *
  * The function allocates memory for input and output buffers, rounding up
- * the input size to the nearest multiple of 32 bytes.
+ * the input size to the nearest multiple of 32 bytes. The input bitmap starts
+ * with all bits cleared, while the output buffer is left uninitialized.
  */
-Vitemap *vitemap_create(uint32_t upper_size);
+Vitemap *vitemap_create(size_t upper_size);
+
+/**
+ * Creates a new Vitemap structure with buffers from a given allocator
+ *
+ * @param upper_size Maximum expected size of input bitmap
+ * @param allocator Provider of all buffers, or NULL for the default one
+ * @return Initialized Vitemap structure, or NULL on allocation failure
+ *
+ * Same as `vitemap_create`, except that only the padding of the input bitmap
+ * is cleared (see `vitemap_reset`). All buffers are aligned on
+ * VITEMAP_ALIGNMENT bytes. The allocator is copied, and used until
+ * `vitemap_delete`.
+ */
+Vitemap *vitemap_create_with_allocator(size_t upper_size,
+                                       const VitemapAllocator *allocator);
+
+/**
+ * Prepares a Vitemap structure for a bitmap of another size
+ *
+ * @param vm Pointer to the Vitemap structure
+ * @param upper_size Maximum expected size of the next input bitmap
+ * @return Whether the buffers could be grown (vm is unchanged otherwise)
+ *
+ * Buffers are reused whenever they are large enough, and reallocated without
+ * copying otherwise, so that recycling a Vitemap avoids the allocations and
+ * page faults of a new one. Only the padding of the input bitmap, past
+ * `upper_size`, is cleared: its other contents are unspecified.
+ */
+bool vitemap_reset(Vitemap *vm, size_t upper_size);
 
 /**
  * Frees all memory associated with a Vitemap structure
@@ -71,9 +501,164 @@ void vitemap_delete(Vitemap *vm);
  *
  * This function compresses the input bitmap stored in vm->input and writes
  * the compressed data to vm->output. The actual size of the compressed data
- * is stored in vm->output_size.
+ * is stored in vm->output_size. Bytes of vm->input past `size` are ignored.
+ *
+ * If vm->flags contains VITEMAP_FLAG_SEEKABLE, an extended stream carrying a
+ * bucket offset index is written instead, enabling random access through
+ * `vitemap_get_bucket` and `vitemap_test_bit`. VITEMAP_FLAG_COUNTS (which
+ * implies VITEMAP_FLAG_SEEKABLE) additionally stores the number of set bits
+ * before every indexed bucket, accelerating `vitemap_rank` and
+ * `vitemap_select`. VITEMAP_FLAG_RUNS encodes stretches of empty or full
+ * buckets as 2-byte runs, which shrinks very sparse (or very dense) bitmaps
+ * and speeds up both directions on them. VITEMAP_FLAG_WIDE forces a wide
+ * stream, which is otherwise only written for bitmaps of about 4 GiB or more.
+ */
+size_t vitemap_compress(Vitemap *vm, size_t size);
+
+/**
+ * Returns the output buffer size needed to compress a bitmap
+ *
+ * @param size Size of the bitmap in bytes
+ * @return Worst-case compressed size, plus the slack written past the end
+ *
+ * Covers all formats, including the wide one.
+ */
+size_t vitemap_max_compressed_size(size_t size);
+
+/**
+ * Compresses a bitmap straight from caller memory
+ *
+ * @param input Pointer to the bitmap, of any length
+ * @param size Size of the bitmap in bytes
+ * @param output Buffer of at least `vitemap_max_compressed_size(size)` bytes
+ * @param flags Stream format flags (see `vitemap_compress`)
+ * @return Size of the compressed data
+ *
+ * Produces the same stream as `vitemap_compress`, without staging the bitmap
+ * in vm->input. Only `size` bytes of input are read: the trailing partial
+ * bucket is loaded with a masked load and padded with zeros. The function is
+ * thread-safe, as it keeps no state between calls.
+ */
+size_t vitemap_compress_buffer(const uint8_t *input, size_t size,
+                               uint8_t *output, uint32_t flags);
+
+/**
+ * Appends bytes to the end of a compressed bitmap, in place
+ *
+ * @param compressed_data Pointer to the compressed data, updated in place
+ * @param size Size of the compressed data
+ * @param capacity Size of the buffer holding the compressed data
+ * @param data Pointer to the bytes to append
+ * @param data_size Number of bytes to append
+ * @return New size of the compressed data, or 0 if the buffer is too small or
+ * the stream would have to become wide
+ *
+ * The result is byte-identical to compressing the whole bitmap with the flags
+ * of the stream. Only the new bytes are encoded, along with the partial last
+ * bucket they complete (or, for streams with runs, the buckets of its index
+ * stride, so that runs may grow). The partial bucket is found through the
+ * index of seekable streams, and by skipping bucket headers otherwise. When
+ * the index of a seekable stream grows, the encoded buckets are moved
+ * forward. A buffer of `vitemap_max_compressed_size` of the new size always
+ * suffices. On failure, the compressed data is left unchanged.
+ */
+size_t vitemap_append(uint8_t *compressed_data, size_t size, size_t capacity,
+                      const uint8_t *data, size_t data_size);
+
+/**
+ * Returns the output arena size needed to compress a batch of bitmaps
+ *
+ * @param inputs Bitmaps to compress
+ * @param count Number of bitmaps
+ * @return Worst-case total compressed size, plus the slack written past the
+ * end
+ */
+size_t vitemap_max_batch_compressed_size(const VitemapBatchInput *inputs,
+                                         size_t count);
+
+/**
+ * Compresses many bitmaps back-to-back into a single arena
+ *
+ * @param inputs Bitmaps to compress
+ * @param count Number of bitmaps
+ * @param output Arena of at least `vitemap_max_batch_compressed_size` bytes
+ * @param[out] offsets Array of `count + 1` entries, receiving the offset of
+ * every compressed bitmap in output, followed by the total size
+ * @param flags Stream format flags (see `vitemap_compress`)
+ * @return Total size of the compressed data
+ *
+ * Bitmap i is compressed to the `offsets[i + 1] - offsets[i]` bytes at
+ * `output + offsets[i]`, exactly as by `vitemap_compress_buffer`. Nothing is
+ * allocated, so that batches of small bitmaps only pay for their encoding.
+ */
+size_t vitemap_compress_batch(const VitemapBatchInput *inputs, size_t count,
+                              uint8_t *output, size_t *offsets,
+                              uint32_t flags);
+
+/**
+ * Creates a VitemapBuilder, with all bits cleared
+ *
+ * @param size Size of the bitmap in bytes
+ * @return Initialized VitemapBuilder structure, or NULL on allocation failure
+ */
+VitemapBuilder *vitemap_builder_create(size_t size);
+
+/**
+ * Frees all memory associated with a VitemapBuilder structure
+ *
+ * @param builder Pointer to the VitemapBuilder structure to be deallocated
+ */
+void vitemap_builder_delete(VitemapBuilder *builder);
+
+/**
+ * Sets a single bit of a builder
+ *
+ * @param builder Pointer to the VitemapBuilder structure
+ * @param bit Position of the bit
+ * @return True if the bit was previously cleared, false if it was already set
+ *         or out of range
+ */
+bool vitemap_set_bit(VitemapBuilder *builder, uint64_t bit);
+
+/**
+ * Clears a single bit of a builder
+ *
+ * @param builder Pointer to the VitemapBuilder structure
+ * @param bit Position of the bit
+ * @return True if the bit was previously set, false if it was already cleared
+ *         or out of range
  */
-uint32_t vitemap_compress(Vitemap *vm, uint32_t size);
+bool vitemap_clear_bit(VitemapBuilder *builder, uint64_t bit);
+
+/**
+ * Recomputes the set bits of every bucket after vm->input was modified
+ * directly
+ *
+ * @param builder Pointer to the VitemapBuilder structure
+ *
+ * Bytes past `size` are cleared, as they are not part of the bitmap.
+ */
+void vitemap_builder_recount(VitemapBuilder *builder);
+
+/**
+ * Returns the number of set bits of a builder, in constant time
+ *
+ * @param builder Pointer to the VitemapBuilder structure
+ * @return Number of set bits
+ */
+uint64_t vitemap_builder_cardinality(const VitemapBuilder *builder);
+
+/**
+ * Compresses the bitmap of a builder
+ *
+ * @param builder Pointer to the VitemapBuilder structure
+ * @return Size of the compressed data
+ *
+ * Produces the same stream as `vitemap_compress(builder->vm, builder->size)`
+ * (including vm->flags), from the maintained bucket sizes rather than a
+ * popcount of every bucket. The compressed data is written to vm->output.
+ */
+size_t vitemap_builder_compress(VitemapBuilder *builder);
 
 /**
  * Extracts the uncompressed data size and buffer size to allocate from the
@@ -85,12 +670,27 @@ uint32_t vitemap_compress(Vitemap *vm, uint32_t size);
  *
  * This function extracts the size of the *decompressed* data (and associate
  * buffer size, rounding up to the nearest 32B) from the compressed Vitemap. The
- * size is stored in the first 4 bytes of the data.
+ * size is stored in the first 4 bytes of the data, or in the extended header.
+ * Wide streams may not fit: use `vitemap_extract_decompressed_sizes64`.
  */
-void vitemap_extract_decompressed_sizes(uint8_t *compressed_data,
+void vitemap_extract_decompressed_sizes(const uint8_t *compressed_data,
                                         uint32_t *data_size,
                                         uint32_t *buffer_size);
 
+/**
+ * Extracts the uncompressed data size and buffer size to allocate from the
+ * compressed data, for streams of any size
+ *
+ * @param compressed_data Pointer to the compressed data
+ * @param[out] data_size Pointer to the extracted data size
+ * @param[out] buffer_size Pointer to the extracted buffer size
+ *
+ * Same as `vitemap_extract_decompressed_sizes`, including for wide streams.
+ */
+void vitemap_extract_decompressed_sizes64(const uint8_t *compressed_data,
+                                          size_t *data_size,
+                                          size_t *buffer_size);
+
 /**
  * Decompresses the input bitmap
  *
@@ -104,7 +704,598 @@ void vitemap_extract_decompressed_sizes(uint8_t *compressed_data,
  * The size of the decompressed data buffer is assumed to be large enough, it
  * can be extracted using the function `vitemap_extract_decompressed_size`.
  */
-void vitemap_decompress(uint8_t *compressed_data, uint32_t size,
+void vitemap_decompress(const uint8_t *compressed_data, size_t size,
                         uint8_t *decompressed_data);
 
-#endif // VITE_H
\ No newline at end of file
+/**
+ * Decompresses a range of bits of the input bitmap
+ *
+ * @param compressed_data Pointer to the compressed data
+ * @param size Size of the compressed data
+ * @param lo First bit of the range
+ * @param hi Bit past the end of the range (at most 8 times the data size)
+ * @param decompressed_data Pointer to a destination buffer of (hi - lo + 7) / 8
+ * bytes
+ *
+ * Bit lo + i of the bitmap is written to bit i of decompressed_data, and the
+ * padding bits of its last byte are cleared. Only the buckets covering the
+ * range are decoded: the first one is found through the index of seekable
+ * streams, and by skipping bucket headers otherwise. Nothing is written if
+ * the range is empty.
+ */
+void vitemap_decompress_range(const uint8_t *compressed_data, size_t size,
+                              uint64_t lo, uint64_t hi,
+                              uint8_t *decompressed_data);
+
+/**
+ * Decompresses an untrusted compressed bitmap
+ *
+ * @param compressed_data Pointer to the compressed data
+ * @param size Size of the compressed data
+ * @param decompressed_data Pointer to the decompressed data
+ * @param capacity Size of the decompressed data buffer
+ * @return VITEMAP_OK, or the first inconsistency found
+ *
+ * Same as `vitemap_decompress`, but never reads past `size` bytes of
+ * compressed data nor writes past `capacity` bytes. The header and the
+ * capacity are checked first, and the size of every bucket is then checked
+ * against its category as it is decoded (see `vitemap_validate`), which only
+ * adds a few well-predicted branches per bucket. On error, the decompressed
+ * data is unspecified. The order of array indices, and the index and counts
+ * of seekable streams, do not affect decoding and are not checked.
+ */
+VitemapStatus vitemap_decompress_checked(const uint8_t *compressed_data,
+                                         size_t size,
+                                         uint8_t *decompressed_data,
+                                         size_t capacity);
+
+/**
+ * Checks that untrusted compressed data is a consistent stream
+ *
+ * @param compressed_data Pointer to the compressed data
+ * @param size Size of the compressed data
+ * @return VITEMAP_OK, or the first inconsistency found
+ *
+ * The header must be supported and fit, and the encoded buckets must exactly
+ * cover the bitmap and the data: the size of every bucket must match its
+ * category, array indices must be strictly increasing, and runs must neither
+ * cross a multiple of VITEMAP_INDEX_STRIDE buckets nor the end of the bitmap.
+ * The index and set bit counts, if any, must match the buckets. Streams that
+ * pass can be given to every other function without reading out of bounds.
+ * Only the bucket headers and array indices are read, and bitmap buckets are
+ * popcounted if the stream has counts.
+ */
+VitemapStatus vitemap_validate(const uint8_t *compressed_data, size_t size);
+
+/**
+ * Validates compressed data and opens a read-only view of it
+ *
+ * @param[out] view View to fill, left untouched on failure
+ * @param compressed_data Pointer to the compressed data
+ * @param size Size of the compressed data
+ * @return VITEMAP_OK, or the first inconsistency found (see
+ * `vitemap_validate`)
+ */
+VitemapStatus vitemap_view_init(VitemapView *view,
+                                const uint8_t *compressed_data, size_t size);
+
+/**
+ * Decompresses a single bucket of the compressed bitmap
+ *
+ * @param compressed_data Pointer to the compressed data
+ * @param size Size of the compressed data
+ * @param bucket Index of the bucket to decompress (must be within bounds)
+ * @param decompressed_bucket Pointer to a 32B destination buffer
+ *
+ * On seekable streams, this function jumps to the closest indexed bucket and
+ * skips at most `VITEMAP_INDEX_STRIDE - 1` bucket headers. On legacy streams,
+ * all preceding bucket headers are skipped, but no payload is expanded.
+ */
+void vitemap_get_bucket(const uint8_t *compressed_data, size_t size,
+                        size_t bucket, uint8_t *decompressed_bucket);
+
+/**
+ * Tests a single bit of the compressed bitmap
+ *
+ * @param compressed_data Pointer to the compressed data
+ * @param size Size of the compressed data
+ * @param bit Position of the bit to test
+ * @return Whether the bit is set (false if out of bounds)
+ *
+ * Bits are numbered in the same order as the encoder: bit `i` is bit `i % 8`
+ * of byte `i / 8`. The bucket is located as in `vitemap_get_bucket`, and the
+ * bit is tested directly on its encoded payload.
+ */
+bool vitemap_test_bit(const uint8_t *compressed_data, size_t size,
+                      uint64_t bit);
+
+/**
+ * Counts the set bits of the compressed bitmap
+ *
+ * @param compressed_data Pointer to the compressed data
+ * @param size Size of the compressed data
+ * @return Number of set bits
+ *
+ * Array buckets are counted from their header only, and bitmap buckets with a
+ * popcount of their payload. Streams written with VITEMAP_FLAG_COUNTS only
+ * count their last index stride.
+ */
+uint64_t vitemap_cardinality(const uint8_t *compressed_data, size_t size);
+
+/**
+ * Counts the set bits before a given position of the compressed bitmap
+ *
+ * @param compressed_data Pointer to the compressed data
+ * @param size Size of the compressed data
+ * @param bit Position of the bit, excluded from the count
+ * @return Number of set bits at positions lower than `bit`
+ *
+ * With VITEMAP_FLAG_COUNTS, the count starts from the closest indexed bucket,
+ * which takes constant time. Only the bucket containing `bit` is expanded.
+ */
+uint64_t vitemap_rank(const uint8_t *compressed_data, size_t size,
+                      uint64_t bit);
+
+/**
+ * Finds the position of a set bit of the compressed bitmap from its rank
+ *
+ * @param compressed_data Pointer to the compressed data
+ * @param size Size of the compressed data
+ * @param rank Number of set bits before the bit to find (0 for the first one)
+ * @param[out] bit Position of the bit
+ * @return Whether the bitmap has more than `rank` set bits
+ *
+ * This is the inverse of `vitemap_rank`: `vitemap_rank(data, size, bit)`
+ * equals `rank`. With VITEMAP_FLAG_COUNTS, the indexed bucket to start from
+ * is found by binary search.
+ */
+bool vitemap_select(const uint8_t *compressed_data, size_t size,
+                    uint64_t rank, uint64_t *bit);
+
+/**
+ * Writes the positions of all set bits of the compressed bitmap
+ *
+ * @param compressed_data Pointer to the compressed data
+ * @param size Size of the compressed data
+ * @param[out] positions Buffer of at least `vitemap_cardinality` entries
+ * @return Number of positions written
+ *
+ * Positions are written in increasing order, straight from the encoded
+ * buckets: array buckets are widened and offset, and other buckets compacted,
+ * without materializing the decompressed bitmap. Positions are 32-bit, which
+ * covers bitmaps of up to 512MB.
+ */
+uint64_t vitemap_to_positions(const uint8_t *compressed_data, size_t size,
+                              uint32_t *positions);
+
+/**
+ * Aggregates the values of a column at the set bits of the compressed bitmap
+ *
+ * @param compressed_data Pointer to the compressed data
+ * @param size Size of the compressed data
+ * @param column Values of the column, the i-th of which is selected by bit i
+ * @param type Type of the values of the column
+ * @param num_values Number of values of the column
+ * @param[out] result Count, sum, minimum and maximum of the selected values
+ * @return Whether `type` is a valid column type
+ *
+ * Buckets are aggregated straight from the compressed stream, in a single
+ * pass: the values of array buckets are gathered from their positions, and
+ * those of other buckets loaded under their mask, without materializing the
+ * decompressed bitmap. Set bits at or past `num_values` are ignored, and the
+ * column is never read past `num_values` values. Floating-point sums may
+ * differ in their last bits between instruction sets, which add values in a
+ * different order, and NaN values give unspecified minimums and maximums.
+ */
+bool vitemap_aggregate(const uint8_t *compressed_data, size_t size,
+                       const void *column, VitemapColumnType type,
+                       uint64_t num_values, VitemapAggregate *result);
+
+/**
+ * Computes a set operation between two compressed bitmaps
+ *
+ * @param vm Pointer to the Vitemap structure receiving the result
+ * @param op Set operation to apply
+ * @param a Pointer to the first compressed bitmap
+ * @param a_size Size of the first compressed bitmap
+ * @param b Pointer to the second compressed bitmap
+ * @param b_size Size of the second compressed bitmap
+ * @return Size of the compressed result
+ *
+ * This function walks both compressed streams bucket by bucket, and writes
+ * the compressed result to vm->output (seekable if requested by vm->flags).
+ * Array buckets are combined by merging their sorted indices, and are only
+ * expanded when the other operand is a bitmap bucket. The result is
+ * byte-identical to compressing the result of the operation on the raw
+ * bitmaps.
+ *
+ * The shorter bitmap is treated as zero-extended, and vm must have been
+ * created for at least the size of the longer one.
+ */
+size_t vitemap_operate(Vitemap *vm, VitemapOperation op, const uint8_t *a,
+                       size_t a_size, const uint8_t *b, size_t b_size);
+
+/**
+ * Computes a set operation between two compressed bitmaps into caller memory
+ *
+ * @param op Set operation to apply
+ * @param a Pointer to the first compressed bitmap
+ * @param a_size Size of the first compressed bitmap
+ * @param b Pointer to the second compressed bitmap
+ * @param b_size Size of the second compressed bitmap
+ * @param output Buffer of at least `vitemap_max_compressed_size` bytes of the
+ * longer bitmap
+ * @param flags Stream format flags of the result (see `vitemap_compress`)
+ * @return Size of the compressed result
+ *
+ * Same as `vitemap_operate`, without a Vitemap.
+ */
+size_t vitemap_operate_buffer(VitemapOperation op, const uint8_t *a,
+                              size_t a_size, const uint8_t *b, size_t b_size,
+                              uint8_t *output, uint32_t flags);
+
+/**
+ * Checks that an expression is well-formed
+ *
+ * @param expr Pointer to the expression
+ * @return true if the expression is well-formed, false otherwise
+ *
+ * A well-formed expression has at most VITEMAP_MAX_EXPRESSION_INPUTS inputs,
+ * only refers to existing ones, never grows its stack past
+ * VITEMAP_MAX_EXPRESSION_DEPTH values, and leaves exactly one value on it.
+ * Expressions passed to the evaluation functions must be well-formed.
+ */
+bool vitemap_check_expression(const VitemapExpression *expr);
+
+/**
+ * Evaluates a boolean expression over many compressed bitmaps
+ *
+ * @param vm Pointer to the Vitemap structure receiving the result
+ * @param expr Pointer to the expression
+ * @return Size of the compressed result
+ *
+ * This function walks all input streams bucket by bucket in a single pass,
+ * without intermediate bitmaps, and writes the compressed result to
+ * vm->output (in the format requested by vm->flags). Empty and full buckets
+ * are resolved from their header: for instance, no input of an AND is decoded
+ * once one of its operands is empty. The result is byte-identical to
+ * compressing the result of the expression on the raw bitmaps.
+ *
+ * Shorter bitmaps are treated as zero-extended, and vm must have been created
+ * for at least the size of the longest one.
+ */
+size_t vitemap_evaluate(Vitemap *vm, const VitemapExpression *expr);
+
+/**
+ * Evaluates a boolean expression over many compressed bitmaps into caller
+ * memory
+ *
+ * @param expr Pointer to the expression
+ * @param output Buffer of at least `vitemap_max_compressed_size` bytes of the
+ * longest bitmap
+ * @param flags Stream format flags of the result (see `vitemap_compress`)
+ * @return Size of the compressed result
+ *
+ * Same as `vitemap_evaluate`, without a Vitemap.
+ */
+size_t vitemap_evaluate_buffer(const VitemapExpression *expr, uint8_t *output,
+                               uint32_t flags);
+
+/**
+ * Evaluates a boolean expression over many compressed bitmaps, and extracts
+ * the positions of the set bits of the result
+ *
+ * @param expr Pointer to the expression
+ * @param positions Output array of set bit positions, sized for the
+ * cardinality of the result
+ * @return Number of set bits of the result
+ *
+ * Same as `vitemap_evaluate` followed by `vitemap_to_positions`, without
+ * writing the compressed result.
+ */
+uint64_t vitemap_evaluate_positions(const VitemapExpression *expr,
+                                    uint32_t *positions);
+
+/**
+ * Compresses the input bitmap using multiple threads
+ *
+ * @param vm Pointer to the Vitemap structure
+ * @param size Actual size of input data to compress (must not exceed max_size)
+ * @param num_threads Maximum number of threads to use, including the caller
+ * @return Size of the compressed data
+ *
+ * The buckets are split into one contiguous chunk per thread. A first pass
+ * computes the encoded size of every chunk, whose prefix sum gives the output
+ * offset of each chunk, so that the second pass can encode all chunks in
+ * place. The output is byte-identical to `vitemap_compress`.
+ */
+size_t vitemap_compress_parallel(Vitemap *vm, size_t size,
+                                 unsigned num_threads);
+
+/**
+ * Compresses a bitmap straight from caller memory using multiple threads
+ *
+ * @param input Pointer to the bitmap, of any length
+ * @param size Size of the bitmap in bytes
+ * @param output Buffer of at least `vitemap_max_compressed_size(size)` bytes
+ * @param flags Stream format flags (see `vitemap_compress`)
+ * @param num_threads Maximum number of threads to use, including the caller
+ * @return Size of the compressed data
+ *
+ * Same as `vitemap_compress_parallel`, with the input and output of
+ * `vitemap_compress_buffer`.
+ */
+size_t vitemap_compress_buffer_parallel(const uint8_t *input, size_t size,
+                                        uint8_t *output, uint32_t flags,
+                                        unsigned num_threads);
+
+/**
+ * Decompresses the input bitmap using multiple threads
+ *
+ * @param compressed_data Pointer to the compressed data
+ * @param size Size of the compressed data
+ * @param decompressed_data Pointer to the decompressed data
+ * @param num_threads Maximum number of threads to use, including the caller
+ *
+ * The entry point of every chunk is taken from the index of seekable streams,
+ * and found by a header-only scan otherwise.
+ */
+void vitemap_decompress_parallel(const uint8_t *compressed_data, size_t size,
+                                 uint8_t *decompressed_data,
+                                 unsigned num_threads);
+
+/**
+ * Converts a compressed bitmap to the split-stream layout
+ *
+ * @param compressed_data Pointer to the compressed data, in any format
+ * @param size Size of the compressed data
+ * @return New split stream, or NULL on allocation failure
+ *
+ * The data must be valid (see `vitemap_validate`). A first pass over the
+ * headers sizes the arrays, and a second one fills them.
+ */
+VitemapSplit *vitemap_split_create(const uint8_t *compressed_data,
+                                   size_t size);
+
+/**
+ * Deletes a split stream
+ *
+ * @param split Pointer to the split stream
+ */
+void vitemap_split_delete(VitemapSplit *split);
+
+/**
+ * Converts a split stream back to a compressed stream
+ *
+ * @param split Pointer to the split stream
+ * @param output Buffer of at least `vitemap_max_compressed_size(split->size)`
+ * bytes
+ * @param flags Stream format flags (see `vitemap_compress`), e.g.
+ * `split->flags` to get the source back
+ * @return Size of the compressed data
+ *
+ * Buckets are copied as they are, so that for data compressed by this library,
+ * the output is byte-identical to compressing the bitmap with `flags`.
+ */
+size_t vitemap_split_to_stream(const VitemapSplit *split, uint8_t *output,
+                               uint32_t flags);
+
+/**
+ * Decompresses a split stream using multiple threads
+ *
+ * @param split Pointer to the split stream
+ * @param decompressed_data Buffer of the bitmap, rounded up to 32 bytes
+ * @param num_threads Maximum number of threads to use, including the caller
+ *
+ * Every bucket is decoded from its header, offset and payload alone, so that
+ * the chunks of the threads need no entry point. This is also the reference
+ * of the device decoders (see vite_cuda.h).
+ */
+void vitemap_split_decompress(const VitemapSplit *split,
+                              uint8_t *decompressed_data,
+                              unsigned num_threads);
+
+/**
+ * Starts a streaming compression
+ *
+ * @param sink Destination of the compressed data
+ * @return New stream, or NULL on allocation failure or if the sink fails
+ *
+ * The stream produces the same data as `vitemap_compress`, starting with a
+ * 4-byte size header that is only known (and patched) once the stream is
+ * finished.
+ */
+VitemapStream *vitemap_stream_begin(VitemapSink sink);
+
+/**
+ * Pushes input data to a streaming compression
+ *
+ * @param stream Pointer to the stream
+ * @param data Next bytes of the bitmap
+ * @param size Number of bytes to push (any size, 32B multiples are fastest)
+ * @return Whether the data was accepted (false if the sink failed, or if the
+ * total input size would exceed `VITEMAP_STREAM_MAX_SIZE`)
+ *
+ * All complete buckets are compressed directly from `data`; only a trailing
+ * partial bucket is buffered until the next push.
+ */
+bool vitemap_stream_push(VitemapStream *stream, const uint8_t *data,
+                         size_t size);
+
+/**
+ * Finishes a streaming compression and frees the stream
+ *
+ * @param stream Pointer to the stream
+ * @param[out] compressed_size Total size of the compressed data (optional)
+ * @return Whether the whole stream was written successfully
+ *
+ * The partial trailing bucket, if any, is padded with zeros and compressed.
+ * The size header is then rewritten through `sink.patch`. Without a patch
+ * callback, the first 4 bytes of the output are left zero, and the caller must
+ * overwrite them with the total number of bytes pushed: read `stream->size`
+ * before calling this function, which frees the stream.
+ */
+bool vitemap_stream_finish(VitemapStream *stream, uint32_t *compressed_size);
+
+/**
+ * Starts writing a container
+ *
+ * @param sink Destination of the container
+ * @param flags Container format flags (VITEMAP_CONTAINER_*)
+ * @return New writer, or NULL on allocation failure or if the sink fails
+ */
+VitemapContainerWriter *vitemap_container_begin(VitemapSink sink,
+                                                uint32_t flags);
+
+/**
+ * Adds a compressed bitmap to a container
+ *
+ * @param writer Pointer to the writer
+ * @param key Key of the bitmap, which must not have been added before
+ * @param compressed_data Pointer to the compressed data
+ * @param size Size of the compressed data, at most UINT32_MAX bytes
+ * @return Whether the bitmap was written (false if the sink failed, or if the
+ * bitmap is too large)
+ *
+ * Bitmaps may be added in any key order. Duplicate keys are only detected when
+ * the container is finished. Directory entries hold 32-bit sizes: larger
+ * bitmaps (e.g. wide streams of more than 4 GiB) are rejected without writing
+ * anything, and the container can still be finished without them.
+ */
+bool vitemap_container_add(VitemapContainerWriter *writer, uint64_t key,
+                           const uint8_t *compressed_data, size_t size);
+
+/**
+ * Finishes writing a container and frees the writer
+ *
+ * @param writer Pointer to the writer
+ * @return Whether the whole container was written (false if the sink failed
+ * or if a key was added twice)
+ *
+ * The directory is sorted by key and written after the bitmaps, followed by
+ * the footer.
+ */
+bool vitemap_container_finish(VitemapContainerWriter *writer);
+
+/**
+ * Opens a container file for reading
+ *
+ * @param path Path of the container file
+ * @param flags VITEMAP_CONTAINER_CHECKSUMS to verify every checksum, or 0
+ * @return New container, or NULL if the file cannot be mapped, is not a valid
+ * container, or has a checksum mismatch
+ *
+ * The file is mapped read-only, and only its header, footer and directory
+ * bounds are validated, without reading the directory or any bitmap: opening
+ * costs the same whatever the size of the file. Checksums, of the directory
+ * and of every bitmap, are only verified on request (see also
+ * `vitemap_container_verify`).
+ */
+VitemapContainer *vitemap_container_open(const char *path, uint32_t flags);
+
+/**
+ * Opens a container already in memory
+ *
+ * @param data Pointer to the container, which must outlive the view
+ * @param size Size of the container in bytes
+ * @param flags VITEMAP_CONTAINER_CHECKSUMS to verify every checksum, or 0
+ * @return New container, or NULL if the data is not a valid container
+ *
+ * Same as `vitemap_container_open`, for containers mapped or loaded by the
+ * caller. `data` must be aligned on 8 bytes.
+ */
+VitemapContainer *vitemap_container_wrap(const uint8_t *data, size_t size,
+                                         uint32_t flags);
+
+/**
+ * Closes a container, unmapping its file
+ *
+ * @param container Pointer to the container
+ *
+ * Views returned by `vitemap_container_get` are invalid afterwards.
+ */
+void vitemap_container_close(VitemapContainer *container);
+
+/**
+ * Looks a bitmap up by key in a container
+ *
+ * @param container Pointer to the container
+ * @param key Key of the bitmap
+ * @param[out] compressed_data Pointer to the compressed data in the container
+ * @param[out] size Size of the compressed data
+ * @return Whether the key was found
+ *
+ * The returned data can be passed as is to `vitemap_decompress` and to the
+ * query functions. The lookup is a binary search of the directory.
+ */
+bool vitemap_container_get(const VitemapContainer *container, uint64_t key,
+                           const uint8_t **compressed_data, uint32_t *size);
+
+/**
+ * Verifies the checksums of the directory and of every bitmap of a container
+ *
+ * @param container Pointer to the container
+ * @return Whether all checksums match (true if the container has none)
+ */
+bool vitemap_container_verify(const VitemapContainer *container);
+
+/**
+ * Compresses a file into another
+ *
+ * @param input_fd Descriptor of the bitmap, read from its current offset
+ * @param output_fd Descriptor of the destination, written from its current
+ * offset
+ * @param flags Stream format flags (see `vitemap_compress`)
+ * @param num_threads Maximum number of threads to use, including the caller
+ * @param[out] compressed_size Size of the compressed data (optional)
+ * @return Whether the whole input was read and the output written
+ *
+ * A regular input file is memory-mapped and compressed in place, with the
+ * kernel reading ahead, and any other input (e.g. a pipe) is read into memory
+ * first. A regular output file opened for reading and writing and positioned
+ * at its start is truncated and mapped, so that the compressed data is
+ * written straight into the page cache and flushed to disk by the kernel.
+ * Other outputs are compressed into memory and then written. The descriptors
+ * are left open.
+ */
+bool vitemap_compress_file(int input_fd, int output_fd, uint32_t flags,
+                           unsigned num_threads, uint64_t *compressed_size);
+
+/**
+ * Decompresses a file into another
+ *
+ * @param input_fd Descriptor of the compressed data, read from its current
+ * offset
+ * @param output_fd Descriptor of the destination, written from its current
+ * offset
+ * @param num_threads Maximum number of threads to use, including the caller
+ * @param[out] decompressed_size Size of the decompressed bitmap (optional)
+ * @return Whether the whole input was read, is a valid stream (see
+ * `vitemap_validate`), and the output was written
+ *
+ * Same as `vitemap_compress_file`, in the other direction.
+ */
+bool vitemap_decompress_file(int input_fd, int output_fd, unsigned num_threads,
+                             uint64_t *decompressed_size);
+
+#ifdef VITEMAP_INSTRUMENTATION
+/**
+ * Reads the instrumentation statistics of the calling thread
+ *
+ * @param[out] stats Statistics since the thread started or last reset them
+ *
+ * Hardware counters are opened through `perf_event_open` on the first
+ * measured call of every thread, for user space only. When they are not
+ * available (e.g. with a restrictive `perf_event_paranoid`), only calls, bytes
+ * and buckets are counted. Bucket categories are counted on the compressed
+ * stream, after the counters are stopped.
+ */
+void vitemap_get_stats(VitemapStats *stats);
+
+/**
+ * Resets the instrumentation statistics of the calling thread
+ */
+void vitemap_reset_stats(void);
+#endif
+
+#endif // VITE_H
@@ -0,0 +1,228 @@
+/*
+ *  ____   ____.__  __
+ *  \   \ /   /|__|/  |_  ____   _____ _____  ______
+ *   \   Y   / |  \   __\/ __ \ /     \\__  \ \____ \
+ *    \     /  |  ||  | \  ___/|  Y Y  \/ __ \|  |_> >
+ *     \___/   |__||__|  \___  >__|_|  (____  /   __/
+ *                           \/      \/     \/|__|
+ *
+ *
+ *  Copyright (c) [2024] [Alexis Schlomer]
+ *  This project is licensed under the MIT License.
+ *  See the LICENSE file for details.
+ */
+
+// AVX2 kernels (with POPCNT and BMI1), for CPUs without AVX-512 VBMI2.
+//
+// Compaction uses a table of packed set bit positions per byte, rather than
+// pext, which is microcoded (and very slow) on AMD CPUs before Zen 3.
+
+#include "vite_internal.h"
+#include <immintrin.h>
+#include <math.h>
+#include <string.h>
+
+#define KERNELS vitemap_kernels_avx2
+#define KERNELS_ISA VITEMAP_ISA_AVX2
+
+// Popcount for 256 bits, one 64-bit word at a time.
+static inline size_t popcount_256(const uint8_t *restrict ptr) {
+  uint64_t words[BUCKET_SIZE_U64];
+  memcpy(words, ptr, BUCKET_SIZE_U8);
+  return _mm_popcnt_u64(words[0]) + _mm_popcnt_u64(words[1]) +
+         _mm_popcnt_u64(words[2]) + _mm_popcnt_u64(words[3]);
+}
+
+// Copies a partial bucket, padding it with zeros.
+static inline void load_partial_256(const uint8_t *src, size_t size,
+                                    uint8_t *dst) {
+  memset(dst, 0, BUCKET_SIZE_U8);
+  memcpy(dst, src, size);
+}
+
+// Compacts the set bit positions of a 256-bit bucket, visiting only its
+// non-zero bytes. Every visited byte stores 8 positions, of which only the
+// first popcount are kept.
+static inline void extract_and_compact_256(const uint64_t *restrict src,
+                                           uint8_t *restrict dst) {
+  const uint8_t *bytes = (const uint8_t *)src;
+  __m256i vec = _mm256_loadu_si256((const __m256i *)src);
+  uint32_t non_zero = ~(uint32_t)_mm256_movemask_epi8(
+      _mm256_cmpeq_epi8(vec, _mm256_setzero_si256()));
+
+  while (non_zero) {
+    unsigned i = _tzcnt_u32(non_zero);
+    uint64_t positions =
+        vitemap_byte_positions[bytes[i]] + 0x0808080808080808ULL * i;
+    memcpy(dst, &positions, sizeof(positions));
+
+    dst += _mm_popcnt_u32(bytes[i]);
+    non_zero &= non_zero - 1;
+  }
+}
+
+// Expands up to `bucket_size` bit positions by OR-ing the corresponding
+// buckets of an 8KB lookup table, and inverts the result for inverted arrays.
+static inline void expand_and_scatter_256(const uint8_t *restrict src,
+                                          size_t bucket_size, bool invert,
+                                          uint8_t *restrict dst) {
+  __m256i result = _mm256_setzero_si256();
+
+  // Positions are OR-ed four at a time, and the last group is padded by
+  // repeating the last position: OR-ing a row twice is harmless, and removes
+  // the remainder loop. Buckets of up to 4 positions, which are the vast
+  // majority of arrays, then decode without any data-dependent branch.
+  if (bucket_size > 0) {
+    size_t last = bucket_size - 1;
+    size_t i = 0;
+    do {
+      size_t i1 = i + 1 < last ? i + 1 : last;
+      size_t i2 = i + 2 < last ? i + 2 : last;
+      size_t i3 = i + 3 < last ? i + 3 : last;
+      __m256i lookup1 =
+          _mm256_load_si256((const __m256i *)vitemap_bit_lookup[src[i]]);
+      __m256i lookup2 =
+          _mm256_load_si256((const __m256i *)vitemap_bit_lookup[src[i1]]);
+      __m256i lookup3 =
+          _mm256_load_si256((const __m256i *)vitemap_bit_lookup[src[i2]]);
+      __m256i lookup4 =
+          _mm256_load_si256((const __m256i *)vitemap_bit_lookup[src[i3]]);
+
+      __m256i pair1 = _mm256_or_si256(lookup1, lookup2);
+      __m256i pair2 = _mm256_or_si256(lookup3, lookup4);
+      result = _mm256_or_si256(result, _mm256_or_si256(pair1, pair2));
+      i += 4;
+    } while (i < bucket_size);
+  }
+
+  result = _mm256_xor_si256(result, _mm256_set1_epi8(-(char)invert));
+  _mm256_storeu_si256((__m256i *)dst, result);
+}
+
+// Widens 8-bit positions to 32 bits and offsets them, 8 at a time, and the
+// remaining ones one by one.
+static inline void widen_positions(const uint8_t *restrict src, size_t size,
+                                   uint32_t base, uint32_t *restrict dst) {
+  __m256i offset = _mm256_set1_epi32(base);
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    __m128i bytes = _mm_loadl_epi64((const __m128i *)(src + i));
+    __m256i widened = _mm256_add_epi32(_mm256_cvtepu8_epi32(bytes), offset);
+    _mm256_storeu_si256((__m256i *)(dst + i), widened);
+  }
+  for (; i < size; i++) {
+    dst[i] = base + src[i];
+  }
+}
+
+// Inverts all 256 bits in src and stores inverse into dst.
+static inline void invert_256(const uint8_t *src, uint8_t *dst) {
+  __m256i src_vec = _mm256_loadu_si256((const __m256i *)src);
+  __m256i all_ones = _mm256_set1_epi8((char)0xFFU);
+  __m256i inverted = _mm256_xor_si256(src_vec, all_ones);
+  _mm256_storeu_si256((__m256i *)dst, inverted);
+}
+
+// Counts the leading buckets whose bytes all equal `fill`.
+static inline size_t uniform_buckets(const uint8_t *src, size_t max_buckets,
+                                     uint8_t fill) {
+  __m256i pattern = _mm256_set1_epi8((char)fill);
+  size_t count = 0;
+  for (; count < max_buckets; count++) {
+    __m256i vec =
+        _mm256_loadu_si256((const __m256i *)(src + count * BUCKET_SIZE_U8));
+    __m256i diff = _mm256_xor_si256(vec, pattern);
+    if (!_mm256_testz_si256(diff, diff)) {
+      break;
+    }
+  }
+  return count;
+}
+
+// Applies a bitwise operation to two 256-bit buckets.
+static inline void bitwise_256(VitemapOperation op, const uint8_t *a,
+                               const uint8_t *b, uint8_t *dst) {
+  __m256i vec_a = _mm256_loadu_si256((const __m256i *)a);
+  __m256i vec_b = _mm256_loadu_si256((const __m256i *)b);
+  __m256i result;
+  switch (op) {
+  case VITEMAP_AND:
+    result = _mm256_and_si256(vec_a, vec_b);
+    break;
+  case VITEMAP_OR:
+    result = _mm256_or_si256(vec_a, vec_b);
+    break;
+  case VITEMAP_XOR:
+    result = _mm256_xor_si256(vec_a, vec_b);
+    break;
+  default:
+    result = _mm256_andnot_si256(vec_b, vec_a);
+    break;
+  }
+  _mm256_storeu_si256((__m256i *)dst, result);
+}
+
+// Values are aggregated one at a time, straight into a VitemapAggregate.
+typedef VitemapAggregate AggregateLanes;
+
+static inline AggregateLanes init_lanes(VitemapColumnType type) {
+  (void)type;
+  return (AggregateLanes){.int_min = INT64_MAX,
+                          .int_max = INT64_MIN,
+                          .min = INFINITY,
+                          .max = -INFINITY};
+}
+
+// AVX2 lacks masked 64-bit minimums and maximums, and the 8-lane gathers do
+// not beat scalar loads on the at most 31 values of array buckets: values are
+// aggregated one at a time, as in the scalar kernels.
+static inline void aggregate_mask_256(VitemapColumnType type,
+                                      const uint8_t *restrict values,
+                                      const uint64_t *restrict mask,
+                                      AggregateLanes *restrict lanes) {
+  for (size_t i = 0; i < BUCKET_SIZE_U64; i++) {
+    for (uint64_t word = mask[i]; word; word &= word - 1) {
+      aggregate_value(type, values, i * 64 + __builtin_ctzll(word), lanes);
+    }
+  }
+}
+
+static inline void aggregate_indices_256(VitemapColumnType type,
+                                         const uint8_t *restrict values,
+                                         const uint8_t *restrict indices,
+                                         size_t count,
+                                         AggregateLanes *restrict lanes) {
+  for (size_t i = 0; i < count; i++) {
+    aggregate_value(type, values, indices[i], lanes);
+  }
+}
+
+// Adds the aggregates to `result`, once all buckets are aggregated.
+static inline void reduce_lanes(VitemapColumnType type,
+                                const AggregateLanes *lanes,
+                                VitemapAggregate *result) {
+  (void)type;
+  result->count += lanes->count;
+  result->int_sum =
+      (int64_t)((uint64_t)result->int_sum + (uint64_t)lanes->int_sum);
+  result->int_min =
+      result->int_min < lanes->int_min ? result->int_min : lanes->int_min;
+  result->int_max =
+      result->int_max > lanes->int_max ? result->int_max : lanes->int_max;
+  result->sum += lanes->sum;
+  result->min = result->min < lanes->min ? result->min : lanes->min;
+  result->max = result->max > lanes->max ? result->max : lanes->max;
+}
+
+// Copies 64 bytes with two non-temporal 32-byte stores.
+static inline void stream_store_512(uint8_t *restrict dst,
+                                    const uint8_t *restrict src) {
+  __m256i low = _mm256_loadu_si256((const __m256i *)src);
+  __m256i high = _mm256_loadu_si256((const __m256i *)(src + 32));
+  _mm256_stream_si256((__m256i *)dst, low);
+  _mm256_stream_si256((__m256i *)(dst + 32), high);
+}
+
+static inline void stream_fence(void) { _mm_sfence(); }
+
+#include "vite_kernels.h"
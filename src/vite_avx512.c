@@ -0,0 +1,369 @@
+/*
+ *  ____   ____.__  __
+ *  \   \ /   /|__|/  |_  ____   _____ _____  ______
+ *   \   Y   / |  \   __\/ __ \ /     \\__  \ \____ \
+ *    \     /  |  ||  | \  ___/|  Y Y  \/ __ \|  |_> >
+ *     \___/   |__||__|  \___  >__|_|  (____  /   __/
+ *                           \/      \/     \/|__|
+ *
+ *
+ *  Copyright (c) [2024] [Alexis Schlomer]
+ *  This project is licensed under the MIT License.
+ *  See the LICENSE file for details.
+ */
+
+// AVX-512 kernels (F, BW, VL, VPOPCNTDQ, VBMI2), the fastest path.
+
+#include "vite_internal.h"
+#include <immintrin.h>
+#include <math.h>
+#include <string.h>
+
+#define KERNELS vitemap_kernels_avx512
+#define KERNELS_ISA VITEMAP_ISA_AVX512
+
+// Fast popcount for 256 bits.
+// Calling this function in the critical section increases incoding time by
+// ~25%. Bitmaps maintained through a VitemapBuilder keep track of their bucket
+// sizes, and skip it entirely (see `compress_counted_buckets`).
+static inline size_t popcount_256(const uint8_t *restrict ptr) {
+  __m256i vec = _mm256_loadu_si256((const __m256i *)ptr);
+  __m256i popcnt = _mm256_popcnt_epi64(vec);
+  __m128i sum = _mm_add_epi64(_mm256_castsi256_si128(popcnt),
+                              _mm256_extracti128_si256(popcnt, 1));
+  sum = _mm_add_epi64(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+  return _mm_cvtsi128_si64(sum);
+}
+
+// Loads a partial bucket through a masked load, padding it with zeros. Masked
+// out bytes are never accessed, so src may end right after `size` bytes.
+static inline void load_partial_256(const uint8_t *src, size_t size,
+                                    uint8_t *dst) {
+  __m256i vec = _mm256_maskz_loadu_epi8((__mmask32)((1ULL << size) - 1), src);
+  _mm256_storeu_si256((__m256i *)dst, vec);
+}
+
+// Performs highly optimized selective bit extraction and compaction.
+// Uses precomputed indices to selectively extract and compact bits from a
+// 256-bit (4x64-bit) bucket using AVX-512 SIMD instructions.
+static inline void extract_and_compact_256(const uint64_t *restrict src,
+                                           uint8_t *restrict dst) {
+  const uint8_t *restrict moving_indices = vitemap_indices;
+  for (size_t i = 0; i < BUCKET_SIZE_U64; i++) {
+    __m512i indices_vector = _mm512_loadu_si512(moving_indices);
+    __m512i compact = _mm512_maskz_compress_epi8(*src, indices_vector);
+    _mm512_storeu_epi8(
+        dst,
+        compact); // This instruction will systematically
+                  // overflow to the next bucket. However, since each bucket is
+                  // processed sequentially, this is not a problem. Furthermore,
+                  // we allocate one extra bucket at the end of the output
+                  // buffer to avoid any tail buffer overflows.
+
+    dst += _mm_popcnt_u64(*src);
+    src += 1;
+    moving_indices += 64;
+  }
+}
+
+// Performs highly optimized selective bit expansion and scattering.
+// Uses provided indices to selectively expand and scatter bits into a
+// 256-bit (4x64-bit) bucket using AVX2 SIMD instructions.
+// Uses an 8KB lookup table for fast bit expansion, and inverts the result
+// for inverted arrays.
+static inline void expand_and_scatter_256(const uint8_t *restrict src,
+                                          size_t bucket_size, bool invert,
+                                          uint8_t *restrict dst) {
+  __m256i result = _mm256_setzero_si256();
+
+  // Positions are OR-ed four at a time, and the last group is padded by
+  // repeating the last position: OR-ing a row twice is harmless, and removes
+  // the remainder loop. Buckets of up to 4 positions, which are the vast
+  // majority of arrays, then decode without any data-dependent branch.
+  if (bucket_size > 0) {
+    size_t last = bucket_size - 1;
+    size_t i = 0;
+    do {
+      size_t i1 = i + 1 < last ? i + 1 : last;
+      size_t i2 = i + 2 < last ? i + 2 : last;
+      size_t i3 = i + 3 < last ? i + 3 : last;
+      __m256i lookup1 =
+          _mm256_load_si256((const __m256i *)vitemap_bit_lookup[src[i]]);
+      __m256i lookup2 =
+          _mm256_load_si256((const __m256i *)vitemap_bit_lookup[src[i1]]);
+      __m256i lookup3 =
+          _mm256_load_si256((const __m256i *)vitemap_bit_lookup[src[i2]]);
+      __m256i lookup4 =
+          _mm256_load_si256((const __m256i *)vitemap_bit_lookup[src[i3]]);
+
+      __m256i pair1 = _mm256_or_si256(lookup1, lookup2);
+      __m256i pair2 = _mm256_or_si256(lookup3, lookup4);
+      result = _mm256_or_si256(result, _mm256_or_si256(pair1, pair2));
+      i += 4;
+    } while (i < bucket_size);
+  }
+
+  result = _mm256_xor_si256(result, _mm256_set1_epi8(-(char)invert));
+  _mm256_storeu_si256((__m256i *)dst, result);
+}
+
+// Widens 8-bit positions to 32 bits and offsets them, 16 at a time. Masked
+// loads and stores handle the last group without touching past the arrays.
+static inline void widen_positions(const uint8_t *restrict src, size_t size,
+                                   uint32_t base, uint32_t *restrict dst) {
+  __m512i offset = _mm512_set1_epi32(base);
+  for (size_t i = 0; i < size; i += 16) {
+    size_t remaining = size - i;
+    __mmask16 mask = remaining < 16 ? (1U << remaining) - 1 : 0xFFFF;
+    __m128i bytes = _mm_maskz_loadu_epi8(mask, src + i);
+    __m512i widened =
+        _mm512_add_epi32(_mm512_maskz_cvtepu8_epi32(mask, bytes), offset);
+    _mm512_mask_storeu_epi32(dst + i, mask, widened);
+  }
+}
+
+// Inverts all 256 bits in src and stores inverse into dst.
+static inline void invert_256(const uint8_t *src, uint8_t *dst) {
+  __m256i src_vec = _mm256_loadu_si256((const __m256i *)src);
+  __m256i all_ones = _mm256_set1_epi8((char)0xFFU);
+  __m256i inverted = _mm256_xor_si256(src_vec, all_ones);
+  _mm256_storeu_si256((__m256i *)dst, inverted);
+}
+
+// Counts the leading buckets whose bytes all equal `fill`, comparing two
+// buckets at once.
+static inline size_t uniform_buckets(const uint8_t *src, size_t max_buckets,
+                                     uint8_t fill) {
+  __m512i pattern = _mm512_set1_epi8((char)fill);
+  size_t count = 0;
+  for (; count + 2 <= max_buckets; count += 2) {
+    __m512i vec = _mm512_loadu_si512(src + count * BUCKET_SIZE_U8);
+    __mmask8 diff = _mm512_cmpneq_epi64_mask(vec, pattern);
+    if (diff) {
+      return count + ((diff & 0x0F) == 0);
+    }
+  }
+  if (count < max_buckets) {
+    __m256i vec =
+        _mm256_loadu_si256((const __m256i *)(src + count * BUCKET_SIZE_U8));
+    __m256i half = _mm256_set1_epi8((char)fill);
+    count += _mm256_cmpneq_epi64_mask(vec, half) == 0;
+  }
+  return count;
+}
+
+// Applies a bitwise operation to two 256-bit buckets.
+static inline void bitwise_256(VitemapOperation op, const uint8_t *a,
+                               const uint8_t *b, uint8_t *dst) {
+  __m256i vec_a = _mm256_loadu_si256((const __m256i *)a);
+  __m256i vec_b = _mm256_loadu_si256((const __m256i *)b);
+  __m256i result;
+  switch (op) {
+  case VITEMAP_AND:
+    result = _mm256_and_si256(vec_a, vec_b);
+    break;
+  case VITEMAP_OR:
+    result = _mm256_or_si256(vec_a, vec_b);
+    break;
+  case VITEMAP_XOR:
+    result = _mm256_xor_si256(vec_a, vec_b);
+    break;
+  default:
+    result = _mm256_andnot_si256(vec_b, vec_a);
+    break;
+  }
+  _mm256_storeu_si256((__m256i *)dst, result);
+}
+
+// Lanes of the aggregates of consecutive buckets: 64-bit integer or double
+// sums, and minimums and maximums of the type of the column.
+typedef struct {
+  uint64_t count;                 // Number of aggregated values
+  __m512i sum, min, max;          // Integer columns
+  __m512d float_sum;              // Floating-point columns
+  __m512 float_min, float_max;    // Float columns
+  __m512d double_min, double_max; // Double columns
+} AggregateLanes;
+
+static inline AggregateLanes init_lanes(VitemapColumnType type) {
+  bool wide = type == VITEMAP_COLUMN_INT64;
+  return (AggregateLanes){
+      .count = 0,
+      .sum = _mm512_setzero_si512(),
+      .min = wide ? _mm512_set1_epi64(INT64_MAX) : _mm512_set1_epi32(INT32_MAX),
+      .max = wide ? _mm512_set1_epi64(INT64_MIN) : _mm512_set1_epi32(INT32_MIN),
+      .float_sum = _mm512_setzero_pd(),
+      .float_min = _mm512_set1_ps(INFINITY),
+      .float_max = _mm512_set1_ps(-INFINITY),
+      .double_min = _mm512_set1_pd(INFINITY),
+      .double_max = _mm512_set1_pd(-INFINITY)};
+}
+
+// Adds 16 32-bit or 8 64-bit values, zeroed outside of `k`, to the lanes.
+// Halves are extracted and widened through full masks, as the unmasked
+// intrinsics (and casts) trip -Wmaybe-uninitialized on GCC 12.
+static inline void accumulate_lanes(VitemapColumnType type, __mmask16 k,
+                                    __m512i v, AggregateLanes *lanes) {
+  lanes->count += __builtin_popcount(k);
+  switch (type) {
+  case VITEMAP_COLUMN_INT32: {
+    __m256i low = _mm512_maskz_extracti64x4_epi64(0xFF, v, 0);
+    __m256i high = _mm512_maskz_extracti64x4_epi64(0xFF, v, 1);
+    lanes->sum = _mm512_add_epi64(lanes->sum,
+                                  _mm512_maskz_cvtepi32_epi64(0xFF, low));
+    lanes->sum = _mm512_add_epi64(lanes->sum,
+                                  _mm512_maskz_cvtepi32_epi64(0xFF, high));
+    lanes->min = _mm512_mask_min_epi32(lanes->min, k, lanes->min, v);
+    lanes->max = _mm512_mask_max_epi32(lanes->max, k, lanes->max, v);
+    break;
+  }
+  case VITEMAP_COLUMN_INT64:
+    lanes->sum = _mm512_add_epi64(lanes->sum, v);
+    lanes->min = _mm512_mask_min_epi64(lanes->min, k, lanes->min, v);
+    lanes->max = _mm512_mask_max_epi64(lanes->max, k, lanes->max, v);
+    break;
+  case VITEMAP_COLUMN_FLOAT: {
+    __m512 values = _mm512_castsi512_ps(v);
+    __m256 low = _mm256_castpd_ps(
+        _mm512_maskz_extractf64x4_pd(0xFF, _mm512_castsi512_pd(v), 0));
+    __m256 high = _mm256_castpd_ps(
+        _mm512_maskz_extractf64x4_pd(0xFF, _mm512_castsi512_pd(v), 1));
+    lanes->float_sum = _mm512_add_pd(lanes->float_sum,
+                                     _mm512_maskz_cvtps_pd(0xFF, low));
+    lanes->float_sum = _mm512_add_pd(lanes->float_sum,
+                                     _mm512_maskz_cvtps_pd(0xFF, high));
+    lanes->float_min =
+        _mm512_mask_min_ps(lanes->float_min, k, lanes->float_min, values);
+    lanes->float_max =
+        _mm512_mask_max_ps(lanes->float_max, k, lanes->float_max, values);
+    break;
+  }
+  default: {
+    __m512d values = _mm512_castsi512_pd(v);
+    lanes->float_sum = _mm512_add_pd(lanes->float_sum, values);
+    lanes->double_min =
+        _mm512_mask_min_pd(lanes->double_min, k, lanes->double_min, values);
+    lanes->double_max =
+        _mm512_mask_max_pd(lanes->double_max, k, lanes->double_max, values);
+    break;
+  }
+  }
+}
+
+// Adds the lanes to `result`, once all buckets are aggregated.
+static inline void reduce_lanes(VitemapColumnType type,
+                                const AggregateLanes *lanes,
+                                VitemapAggregate *result) {
+  if (lanes->count == 0) {
+    return;
+  }
+  result->count += lanes->count;
+
+  if (type == VITEMAP_COLUMN_INT32 || type == VITEMAP_COLUMN_INT64) {
+    int64_t sums[8], mins[8], maxs[8];
+    int32_t narrow_mins[16], narrow_maxs[16];
+    _mm512_storeu_si512(sums, lanes->sum);
+    _mm512_storeu_si512(mins, lanes->min);
+    _mm512_storeu_si512(maxs, lanes->max);
+    _mm512_storeu_si512(narrow_mins, lanes->min);
+    _mm512_storeu_si512(narrow_maxs, lanes->max);
+    for (size_t i = 0; i < 16; i++) {
+      int64_t min = type == VITEMAP_COLUMN_INT32 ? narrow_mins[i] : mins[i % 8];
+      int64_t max = type == VITEMAP_COLUMN_INT32 ? narrow_maxs[i] : maxs[i % 8];
+      result->int_min = result->int_min < min ? result->int_min : min;
+      result->int_max = result->int_max > max ? result->int_max : max;
+    }
+    for (size_t i = 0; i < 8; i++) {
+      result->int_sum =
+          (int64_t)((uint64_t)result->int_sum + (uint64_t)sums[i]);
+    }
+    return;
+  }
+
+  double sums[8], mins[16], maxs[16];
+  _mm512_storeu_pd(sums, lanes->float_sum);
+  if (type == VITEMAP_COLUMN_FLOAT) {
+    float float_mins[16], float_maxs[16];
+    _mm512_storeu_ps(float_mins, lanes->float_min);
+    _mm512_storeu_ps(float_maxs, lanes->float_max);
+    for (size_t i = 0; i < 16; i++) {
+      mins[i] = float_mins[i];
+      maxs[i] = float_maxs[i];
+    }
+  } else {
+    _mm512_storeu_pd(mins, lanes->double_min);
+    _mm512_storeu_pd(maxs, lanes->double_max);
+    memcpy(mins + 8, mins, sizeof(double) * 8);
+    memcpy(maxs + 8, maxs, sizeof(double) * 8);
+  }
+  for (size_t i = 0; i < 16; i++) {
+    result->min = result->min < mins[i] ? result->min : mins[i];
+    result->max = result->max > maxs[i] ? result->max : maxs[i];
+  }
+  for (size_t i = 0; i < 8; i++) {
+    result->sum += sums[i];
+  }
+}
+
+// Aggregates the values at the set bits of a mask through masked loads, the
+// mask bits of 16 32-bit or 8 64-bit values at a time being the load mask.
+static inline void aggregate_mask_256(VitemapColumnType type,
+                                      const uint8_t *restrict values,
+                                      const uint64_t *restrict mask,
+                                      AggregateLanes *restrict lanes) {
+  const uint8_t *mask_bytes = (const uint8_t *)mask;
+  if (column_value_size(type) == 4) {
+    for (size_t i = 0; i < BUCKET_SIZE / 16; i++) {
+      __mmask16 k;
+      memcpy(&k, mask_bytes + 2 * i, sizeof(k));
+      __m512i v = _mm512_maskz_loadu_epi32(k, values + i * 64);
+      accumulate_lanes(type, k, v, lanes);
+    }
+  } else {
+    for (size_t i = 0; i < BUCKET_SIZE / 8; i++) {
+      __mmask8 k = mask_bytes[i];
+      __m512i v = _mm512_maskz_loadu_epi64(k, values + i * 64);
+      accumulate_lanes(type, k, v, lanes);
+    }
+  }
+}
+
+// Aggregates the values at the positions of an array bucket through masked
+// gathers, of 16 32-bit or 8 64-bit values at a time.
+static inline void aggregate_indices_256(VitemapColumnType type,
+                                         const uint8_t *restrict values,
+                                         const uint8_t *restrict indices,
+                                         size_t count,
+                                         AggregateLanes *restrict lanes) {
+  if (column_value_size(type) == 4) {
+    for (size_t i = 0; i < count; i += 16) {
+      size_t remaining = count - i;
+      __mmask16 k = remaining < 16 ? (1U << remaining) - 1 : 0xFFFF;
+      __m512i positions =
+          _mm512_maskz_cvtepu8_epi32(k, _mm_maskz_loadu_epi8(k, indices + i));
+      __m512i v = _mm512_mask_i32gather_epi32(_mm512_setzero_si512(), k,
+                                              positions, values, 4);
+      accumulate_lanes(type, k, v, lanes);
+    }
+  } else {
+    for (size_t i = 0; i < count; i += 8) {
+      size_t remaining = count - i;
+      __mmask8 k = remaining < 8 ? (1U << remaining) - 1 : 0xFF;
+      __m256i positions =
+          _mm256_maskz_cvtepu8_epi32(k, _mm_maskz_loadu_epi8(k, indices + i));
+      __m512i v = _mm512_mask_i32gather_epi64(_mm512_setzero_si512(), k,
+                                              positions, values, 8);
+      accumulate_lanes(type, k, v, lanes);
+    }
+  }
+}
+
+// Copies 64 bytes with a non-temporal store of a whole cache line.
+static inline void stream_store_512(uint8_t *restrict dst,
+                                    const uint8_t *restrict src) {
+  _mm512_stream_si512((void *)dst, _mm512_loadu_si512(src));
+}
+
+static inline void stream_fence(void) { _mm_sfence(); }
+
+#include "vite_kernels.h"
@@ -0,0 +1,313 @@
+/*
+ *  ____   ____.__  __
+ *  \   \ /   /|__|/  |_  ____   _____ _____  ______
+ *   \   Y   / |  \   __\/ __ \ /     \\__  \ \____ \
+ *    \     /  |  ||  | \  ___/|  Y Y  \/ __ \|  |_> >
+ *     \___/   |__||__|  \___  >__|_|  (____  /   __/
+ *                           \/      \/     \/|__|
+ *
+ *
+ *  Copyright (c) [2024] [Alexis Schlomer]
+ *  This project is licensed under the MIT License.
+ *  See the LICENSE file for details.
+ */
+
+// Container files holding many compressed bitmaps (see the container format
+// definitions in vite.h).
+
+#include "vite.h"
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// CRC-32C (Castagnoli, reflected) lookup tables for slicing-by-8: entry
+// [k][b] is the CRC of byte b followed by k zero bytes.
+static uint32_t crc32c_lookup[8][256] = {{0}};
+__attribute__((constructor)) static void init_crc32c_lookup(void) {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (size_t bit = 0; bit < 8; bit++) {
+      crc = crc & 1 ? (crc >> 1) ^ 0x82F63B78U : crc >> 1;
+    }
+    crc32c_lookup[0][i] = crc;
+  }
+  for (uint32_t i = 0; i < 256; i++) {
+    for (size_t k = 1; k < 8; k++) {
+      uint32_t previous = crc32c_lookup[k - 1][i];
+      crc32c_lookup[k][i] = (previous >> 8) ^ crc32c_lookup[0][previous & 0xFF];
+    }
+  }
+}
+
+static uint32_t crc32c(const uint8_t *data, size_t size) {
+  uint32_t crc = 0xFFFFFFFFU;
+  for (; size >= 8; data += 8, size -= 8) {
+    uint64_t word;
+    memcpy(&word, data, sizeof(word));
+    word ^= crc;
+    crc = crc32c_lookup[7][word & 0xFF] ^ crc32c_lookup[6][word >> 8 & 0xFF] ^
+          crc32c_lookup[5][word >> 16 & 0xFF] ^
+          crc32c_lookup[4][word >> 24 & 0xFF] ^
+          crc32c_lookup[3][word >> 32 & 0xFF] ^
+          crc32c_lookup[2][word >> 40 & 0xFF] ^
+          crc32c_lookup[1][word >> 48 & 0xFF] ^ crc32c_lookup[0][word >> 56];
+  }
+  for (; size > 0; data++, size--) {
+    crc = (crc >> 8) ^ crc32c_lookup[0][(crc ^ *data) & 0xFF];
+  }
+  return ~crc;
+}
+
+// Writes data through the sink of the writer, and then zeros up to the next
+// multiple of `alignment` bytes.
+static bool write_aligned(VitemapContainerWriter *writer, const uint8_t *data,
+                          size_t size, size_t alignment) {
+  static const uint8_t zeros[VITEMAP_CONTAINER_ALIGNMENT] = {0};
+  size_t end = writer->offset + size;
+  size_t padding = (alignment - end % alignment) % alignment;
+  if (writer->failed ||
+      (size > 0 && !writer->sink.write(writer->sink.ctx, data, size)) ||
+      (padding > 0 && !writer->sink.write(writer->sink.ctx, zeros, padding))) {
+    writer->failed = true;
+    return false;
+  }
+  writer->offset += size + padding;
+  return true;
+}
+
+VitemapContainerWriter *vitemap_container_begin(VitemapSink sink,
+                                                uint32_t flags) {
+  VitemapContainerWriter *writer = calloc(1, sizeof(VitemapContainerWriter));
+  if (writer == NULL) {
+    return NULL;
+  }
+  writer->sink = sink;
+  writer->flags = flags;
+
+  uint8_t header[VITEMAP_CONTAINER_HEADER_SIZE];
+  uint32_t version = VITEMAP_CONTAINER_VERSION;
+  memcpy(header, VITEMAP_CONTAINER_MAGIC, 8);
+  memcpy(header + 8, &version, sizeof(version));
+  memcpy(header + 12, &flags, sizeof(flags));
+  if (!write_aligned(writer, header, sizeof(header),
+                     VITEMAP_CONTAINER_ALIGNMENT)) {
+    free(writer);
+    return NULL;
+  }
+  return writer;
+}
+
+bool vitemap_container_add(VitemapContainerWriter *writer, uint64_t key,
+                           const uint8_t *compressed_data, size_t size) {
+  if (writer->failed || size > UINT32_MAX) {
+    return false;
+  }
+  if (writer->count == writer->capacity) {
+    size_t capacity = writer->capacity ? 2 * writer->capacity : 1024;
+    VitemapContainerEntry *entries =
+        realloc(writer->entries, capacity * sizeof(VitemapContainerEntry));
+    if (entries == NULL) {
+      writer->failed = true;
+      return false;
+    }
+    writer->entries = entries;
+    writer->capacity = capacity;
+  }
+
+  VitemapContainerEntry *entry = &writer->entries[writer->count];
+  entry->key = key;
+  entry->offset = writer->offset;
+  entry->size = size;
+  entry->checksum = writer->flags & VITEMAP_CONTAINER_CHECKSUMS
+                        ? crc32c(compressed_data, size)
+                        : 0;
+  if (!write_aligned(writer, compressed_data, size,
+                     VITEMAP_CONTAINER_ALIGNMENT)) {
+    return false;
+  }
+  writer->count++;
+  return true;
+}
+
+static int compare_entries(const void *a, const void *b) {
+  uint64_t key_a = ((const VitemapContainerEntry *)a)->key;
+  uint64_t key_b = ((const VitemapContainerEntry *)b)->key;
+  return (key_a > key_b) - (key_a < key_b);
+}
+
+bool vitemap_container_finish(VitemapContainerWriter *writer) {
+  qsort(writer->entries, writer->count, sizeof(VitemapContainerEntry),
+        compare_entries);
+  bool success = !writer->failed;
+  for (size_t i = 1; i < writer->count && success; i++) {
+    success = writer->entries[i - 1].key != writer->entries[i].key;
+  }
+
+  uint64_t directory_offset = writer->offset;
+  uint64_t count = writer->count;
+  size_t directory_size = writer->count * sizeof(VitemapContainerEntry);
+  uint32_t checksum =
+      writer->flags & VITEMAP_CONTAINER_CHECKSUMS
+          ? crc32c((const uint8_t *)writer->entries, directory_size)
+          : 0;
+  uint8_t footer[VITEMAP_CONTAINER_FOOTER_SIZE] = {0};
+  memcpy(footer, &directory_offset, sizeof(directory_offset));
+  memcpy(footer + 8, &count, sizeof(count));
+  memcpy(footer + 16, &checksum, sizeof(checksum));
+  memcpy(footer + 24, VITEMAP_CONTAINER_MAGIC, 8);
+
+  success = success &&
+            write_aligned(writer, (const uint8_t *)writer->entries,
+                          directory_size, 1) &&
+            write_aligned(writer, footer, sizeof(footer), 1);
+
+  free(writer->entries);
+  free(writer);
+  return success;
+}
+
+VitemapContainer *vitemap_container_wrap(const uint8_t *data, size_t size,
+                                         uint32_t flags) {
+  if (size < VITEMAP_CONTAINER_HEADER_SIZE + VITEMAP_CONTAINER_FOOTER_SIZE ||
+      (uintptr_t)data % 8 != 0 ||
+      memcmp(data, VITEMAP_CONTAINER_MAGIC, 8) != 0) {
+    return NULL;
+  }
+
+  uint32_t version, container_flags;
+  memcpy(&version, data + 8, sizeof(version));
+  memcpy(&container_flags, data + 12, sizeof(container_flags));
+
+  const uint8_t *footer = data + size - VITEMAP_CONTAINER_FOOTER_SIZE;
+  uint64_t directory_offset, count;
+  memcpy(&directory_offset, footer, sizeof(directory_offset));
+  memcpy(&count, footer + 8, sizeof(count));
+
+  // The directory must lie between the header and the footer.
+  uint64_t directory_end = size - VITEMAP_CONTAINER_FOOTER_SIZE;
+  if (version != VITEMAP_CONTAINER_VERSION ||
+      memcmp(footer + 24, VITEMAP_CONTAINER_MAGIC, 8) != 0 ||
+      directory_offset < VITEMAP_CONTAINER_HEADER_SIZE ||
+      directory_offset % VITEMAP_CONTAINER_ALIGNMENT != 0 ||
+      directory_offset > directory_end ||
+      count != (directory_end - directory_offset) /
+                   sizeof(VitemapContainerEntry) ||
+      (directory_end - directory_offset) % sizeof(VitemapContainerEntry)) {
+    return NULL;
+  }
+
+  VitemapContainer *container = calloc(1, sizeof(VitemapContainer));
+  if (container == NULL) {
+    return NULL;
+  }
+  container->data = data;
+  container->size = size;
+  container->flags = container_flags;
+  container->entries = (const VitemapContainerEntry *)(const void *)(
+      data + directory_offset);
+  container->count = count;
+
+  if ((flags & VITEMAP_CONTAINER_CHECKSUMS) &&
+      !vitemap_container_verify(container)) {
+    free(container);
+    return NULL;
+  }
+  return container;
+}
+
+VitemapContainer *vitemap_container_open(const char *path, uint32_t flags) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+    close(fd);
+    return NULL;
+  }
+
+  // The mapping stays valid once the descriptor is closed.
+  size_t size = st.st_size;
+  void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return NULL;
+  }
+
+  VitemapContainer *container = vitemap_container_wrap(data, size, flags);
+  if (container == NULL) {
+    munmap(data, size);
+    return NULL;
+  }
+  container->mapped = true;
+  return container;
+}
+
+void vitemap_container_close(VitemapContainer *container) {
+  if (container->mapped) {
+    munmap((void *)(uintptr_t)container->data, container->size);
+  }
+  free(container);
+}
+
+// Returns whether the bitmap of an entry lies between the header and the
+// directory.
+static bool entry_in_bounds(const VitemapContainer *container,
+                            const VitemapContainerEntry *entry) {
+  uint64_t directory_offset =
+      (const uint8_t *)container->entries - container->data;
+  return entry->offset >= VITEMAP_CONTAINER_HEADER_SIZE &&
+         entry->offset <= directory_offset &&
+         entry->size <= directory_offset - entry->offset;
+}
+
+bool vitemap_container_get(const VitemapContainer *container, uint64_t key,
+                           const uint8_t **compressed_data, uint32_t *size) {
+  uint64_t low = 0;
+  uint64_t high = container->count;
+  while (low < high) {
+    uint64_t middle = low + (high - low) / 2;
+    if (container->entries[middle].key < key) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+
+  const VitemapContainerEntry *entry = &container->entries[low];
+  if (low == container->count || entry->key != key ||
+      !entry_in_bounds(container, entry)) {
+    return false;
+  }
+  *compressed_data = container->data + entry->offset;
+  *size = entry->size;
+  return true;
+}
+
+bool vitemap_container_verify(const VitemapContainer *container) {
+  if (!(container->flags & VITEMAP_CONTAINER_CHECKSUMS)) {
+    return true;
+  }
+
+  uint32_t checksum;
+  const uint8_t *footer =
+      container->data + container->size - VITEMAP_CONTAINER_FOOTER_SIZE;
+  memcpy(&checksum, footer + 16, sizeof(checksum));
+  if (crc32c((const uint8_t *)container->entries,
+             container->count * sizeof(VitemapContainerEntry)) != checksum) {
+    return false;
+  }
+
+  for (uint64_t i = 0; i < container->count; i++) {
+    const VitemapContainerEntry *entry = &container->entries[i];
+    if ((i > 0 && entry[-1].key >= entry->key) ||
+        !entry_in_bounds(container, entry) ||
+        crc32c(container->data + entry->offset, entry->size) !=
+            entry->checksum) {
+      return false;
+    }
+  }
+  return true;
+}
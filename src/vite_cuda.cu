@@ -0,0 +1,107 @@
+/*
+ *  ____   ____.__  __
+ *  \   \ /   /|__|/  |_  ____   _____ _____  ______
+ *   \   Y   / |  \   __\/ __ \ /     \\__  \ \____ \
+ *    \     /  |  ||  | \  ___/|  Y Y  \/ __ \|  |_> >
+ *     \___/   |__||__|  \___  >__|_|  (____  /   __/
+ *                           \/      \/     \/|__|
+ *
+ *
+ *  Copyright (c) [2024] [Alexis Schlomer]
+ *  This project is licensed under the MIT License.
+ *  See the LICENSE file for details.
+ */
+
+// CUDA decoder of split streams (see vite_cuda.h).
+
+#include "vite_cuda.h"
+#include <cuda_runtime.h>
+
+// Threads per block of the decoding kernel
+#define THREADS_PER_BLOCK 256
+
+// Decodes one 32-bit word of the bitmap per thread. The 8 threads of a bucket
+// read the same header and payload, which the caches serve once.
+__global__ static void decompress_split_kernel(const uint8_t *headers,
+                                               const uint64_t *offsets,
+                                               const uint8_t *payload,
+                                               size_t num_words,
+                                               uint32_t *words) {
+  size_t word = (size_t)blockIdx.x * blockDim.x + threadIdx.x;
+  if (word >= num_words) {
+    return;
+  }
+  size_t bucket = word / BUCKET_SIZE_U32;
+  uint32_t lane = word % BUCKET_SIZE_U32;
+  uint8_t bucket_size = headers[bucket] & 0x3F;
+  uint8_t category = headers[bucket] >> 6;
+  const uint8_t *bucket_payload = payload + offsets[bucket];
+
+  uint32_t value = 0;
+  if (category == 2) {
+    const uint8_t *bytes = bucket_payload + 4 * lane;
+    value = bytes[0] | bytes[1] << 8 | bytes[2] << 16 |
+            (uint32_t)bytes[3] << 24;
+  } else {
+    // Arrays and inverted arrays: the indices falling in the word of the
+    // thread, inverted for category 1.
+    for (uint8_t i = 0; i < bucket_size; i++) {
+      uint8_t index = bucket_payload[i];
+      if (index / 32 == lane) {
+        value |= 1U << (index % 32);
+      }
+    }
+    value ^= -(uint32_t)(category == 1);
+  }
+  words[word] = value;
+}
+
+bool vitemap_cuda_decompress_device(const uint8_t *headers,
+                                    const uint64_t *offsets,
+                                    const uint8_t *payload, size_t num_buckets,
+                                    uint8_t *decompressed_data, void *stream) {
+  size_t num_words = num_buckets * BUCKET_SIZE_U32;
+  if (num_words == 0) {
+    return true;
+  }
+  size_t num_blocks = (num_words + THREADS_PER_BLOCK - 1) / THREADS_PER_BLOCK;
+  decompress_split_kernel<<<num_blocks, THREADS_PER_BLOCK, 0,
+                            (cudaStream_t)stream>>>(
+      headers, offsets, payload, num_words, (uint32_t *)decompressed_data);
+  return cudaGetLastError() == cudaSuccess;
+}
+
+bool vitemap_cuda_decompress(const VitemapSplit *split,
+                             uint8_t *decompressed_data) {
+  size_t headers_size = split->num_buckets;
+  size_t offsets_size = (split->num_buckets + 1) * sizeof(uint64_t);
+  size_t payload_size =
+      split->offsets[split->num_buckets] + VITEMAP_SPLIT_PADDING;
+  size_t output_size = split->num_buckets * BUCKET_SIZE_U8;
+
+  // All arrays share one allocation, those of wider elements first so that
+  // they stay aligned.
+  uint8_t *device = NULL;
+  if (cudaMalloc(&device, offsets_size + output_size + headers_size +
+                              payload_size) != cudaSuccess) {
+    return false;
+  }
+  uint64_t *offsets = (uint64_t *)device;
+  uint8_t *output = device + offsets_size;
+  uint8_t *headers = output + output_size;
+  uint8_t *payload = headers + headers_size;
+
+  bool success =
+      cudaMemcpy(offsets, split->offsets, offsets_size,
+                 cudaMemcpyHostToDevice) == cudaSuccess &&
+      cudaMemcpy(headers, split->headers, headers_size,
+                 cudaMemcpyHostToDevice) == cudaSuccess &&
+      cudaMemcpy(payload, split->payload, payload_size,
+                 cudaMemcpyHostToDevice) == cudaSuccess &&
+      vitemap_cuda_decompress_device(headers, offsets, payload,
+                                     split->num_buckets, output, NULL) &&
+      cudaMemcpy(decompressed_data, output, output_size,
+                 cudaMemcpyDeviceToHost) == cudaSuccess;
+  cudaFree(device);
+  return success;
+}
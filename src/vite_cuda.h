@@ -0,0 +1,70 @@
+/*
+ *  ____   ____.__  __
+ *  \   \ /   /|__|/  |_  ____   _____ _____  ______
+ *   \   Y   / |  \   __\/ __ \ /     \\__  \ \____ \
+ *    \     /  |  ||  | \  ___/|  Y Y  \/ __ \|  |_> >
+ *     \___/   |__||__|  \___  >__|_|  (____  /   __/
+ *                           \/      \/     \/|__|
+ *
+ *
+ *  Copyright (c) [2024] [Alexis Schlomer]
+ *  This project is licensed under the MIT License.
+ *  See the LICENSE file for details.
+ */
+
+// Decompression of split streams (see `VitemapSplit`) on CUDA devices.
+//
+// Only built by `make cuda`, which requires nvcc: link target/obj/vite_cuda.o
+// and the CUDA runtime (-lcudart) along with the rest of the library. Every
+// device thread decodes one 32-bit word of the bitmap from the header, offset
+// and payload of its bucket, so that the writes of a warp are coalesced. The
+// output is the same as `vitemap_split_decompress`.
+
+#ifndef VITE_CUDA_H
+#define VITE_CUDA_H
+
+#include "vite.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Decompresses split stream arrays already on the device
+ *
+ * @param headers Device copy of `split->headers`
+ * @param offsets Device copy of `split->offsets`
+ * @param payload Device copy of `split->payload`, with its padding
+ * @param num_buckets Number of buckets
+ * @param decompressed_data Device buffer of `num_buckets * 32` bytes, aligned
+ * on 4 bytes
+ * @param stream CUDA stream (`cudaStream_t`) of the launch, or NULL for the
+ * default stream
+ * @return Whether the kernel was launched
+ *
+ * The launch is asynchronous: the output is ready once the stream is
+ * synchronized. Calls on different streams decode a batch of bitmaps at once.
+ */
+bool vitemap_cuda_decompress_device(const uint8_t *headers,
+                                    const uint64_t *offsets,
+                                    const uint8_t *payload, size_t num_buckets,
+                                    uint8_t *decompressed_data, void *stream);
+
+/**
+ * Decompresses a split stream on the current device
+ *
+ * @param split Pointer to the split stream, in host memory
+ * @param decompressed_data Host buffer of the bitmap, rounded up to 32 bytes
+ * @return Whether every allocation, copy and launch succeeded
+ *
+ * Copies the arrays to the device, decodes them, and copies the bitmap back,
+ * synchronously.
+ */
+bool vitemap_cuda_decompress(const VitemapSplit *split,
+                             uint8_t *decompressed_data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // VITE_CUDA_H
@@ -0,0 +1,211 @@
+/*
+ *  ____   ____.__  __
+ *  \   \ /   /|__|/  |_  ____   _____ _____  ______
+ *   \   Y   / |  \   __\/ __ \ /     \\__  \ \____ \
+ *    \     /  |  ||  | \  ___/|  Y Y  \/ __ \|  |_> >
+ *     \___/   |__||__|  \___  >__|_|  (____  /   __/
+ *                           \/      \/     \/|__|
+ *
+ *
+ *  Copyright (c) [2024] [Alexis Schlomer]
+ *  This project is licensed under the MIT License.
+ *  See the LICENSE file for details.
+ */
+
+// Compression and decompression between file descriptors, through
+// memory-mapped files whenever possible.
+
+#define _GNU_SOURCE
+#include "vite.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Chunk size of reads from descriptors that cannot be mapped
+#define READ_CHUNK_SIZE (1 << 20)
+
+// Whole contents of an input descriptor, mapped or read into memory.
+typedef struct {
+  const uint8_t *data; // First byte at the offset of the descriptor
+  size_t size;         // Number of bytes from that offset
+  void *mapping;       // Mapping of the whole file, or NULL if read
+  size_t mapping_size; // Size of the mapping
+} FileInput;
+
+// Destination of an output descriptor, mapped or buffered in memory.
+typedef struct {
+  int fd;
+  uint8_t *data;   // Buffer of `capacity` bytes
+  size_t capacity; // Maximum number of bytes written, including any slack
+  bool mapped;     // Whether `data` is a shared mapping of the file
+} FileOutput;
+
+// Reads the rest of a descriptor that cannot be mapped into memory.
+static bool read_input(int fd, FileInput *input) {
+  size_t capacity = READ_CHUNK_SIZE;
+  uint8_t *data = malloc(capacity);
+  size_t size = 0;
+  while (data != NULL) {
+    if (size == capacity) {
+      uint8_t *grown = realloc(data, 2 * capacity);
+      if (grown == NULL) {
+        break;
+      }
+      data = grown;
+      capacity *= 2;
+    }
+    ssize_t bytes = read(fd, data + size, capacity - size);
+    if (bytes == 0) {
+      input->data = data;
+      input->size = size;
+      input->mapping = NULL;
+      return true;
+    }
+    if (bytes < 0) {
+      break;
+    }
+    size += bytes;
+  }
+  free(data);
+  return false;
+}
+
+// Maps a regular file from the offset of its descriptor, or reads any other
+// descriptor (and empty files, which cannot be mapped) into memory.
+static bool open_input(int fd, FileInput *input) {
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    return false;
+  }
+  off_t offset = lseek(fd, 0, SEEK_CUR);
+  if (!S_ISREG(st.st_mode) || offset < 0 || offset >= st.st_size) {
+    return read_input(fd, input);
+  }
+
+  void *mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (mapping == MAP_FAILED) {
+    return read_input(fd, input);
+  }
+  madvise(mapping, st.st_size, MADV_SEQUENTIAL);
+  input->data = (const uint8_t *)mapping + offset;
+  input->size = st.st_size - offset;
+  input->mapping = mapping;
+  input->mapping_size = st.st_size;
+  return true;
+}
+
+static void close_input(FileInput *input) {
+  if (input->mapping != NULL) {
+    munmap(input->mapping, input->mapping_size);
+  } else {
+    free((void *)(uintptr_t)input->data);
+  }
+}
+
+// Maps `capacity` bytes of a regular output file at its start, and allocates
+// a buffer for any other output. The blocks of the mapping are reserved first,
+// as running out of space while writing to it would raise SIGBUS instead of
+// failing.
+static bool open_output(int fd, size_t capacity, FileOutput *output) {
+  output->fd = fd;
+  output->capacity = capacity;
+  struct stat st;
+  if (capacity > 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+      (fcntl(fd, F_GETFL) & O_ACCMODE) == O_RDWR &&
+      lseek(fd, 0, SEEK_CUR) == 0) {
+    void *mapping = MAP_FAILED;
+    if (posix_fallocate(fd, 0, capacity) == 0) {
+      mapping = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (mapping != MAP_FAILED) {
+      output->data = mapping;
+      output->mapped = true;
+      return true;
+    }
+    // The output is written from its start either way: drop any reservation.
+    if (ftruncate(fd, 0) != 0) {
+      return false;
+    }
+  }
+
+  // Also reached for files opened write-only, which cannot be mapped.
+  output->data = malloc(capacity > 0 ? capacity : 1);
+  output->mapped = false;
+  return output->data != NULL;
+}
+
+// Writes the first `size` bytes of the output, and releases it.
+static bool close_output(FileOutput *output, size_t size) {
+  if (output->mapped) {
+    bool unmapped = munmap(output->data, output->capacity) == 0;
+    return unmapped && ftruncate(output->fd, size) == 0;
+  }
+
+  bool written = true;
+  for (size_t offset = 0; offset < size && written;) {
+    ssize_t bytes = write(output->fd, output->data + offset, size - offset);
+    written = bytes > 0;
+    offset += written ? (size_t)bytes : 0;
+  }
+  free(output->data);
+  return written;
+}
+
+bool vitemap_compress_file(int input_fd, int output_fd, uint32_t flags,
+                           unsigned num_threads, uint64_t *compressed_size) {
+  FileInput input;
+  if (!open_input(input_fd, &input)) {
+    return false;
+  }
+  FileOutput output;
+  if (!open_output(output_fd, vitemap_max_compressed_size(input.size),
+                   &output)) {
+    close_input(&input);
+    return false;
+  }
+
+  size_t size = vitemap_compress_buffer_parallel(input.data, input.size,
+                                                 output.data, flags,
+                                                 num_threads);
+  close_input(&input);
+  if (compressed_size != NULL) {
+    *compressed_size = size;
+  }
+  return close_output(&output, size);
+}
+
+bool vitemap_decompress_file(int input_fd, int output_fd, unsigned num_threads,
+                             uint64_t *decompressed_size) {
+  FileInput input;
+  if (!open_input(input_fd, &input)) {
+    return false;
+  }
+  if (vitemap_validate(input.data, input.size) != VITEMAP_OK) {
+    close_input(&input);
+    return false;
+  }
+  size_t size = 0;
+  size_t buffer_size = 0;
+  vitemap_extract_decompressed_sizes64(input.data, &size, &buffer_size);
+  FileOutput output;
+  if (!open_output(output_fd, buffer_size, &output)) {
+    close_input(&input);
+    return false;
+  }
+
+  // The single-threaded path switches to non-temporal stores for large files.
+  if (num_threads > 1) {
+    vitemap_decompress_parallel(input.data, input.size, output.data,
+                                num_threads);
+  } else {
+    vitemap_decompress(input.data, input.size, output.data);
+  }
+  close_input(&input);
+  if (decompressed_size != NULL) {
+    *decompressed_size = size;
+  }
+  return close_output(&output, size);
+}
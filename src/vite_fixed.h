@@ -0,0 +1,108 @@
+/*
+ *  ____   ____.__  __
+ *  \   \ /   /|__|/  |_  ____   _____ _____  ______
+ *   \   Y   / |  \   __\/ __ \ /     \\__  \ \____ \
+ *    \     /  |  ||  | \  ___/|  Y Y  \/ __ \|  |_> >
+ *     \___/   |__||__|  \___  >__|_|  (____  /   __/
+ *                           \/      \/     \/|__|
+ *
+ *
+ *  Copyright (c) [2024] [Alexis Schlomer]
+ *  This project is licensed under the MIT License.
+ *  See the LICENSE file for details.
+ */
+
+// Compression of bitmaps whose size is known at compile time.
+//
+// Every size of VITEMAP_FIXED_SIZES has its own kernels, in every instruction
+// set, with a constant number of buckets: their loops are unrolled, and they
+// have no flags, index, runs or partial bucket to handle. They write and read
+// legacy streams, the same as `vitemap_compress_buffer` with no flags.
+//
+// `vitemap_compress_fixed` and `vitemap_decompress_fixed` pick the kernels of
+// their size, and fall back to the generic functions for other sizes. When
+// the size is a constant, the choice is made by the compiler, and a call costs
+// the same as calling the kernels of its size directly.
+
+#ifndef VITE_FIXED_H
+#define VITE_FIXED_H
+
+#include "vite.h"
+
+// Bitmap sizes, in bits, with specialized kernels
+#define VITEMAP_FIXED_SIZES(X) X(4096) X(8192) X(16384) X(32768) X(65536)
+
+// For every size of VITEMAP_FIXED_SIZES, e.g. 4096 bits:
+//
+//   size_t vitemap_compress_fixed_4096(const uint8_t *input, uint8_t *output)
+//
+// compresses the 4096 / 8 bytes of input into output, of at least
+// `vitemap_max_compressed_size(4096 / 8)` bytes, and returns the compressed
+// size, producing the same stream as `vitemap_compress_buffer` with no flags.
+//
+//   void vitemap_decompress_fixed_4096(const uint8_t *compressed_data,
+//                                      size_t size,
+//                                      uint8_t *decompressed_data)
+//
+// decompresses `size` bytes of compressed data holding a bitmap of 4096 bits
+// into its 4096 / 8 bytes. Legacy streams are decoded by the kernels of the
+// size, and any other stream (e.g. with runs) by `vitemap_decompress`.
+#define VITEMAP_DECLARE_FIXED(bits)                                            \
+  size_t vitemap_compress_fixed_##bits(const uint8_t *input, uint8_t *output); \
+  void vitemap_decompress_fixed_##bits(const uint8_t *compressed_data,         \
+                                       size_t size,                            \
+                                       uint8_t *decompressed_data);
+VITEMAP_FIXED_SIZES(VITEMAP_DECLARE_FIXED)
+#undef VITEMAP_DECLARE_FIXED
+
+/**
+ * Compresses a bitmap, with the kernels of its size if it has any
+ *
+ * @param input Pointer to the bitmap
+ * @param size Size of the bitmap in bytes, best known at compile time
+ * @param output Buffer of at least `vitemap_max_compressed_size(size)` bytes
+ * @return Size of the compressed data
+ *
+ * Same as `vitemap_compress_buffer(input, size, output, 0)`.
+ */
+static inline size_t vitemap_compress_fixed(const uint8_t *input, size_t size,
+                                            uint8_t *output) {
+  switch (size) {
+#define VITEMAP_COMPRESS_FIXED(bits)                                           \
+  case (bits) / 8:                                                             \
+    return vitemap_compress_fixed_##bits(input, output);
+    VITEMAP_FIXED_SIZES(VITEMAP_COMPRESS_FIXED)
+#undef VITEMAP_COMPRESS_FIXED
+  default:
+    return vitemap_compress_buffer(input, size, output, 0);
+  }
+}
+
+/**
+ * Decompresses a bitmap, with the kernels of its size if it has any
+ *
+ * @param compressed_data Pointer to the compressed data
+ * @param size Size of the compressed data
+ * @param decompressed_size Size of the bitmap in bytes, best known at compile
+ * time
+ * @param decompressed_data Buffer of the bitmap, rounded up to 32 bytes
+ *
+ * Same as `vitemap_decompress`, for a bitmap of `decompressed_size` bytes.
+ */
+static inline void vitemap_decompress_fixed(const uint8_t *compressed_data,
+                                            size_t size,
+                                            size_t decompressed_size,
+                                            uint8_t *decompressed_data) {
+  switch (decompressed_size) {
+#define VITEMAP_DECOMPRESS_FIXED(bits)                                         \
+  case (bits) / 8:                                                             \
+    vitemap_decompress_fixed_##bits(compressed_data, size, decompressed_data); \
+    return;
+    VITEMAP_FIXED_SIZES(VITEMAP_DECOMPRESS_FIXED)
+#undef VITEMAP_DECOMPRESS_FIXED
+  default:
+    vitemap_decompress(compressed_data, size, decompressed_data);
+  }
+}
+
+#endif // VITE_FIXED_H
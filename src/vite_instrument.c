@@ -0,0 +1,140 @@
+/*
+ *  ____   ____.__  __
+ *  \   \ /   /|__|/  |_  ____   _____ _____  ______
+ *   \   Y   / |  \   __\/ __ \ /     \\__  \ \____ \
+ *    \     /  |  ||  | \  ___/|  Y Y  \/ __ \|  |_> >
+ *     \___/   |__||__|  \___  >__|_|  (____  /   __/
+ *                           \/      \/     \/|__|
+ *
+ *
+ *  Copyright (c) [2024] [Alexis Schlomer]
+ *  This project is licensed under the MIT License.
+ *  See the LICENSE file for details.
+ */
+
+// Hardware performance counters of instrumented builds (see the
+// instrumentation definitions in vite.h). Only compiled with
+// VITEMAP_INSTRUMENTATION.
+
+#define _GNU_SOURCE // syscall
+#include "vite.h"
+#include "vite_internal.h"
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define NUM_EVENTS 5
+
+// Counted events, in the order of the counters of VitemapCounters.
+static const struct {
+  uint32_t type;
+  uint64_t config;
+} events[NUM_EVENTS] = {
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+                             PERF_COUNT_HW_CACHE_OP_READ << 8 |
+                             PERF_COUNT_HW_CACHE_RESULT_MISS << 16},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+};
+
+// Counters of a thread, opened as one group so that they are enabled and read
+// together. Events the CPU does not support are left out of the group.
+typedef struct {
+  bool opened;              // Whether the group was opened
+  int fds[NUM_EVENTS];      // Descriptors of the group, leader first
+  size_t group[NUM_EVENTS]; // Events of the group, in read order
+  size_t num_events;        // Number of events of the group
+  VitemapStats stats;       // Statistics of the thread
+} ThreadCounters;
+
+static _Thread_local ThreadCounters counters;
+
+// Closes the counters of exiting threads.
+static pthread_key_t counters_key;
+static pthread_once_t counters_key_once = PTHREAD_ONCE_INIT;
+
+static void close_counters(void *arg) {
+  ThreadCounters *thread_counters = arg;
+  for (size_t i = 0; i < thread_counters->num_events; i++) {
+    close(thread_counters->fds[i]);
+  }
+  thread_counters->num_events = 0;
+}
+
+static void create_counters_key(void) {
+  pthread_key_create(&counters_key, close_counters);
+}
+
+static void open_counters(void) {
+  counters.opened = true;
+  for (size_t event = 0; event < NUM_EVENTS; event++) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = events[event].type;
+    attr.config = events[event].config;
+    attr.disabled = counters.num_events == 0;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+
+    int leader = counters.num_events > 0 ? counters.fds[0] : -1;
+    int fd = syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+    if (fd >= 0) {
+      counters.fds[counters.num_events] = fd;
+      counters.group[counters.num_events++] = event;
+    }
+  }
+
+  if (counters.num_events > 0) {
+    pthread_once(&counters_key_once, create_counters_key);
+    pthread_setspecific(counters_key, &counters);
+  }
+  counters.stats.counters_available = counters.num_events > 0;
+}
+
+void instrument_begin(void) {
+  if (!counters.opened) {
+    open_counters();
+  }
+  if (counters.num_events > 0) {
+    ioctl(counters.fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(counters.fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  }
+}
+
+VitemapCounters *instrument_end(bool compress) {
+  VitemapCounters *totals =
+      compress ? &counters.stats.compress : &counters.stats.decompress;
+  totals->calls++;
+  if (counters.num_events == 0) {
+    return totals;
+  }
+
+  ioctl(counters.fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+  uint64_t values[1 + NUM_EVENTS];
+  if (read(counters.fds[0], values, sizeof(values)) <= 0) {
+    return totals;
+  }
+
+  uint64_t *fields[NUM_EVENTS] = {&totals->cycles, &totals->instructions,
+                                  &totals->branch_misses, &totals->l1d_misses,
+                                  &totals->llc_misses};
+  for (size_t i = 0; i < values[0] && i < counters.num_events; i++) {
+    *fields[counters.group[i]] += values[1 + i];
+  }
+  return totals;
+}
+
+void vitemap_get_stats(VitemapStats *stats) { *stats = counters.stats; }
+
+void vitemap_reset_stats(void) {
+  bool counters_available = counters.stats.counters_available;
+  memset(&counters.stats, 0, sizeof(counters.stats));
+  counters.stats.counters_available = counters_available;
+}
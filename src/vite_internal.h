@@ -0,0 +1,270 @@
+/*
+ *  ____   ____.__  __
+ *  \   \ /   /|__|/  |_  ____   _____ _____  ______
+ *   \   Y   / |  \   __\/ __ \ /     \\__  \ \____ \
+ *    \     /  |  ||  | \  ___/|  Y Y  \/ __ \|  |_> >
+ *     \___/   |__||__|  \___  >__|_|  (____  /   __/
+ *                           \/      \/     \/|__|
+ *
+ *
+ *  Copyright (c) [2024] [Alexis Schlomer]
+ *  This project is licensed under the MIT License.
+ *  See the LICENSE file for details.
+ */
+
+// Internal definitions shared by the generic code (vite.c) and the
+// instruction set specific kernels (vite_<isa>.c). Not part of the public API.
+
+#ifndef VITE_INTERNAL_H
+#define VITE_INTERNAL_H
+
+#include "vite.h"
+#include "vite_fixed.h"
+#include <string.h>
+
+// Upper bound on the number of bytes touched past the output pointer when
+// encoding a bucket: the SIMD stores of the compaction may start after the
+// header and up to 31 compacted indices, and write up to 64B.
+#define COMPRESS_BUCKET_OVERRUN (1 + (BUCKET_SIZE_U8 - 1) + 64)
+
+// Distance in bytes of the prefetches of the compressed data, when decoding
+// outputs much larger than the caches.
+#define STREAMING_PREFETCH 512
+
+// Run buckets (category 3) have a 1-byte payload, with the fill of the run in
+// bit 7 and its number of buckets minus one in bits 0-5.
+#define RUN_HEADER (0b11000000 | 1) // Header of every run bucket
+#define RUN_FULL 0x80               // Payload bit of runs of full buckets
+#define RUN_LENGTH_MASK 0x3F        // Payload bits of the run length
+
+// Returns the number of buckets encoded by the bucket whose header is at
+// `compressed_data`, which is only above 1 for runs.
+static inline uint32_t bucket_span(const uint8_t *compressed_data) {
+  return *compressed_data >> 6 == 3
+             ? (compressed_data[1] & RUN_LENGTH_MASK) + 1U
+             : 1U;
+}
+
+// Returns the number of buckets encoded by the bucket whose header is at
+// `compressed_data`, the `bucket`-th of `num_buckets`, or 0 if it is invalid:
+// if it extends past `end`, if its size does not match its category, or if a
+// run extends past the last bucket or across a multiple of
+// VITEMAP_INDEX_STRIDE buckets. The indices of arrays are not checked, as
+// decoding them is safe in any order.
+static inline size_t checked_span(const uint8_t *compressed_data,
+                                  const uint8_t *end, size_t bucket,
+                                  size_t num_buckets) {
+  if (compressed_data >= end) {
+    return 0;
+  }
+  uint8_t bucket_size = *compressed_data & 0x3F;
+  const uint8_t *payload = compressed_data + 1;
+  if ((size_t)(end - payload) < bucket_size) {
+    return 0;
+  }
+
+  switch (*compressed_data >> 6) {
+  case 2:
+    return bucket_size == BUCKET_SIZE_U8;
+  case 3: {
+    size_t span = (*payload & RUN_LENGTH_MASK) + 1U;
+    return *compressed_data == RUN_HEADER &&
+                   (*payload & ~(RUN_FULL | RUN_LENGTH_MASK)) == 0 &&
+                   span <= num_buckets - bucket &&
+                   bucket % VITEMAP_INDEX_STRIDE + span <= VITEMAP_INDEX_STRIDE
+               ? span
+               : 0;
+  }
+  default:
+    return bucket_size < BUCKET_SIZE_U8;
+  }
+}
+
+// Returns the size in bytes of the values of a column.
+static inline size_t column_value_size(VitemapColumnType type) {
+  return type == VITEMAP_COLUMN_INT64 || type == VITEMAP_COLUMN_DOUBLE ? 8 : 4;
+}
+
+// Adds the value of a column at `position` (relative to `values`) to an
+// aggregate. Minimums and maximums keep the accumulated value unless the new
+// one compares lower or greater, as the AVX-512 instructions do.
+static inline void aggregate_value(VitemapColumnType type,
+                                   const uint8_t *values, size_t position,
+                                   VitemapAggregate *result) {
+  int64_t int_value;
+  double value;
+  switch (type) {
+  case VITEMAP_COLUMN_INT32: {
+    int32_t v;
+    memcpy(&v, values + position * sizeof(v), sizeof(v));
+    int_value = v;
+    break;
+  }
+  case VITEMAP_COLUMN_INT64:
+    memcpy(&int_value, values + position * sizeof(int_value),
+           sizeof(int_value));
+    break;
+  case VITEMAP_COLUMN_FLOAT: {
+    float v;
+    memcpy(&v, values + position * sizeof(v), sizeof(v));
+    value = v;
+    break;
+  }
+  default:
+    memcpy(&value, values + position * sizeof(value), sizeof(value));
+    break;
+  }
+
+  result->count++;
+  if (type == VITEMAP_COLUMN_INT32 || type == VITEMAP_COLUMN_INT64) {
+    result->int_sum =
+        (int64_t)((uint64_t)result->int_sum + (uint64_t)int_value);
+    result->int_min = result->int_min < int_value ? result->int_min : int_value;
+    result->int_max = result->int_max > int_value ? result->int_max : int_value;
+  } else {
+    result->sum += value;
+    result->min = result->min < value ? result->min : value;
+    result->max = result->max > value ? result->max : value;
+  }
+}
+
+// Layout of a compressed stream, resolved from its header.
+typedef struct {
+  size_t size;            // Decompressed size in bytes
+  size_t num_buckets;     // Number of encoded buckets
+  uint32_t flags;         // Stream format flags (VITEMAP_FLAG_*)
+  uint32_t stride_log2;   // log2 of the buckets per index entry
+  const uint8_t *index;   // Bucket offset index, 32 or 64-bit (or NULL)
+  const uint8_t *counts;  // Unaligned uint64_t set bit counts (or NULL)
+  const uint8_t *payload; // First encoded bucket
+  const uint8_t *end;     // End of the compressed data
+} StreamInfo;
+
+// Bucket kernels of one instruction set. All kernels produce exactly the same
+// output, whatever the instruction set.
+typedef struct {
+  VitemapIsa isa;
+
+  // Encodes consecutive buckets and returns the number of bytes written.
+  // Up to COMPRESS_BUCKET_OVERRUN bytes past the encoded data may be touched.
+  // With `runs`, stretches of empty or full buckets are encoded as runs, which
+  // requires input to start on a multiple of VITEMAP_INDEX_STRIDE buckets.
+  size_t (*compress_buckets)(const uint8_t *input, size_t num_buckets,
+                             bool runs, uint8_t *output,
+                             uint8_t *helper_bucket);
+
+  // Same as `compress_buckets`, with the number of set bits of every bucket
+  // given by `cardinalities` instead of being computed.
+  size_t (*compress_counted_buckets)(const uint8_t *input,
+                                     const uint16_t *cardinalities,
+                                     size_t num_buckets, bool runs,
+                                     uint8_t *output,
+                                     uint8_t *helper_bucket);
+
+  // Encodes the first `size` bytes of input (less than a bucket) as a
+  // zero-padded bucket, without reading past them (see `compress_buckets`
+  // for overruns).
+  size_t (*compress_partial_bucket)(const uint8_t *input, size_t size,
+                                    uint8_t *output, uint8_t *helper_bucket);
+
+  // Returns the encoded size of consecutive buckets, without encoding them.
+  size_t (*measure_buckets)(const uint8_t *input, size_t num_buckets,
+                            bool runs);
+
+  // The following kernels walk consecutive encoded buckets. A run that extends
+  // past the last bucket is only partially accounted for, and the returned
+  // pointer is then past the whole run.
+
+  // Decodes consecutive buckets and returns a pointer past the last one.
+  const uint8_t *(*decompress_buckets)(const uint8_t *compressed_data,
+                                       size_t num_buckets,
+                                       uint8_t *decompressed_data);
+
+  // Same as `decompress_buckets`, writing whole cache lines of
+  // `decompressed_data` with non-temporal stores, for outputs much larger
+  // than the caches.
+  const uint8_t *(*decompress_streaming_buckets)(
+      const uint8_t *compressed_data, size_t num_buckets,
+      uint8_t *decompressed_data);
+
+  // Same as `decompress_buckets`, on untrusted data ending at `end`: returns
+  // NULL as soon as a bucket is invalid (see `checked_span`), having written
+  // at most `num_buckets` decoded buckets.
+  const uint8_t *(*decompress_checked_buckets)(const uint8_t *compressed_data,
+                                               const uint8_t *end,
+                                               size_t num_buckets,
+                                               uint8_t *decompressed_data);
+
+  // Decodes consecutive buckets of a split stream (see `VitemapSplit`), none
+  // of which may be a run, from their headers and payload offsets alone.
+  void (*decompress_split_buckets)(const uint8_t *headers,
+                                   const uint64_t *offsets,
+                                   const uint8_t *payload, size_t num_buckets,
+                                   uint8_t *decompressed_data);
+
+  // Adds the set bits of consecutive encoded buckets to `cardinality`, and
+  // returns a pointer past the last one.
+  const uint8_t *(*count_buckets)(const uint8_t *compressed_data,
+                                  size_t num_buckets, uint64_t *cardinality);
+
+  // Writes the positions of the set bits of consecutive encoded buckets, the
+  // first bit being at `first_position`, and returns their number.
+  size_t (*extract_positions)(const uint8_t *compressed_data,
+                              size_t num_buckets, uint32_t first_position,
+                              uint32_t *positions);
+
+  // Computes `a op b` on two encoded buckets, none of which may be a run,
+  // writes the encoded result to output, and returns the number of bytes
+  // written (see `compress_buckets` for overruns).
+  size_t (*operate_bucket)(VitemapOperation op, const uint8_t *a,
+                           const uint8_t *b, uint8_t *output,
+                           uint8_t *helper_bucket);
+
+  // Evaluates a well-formed expression on one encoded bucket of each of its
+  // inputs, none of which may be a run, writes the encoded result to output,
+  // and returns the number of bytes written (see `compress_buckets` for
+  // overruns).
+  size_t (*evaluate_bucket)(const VitemapStep *steps, size_t num_steps,
+                            const uint8_t *const *buckets, uint8_t *output,
+                            uint8_t *helper_bucket);
+
+  // Adds the values of `column` at the set bits of consecutive encoded buckets
+  // to `result`, ignoring the bits at or past `num_values` (see
+  // `vitemap_aggregate`).
+  void (*aggregate_buckets)(const uint8_t *compressed_data, size_t num_buckets,
+                            const uint8_t *column, VitemapColumnType type,
+                            uint64_t num_values, VitemapAggregate *result);
+
+  // Copies `size` bytes, a multiple of 64, to `dst`, aligned on 64 bytes, with
+  // non-temporal stores where available (see `decompress_streaming_buckets`).
+  void (*stream_copy)(uint8_t *dst, const uint8_t *src, size_t size);
+
+  // Compress and decompress bitmaps of each of VITEMAP_FIXED_SIZES, as legacy
+  // streams (see vite_fixed.h). Decompression starts at the first bucket.
+#define FIXED_KERNEL_ENTRIES(bits)                                             \
+  size_t (*compress_fixed_##bits)(const uint8_t *input, uint8_t *output);      \
+  void (*decompress_fixed_##bits)(const uint8_t *compressed_data,              \
+                                  uint8_t *decompressed_data);
+  VITEMAP_FIXED_SIZES(FIXED_KERNEL_ENTRIES)
+#undef FIXED_KERNEL_ENTRIES
+} VitemapKernels;
+
+extern const VitemapKernels vitemap_kernels_scalar;
+extern const VitemapKernels vitemap_kernels_avx2;
+extern const VitemapKernels vitemap_kernels_avx512;
+
+// Lookup tables, filled at load time by vite.c.
+extern uint64_t vitemap_bit_lookup[BUCKET_SIZE][4]; // Bucket with bit i set
+extern uint8_t vitemap_indices[BUCKET_SIZE];        // Identity permutation
+extern uint64_t vitemap_byte_positions[256]; // Packed set bit positions
+
+#ifdef VITEMAP_INSTRUMENTATION
+// Starts the hardware counters of the calling thread (see vite_instrument.c).
+void instrument_begin(void);
+
+// Stops the hardware counters of the calling thread, adds them to the totals
+// of the compression or decompression operation, and returns these totals.
+VitemapCounters *instrument_end(bool compress);
+#endif
+
+#endif // VITE_INTERNAL_H
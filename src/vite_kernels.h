@@ -0,0 +1,837 @@
+/*
+ *  ____   ____.__  __
+ *  \   \ /   /|__|/  |_  ____   _____ _____  ______
+ *   \   Y   / |  \   __\/ __ \ /     \\__  \ \____ \
+ *    \     /  |  ||  | \  ___/|  Y Y  \/ __ \|  |_> >
+ *     \___/   |__||__|  \___  >__|_|  (____  /   __/
+ *                           \/      \/     \/|__|
+ *
+ *
+ *  Copyright (c) [2024] [Alexis Schlomer]
+ *  This project is licensed under the MIT License.
+ *  See the LICENSE file for details.
+ */
+
+// Bucket kernels, written once for all instruction sets.
+//
+// This file is included by every vite_<isa>.c, which are compiled with their
+// own instruction set flags. Before including it, they define:
+//
+//   KERNELS      Name of the resulting VitemapKernels table
+//   KERNELS_ISA  Matching VitemapIsa value
+//
+// as well as the following primitives, all operating on one 256-bit bucket:
+//
+//   size_t popcount_256(const uint8_t *src)
+//   void load_partial_256(const uint8_t *src, size_t size, uint8_t *dst)
+//   void extract_and_compact_256(const uint64_t *src, uint8_t *dst)
+//   void expand_and_scatter_256(const uint8_t *src, size_t size, bool invert,
+//                               uint8_t *dst)
+//   void widen_positions(const uint8_t *src, size_t size, uint32_t base,
+//                        uint32_t *dst)
+//   void invert_256(const uint8_t *src, uint8_t *dst)
+//   size_t uniform_buckets(const uint8_t *src, size_t max_buckets,
+//                          uint8_t fill)
+//   void bitwise_256(VitemapOperation op, const uint8_t *a, const uint8_t *b,
+//                    uint8_t *dst)
+//   AggregateLanes init_lanes(VitemapColumnType type)
+//   void aggregate_mask_256(VitemapColumnType type, const uint8_t *values,
+//                           const uint64_t *mask, AggregateLanes *lanes)
+//   void aggregate_indices_256(VitemapColumnType type, const uint8_t *values,
+//                              const uint8_t *indices, size_t count,
+//                              AggregateLanes *lanes)
+//   void reduce_lanes(VitemapColumnType type, const AggregateLanes *lanes,
+//                     VitemapAggregate *result)
+//   void stream_store_512(uint8_t *dst, const uint8_t *src)
+//   void stream_fence(void)
+//
+// `load_partial_256` reads the first `size` bytes of src (less than a bucket)
+// and zero-pads the rest, `extract_and_compact_256` may write up to 64B past
+// dst, `widen_positions` writes `base + src[i]` for the `size` (at most 256)
+// first bytes of src without accessing anything past either array,
+// `invert_256` must allow src == dst, and `uniform_buckets` returns the number
+// of leading buckets (at most `max_buckets`) whose bytes all equal `fill`.
+// `AggregateLanes` holds the aggregates of consecutive buckets, started by
+// `init_lanes` and added to a result by `reduce_lanes` (see
+// `aggregate_value`). `aggregate_mask_256` and `aggregate_indices_256` add
+// the values of a bucket, the `values` of which start at its first bit: those
+// whose bit is set in `mask`, or the `count` (at most 32) at `indices`.
+// Neither reads the other values. `stream_store_512` copies 64 bytes from src
+// (of any alignment) to dst, aligned on 64 bytes, with non-temporal stores
+// where available, which become visible to other threads after
+// `stream_fence`.
+
+#include "vite_internal.h"
+#include <string.h>
+
+// Encodes a single bucket of `count` set bits and returns the number of bytes
+// written to output.
+static inline size_t compress_counted_bucket(const uint8_t *restrict input,
+                                             size_t count,
+                                             uint8_t *restrict output,
+                                             uint8_t *restrict helper_bucket) {
+  if (count < BUCKET_SIZE_U8) {
+    *output = count;
+    output += 1;
+
+    extract_and_compact_256((const uint64_t *)(input), output);
+
+    return 1 + count;
+  } else if (BUCKET_SIZE - count < BUCKET_SIZE_U8) {
+    *output = (BUCKET_SIZE - count) | 0b01000000;
+    output += 1;
+
+    invert_256(input, helper_bucket);
+    extract_and_compact_256((const uint64_t *)(helper_bucket), output);
+
+    return 1 + BUCKET_SIZE - count;
+  } else {
+    *output = BUCKET_SIZE_U8 | 0b10000000;
+    output += 1;
+
+    memcpy(output, input, BUCKET_SIZE_U8);
+
+    return 1 + BUCKET_SIZE_U8;
+  }
+}
+
+// Encodes a single bucket and returns the number of bytes written to output.
+static inline size_t compress_bucket(const uint8_t *restrict input,
+                                     uint8_t *restrict output,
+                                     uint8_t *restrict helper_bucket) {
+  return compress_counted_bucket(input, popcount_256(input), output,
+                                 helper_bucket);
+}
+
+// Returns the index of the bucket ending the run that may start at `bucket`,
+// since runs stop at the next multiple of VITEMAP_INDEX_STRIDE buckets,
+// counted from the first bucket.
+static inline size_t run_end(size_t bucket, size_t num_buckets) {
+  size_t end = bucket - bucket % VITEMAP_INDEX_STRIDE + VITEMAP_INDEX_STRIDE;
+  return end < num_buckets ? end : num_buckets;
+}
+
+// Returns the number of leading buckets of input identical to the first one,
+// of `count` set bits, if it is empty or full, and 1 otherwise. The popcount
+// being needed anyway, other buckets cost no additional work.
+static inline size_t run_length(const uint8_t *restrict input, size_t count,
+                                size_t bucket, size_t num_buckets) {
+  if (count != 0 && count != BUCKET_SIZE) {
+    return 1;
+  }
+
+  size_t max_length = run_end(bucket, num_buckets) - bucket;
+  return 1 + uniform_buckets(input + BUCKET_SIZE_U8, max_length - 1,
+                             count ? 0xFF : 0x00);
+}
+
+// Same as `run_length`, from the number of set bits of every bucket.
+static inline size_t counted_run_length(const uint16_t *restrict cardinalities,
+                                        size_t bucket, size_t num_buckets) {
+  uint16_t count = cardinalities[bucket];
+  if (count != 0 && count != BUCKET_SIZE) {
+    return 1;
+  }
+
+  size_t end = run_end(bucket, num_buckets);
+  size_t length = 1;
+  while (bucket + length < end && cardinalities[bucket + length] == count) {
+    length++;
+  }
+  return length;
+}
+
+// Encodes a run of `length` empty or full buckets and returns the number of
+// bytes written to output.
+static inline size_t write_run(size_t length, bool full,
+                               uint8_t *restrict output) {
+  output[0] = RUN_HEADER;
+  output[1] = (full ? RUN_FULL : 0) | (length - 1);
+  return 2;
+}
+
+// Returns the encoded size of a bucket of `count` set bits, without encoding
+// it.
+static inline size_t encoded_bucket_size(size_t count) {
+  if (count < BUCKET_SIZE_U8) {
+    return 1 + count;
+  } else if (BUCKET_SIZE - count < BUCKET_SIZE_U8) {
+    return 1 + BUCKET_SIZE - count;
+  } else {
+    return 1 + BUCKET_SIZE_U8;
+  }
+}
+
+// Decodes the bucket whose header is at `compressed_data` into 32 bytes.
+static inline void decompress_bucket(const uint8_t *restrict compressed_data,
+                                     uint8_t *restrict decompressed_data) {
+  uint8_t bucket_size = *compressed_data & 0x3F;
+  uint8_t category = *compressed_data >> 6;
+  const uint8_t *payload = compressed_data + 1;
+
+  // Both array categories share a single path, the inversion being applied
+  // in register, so that only bitmaps branch away.
+  if (category < 2) {
+    expand_and_scatter_256(payload, bucket_size, category, decompressed_data);
+  } else {
+    memcpy(decompressed_data, payload, BUCKET_SIZE_U8);
+  }
+}
+
+// Returns the number of set bits of the bucket whose header is at
+// `compressed_data`, which only requires a popcount for bitmaps. Runs count as
+// a single one of their buckets.
+static inline size_t
+bucket_cardinality(const uint8_t *restrict compressed_data) {
+  uint8_t bucket_size = *compressed_data & 0x3F;
+
+  switch (*compressed_data >> 6) {
+  case 0:
+    return bucket_size;
+  case 1:
+    return BUCKET_SIZE - bucket_size;
+  case 2:
+    return popcount_256(compressed_data + 1);
+  default:
+    return compressed_data[1] & RUN_FULL ? BUCKET_SIZE : 0;
+  }
+}
+
+// Writes the positions of the set bits of the bucket whose header is at
+// `compressed_data`, offset by `base`, and returns their number.
+static inline size_t bucket_positions(const uint8_t *restrict compressed_data,
+                                      uint32_t base,
+                                      uint32_t *restrict positions) {
+  uint8_t bucket_size = *compressed_data & 0x3F;
+  uint8_t category = *compressed_data >> 6;
+  const uint8_t *payload = compressed_data + 1;
+
+  // Arrays already store the positions, which only need widening.
+  if (category == 0) {
+    widen_positions(payload, bucket_size, base, positions);
+    return bucket_size;
+  }
+
+  // Other buckets are compacted to 8-bit positions first.
+  __attribute__((aligned(32))) uint64_t bucket[BUCKET_SIZE_U64];
+  uint8_t indices[BUCKET_SIZE + 64];
+  if (category == 1) {
+    expand_and_scatter_256(payload, bucket_size, true, (uint8_t *)bucket);
+  } else {
+    memcpy(bucket, payload, BUCKET_SIZE_U8);
+  }
+  size_t count = category == 1 ? (size_t)(BUCKET_SIZE - bucket_size)
+                               : popcount_256((const uint8_t *)bucket);
+  extract_and_compact_256(bucket, indices);
+  widen_positions(indices, count, base, positions);
+
+  return count;
+}
+
+// Merges two sorted index lists into `dst`, keeping the indices present only
+// in the first list (keep & 1), only in the second list (keep & 2), or in both
+// lists (keep & 4). Returns the number of indices written.
+static size_t merge_indices(const uint8_t *restrict first, size_t first_size,
+                            const uint8_t *restrict second, size_t second_size,
+                            unsigned keep, uint8_t *restrict dst) {
+  size_t i = 0, j = 0, count = 0;
+
+  while (i < first_size && j < second_size) {
+    if (first[i] < second[j]) {
+      dst[count] = first[i++];
+      count += keep & 1;
+    } else if (first[i] > second[j]) {
+      dst[count] = second[j++];
+      count += (keep >> 1) & 1;
+    } else {
+      dst[count] = first[i];
+      count += (keep >> 2) & 1;
+      i++;
+      j++;
+    }
+  }
+  if (keep & 1) {
+    memcpy(dst + count, first + i, first_size - i);
+    count += first_size - i;
+  }
+  if (keep & 2) {
+    memcpy(dst + count, second + j, second_size - j);
+    count += second_size - j;
+  }
+
+  return count;
+}
+
+// Set operations on two array buckets, indexed by operation and by the
+// categories (0 = array, 1 = inverted array) of both operands. The low 3 bits
+// select the indices to keep (see `merge_indices`), and bit 3 tells whether
+// the result is inverted. For instance, ~A & ~B = ~(A | B).
+static const uint8_t array_rules[4][2][2] = {
+    [VITEMAP_AND] = {{4, 1}, {2, 7 | 8}},
+    [VITEMAP_OR] = {{7, 2 | 8}, {1 | 8, 4 | 8}},
+    [VITEMAP_XOR] = {{3, 3 | 8}, {3 | 8, 3}},
+    [VITEMAP_ANDNOT] = {{1, 4}, {7 | 8, 2}},
+};
+
+// Computes `a op b` on two encoded buckets and writes the encoded result to
+// output, without expanding array buckets whenever possible. Returns the
+// number of bytes written to output.
+static size_t operate_bucket(VitemapOperation op, const uint8_t *restrict a,
+                             const uint8_t *restrict b,
+                             uint8_t *restrict output,
+                             uint8_t *restrict helper_bucket) {
+  uint8_t category_a = *a >> 6;
+  uint8_t category_b = *b >> 6;
+
+  if (category_a < 2 && category_b < 2) {
+    uint8_t rule = array_rules[op][category_a][category_b];
+    size_t count = merge_indices(a + 1, *a & 0x3F, b + 1, *b & 0x3F, rule & 7,
+                                 output + 1);
+    if (count < BUCKET_SIZE_U8) {
+      *output = count | (rule & 8 ? 0b01000000 : 0);
+      return 1 + count;
+    }
+
+    // Too many indices for an array: only a bitmap encoding is possible.
+    expand_and_scatter_256(output + 1, count, rule & 8, helper_bucket);
+    *output = BUCKET_SIZE_U8 | 0b10000000;
+    memcpy(output + 1, helper_bucket, BUCKET_SIZE_U8);
+    return 1 + BUCKET_SIZE_U8;
+  }
+
+  // An array intersected with a bitmap is the subset of its indices whose bit
+  // is set (or unset, for ANDNOT) in the bitmap.
+  if ((op == VITEMAP_AND || op == VITEMAP_ANDNOT) && category_a == 0 &&
+      category_b == 2) {
+    size_t count = 0;
+    for (size_t i = 0; i < (*a & 0x3F); i++) {
+      uint8_t pos = a[1 + i];
+      output[1 + count] = pos;
+      count += ((b[1 + pos / 8] >> (pos % 8)) & 1) == (op == VITEMAP_AND);
+    }
+    *output = count;
+    return 1 + count;
+  }
+  if (op == VITEMAP_AND && category_a == 2 && category_b == 0) {
+    return operate_bucket(op, b, a, output, helper_bucket);
+  }
+
+  __attribute__((aligned(32))) uint8_t bucket_a[BUCKET_SIZE_U8];
+  __attribute__((aligned(32))) uint8_t bucket_b[BUCKET_SIZE_U8];
+  decompress_bucket(a, bucket_a);
+  decompress_bucket(b, bucket_b);
+  bitwise_256(op, bucket_a, bucket_b, bucket_a);
+
+  return compress_bucket(bucket_a, output, helper_bucket);
+}
+
+// Kinds of the values of an expression on one bucket. Operands are kept
+// encoded for as long as possible, so that inputs are only decoded when
+// reaching a bitwise operation.
+#define VALUE_EMPTY 0   // No bit set
+#define VALUE_FULL 1    // All bits set
+#define VALUE_ENCODED 2 // Encoded bucket at `encoded`
+#define VALUE_DECODED 3 // Decoded bucket in `bits`
+
+typedef struct {
+  __attribute__((aligned(32))) uint8_t bits[BUCKET_SIZE_U8];
+  const uint8_t *encoded;
+  uint8_t kind;
+} ExpressionValue;
+
+// Truth tables of the set operations: bit 2 * a + b holds `a op b` on bits.
+static const uint8_t truth_tables[4] = {
+    [VITEMAP_AND] = 0b1000,
+    [VITEMAP_OR] = 0b1110,
+    [VITEMAP_XOR] = 0b0110,
+    [VITEMAP_ANDNOT] = 0b0100,
+};
+
+static inline void decode_value(ExpressionValue *value) {
+  if (value->kind == VALUE_ENCODED) {
+    decompress_bucket(value->encoded, value->bits);
+    value->kind = VALUE_DECODED;
+  }
+}
+
+static inline void complement_value(ExpressionValue *value) {
+  if (value->kind <= VALUE_FULL) {
+    value->kind ^= 1;
+  } else {
+    decode_value(value);
+    invert_256(value->bits, value->bits);
+  }
+}
+
+// Stores `a op b` to a.
+static inline void apply_value(VitemapOperation op, ExpressionValue *a,
+                               ExpressionValue *b) {
+  uint8_t table = truth_tables[op];
+  if (a->kind > VALUE_FULL && b->kind > VALUE_FULL) {
+    decode_value(a);
+    decode_value(b);
+    bitwise_256(op, a->bits, b->bits, a->bits);
+    return;
+  }
+
+  // A uniform operand turns the operation into a constant, the identity or
+  // the complement of the other operand, which is moved to a.
+  uint8_t on_zero, on_one;
+  if (a->kind <= VALUE_FULL) {
+    on_zero = table >> (2 * a->kind) & 1;
+    on_one = table >> (2 * a->kind + 1) & 1;
+    *a = *b;
+  } else {
+    on_zero = table >> b->kind & 1;
+    on_one = table >> (2 + b->kind) & 1;
+  }
+  if (on_zero == on_one) {
+    a->kind = on_zero ? VALUE_FULL : VALUE_EMPTY;
+  } else if (on_zero) {
+    complement_value(a);
+  }
+}
+
+static size_t evaluate_bucket(const VitemapStep *restrict steps,
+                              size_t num_steps,
+                              const uint8_t *const *restrict buckets,
+                              uint8_t *restrict output,
+                              uint8_t *restrict helper_bucket) {
+  ExpressionValue stack[VITEMAP_MAX_EXPRESSION_DEPTH];
+  size_t depth = 0;
+
+  for (size_t i = 0; i < num_steps; i++) {
+    const VitemapStep *step = &steps[i];
+    if (step->type == VITEMAP_STEP_INPUT) {
+      const uint8_t *bucket = buckets[step->input];
+      stack[depth].encoded = bucket;
+      stack[depth].kind = *bucket == 0            ? VALUE_EMPTY
+                          : *bucket == 0b01000000 ? VALUE_FULL
+                                                  : VALUE_ENCODED;
+      depth++;
+    } else if (step->type == VITEMAP_STEP_NOT) {
+      complement_value(&stack[depth - 1]);
+    } else {
+      depth--;
+      apply_value(step->op, &stack[depth - 1], &stack[depth]);
+    }
+  }
+
+  const ExpressionValue *result = &stack[0];
+  switch (result->kind) {
+  case VALUE_EMPTY:
+  case VALUE_FULL:
+    *output = result->kind == VALUE_FULL ? 0b01000000 : 0;
+    return 1;
+  case VALUE_ENCODED: {
+    size_t size = 1 + (*result->encoded & 0x3F);
+    memcpy(output, result->encoded, size);
+    return size;
+  }
+  default:
+    return compress_bucket(result->bits, output, helper_bucket);
+  }
+}
+
+static size_t compress_buckets(const uint8_t *restrict input,
+                               size_t num_buckets, bool runs,
+                               uint8_t *restrict output,
+                               uint8_t *restrict helper_bucket) {
+  size_t result_size = 0;
+
+  for (size_t bucket = 0; bucket < num_buckets;) {
+    size_t count = popcount_256(input);
+    size_t length = runs ? run_length(input, count, bucket, num_buckets) : 1;
+    if (length > 1) {
+      result_size += write_run(length, count != 0, output + result_size);
+    } else {
+      result_size += compress_counted_bucket(input, count, output + result_size,
+                                             helper_bucket);
+    }
+    bucket += length;
+    input += length * BUCKET_SIZE_U8;
+  }
+
+  return result_size;
+}
+
+static size_t compress_counted_buckets(const uint8_t *restrict input,
+                                       const uint16_t *restrict cardinalities,
+                                       size_t num_buckets, bool runs,
+                                       uint8_t *restrict output,
+                                       uint8_t *restrict helper_bucket) {
+  size_t result_size = 0;
+
+  for (size_t bucket = 0; bucket < num_buckets;) {
+    size_t length =
+        runs ? counted_run_length(cardinalities, bucket, num_buckets) : 1;
+    if (length > 1) {
+      result_size += write_run(length, cardinalities[bucket] != 0,
+                               output + result_size);
+    } else {
+      result_size +=
+          compress_counted_bucket(input, cardinalities[bucket],
+                                  output + result_size, helper_bucket);
+    }
+    bucket += length;
+    input += length * BUCKET_SIZE_U8;
+  }
+
+  return result_size;
+}
+
+static size_t compress_partial_bucket(const uint8_t *restrict input,
+                                      size_t size, uint8_t *restrict output,
+                                      uint8_t *restrict helper_bucket) {
+  __attribute__((aligned(32))) uint8_t bucket[BUCKET_SIZE_U8];
+  load_partial_256(input, size, bucket);
+
+  return compress_bucket(bucket, output, helper_bucket);
+}
+
+static size_t measure_buckets(const uint8_t *restrict input,
+                              size_t num_buckets, bool runs) {
+  size_t result_size = 0;
+
+  for (size_t bucket = 0; bucket < num_buckets;) {
+    size_t count = popcount_256(input);
+    size_t length = runs ? run_length(input, count, bucket, num_buckets) : 1;
+    result_size += length > 1 ? 2 : encoded_bucket_size(count);
+    bucket += length;
+    input += length * BUCKET_SIZE_U8;
+  }
+
+  return result_size;
+}
+
+// Returns the number of buckets encoded by the bucket whose header is at
+// `compressed_data`, and at most `num_buckets`.
+static inline size_t clamped_span(const uint8_t *restrict compressed_data,
+                                  size_t num_buckets) {
+  size_t span = bucket_span(compressed_data);
+  return span < num_buckets ? span : num_buckets;
+}
+
+// Decodes the run whose header is at `compressed_data`, up to `num_buckets`
+// buckets, and returns the number of buckets written. Kept out of line so that
+// the decoding loop of the other buckets is unaffected.
+__attribute__((noinline)) static size_t
+decompress_run(const uint8_t *restrict compressed_data, size_t num_buckets,
+               uint8_t *restrict decompressed_data) {
+  size_t span = clamped_span(compressed_data, num_buckets);
+  memset(decompressed_data, compressed_data[1] & RUN_FULL ? 0xFF : 0x00,
+         span * BUCKET_SIZE_U8);
+  return span;
+}
+
+static const uint8_t *
+decompress_buckets(const uint8_t *restrict compressed_data, size_t num_buckets,
+                   uint8_t *restrict decompressed_data) {
+  for (size_t bucket = 0; bucket < num_buckets; bucket++) {
+    uint8_t bucket_size = *compressed_data & 0x3F;
+    uint8_t category = *compressed_data >> 6;
+    const uint8_t *payload = compressed_data + 1;
+
+    // Runs are only told apart from bitmaps, so that arrays decode as fast
+    // as without them.
+    if (category < 2) {
+      expand_and_scatter_256(payload, bucket_size, category,
+                             decompressed_data);
+    } else if (category == 2) {
+      memcpy(decompressed_data, payload, BUCKET_SIZE_U8);
+    } else {
+      size_t span = decompress_run(compressed_data, num_buckets - bucket,
+                                   decompressed_data);
+      decompressed_data += (span - 1) * BUCKET_SIZE_U8;
+      bucket += span - 1;
+    }
+
+    compressed_data = payload + bucket_size;
+    decompressed_data += BUCKET_SIZE_U8;
+  }
+
+  return compressed_data;
+}
+
+// Same as `decompress_buckets`, for outputs much larger than the caches: one
+// index stride of buckets at a time is decoded into a cache-resident buffer
+// (runs never cross strides), and written one whole destination cache line at
+// a time with `stream_store_512`, which does not read the lines first, the
+// bytes before the first line boundary using regular stores. The compressed
+// data is prefetched STREAMING_PREFETCH bytes ahead.
+static const uint8_t *
+decompress_streaming_buckets(const uint8_t *restrict compressed_data,
+                             size_t num_buckets,
+                             uint8_t *restrict decompressed_data) {
+  __attribute__((aligned(64)))
+  uint8_t staging[64 + VITEMAP_INDEX_STRIDE * BUCKET_SIZE_U8];
+  size_t head = -(uintptr_t)decompressed_data % 64;
+  size_t pending = 0;
+
+  for (size_t bucket = 0; bucket < num_buckets;
+       bucket += VITEMAP_INDEX_STRIDE) {
+    size_t batch = num_buckets - bucket < VITEMAP_INDEX_STRIDE
+                       ? num_buckets - bucket
+                       : VITEMAP_INDEX_STRIDE;
+    const uint8_t *next =
+        decompress_buckets(compressed_data, batch, staging + pending);
+    for (const uint8_t *line = compressed_data; line < next; line += 64) {
+      __builtin_prefetch(line + STREAMING_PREFETCH);
+    }
+    compressed_data = next;
+    pending += batch * BUCKET_SIZE_U8;
+
+    // Less than 64 bytes are left pending after every batch.
+    size_t flushed = 0;
+    if (head > 0 && pending >= head) {
+      memcpy(decompressed_data, staging, head);
+      flushed = head;
+      head = 0;
+    }
+    if (head == 0) {
+      for (; pending - flushed >= 64; flushed += 64) {
+        stream_store_512(decompressed_data + flushed, staging + flushed);
+      }
+    }
+    memmove(staging, staging + flushed, pending - flushed);
+    decompressed_data += flushed;
+    pending -= flushed;
+  }
+
+  memcpy(decompressed_data, staging, pending);
+  stream_fence();
+  return compressed_data;
+}
+
+static void stream_copy(uint8_t *restrict dst, const uint8_t *restrict src,
+                        size_t size) {
+  for (size_t i = 0; i < size; i += 64) {
+    stream_store_512(dst + i, src + i);
+  }
+  stream_fence();
+}
+
+static const uint8_t *
+decompress_checked_buckets(const uint8_t *restrict compressed_data,
+                           const uint8_t *end, size_t num_buckets,
+                           uint8_t *restrict decompressed_data) {
+  for (size_t bucket = 0; bucket < num_buckets; bucket++) {
+    size_t span = checked_span(compressed_data, end, bucket, num_buckets);
+    if (span == 0) {
+      return NULL;
+    }
+
+    uint8_t bucket_size = *compressed_data & 0x3F;
+    uint8_t category = *compressed_data >> 6;
+    const uint8_t *payload = compressed_data + 1;
+    if (category < 2) {
+      expand_and_scatter_256(payload, bucket_size, category,
+                             decompressed_data);
+    } else if (category == 2) {
+      memcpy(decompressed_data, payload, BUCKET_SIZE_U8);
+    } else {
+      decompress_run(compressed_data, span, decompressed_data);
+      decompressed_data += (span - 1) * BUCKET_SIZE_U8;
+      bucket += span - 1;
+    }
+
+    compressed_data = payload + bucket_size;
+    decompressed_data += BUCKET_SIZE_U8;
+  }
+
+  return compressed_data;
+}
+
+static void decompress_split_buckets(const uint8_t *restrict headers,
+                                     const uint64_t *restrict offsets,
+                                     const uint8_t *restrict payload,
+                                     size_t num_buckets,
+                                     uint8_t *restrict decompressed_data) {
+  for (size_t bucket = 0; bucket < num_buckets; bucket++) {
+    uint8_t bucket_size = headers[bucket] & 0x3F;
+    uint8_t category = headers[bucket] >> 6;
+    const uint8_t *bucket_payload = payload + offsets[bucket];
+
+    if (category < 2) {
+      expand_and_scatter_256(bucket_payload, bucket_size, category,
+                             decompressed_data);
+    } else {
+      memcpy(decompressed_data, bucket_payload, BUCKET_SIZE_U8);
+    }
+    decompressed_data += BUCKET_SIZE_U8;
+  }
+}
+
+static const uint8_t *count_buckets(const uint8_t *restrict compressed_data,
+                                    size_t num_buckets,
+                                    uint64_t *restrict cardinality) {
+  uint64_t result = 0;
+
+  for (size_t bucket = 0; bucket < num_buckets;) {
+    size_t span = clamped_span(compressed_data, num_buckets - bucket);
+    result += bucket_cardinality(compressed_data) * span;
+    compressed_data += 1 + (*compressed_data & 0x3F);
+    bucket += span;
+  }
+
+  *cardinality += result;
+  return compressed_data;
+}
+
+static size_t extract_positions(const uint8_t *restrict compressed_data,
+                                size_t num_buckets, uint32_t first_position,
+                                uint32_t *restrict positions) {
+  size_t result_size = 0;
+
+  for (size_t bucket = 0; bucket < num_buckets;) {
+    uint32_t base = first_position + bucket * BUCKET_SIZE;
+    size_t span = 1;
+    if (*compressed_data >> 6 == 3) {
+      // All positions of full buckets, from the identity permutation.
+      span = clamped_span(compressed_data, num_buckets - bucket);
+      for (size_t i = 0; i < span && (compressed_data[1] & RUN_FULL); i++) {
+        widen_positions(vitemap_indices, BUCKET_SIZE, base + i * BUCKET_SIZE,
+                        positions + result_size);
+        result_size += BUCKET_SIZE;
+      }
+    } else {
+      result_size +=
+          bucket_positions(compressed_data, base, positions + result_size);
+    }
+    compressed_data += 1 + (*compressed_data & 0x3F);
+    bucket += span;
+  }
+
+  return result_size;
+}
+
+// Adds the values of the bucket whose header is at `compressed_data` (a run
+// counting as a single one of its buckets) to the lanes, only considering its
+// `limit` first bits.
+static inline void
+aggregate_bucket(const uint8_t *restrict compressed_data,
+                 const uint8_t *restrict values, VitemapColumnType type,
+                 size_t limit, AggregateLanes *restrict lanes) {
+  uint8_t bucket_size = *compressed_data & 0x3F;
+  uint8_t category = *compressed_data >> 6;
+  const uint8_t *payload = compressed_data + 1;
+
+  // Complete arrays gather their values, and all other buckets are masks.
+  if (category == 0 && limit == BUCKET_SIZE) {
+    aggregate_indices_256(type, values, payload, bucket_size, lanes);
+    return;
+  }
+  __attribute__((aligned(32))) uint64_t mask[BUCKET_SIZE_U64];
+  if (category == 3) {
+    memset(mask, payload[0] & RUN_FULL ? 0xFF : 0x00, BUCKET_SIZE_U8);
+  } else {
+    decompress_bucket(compressed_data, (uint8_t *)mask);
+  }
+  for (size_t i = 0; i < BUCKET_SIZE_U64; i++) {
+    size_t start = i * 64;
+    if (limit <= start) {
+      mask[i] = 0;
+    } else if (limit - start < 64) {
+      mask[i] &= (1ULL << (limit - start)) - 1;
+    }
+  }
+  aggregate_mask_256(type, values, mask, lanes);
+}
+
+static void aggregate_buckets(const uint8_t *restrict compressed_data,
+                              size_t num_buckets,
+                              const uint8_t *restrict column,
+                              VitemapColumnType type, uint64_t num_values,
+                              VitemapAggregate *restrict result) {
+  size_t value_size = column_value_size(type);
+  AggregateLanes lanes = init_lanes(type);
+
+  for (size_t bucket = 0; bucket < num_buckets;) {
+    uint64_t first = (uint64_t)bucket * BUCKET_SIZE;
+    if (first >= num_values) {
+      break;
+    }
+    size_t span = clamped_span(compressed_data, num_buckets - bucket);
+
+    // Empty runs are skipped, and full runs aggregated one bucket at a time.
+    bool empty = *compressed_data >> 6 == 3 && !(compressed_data[1] & RUN_FULL);
+    for (size_t i = 0; i < span && !empty; i++) {
+      uint64_t start = first + i * BUCKET_SIZE;
+      if (start >= num_values) {
+        break;
+      }
+      uint64_t remaining = num_values - start;
+      aggregate_bucket(compressed_data, column + start * value_size, type,
+                       remaining < BUCKET_SIZE ? remaining : BUCKET_SIZE,
+                       &lanes);
+    }
+    compressed_data += 1 + (*compressed_data & 0x3F);
+    bucket += span;
+  }
+
+  reduce_lanes(type, &lanes, result);
+}
+
+// Compresses a bitmap of `num_buckets` buckets, a constant once inlined into
+// the kernels of a fixed size, as a legacy stream.
+static inline __attribute__((always_inline)) size_t
+compress_fixed(const uint8_t *restrict input, size_t num_buckets,
+               uint8_t *restrict output) {
+  uint8_t helper_bucket[BUCKET_SIZE_U8];
+  uint32_t size = num_buckets * BUCKET_SIZE_U8;
+  memcpy(output, &size, sizeof(size));
+  uint8_t *ptr = output + VITEMAP_LEGACY_HEADER_SIZE;
+#pragma GCC unroll 16
+  for (size_t bucket = 0; bucket < num_buckets; bucket++) {
+    ptr += compress_bucket(input + bucket * BUCKET_SIZE_U8, ptr, helper_bucket);
+  }
+  return ptr - output;
+}
+
+// Decodes `num_buckets` buckets, none of which may be a run.
+static inline __attribute__((always_inline)) void
+decompress_fixed(const uint8_t *restrict compressed_data, size_t num_buckets,
+                 uint8_t *restrict decompressed_data) {
+#pragma GCC unroll 16
+  for (size_t bucket = 0; bucket < num_buckets; bucket++) {
+    decompress_bucket(compressed_data,
+                      decompressed_data + bucket * BUCKET_SIZE_U8);
+    compressed_data += 1 + (*compressed_data & 0x3F);
+  }
+}
+
+#define DEFINE_FIXED_KERNELS(bits)                                             \
+  static size_t compress_fixed_##bits(const uint8_t *restrict input,           \
+                                      uint8_t *restrict output) {              \
+    return compress_fixed(input, (bits) / BUCKET_SIZE, output);                \
+  }                                                                            \
+  static void decompress_fixed_##bits(const uint8_t *restrict compressed_data, \
+                                      uint8_t *restrict decompressed_data) {   \
+    decompress_fixed(compressed_data, (bits) / BUCKET_SIZE,                    \
+                     decompressed_data);                                       \
+  }
+VITEMAP_FIXED_SIZES(DEFINE_FIXED_KERNELS)
+#undef DEFINE_FIXED_KERNELS
+
+#define FIXED_KERNEL_ENTRIES(bits)                                             \
+  .compress_fixed_##bits = compress_fixed_##bits,                              \
+  .decompress_fixed_##bits = decompress_fixed_##bits,
+
+const VitemapKernels KERNELS = {
+    .isa = KERNELS_ISA,
+    .compress_buckets = compress_buckets,
+    .compress_counted_buckets = compress_counted_buckets,
+    .compress_partial_bucket = compress_partial_bucket,
+    .measure_buckets = measure_buckets,
+    .decompress_buckets = decompress_buckets,
+    .decompress_streaming_buckets = decompress_streaming_buckets,
+    .decompress_checked_buckets = decompress_checked_buckets,
+    .decompress_split_buckets = decompress_split_buckets,
+    .count_buckets = count_buckets,
+    .extract_positions = extract_positions,
+    .operate_bucket = operate_bucket,
+    .evaluate_bucket = evaluate_bucket,
+    .aggregate_buckets = aggregate_buckets,
+    .stream_copy = stream_copy,
+    VITEMAP_FIXED_SIZES(FIXED_KERNEL_ENTRIES)};
+#undef FIXED_KERNEL_ENTRIES
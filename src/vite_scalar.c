@@ -0,0 +1,180 @@
+/*
+ *  ____   ____.__  __
+ *  \   \ /   /|__|/  |_  ____   _____ _____  ______
+ *   \   Y   / |  \   __\/ __ \ /     \\__  \ \____ \
+ *    \     /  |  ||  | \  ___/|  Y Y  \/ __ \|  |_> >
+ *     \___/   |__||__|  \___  >__|_|  (____  /   __/
+ *                           \/      \/     \/|__|
+ *
+ *
+ *  Copyright (c) [2024] [Alexis Schlomer]
+ *  This project is licensed under the MIT License.
+ *  See the LICENSE file for details.
+ */
+
+// Portable kernels, for CPUs without AVX2.
+
+#include "vite_internal.h"
+#include <math.h>
+#include <string.h>
+
+#define KERNELS vitemap_kernels_scalar
+#define KERNELS_ISA VITEMAP_ISA_SCALAR
+
+static inline size_t popcount_256(const uint8_t *restrict ptr) {
+  uint64_t words[BUCKET_SIZE_U64];
+  memcpy(words, ptr, BUCKET_SIZE_U8);
+  return __builtin_popcountll(words[0]) + __builtin_popcountll(words[1]) +
+         __builtin_popcountll(words[2]) + __builtin_popcountll(words[3]);
+}
+
+// Copies a partial bucket, padding it with zeros.
+static inline void load_partial_256(const uint8_t *src, size_t size,
+                                    uint8_t *dst) {
+  memset(dst, 0, BUCKET_SIZE_U8);
+  memcpy(dst, src, size);
+}
+
+// Compacts the set bit positions of a 256-bit bucket, one set bit at a time.
+static inline void extract_and_compact_256(const uint64_t *restrict src,
+                                           uint8_t *restrict dst) {
+  for (size_t i = 0; i < BUCKET_SIZE_U64; i++) {
+    uint64_t word;
+    memcpy(&word, src + i, sizeof(word));
+    while (word) {
+      *dst++ = i * 64 + __builtin_ctzll(word);
+      word &= word - 1;
+    }
+  }
+}
+
+static inline void expand_and_scatter_256(const uint8_t *restrict src,
+                                          size_t bucket_size, bool invert,
+                                          uint8_t *restrict dst) {
+  uint64_t words[BUCKET_SIZE_U64] = {0};
+  for (size_t i = 0; i < bucket_size; i++) {
+    words[src[i] / 64] |= 1ULL << (src[i] % 64);
+  }
+  for (size_t i = 0; i < BUCKET_SIZE_U64; i++) {
+    words[i] ^= -(uint64_t)invert;
+  }
+  memcpy(dst, words, BUCKET_SIZE_U8);
+}
+
+static inline void widen_positions(const uint8_t *restrict src, size_t size,
+                                   uint32_t base, uint32_t *restrict dst) {
+  for (size_t i = 0; i < size; i++) {
+    dst[i] = base + src[i];
+  }
+}
+
+// Inverts all 256 bits in src and stores inverse into dst.
+static inline void invert_256(const uint8_t *src, uint8_t *dst) {
+  uint64_t words[BUCKET_SIZE_U64];
+  memcpy(words, src, BUCKET_SIZE_U8);
+  for (size_t i = 0; i < BUCKET_SIZE_U64; i++) {
+    words[i] = ~words[i];
+  }
+  memcpy(dst, words, BUCKET_SIZE_U8);
+}
+
+// Counts the leading buckets whose bytes all equal `fill`.
+static inline size_t uniform_buckets(const uint8_t *src, size_t max_buckets,
+                                     uint8_t fill) {
+  uint64_t pattern = 0x0101010101010101ULL * fill;
+  size_t count = 0;
+  for (; count < max_buckets; count++) {
+    uint64_t words[BUCKET_SIZE_U64];
+    memcpy(words, src + count * BUCKET_SIZE_U8, BUCKET_SIZE_U8);
+    if ((words[0] ^ pattern) | (words[1] ^ pattern) | (words[2] ^ pattern) |
+        (words[3] ^ pattern)) {
+      break;
+    }
+  }
+  return count;
+}
+
+// Applies a bitwise operation to two 256-bit buckets.
+static inline void bitwise_256(VitemapOperation op, const uint8_t *a,
+                               const uint8_t *b, uint8_t *dst) {
+  uint64_t words_a[BUCKET_SIZE_U64], words_b[BUCKET_SIZE_U64];
+  memcpy(words_a, a, BUCKET_SIZE_U8);
+  memcpy(words_b, b, BUCKET_SIZE_U8);
+  for (size_t i = 0; i < BUCKET_SIZE_U64; i++) {
+    switch (op) {
+    case VITEMAP_AND:
+      words_a[i] &= words_b[i];
+      break;
+    case VITEMAP_OR:
+      words_a[i] |= words_b[i];
+      break;
+    case VITEMAP_XOR:
+      words_a[i] ^= words_b[i];
+      break;
+    default:
+      words_a[i] &= ~words_b[i];
+      break;
+    }
+  }
+  memcpy(dst, words_a, BUCKET_SIZE_U8);
+}
+
+// Values are aggregated one at a time, straight into a VitemapAggregate.
+typedef VitemapAggregate AggregateLanes;
+
+static inline AggregateLanes init_lanes(VitemapColumnType type) {
+  (void)type;
+  return (AggregateLanes){.int_min = INT64_MAX,
+                          .int_max = INT64_MIN,
+                          .min = INFINITY,
+                          .max = -INFINITY};
+}
+
+// Aggregates the values at the set bits of a mask, one set bit at a time.
+static inline void aggregate_mask_256(VitemapColumnType type,
+                                      const uint8_t *restrict values,
+                                      const uint64_t *restrict mask,
+                                      AggregateLanes *restrict lanes) {
+  for (size_t i = 0; i < BUCKET_SIZE_U64; i++) {
+    for (uint64_t word = mask[i]; word; word &= word - 1) {
+      aggregate_value(type, values, i * 64 + __builtin_ctzll(word), lanes);
+    }
+  }
+}
+
+static inline void aggregate_indices_256(VitemapColumnType type,
+                                         const uint8_t *restrict values,
+                                         const uint8_t *restrict indices,
+                                         size_t count,
+                                         AggregateLanes *restrict lanes) {
+  for (size_t i = 0; i < count; i++) {
+    aggregate_value(type, values, indices[i], lanes);
+  }
+}
+
+// Adds the aggregates to `result`, once all buckets are aggregated.
+static inline void reduce_lanes(VitemapColumnType type,
+                                const AggregateLanes *lanes,
+                                VitemapAggregate *result) {
+  (void)type;
+  result->count += lanes->count;
+  result->int_sum =
+      (int64_t)((uint64_t)result->int_sum + (uint64_t)lanes->int_sum);
+  result->int_min =
+      result->int_min < lanes->int_min ? result->int_min : lanes->int_min;
+  result->int_max =
+      result->int_max > lanes->int_max ? result->int_max : lanes->int_max;
+  result->sum += lanes->sum;
+  result->min = result->min < lanes->min ? result->min : lanes->min;
+  result->max = result->max > lanes->max ? result->max : lanes->max;
+}
+
+// Copies 64 bytes: portable code has no non-temporal stores.
+static inline void stream_store_512(uint8_t *restrict dst,
+                                    const uint8_t *restrict src) {
+  memcpy(dst, src, 64);
+}
+
+static inline void stream_fence(void) {}
+
+#include "vite_kernels.h"